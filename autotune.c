@@ -0,0 +1,279 @@
+#ifndef AUTOTUNE_C
+#define AUTOTUNE_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <omp.h>
+#include "matrix.c"
+#include "simd_kernels.c"
+
+// Autotuning of the blocking and thread counts of mat_mul and the elementwise kernels
+//
+// Without autotuning every kernel uses one fixed strategy on all threads. With
+// autotuning enabled (NN_AUTOTUNE=1 or enable_autotune), the first call of a
+// kernel on a new shape times every candidate configuration and keeps the
+// fastest. Winners are appended to a cache file (NN_AUTOTUNE_CACHE, by default
+// nn_autotune.cache) under the CPU model, kernel variant and number of threads,
+// and later runs on the same machine reuse them without timing anything.
+// All configurations give bitwise identical results. Unroll factors are not
+// tuned, since the number of accumulators of a kernel decides its summation order.
+
+#define TUNE_REPEATS 2
+#define TUNE_MAX_CANDIDATES 64
+#define TUNE_CPU_LENGTH 256
+#define TUNE_DEFAULT_CACHE "nn_autotune.cache"
+
+enum tune_kernel {
+    TUNE_GEMV,
+    TUNE_SKINNY,
+    TUNE_MAT_MUL,
+    TUNE_ELEM_MEMORY,
+    TUNE_ELEM_COMPUTE,
+    NUM_TUNE_KERNELS
+};
+
+char *tune_kernel_names[NUM_TUNE_KERNELS] = {"gemv", "skinny", "mat_mul", "elem_memory", "elem_compute"};
+
+typedef struct {
+    // Rows per task for gemv and skinny, columns per tile of mat2 for mat_mul
+    // (0 for no tiling), elements per chunk for the elementwise kernels
+    size_t block;
+    int threads;
+} tune_config;
+
+typedef struct {
+    enum tune_kernel kernel;
+    enum isa isa;
+    int max_threads;
+    size_t dims[3];
+    tune_config config;
+} tune_entry;
+
+typedef struct {
+    bool enabled;
+    char *path;
+    char cpu[TUNE_CPU_LENGTH];
+    tune_entry *entries;
+    size_t num_entries;
+    size_t capacity;
+    size_t num_tuned;
+} tune_table;
+
+tune_table tuner;
+
+void read_cpu_model(char *cpu) {
+    // Model name of the CPU from /proc/cpuinfo, or "unknown"
+
+    char line[TUNE_CPU_LENGTH + 64];
+    strcpy(cpu, "unknown");
+
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "model name", 10) == 0) {
+            char *value = strchr(line, ':');
+            if (value != NULL) {
+                value += strspn(value + 1, " \t") + 1;
+                value[strcspn(value, "\n")] = '\0';
+                strncpy(cpu, value, TUNE_CPU_LENGTH - 1);
+                cpu[TUNE_CPU_LENGTH - 1] = '\0';
+            }
+            break;
+        }
+    }
+    fclose(file);
+}
+
+void add_tune_entry(tune_entry *entry) {
+    if (tuner.num_entries == tuner.capacity) {
+        tuner.capacity = (tuner.capacity == 0) ? 64 : 2 * tuner.capacity;
+        tuner.entries = realloc(tuner.entries, tuner.capacity * sizeof(tune_entry));
+        check_alloc(tuner.entries);
+    }
+    tuner.entries[tuner.num_entries++] = *entry;
+}
+
+void load_tune_cache(void) {
+    // Read the entries of the cache file that were tuned on this CPU model
+    // Each line is: cpu model <TAB> variant threads kernel dim0 dim1 dim2 block threads
+
+    char line[TUNE_CPU_LENGTH + 256];
+    char isa_name[32], kernel_name[32];
+    unsigned int isa, kernel;
+
+    FILE *file = fopen(tuner.path, "r");
+    if (file == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *tab = strchr(line, '\t');
+        if (tab == NULL) {
+            continue;
+        }
+        *tab = '\0';
+        if (strcmp(line, tuner.cpu) != 0) {
+            continue;
+        }
+
+        tune_entry entry;
+        if (sscanf(tab + 1, "%31s %d %31s %zu %zu %zu %zu %d", isa_name, &entry.max_threads, kernel_name,
+                &entry.dims[0], &entry.dims[1], &entry.dims[2], &entry.config.block, &entry.config.threads) != 8) {
+            continue;
+        }
+        for (isa = 0; isa < NUM_ISAS && strcmp(isa_name, isa_names[isa]) != 0; isa++);
+        for (kernel = 0; kernel < NUM_TUNE_KERNELS && strcmp(kernel_name, tune_kernel_names[kernel]) != 0; kernel++);
+        // Only mat_mul has a meaning for block 0 (no tiling), the other loops step by block
+        if (isa == NUM_ISAS || kernel == NUM_TUNE_KERNELS || entry.config.threads < 1 ||
+                (entry.config.block == 0 && kernel != TUNE_MAT_MUL)) {
+            continue;
+        }
+        entry.isa = isa;
+        entry.kernel = kernel;
+        add_tune_entry(&entry);
+    }
+    fclose(file);
+}
+
+void save_tune_entry(tune_entry *entry) {
+    if (tuner.path == NULL) {
+        return;
+    }
+    FILE *file = fopen(tuner.path, "a");
+    if (file == NULL) {
+        printf("Warning: Could not write autotuning cache %s\n", tuner.path);
+        return;
+    }
+    fprintf(file, "%s\t%s %d %s %zu %zu %zu %zu %d\n", tuner.cpu, isa_names[entry->isa], entry->max_threads,
+        tune_kernel_names[entry->kernel], entry->dims[0], entry->dims[1], entry->dims[2], entry->config.block, entry->config.threads);
+    fclose(file);
+}
+
+void disable_autotune(void) {
+    // Go back to the fixed configurations and forget the tuned ones
+
+    tuner.enabled = false;
+    free(tuner.path);
+    free(tuner.entries);
+    tuner.path = NULL;
+    tuner.entries = NULL;
+    tuner.num_entries = 0;
+    tuner.capacity = 0;
+}
+
+void enable_autotune(char *cache_path) {
+    // Tune every kernel and shape on first use, reusing and extending the
+    // winners in the file cache_path (tuned in memory only if NULL)
+
+    disable_autotune();
+    read_cpu_model(tuner.cpu);
+    if (cache_path != NULL) {
+        tuner.path = strdup(cache_path);
+        check_alloc(tuner.path);
+        load_tune_cache();
+    }
+    tuner.enabled = true;
+}
+
+__attribute__((constructor))
+void init_autotune(void) {
+    char *enabled = getenv("NN_AUTOTUNE");
+    char *path = getenv("NN_AUTOTUNE_CACHE");
+
+    if (enabled != NULL && strcmp(enabled, "0") != 0) {
+        enable_autotune((path != NULL) ? path : TUNE_DEFAULT_CACHE);
+    }
+}
+
+size_t thread_candidates(int *threads) {
+    // 1, 2, 4, ... threads up to and including all available threads
+
+    int max_threads = omp_get_max_threads();
+    size_t num = 0;
+    int t;
+
+    for (t = 1; t < max_threads; t *= 2) {
+        threads[num++] = t;
+    }
+    threads[num++] = max_threads;
+    return num;
+}
+
+tune_config tuned_config(enum tune_kernel kernel, size_t *dims, tune_config fixed, tune_config *candidates, size_t num_candidates,
+        void (*run)(tune_config, void *), void *arg) {
+    // Configuration of kernel for the shape dims: fixed if autotuning is off, else
+    // the cached winner, else the fastest of the candidates, timing run(candidate, arg)
+    // run must give the same result for every candidate and may be called repeatedly
+    // Tuning is skipped inside parallel regions, where the timings would be meaningless
+
+    if (!tuner.enabled || omp_in_parallel()) {
+        return fixed;
+    }
+
+    tune_config config = fixed;
+    int max_threads = omp_get_max_threads();
+    bool found = false;
+    unsigned int i, r;
+
+    #pragma omp critical(autotune)
+    {
+        for (i = 0; i < tuner.num_entries && !found; i++) {
+            tune_entry *entry = &tuner.entries[i];
+            if (entry->kernel == kernel && entry->isa == kernels.isa && entry->max_threads == max_threads &&
+                entry->dims[0] == dims[0] && entry->dims[1] == dims[1] && entry->dims[2] == dims[2]) {
+                config = entry->config;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            double best = 0.0;
+            run(candidates[0], arg);
+            for (i = 0; i < num_candidates; i++) {
+                for (r = 0; r < TUNE_REPEATS; r++) {
+                    double start = omp_get_wtime();
+                    run(candidates[i], arg);
+                    double seconds = omp_get_wtime() - start;
+                    if ((i == 0 && r == 0) || seconds < best) {
+                        best = seconds;
+                        config = candidates[i];
+                    }
+                }
+            }
+
+            tune_entry entry = {kernel, kernels.isa, max_threads, {dims[0], dims[1], dims[2]}, config};
+            add_tune_entry(&entry);
+            save_tune_entry(&entry);
+            tuner.num_tuned++;
+        }
+    }
+    return config;
+}
+
+void print_autotune(void) {
+    // Print the tuned configurations for this CPU
+
+    unsigned int i;
+
+    printf("Autotuned configurations (%s, %s)\n", tuner.cpu, isa_names[kernels.isa]);
+    printf("%-14s %-20s %8s %8s\n", "kernel", "shape", "block", "threads");
+    for (i = 0; i < tuner.num_entries; i++) {
+        tune_entry *entry = &tuner.entries[i];
+        if (entry->isa != kernels.isa || entry->max_threads != omp_get_max_threads()) {
+            continue;
+        }
+        char shape[64];
+        if (entry->kernel == TUNE_ELEM_MEMORY || entry->kernel == TUNE_ELEM_COMPUTE) {
+            snprintf(shape, sizeof(shape), "%zu", entry->dims[0]);
+        } else {
+            snprintf(shape, sizeof(shape), "%zux%zux%zu", entry->dims[0], entry->dims[1], entry->dims[2]);
+        }
+        printf("%-14s %-20s %8zu %8d\n", tune_kernel_names[entry->kernel], shape, entry->config.block, entry->config.threads);
+    }
+    printf("\n");
+}
+
+#endif
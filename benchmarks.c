@@ -0,0 +1,1244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "neural_network.c"
+#include "inference_server.c"
+#include "multi_train.c"
+#include "distributed.c"
+#include "half.c"
+#include "sparse.c"
+#include "stream.c"
+
+// Benchmarks of the kernels on the shapes of the 784-512-10 MNIST network
+// Run all benchmarks, or only the one named by the first argument
+
+#define MNIST_INPUT 784
+#define MNIST_HIDDEN 512
+#define MNIST_OUTPUT 10
+#define MNIST_BATCH 1024
+#define BENCH_REPEATS 5
+#define REQUESTS_PER_THREAD 2000
+
+typedef struct {
+    char *name;
+    void (*func)(void);
+} benchmark;
+
+// Arguments of the program, with which data_parallel relaunches it for the worker ranks
+char **bench_argv;
+
+void sparsify(matrix *mat, double sparsity) {
+    // Set a random fraction sparsity of the entries of mat to zero
+
+    size_t length = mat->rows * mat->cols;
+    unsigned int i;
+    for (i = 0; i < length; i++) {
+        if (rand_weight() < sparsity) {
+            mat->data[i] = 0.0;
+        }
+    }
+}
+
+double time_mat_mul_trans(void (*mul)(matrix *, matrix *, matrix *, bool, bool), matrix *result, matrix *mat1, matrix *mat2, bool t1, bool t2) {
+    // Best time of BENCH_REPEATS runs of mul, in seconds
+
+    double best = 0.0;
+    unsigned int i;
+
+    for (i = 0; i < BENCH_REPEATS; i++) {
+        double start = omp_get_wtime();
+        mul(result, mat1, mat2, t1, t2);
+        double seconds = omp_get_wtime() - start;
+        if (i == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+void bench_sparse_backprop(void) {
+    // Back propagation products of the MNIST network with ReLU sparsity in the hidden layer
+    // dW1 = dZ1 * X^T, with dZ1 as sparse as A1
+    // dW2 = dZ2 * A1^T, with a dense softmax dZ2
+
+    double sparsities[] = {0.0, 0.25, 0.5, 0.75, 0.9, 0.95};
+    size_t num_sparsities = sizeof(sparsities) / sizeof(double);
+    unsigned int i;
+
+    printf("Sparse back propagation (batch size %d)\n", MNIST_BATCH);
+    printf("%-10s %-10s %12s %12s %8s\n", "product", "sparsity", "dense (ms)", "sparse (ms)", "speedup");
+
+    for (i = 0; i < num_sparsities; i++) {
+        matrix *X = rand_mat(MNIST_INPUT, MNIST_BATCH);
+        matrix *dZ1 = rand_mat(MNIST_HIDDEN, MNIST_BATCH);
+        matrix *A1 = rand_mat(MNIST_HIDDEN, MNIST_BATCH);
+        matrix *dZ2 = rand_mat(MNIST_OUTPUT, MNIST_BATCH);
+        matrix *dW1 = zero_mat(MNIST_HIDDEN, MNIST_INPUT);
+        matrix *dW2 = zero_mat(MNIST_OUTPUT, MNIST_HIDDEN);
+        sparsify(dZ1, sparsities[i]);
+        sparsify(A1, sparsities[i]);
+
+        double dense = time_mat_mul_trans(mat_mul_trans, dW1, dZ1, X, false, true);
+        double sparse = time_mat_mul_trans(mat_mul_trans_sparse, dW1, dZ1, X, false, true);
+        printf("%-10s %-10.3f %12.3f %12.3f %7.2fx\n", "dW1", mat_sparsity(dZ1), 1000 * dense, 1000 * sparse, dense / sparse);
+
+        dense = time_mat_mul_trans(mat_mul_trans, dW2, dZ2, A1, false, true);
+        sparse = time_mat_mul_trans(mat_mul_trans_sparse, dW2, dZ2, A1, false, true);
+        printf("%-10s %-10.3f %12.3f %12.3f %7.2fx\n", "dW2", mat_sparsity(A1), 1000 * dense, 1000 * sparse, dense / sparse);
+
+        free_mat(X);
+        free_mat(dZ1);
+        free_mat(A1);
+        free_mat(dZ2);
+        free_mat(dW1);
+        free_mat(dW2);
+    }
+    printf("\n");
+}
+
+void mat_mul_rows(matrix *result, matrix *mat1, matrix *mat2) {
+    // mat_mul without the matrix-vector and small batch paths
+
+    size_t cols1 = mat1->cols;
+    size_t cols2 = mat2->cols;
+    unsigned int i;
+
+    #pragma omp parallel for
+    for (i = 0; i < mat1->rows; i++) {
+        kernels.mat_mul_row(result->data + i * cols2, mat1->data + i * cols1, mat2->data, cols1, cols2);
+    }
+}
+
+double time_mat_mul(void (*mul)(matrix *, matrix *, matrix *), matrix *result, matrix *mat1, matrix *mat2, unsigned int repeats) {
+    // Average time of repeats runs of mul, in seconds
+
+    unsigned int i;
+    double start = omp_get_wtime();
+    for (i = 0; i < repeats; i++) {
+        mul(result, mat1, mat2);
+    }
+    return (omp_get_wtime() - start) / repeats;
+}
+
+void bench_small_batch(void) {
+    // Latency of the hidden layer product and of model_predict for batch sizes 1 to 16
+
+    size_t batch_sizes[] = {1, 2, 4, 8, 16};
+    size_t num_batch_sizes = sizeof(batch_sizes) / sizeof(size_t);
+    unsigned int repeats = 200;
+    unsigned int i, j;
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    matrix *W = model->layers[1].W;
+
+    printf("Small batch inference (784-512-10 network)\n");
+    printf("%-6s %16s %16s %8s %18s\n", "batch", "generic W*X (us)", "shaped W*X (us)", "speedup", "model_predict (us)");
+
+    for (i = 0; i < num_batch_sizes; i++) {
+        size_t batch = batch_sizes[i];
+        matrix *X = rand_mat(MNIST_INPUT, batch);
+        matrix *Z = zero_mat(MNIST_HIDDEN, batch);
+        matrix *Y_hat = zero_mat(MNIST_OUTPUT, batch);
+
+        double generic = time_mat_mul(mat_mul_rows, Z, W, X, repeats);
+        double shaped = time_mat_mul(mat_mul, Z, W, X, repeats);
+
+        double start = omp_get_wtime();
+        for (j = 0; j < repeats; j++) {
+            model_predict(model, Y_hat, X, batch);
+        }
+        double predict = (omp_get_wtime() - start) / repeats;
+
+        printf("%-6zu %16.1f %16.1f %7.2fx %18.1f\n", batch, 1e6 * generic, 1e6 * shaped, generic / shaped, 1e6 * predict);
+
+        free_mat(X);
+        free_mat(Z);
+        free_mat(Y_hat);
+    }
+    printf("\n");
+
+    free_model(model);
+}
+
+typedef struct {
+    nn_model *model;
+    matrix *input;
+    // If set, the thread pins itself to CPU index of node and reads the local replica
+    nn_replicas *replicas;
+    int node;
+    int index;
+    // If set, the thread reads the newest snapshot published for model
+    nn_publisher *publisher;
+} request_thread_args;
+
+void* request_thread(void *arg) {
+    // Serve REQUESTS_PER_THREAD single sample predictions with a private context
+    // Each request thread runs its kernels single threaded
+
+    request_thread_args *args = arg;
+    nn_model *model = args->model;
+    if (args->replicas != NULL) {
+        numa_pin_to_node(args->node, args->index);
+        model = local_replica(args->replicas);
+    }
+    nn_context *ctx = create_context(model, 1);
+    nn_reader *reader = (args->publisher != NULL) ? create_reader(args->publisher, 1) : NULL;
+    matrix *result = zero_mat(MNIST_OUTPUT, 1);
+    unsigned int i;
+
+    omp_set_num_threads(1);
+    for (i = 0; i < REQUESTS_PER_THREAD; i++) {
+        if (reader != NULL) {
+            snapshot_predict(reader, result, args->input, 1);
+        } else {
+            model_predict_ctx(model, ctx, result, args->input, 1);
+        }
+    }
+
+    if (reader != NULL) {
+        free_reader(reader);
+    }
+    free_mat(result);
+    free_context(ctx);
+    return NULL;
+}
+
+void bench_inference_threads(void) {
+    // Aggregate throughput of single sample requests from 1 to num_procs threads sharing one model
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    int num_procs = omp_get_num_procs();
+    int num_threads;
+    unsigned int i;
+
+    pthread_t *threads = malloc(num_procs * sizeof(pthread_t));
+    request_thread_args *args = malloc(num_procs * sizeof(request_thread_args));
+    check_alloc(threads);
+    check_alloc(args);
+    for (i = 0; i < num_procs; i++) {
+        args[i].model = model;
+        args[i].input = rand_mat(MNIST_INPUT, 1);
+        args[i].replicas = NULL;
+        args[i].publisher = NULL;
+    }
+
+    printf("Concurrent inference on a shared model (784-512-10 network, batch size 1)\n");
+    printf("%-8s %16s %8s\n", "threads", "requests/s", "scaling");
+
+    double base = 0.0;
+    for (num_threads = 1; num_threads <= num_procs; num_threads *= 2) {
+        double start = omp_get_wtime();
+        for (i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, request_thread, &args[i]);
+        }
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double throughput = num_threads * REQUESTS_PER_THREAD / (omp_get_wtime() - start);
+        if (num_threads == 1) {
+            base = throughput;
+        }
+        printf("%-8d %16.0f %7.2fx\n", num_threads, throughput, throughput / base);
+    }
+    printf("\n");
+
+    for (i = 0; i < num_procs; i++) {
+        free_mat(args[i].input);
+    }
+    free(threads);
+    free(args);
+    free_model(model);
+}
+
+// Synthetic closed-loop load: every client sends requests_per_client requests
+// one after another, sleeping think_time seconds between them
+typedef struct {
+    size_t num_clients;
+    size_t requests_per_client;
+    double think_time;
+} load_config;
+
+typedef struct {
+    nn_server *server;
+    load_config *config;
+    double *latencies;
+} load_client_args;
+
+void* load_client(void *arg) {
+    load_client_args *args = arg;
+    double *input = malloc(MNIST_INPUT * sizeof(double));
+    double *output = malloc(MNIST_OUTPUT * sizeof(double));
+    check_alloc(input);
+    check_alloc(output);
+    struct timespec think = {0, (long) (args->config->think_time * 1e9)};
+    unsigned int i;
+
+    for (i = 0; i < MNIST_INPUT; i++) {
+        input[i] = (double) i / MNIST_INPUT;
+    }
+    for (i = 0; i < args->config->requests_per_client; i++) {
+        double start = omp_get_wtime();
+        server_predict(args->server, output, input);
+        args->latencies[i] = omp_get_wtime() - start;
+        if (think.tv_nsec > 0) {
+            nanosleep(&think, NULL);
+        }
+    }
+
+    free(input);
+    free(output);
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+void run_load(nn_server *server, load_config *config) {
+    // Run the load against server and print throughput, p50 and p99 latency
+
+    size_t num_clients = config->num_clients;
+    size_t num_requests = num_clients * config->requests_per_client;
+    double *latencies = malloc(num_requests * sizeof(double));
+    pthread_t *threads = malloc(num_clients * sizeof(pthread_t));
+    load_client_args *args = malloc(num_clients * sizeof(load_client_args));
+    check_alloc(latencies);
+    check_alloc(threads);
+    check_alloc(args);
+    size_t batches_before = server->num_batches;
+    unsigned int i;
+
+    double start = omp_get_wtime();
+    for (i = 0; i < num_clients; i++) {
+        args[i].server = server;
+        args[i].config = config;
+        args[i].latencies = latencies + i * config->requests_per_client;
+        pthread_create(&threads[i], NULL, load_client, &args[i]);
+    }
+    for (i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = omp_get_wtime() - start;
+
+    qsort(latencies, num_requests, sizeof(double), compare_double);
+    printf("%-8zu %-10zu %10.0f %12.1f %10.0f %10.0f\n", num_clients, server->max_batch,
+        num_requests / seconds, (double) num_requests / (server->num_batches - batches_before),
+        1e6 * latencies[num_requests / 2], 1e6 * latencies[num_requests * 99 / 100]);
+
+    free(latencies);
+    free(threads);
+    free(args);
+}
+
+void bench_server(void) {
+    // Throughput and latency of the batching server as concurrent clients increase,
+    // without batching (max batch 1) and with batching
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    size_t clients[] = {1, 4, 16, 64};
+    size_t max_batches[] = {1, 64};
+    size_t num_clients = sizeof(clients) / sizeof(size_t);
+    size_t num_max_batches = sizeof(max_batches) / sizeof(size_t);
+    double max_delay = 0.0005;
+    unsigned int i, j;
+
+    printf("Batching inference server (784-512-10 network, max delay %g ms)\n", 1000 * max_delay);
+    printf("%-8s %-10s %10s %12s %10s %10s\n", "clients", "max batch", "requests/s", "mean batch", "p50 (us)", "p99 (us)");
+
+    for (i = 0; i < num_max_batches; i++) {
+        for (j = 0; j < num_clients; j++) {
+            load_config config = {clients[j], 8000 / clients[j], 0.0};
+            nn_server *server = start_server(model, max_batches[i], max_delay);
+            run_load(server, &config);
+            stop_server(server);
+        }
+    }
+    printf("\n");
+
+    free_model(model);
+}
+
+void bench_classify(void) {
+    // Output stage of classifying 28000 inputs (the MNIST test set): softmax, then
+    // max_index of every column, against mat_col_argmax straight on the logits,
+    // and end to end model_predict against model_classify on a smaller batch
+
+    size_t num_inputs = 28000;
+    size_t batch = 4 * MNIST_BATCH;
+    matrix *Z = rand_mat(MNIST_OUTPUT, num_inputs);
+    matrix *Y_hat = zero_mat(MNIST_OUTPUT, num_inputs);
+    matrix *y_hat = zero_mat(MNIST_OUTPUT, 1);
+    size_t *labels = malloc(num_inputs * sizeof(size_t));
+    check_alloc(labels);
+    double times[4] = {0.0, 0.0, 0.0, 0.0};
+    unsigned int i, j;
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    matrix *X = rand_mat(MNIST_INPUT, batch);
+    matrix *Y_batch = zero_mat(MNIST_OUTPUT, batch);
+
+    for (i = 0; i < BENCH_REPEATS; i++) {
+        double start[5];
+        start[0] = omp_get_wtime();
+        softmax(Y_hat, Z);
+        for (j = 0; j < num_inputs; j++) {
+            mat_get_col(y_hat, Y_hat, j);
+            labels[j] = max_index(y_hat);
+        }
+        start[1] = omp_get_wtime();
+        mat_col_argmax(labels, Z);
+        start[2] = omp_get_wtime();
+        model_predict(model, Y_batch, X, batch);
+        for (j = 0; j < batch; j++) {
+            mat_get_col(y_hat, Y_batch, j);
+            labels[j] = max_index(y_hat);
+        }
+        start[3] = omp_get_wtime();
+        model_classify(model, labels, X, batch);
+        start[4] = omp_get_wtime();
+
+        for (j = 0; j < 4; j++) {
+            double seconds = start[j + 1] - start[j];
+            times[j] = (i == 0 || seconds < times[j]) ? seconds : times[j];
+        }
+    }
+
+    printf("Classification (784-512-10 network)\n");
+    printf("%-44s %10.3f ms\n", "softmax + max_index per column (28000)", 1000 * times[0]);
+    printf("%-44s %10.3f ms (%.1fx)\n", "mat_col_argmax of logits (28000)", 1000 * times[1], times[0] / times[1]);
+    printf("%-44s %10.3f ms\n", "model_predict + max_index per column (4096)", 1000 * times[2]);
+    printf("%-44s %10.3f ms (%.2fx)\n\n", "model_classify (4096)", 1000 * times[3], times[2] / times[3]);
+
+    free_mat(Z);
+    free_mat(Y_hat);
+    free_mat(y_hat);
+    free_mat(X);
+    free_mat(Y_batch);
+    free(labels);
+    free_model(model);
+}
+
+int quiet_begin(void) {
+    // Send stdout to /dev/null, returning the descriptor to restore it with quiet_end
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+void quiet_end(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+void bench_multi_model(void) {
+    // Training throughput of K models with train_models against K sequential train_model runs
+
+    size_t num_models[] = {1, 2, 4, 8};
+    size_t num_counts = sizeof(num_models) / sizeof(size_t);
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    size_t training_set_size = MNIST_BATCH;
+    size_t batch = MNIST_BATCH / 4;
+    int steps = 20;
+    unsigned int i, k;
+
+    matrix *X = rand_mat(MNIST_INPUT, training_set_size);
+    matrix *Y = zero_mat(MNIST_OUTPUT, training_set_size);
+    for (i = 0; i < training_set_size; i++) {
+        mat_set(Y, rand() % MNIST_OUTPUT, i, 1.0);
+    }
+
+    printf("Multi-model training (784-512-10 network, batch size %zu, %d steps)\n", batch, steps);
+    printf("%-8s %22s %22s %8s\n", "models", "sequential (samples/s)", "batched (samples/s)", "speedup");
+
+    for (i = 0; i < num_counts; i++) {
+        size_t K = num_models[i];
+        nn_model **models = malloc(K * sizeof(nn_model*));
+        adam_config *configs = malloc(K * sizeof(adam_config));
+        check_alloc(models);
+        check_alloc(configs);
+        for (k = 0; k < K; k++) {
+            models[k] = create_model(3, layer_sizes, layer_activations);
+            configs[k] = (adam_config) {0.001 * (k + 1), 0.9, 0.999, 1e-8};
+        }
+
+        int saved = quiet_begin();
+        double start = omp_get_wtime();
+        for (k = 0; k < K; k++) {
+            train_model(models[k], X, Y, batch, steps, configs[k].lr, configs[k].beta_1, configs[k].beta_2, configs[k].epsilon);
+        }
+        double sequential = omp_get_wtime() - start;
+
+        start = omp_get_wtime();
+        train_models(models, K, X, Y, batch, steps, configs);
+        double batched = omp_get_wtime() - start;
+        quiet_end(saved);
+
+        // Both include the final accuracy evaluation of every model on the training set
+        double samples = (double) K * steps * batch;
+        printf("%-8zu %22.0f %22.0f %7.2fx\n", K, samples / sequential, samples / batched, sequential / batched);
+
+        for (k = 0; k < K; k++) {
+            free_model(models[k]);
+        }
+        free(models);
+        free(configs);
+    }
+    printf("\n");
+
+    free_mat(X);
+    free_mat(Y);
+}
+
+typedef struct {
+    matrix *X;
+    matrix *Y;
+    size_t next;
+    size_t remaining;
+} replay_source;
+
+bool replay_producer(double *x, double *y, void *arg) {
+    // remaining samples from the columns of X and Y, starting over after the last one
+
+    replay_source *source = arg;
+    unsigned int i;
+
+    if (source->remaining == 0) {
+        return false;
+    }
+    for (i = 0; i < source->X->rows; i++) {
+        x[i] = source->X->data[i * source->X->cols + source->next];
+    }
+    for (i = 0; i < source->Y->rows; i++) {
+        y[i] = source->Y->data[i * source->Y->cols + source->next];
+    }
+    source->next = (source->next + 1) % source->X->cols;
+    source->remaining--;
+    return true;
+}
+
+void bench_stream(void) {
+    // Training throughput of train_stream, fed by a producer thread, against train_model
+    // on the same samples in memory
+
+    size_t shuffle_sizes[] = {0, 4096};
+    size_t num_shuffle_sizes = sizeof(shuffle_sizes) / sizeof(size_t);
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    size_t training_set_size = MNIST_BATCH;
+    size_t batch = MNIST_BATCH / 4;
+    size_t capacity = 2 * batch;
+    int steps = 20;
+    unsigned int i;
+
+    matrix *X = rand_mat(MNIST_INPUT, training_set_size);
+    matrix *Y = zero_mat(MNIST_OUTPUT, training_set_size);
+    for (i = 0; i < training_set_size; i++) {
+        mat_set(Y, rand() % MNIST_OUTPUT, i, 1.0);
+    }
+
+    printf("Stream training (784-512-10 network, batch size %zu, %d steps, ring of %zu samples)\n", batch, steps, capacity);
+    printf("%-24s %12s %18s\n", "source", "samples/s", "waiting for data");
+
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    int saved = quiet_begin();
+    double start = omp_get_wtime();
+    train_model(model, X, Y, batch, steps, 0.001, 0.9, 0.999, 1e-8);
+    double seconds = omp_get_wtime() - start;
+    quiet_end(saved);
+    free_model(model);
+    // Includes the final accuracy evaluation on the training set
+    printf("%-24s %12.0f %18s\n", "in memory (train_model)", steps * batch / seconds, "-");
+
+    for (i = 0; i < num_shuffle_sizes; i++) {
+        // The shuffle buffer is filled before the first step, so the stream carries its samples on top
+        replay_source source = {X, Y, 0, (steps * batch + shuffle_sizes[i])};
+        char name[32];
+        model = create_model(3, layer_sizes, layer_activations);
+        sample_stream *stream = create_stream(MNIST_INPUT, MNIST_OUTPUT, capacity);
+
+        saved = quiet_begin();
+        start = omp_get_wtime();
+        start_producer(stream, replay_producer, &source);
+        train_stream(model, stream, batch, shuffle_sizes[i], steps, 0.001, 0.9, 0.999, 1e-8);
+        seconds = omp_get_wtime() - start;
+        quiet_end(saved);
+
+        snprintf(name, sizeof(name), "stream, shuffle %zu", shuffle_sizes[i]);
+        printf("%-24s %12.0f %17.1f%%\n", name, steps * batch / seconds, 100.0 * stream->wait_seconds / seconds);
+        free_stream(stream);
+        free_model(model);
+    }
+    printf("\n");
+
+    free_mat(X);
+    free_mat(Y);
+}
+
+void bench_lazy_backprop(void) {
+    // Eager and lazy (fused) back propagation of the MNIST network
+
+    size_t batch_sizes[] = {64, 256, MNIST_BATCH};
+    size_t num_batch_sizes = sizeof(batch_sizes) / sizeof(size_t);
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    unsigned int b, i, r;
+
+    printf("Lazy back propagation\n");
+    printf("%-8s %12s %12s %8s\n", "batch", "eager (ms)", "lazy (ms)", "speedup");
+
+    for (b = 0; b < num_batch_sizes; b++) {
+        size_t m = batch_sizes[b];
+        nn_model *model = create_model(3, layer_sizes, layer_activations);
+        nn_layer *layers = model->layers;
+        matrix *X = rand_mat(MNIST_INPUT, m);
+        matrix *Y = zero_mat(MNIST_OUTPUT, m);
+        for (i = 0; i < m; i++) {
+            mat_set(Y, rand() % MNIST_OUTPUT, i, 1.0);
+        }
+
+        layers[0].A = X;
+        for (i = 1; i < 3; i++) {
+            layers[i].A = zero_mat(layer_sizes[i], m);
+            layers[i].Z = zero_mat(layer_sizes[i], m);
+            layers[i].dA = zero_mat(layer_sizes[i], m);
+            layers[i].dZ = zero_mat(layer_sizes[i], m);
+        }
+        forward_prop(model);
+
+        double times[2];
+        for (r = 0; r < 2; r++) {
+            model->lazy_backprop = (r == 1);
+            back_prop(model, Y);
+            double start = omp_get_wtime();
+            for (i = 0; i < BENCH_REPEATS; i++) {
+                back_prop(model, Y);
+            }
+            times[r] = (omp_get_wtime() - start) / BENCH_REPEATS;
+        }
+        printf("%-8zu %12.3f %12.3f %7.2fx\n", m, 1000 * times[0], 1000 * times[1], times[0] / times[1]);
+
+        layers[0].A = NULL;
+        free_mat(X);
+        free_mat(Y);
+        free_model(model);
+    }
+    printf("\n");
+}
+
+double time_sigmoid(matrix *result, matrix *mat) {
+    // Average time of sigmoid, in seconds
+
+    unsigned int repeats = 20 * BENCH_REPEATS;
+    unsigned int i;
+    double start = omp_get_wtime();
+    for (i = 0; i < repeats; i++) {
+        sigmoid(result, mat);
+    }
+    return (omp_get_wtime() - start) / repeats;
+}
+
+void bench_autotune(void) {
+    // Fixed and autotuned mat_mul and sigmoid on the shapes of the MNIST network
+
+    size_t shapes[][3] = {
+        {MNIST_HIDDEN, MNIST_INPUT, 1},
+        {MNIST_HIDDEN, MNIST_INPUT, 8},
+        {MNIST_HIDDEN, MNIST_INPUT, MNIST_BATCH},
+        {MNIST_OUTPUT, MNIST_HIDDEN, MNIST_BATCH},
+        {MNIST_HIDDEN, MNIST_BATCH, MNIST_INPUT},
+        {MNIST_OUTPUT, MNIST_BATCH, MNIST_HIDDEN},
+    };
+    size_t num_shapes = sizeof(shapes) / sizeof(shapes[0]);
+    unsigned int i;
+
+    printf("Autotuning (tuned in memory, not cached)\n");
+    printf("%-20s %12s %12s %8s\n", "shape", "fixed (ms)", "tuned (ms)", "speedup");
+
+    for (i = 0; i < num_shapes; i++) {
+        matrix *mat1 = rand_mat(shapes[i][0], shapes[i][1]);
+        matrix *mat2 = rand_mat(shapes[i][1], shapes[i][2]);
+        matrix *result = zero_mat(shapes[i][0], shapes[i][2]);
+        unsigned int repeats = 1 + 100000000 / (shapes[i][0] * shapes[i][1] * shapes[i][2]);
+
+        disable_autotune();
+        double fixed = time_mat_mul(mat_mul, result, mat1, mat2, repeats);
+        enable_autotune(NULL);
+        mat_mul(result, mat1, mat2);
+        double tuned = time_mat_mul(mat_mul, result, mat1, mat2, repeats);
+
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%zux%zux%zu", shapes[i][0], shapes[i][1], shapes[i][2]);
+        printf("%-20s %12.3f %12.3f %7.2fx\n", shape, 1000 * fixed, 1000 * tuned, fixed / tuned);
+
+        free_mat(mat1);
+        free_mat(mat2);
+        free_mat(result);
+    }
+
+    // Autotuning is still enabled from the last shape
+    matrix *Z = rand_mat(MNIST_HIDDEN, MNIST_BATCH);
+    matrix *A = zero_mat(MNIST_HIDDEN, MNIST_BATCH);
+    sigmoid(A, Z);
+    double tuned = time_sigmoid(A, Z);
+    disable_autotune();
+    double fixed = time_sigmoid(A, Z);
+    printf("%-20s %12.3f %12.3f %7.2fx\n\n", "sigmoid 512x1024", 1000 * fixed, 1000 * tuned, fixed / tuned);
+
+    free_mat(Z);
+    free_mat(A);
+}
+
+double time_train_steps(bool numa_placement) {
+    // Average time of forward_prop and back_prop of the MNIST network, with the
+    // model, activations and mini-batch allocated with or without NUMA placement
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    unsigned int i;
+
+    numa.enabled = numa_placement;
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_layer *layers = model->layers;
+    matrix *X = numa_zero_mat(MNIST_INPUT, MNIST_BATCH);
+    matrix *Y = numa_zero_mat(MNIST_OUTPUT, MNIST_BATCH);
+    for (i = 0; i < MNIST_INPUT * MNIST_BATCH; i++) {
+        X->data[i] = rand_weight();
+    }
+    for (i = 0; i < MNIST_BATCH; i++) {
+        mat_set(Y, rand() % MNIST_OUTPUT, i, 1.0);
+    }
+
+    layers[0].A = X;
+    for (i = 1; i < 3; i++) {
+        layers[i].A = numa_zero_mat(layer_sizes[i], MNIST_BATCH);
+        layers[i].Z = numa_zero_mat(layer_sizes[i], MNIST_BATCH);
+        layers[i].dA = numa_zero_mat(layer_sizes[i], MNIST_BATCH);
+        layers[i].dZ = numa_zero_mat(layer_sizes[i], MNIST_BATCH);
+    }
+
+    forward_prop(model);
+    back_prop(model, Y);
+    double start = omp_get_wtime();
+    for (i = 0; i < BENCH_REPEATS; i++) {
+        forward_prop(model);
+        back_prop(model, Y);
+    }
+    double seconds = (omp_get_wtime() - start) / BENCH_REPEATS;
+
+    layers[0].A = NULL;
+    free_mat(X);
+    free_mat(Y);
+    free_model(model);
+    return seconds;
+}
+
+double time_replica_inference(nn_model *model, nn_replicas *replicas, int num_threads) {
+    // Requests per second of num_threads request threads, spread over the nodes
+    // and reading the local replica if replicas is set
+
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    request_thread_args *args = malloc(num_threads * sizeof(request_thread_args));
+    check_alloc(threads);
+    check_alloc(args);
+    unsigned int i;
+
+    for (i = 0; i < num_threads; i++) {
+        args[i].model = model;
+        args[i].input = rand_mat(MNIST_INPUT, 1);
+        args[i].replicas = replicas;
+        args[i].publisher = NULL;
+        args[i].node = numa_thread_node(i, num_threads);
+        args[i].index = i;
+    }
+
+    double start = omp_get_wtime();
+    for (i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, request_thread, &args[i]);
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double throughput = num_threads * REQUESTS_PER_THREAD / (omp_get_wtime() - start);
+
+    for (i = 0; i < num_threads; i++) {
+        free_mat(args[i].input);
+    }
+    free(threads);
+    free(args);
+    return throughput;
+}
+
+void bench_numa(void) {
+    // Default and NUMA-aware placement for training steps and for concurrent inference
+
+    bool enabled = numa.enabled;
+    int num_procs = omp_get_num_procs();
+
+    printf("NUMA placement (%d nodes, %d threads)\n", numa.num_nodes, omp_get_max_threads());
+    printf("%-28s %14s %14s %8s\n", "workload", "default", "numa", "speedup");
+
+    enable_numa(false);
+    double fixed = time_train_steps(false);
+    double placed = time_train_steps(true);
+    printf("%-28s %11.2f ms %11.2f ms %7.2fx\n", "forward + back prop", 1000 * fixed, 1000 * placed, fixed / placed);
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    numa.enabled = false;
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_replicas *replicas = create_replicas(model);
+
+    double shared = time_replica_inference(model, NULL, num_procs);
+    double local = time_replica_inference(model, replicas, num_procs);
+    printf("%-28s %10.0f r/s %10.0f r/s %7.2fx\n\n", "inference, local replicas", shared, local, local / shared);
+
+    free_replicas(replicas);
+    free_model(model);
+    numa.enabled = enabled;
+}
+
+void bench_data_parallel(void) {
+    // Training throughput of train_data_parallel on 1, 2 and 4 ranks, each rank
+    // getting its share of the threads, and the scaling efficiency against 1 rank
+    // on all of them
+    // Worker processes run main again and only take part in their own launch
+
+    size_t num_ranks[] = {1, 2, 4};
+    size_t num_counts = sizeof(num_ranks) / sizeof(size_t);
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    size_t training_set_size = MNIST_BATCH;
+    size_t batch = MNIST_BATCH / 4;
+    int steps = 20;
+    int max_threads = omp_get_max_threads();
+    char *world_size = getenv("NN_WORLD_SIZE");
+    double single = 0.0;
+    unsigned int i;
+
+    matrix *X = rand_mat(MNIST_INPUT, training_set_size);
+    matrix *Y = zero_mat(MNIST_OUTPUT, training_set_size);
+    for (i = 0; i < training_set_size; i++) {
+        mat_set(Y, rand() % MNIST_OUTPUT, i, 1.0);
+    }
+
+    if (world_size == NULL) {
+        printf("Data-parallel training (784-512-10 network, batch size %zu, %d steps)\n", batch, steps);
+        printf("%-8s %18s %14s %12s\n", "ranks", "throughput", "efficiency", "all-reduce");
+    }
+
+    for (i = 0; i < num_counts; i++) {
+        size_t R = num_ranks[i];
+        if (world_size != NULL && (size_t) atoi(world_size) != R) {
+            continue;
+        }
+
+        nn_model *model = create_model(3, layer_sizes, layer_activations);
+        nn_transport *transport = start_workers(R, bench_argv);
+        int saved = (transport->rank == 0) ? quiet_begin() : -1;
+        double start = omp_get_wtime();
+        train_data_parallel(model, transport, X, Y, batch, steps, 0.001, 0.9, 0.999, 1e-8);
+        double seconds = omp_get_wtime() - start;
+        double comm_time = transport->comm_seconds;
+        if (saved >= 0) {
+            quiet_end(saved);
+        }
+        stop_workers(transport);
+
+        double throughput = steps * batch / seconds;
+        if (R == 1) {
+            single = throughput;
+        }
+        printf("%-8zu %12.0f samples/s %13.0f%% %11.1f%%\n", R, throughput, 100.0 * throughput / single, 100.0 * comm_time / seconds);
+
+        free_model(model);
+        omp_set_num_threads(max_threads);
+    }
+    printf("\n");
+
+    free_mat(X);
+    free_mat(Y);
+}
+
+void bench_hot_swap(void) {
+    // Throughput of single sample requests reading published snapshots, with the
+    // model idle and while train_model publishes new weights after every step
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    size_t training_set_size = MNIST_BATCH;
+    size_t batch = 64;
+    int steps = 200;
+    int num_threads = omp_get_num_procs();
+    unsigned int i, run;
+
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_publisher *publisher = create_publisher(model, 1);
+    matrix *X = rand_mat(MNIST_INPUT, training_set_size);
+    matrix *Y = zero_mat(MNIST_OUTPUT, training_set_size);
+    for (i = 0; i < training_set_size; i++) {
+        mat_set(Y, rand() % MNIST_OUTPUT, i, 1.0);
+    }
+
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    request_thread_args *args = malloc(num_threads * sizeof(request_thread_args));
+    check_alloc(threads);
+    check_alloc(args);
+    for (i = 0; i < num_threads; i++) {
+        args[i].model = model;
+        args[i].input = rand_mat(MNIST_INPUT, 1);
+        args[i].replicas = NULL;
+        args[i].publisher = publisher;
+    }
+
+    printf("Serving published weight snapshots (784-512-10 network, %d request threads)\n", num_threads);
+    printf("%-20s %14s %12s %12s\n", "trainer", "requests/s", "published", "reclaimed");
+
+    for (run = 0; run < 2; run++) {
+        size_t published = publisher->num_published;
+        size_t reclaimed = publisher->num_reclaimed;
+
+        double start = omp_get_wtime();
+        for (i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, request_thread, &args[i]);
+        }
+        if (run == 1) {
+            int saved = quiet_begin();
+            train_model(model, X, Y, batch, steps, 0.001, 0.9, 0.999, 1e-8);
+            quiet_end(saved);
+        }
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double throughput = num_threads * REQUESTS_PER_THREAD / (omp_get_wtime() - start);
+
+        printf("%-20s %14.0f %12zu %12zu\n", (run == 0) ? "idle" : "training", throughput,
+            publisher->num_published - published, publisher->num_reclaimed - reclaimed);
+    }
+    printf("\n");
+
+    for (i = 0; i < num_threads; i++) {
+        free_mat(args[i].input);
+    }
+    free(threads);
+    free(args);
+    free_mat(X);
+    free_mat(Y);
+    free_model(model);
+}
+
+void bench_half_weights(void) {
+    // Latency of model_predict with double weights against fp16 and bf16 weights
+    // for small batches, where reading W dominates
+
+    size_t batch_sizes[] = {1, 4, 16, 64};
+    size_t num_batch_sizes = sizeof(batch_sizes) / sizeof(size_t);
+    unsigned int repeats = 200;
+    unsigned int i, j, format;
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    h_model *hmodels[NUM_HALF_FORMATS];
+    for (format = 0; format < NUM_HALF_FORMATS; format++) {
+        hmodels[format] = compress_model(model, format);
+    }
+
+    printf("Half precision weights (784-512-10 network, %.1f MB of double weights)\n",
+        model->num_params * sizeof(double) / 1e6);
+    printf("%-6s %12s %12s %8s %12s %8s\n", "batch", "fp64 (us)", "fp16 (us)", "speedup", "bf16 (us)", "speedup");
+
+    for (i = 0; i < num_batch_sizes; i++) {
+        size_t batch = batch_sizes[i];
+        matrix *X = rand_mat(MNIST_INPUT, batch);
+        matrix *Y_hat = zero_mat(MNIST_OUTPUT, batch);
+        double times[NUM_HALF_FORMATS];
+
+        model_predict(model, Y_hat, X, batch);
+        double start = omp_get_wtime();
+        for (j = 0; j < repeats; j++) {
+            model_predict(model, Y_hat, X, batch);
+        }
+        double full = (omp_get_wtime() - start) / repeats;
+
+        for (format = 0; format < NUM_HALF_FORMATS; format++) {
+            h_model_predict(hmodels[format], Y_hat, X, batch);
+            start = omp_get_wtime();
+            for (j = 0; j < repeats; j++) {
+                h_model_predict(hmodels[format], Y_hat, X, batch);
+            }
+            times[format] = (omp_get_wtime() - start) / repeats;
+        }
+
+        printf("%-6zu %12.1f %12.1f %7.2fx %12.1f %7.2fx\n", batch, 1e6 * full,
+            1e6 * times[HALF_FP16], full / times[HALF_FP16], 1e6 * times[HALF_BF16], full / times[HALF_BF16]);
+
+        free_mat(X);
+        free_mat(Y_hat);
+    }
+    printf("\n");
+
+    for (format = 0; format < NUM_HALF_FORMATS; format++) {
+        free_h_model(hmodels[format]);
+    }
+    free_model(model);
+}
+
+void bench_pruning(void) {
+    // Latency of model_predict on the dense model against s_model_predict on the
+    // model pruned to increasing sparsities, for one sample and a batch
+
+    double sparsities[] = {0.0, 0.5, 0.75, 0.9, 0.95, 0.99};
+    size_t num_sparsities = sizeof(sparsities) / sizeof(double);
+    size_t batch_sizes[] = {1, 64};
+    unsigned int repeats = 200;
+    unsigned int i, j, r;
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    double *original = malloc(model->num_params * sizeof(double));
+    check_alloc(original);
+    memcpy(original, model->params, model->num_params * sizeof(double));
+
+    printf("Pruned CSR inference (784-512-10 network)\n");
+    printf("%-9s %-6s %12s %12s %8s\n", "sparsity", "batch", "dense (us)", "csr (us)", "speedup");
+
+    for (i = 0; i < num_sparsities; i++) {
+        memcpy(model->params, original, model->num_params * sizeof(double));
+        prune_to_sparsity(model, sparsities[i]);
+        s_model *smodel = sparse_model(model);
+
+        for (j = 0; j < 2; j++) {
+            size_t batch = batch_sizes[j];
+            matrix *X = rand_mat(MNIST_INPUT, batch);
+            matrix *Y_hat = zero_mat(MNIST_OUTPUT, batch);
+
+            model_predict(model, Y_hat, X, batch);
+            double start = omp_get_wtime();
+            for (r = 0; r < repeats; r++) {
+                model_predict(model, Y_hat, X, batch);
+            }
+            double dense = (omp_get_wtime() - start) / repeats;
+
+            s_model_predict(smodel, Y_hat, X, batch);
+            start = omp_get_wtime();
+            for (r = 0; r < repeats; r++) {
+                s_model_predict(smodel, Y_hat, X, batch);
+            }
+            double sparse = (omp_get_wtime() - start) / repeats;
+
+            printf("%-9.2f %-6zu %12.1f %12.1f %7.2fx\n", sparsities[i], batch, 1e6 * dense, 1e6 * sparse, dense / sparse);
+
+            free_mat(X);
+            free_mat(Y_hat);
+        }
+        free_s_model(smodel);
+    }
+    printf("\n");
+
+    free(original);
+    free_model(model);
+}
+
+size_t count_macs(nn_model *model) {
+    // Multiply-adds of one forward pass for one sample
+
+    nn_layer *layers = model->layers;
+    size_t macs = 0;
+    unsigned int i;
+
+    for (i = 1; i < model->num_layers; i++) {
+        size_t positions = (layers[i].type == CONV) ? layers[i].height * layers[i].width : 1;
+        macs += layers[i].W->rows * layers[i].W->cols * positions;
+    }
+    return macs;
+}
+
+void bench_conv(void) {
+    // The dense MNIST network against a small convolutional network on the same 28x28
+    // images: size, multiply-adds, time of a training step and inference throughput
+
+    size_t layer_sizes[] = {MNIST_INPUT, MNIST_HIDDEN, MNIST_OUTPUT};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_layer_spec conv_specs[] = {input_layer(1, 28, 28), conv_layer(8, 5, RELU), maxpool_layer(2),
+        conv_layer(16, 5, RELU), maxpool_layer(2), dense_layer(MNIST_OUTPUT, SOFTMAX)};
+    nn_model *models[] = {create_model(3, layer_sizes, layer_activations), create_model_layers(6, conv_specs)};
+    char *names[] = {"dense 784-512-10", "conv 8c5-p2-16c5-p2-10"};
+    size_t batch = 256;
+    unsigned int i, r;
+
+    matrix *X = rand_mat(MNIST_INPUT, MNIST_BATCH);
+    matrix *Y_hat = zero_mat(MNIST_OUTPUT, MNIST_BATCH);
+    matrix *mini_X = rand_mat(MNIST_INPUT, batch);
+    matrix *mini_Y = zero_mat(MNIST_OUTPUT, batch);
+    for (i = 0; i < batch; i++) {
+        mat_set(mini_Y, rand() % MNIST_OUTPUT, i, 1.0);
+    }
+
+    printf("Convolutional and dense MNIST networks (training batch %zu, inference batch %d)\n", batch, MNIST_BATCH);
+    printf("%-24s %10s %12s %16s %18s\n", "network", "params", "MACs/sample", "train step (ms)", "inference (1/s)");
+
+    for (i = 0; i < 2; i++) {
+        nn_model *model = models[i];
+
+        create_train_buffers(model, mini_X);
+        forward_prop(model);
+        back_prop(model, mini_Y);
+        double start = omp_get_wtime();
+        for (r = 0; r < BENCH_REPEATS; r++) {
+            forward_prop(model);
+            back_prop(model, mini_Y);
+        }
+        double train = (omp_get_wtime() - start) / BENCH_REPEATS;
+        free_train_buffers(model);
+
+        model_predict(model, Y_hat, X, MNIST_BATCH);
+        start = omp_get_wtime();
+        for (r = 0; r < BENCH_REPEATS; r++) {
+            model_predict(model, Y_hat, X, MNIST_BATCH);
+        }
+        double inference = (omp_get_wtime() - start) / BENCH_REPEATS;
+
+        printf("%-24s %10zu %12zu %16.2f %18.0f\n", names[i], model->num_params, count_macs(model),
+            1000 * train, MNIST_BATCH / inference);
+        free_model(model);
+    }
+    printf("\n");
+
+    free_mat(X);
+    free_mat(Y_hat);
+    free_mat(mini_X);
+    free_mat(mini_Y);
+}
+
+void bench_random(void) {
+    // Counter-based random numbers (random.c) against the serial C rand() for filling
+    // a weight matrix and shuffling the indices of a training set
+
+    size_t lengths[] = {MNIST_INPUT * MNIST_HIDDEN, 16 * 1048576};
+    int sizes[] = {42000, 4 * 1048576};
+    unsigned int i, j, r;
+
+    printf("Random numbers (%d threads)\n", omp_get_max_threads());
+    printf("%-26s %16s %16s %8s\n", "operation", "rand() (ms)", "counter (ms)", "speedup");
+
+    for (i = 0; i < 2; i++) {
+        size_t length = lengths[i];
+        double *data = malloc(length * sizeof(double));
+        check_alloc(data);
+
+        double start = omp_get_wtime();
+        for (r = 0; r < BENCH_REPEATS; r++) {
+            for (j = 0; j < length; j++) {
+                data[j] = rand_weight();
+            }
+        }
+        double serial = (omp_get_wtime() - start) / BENCH_REPEATS;
+
+        start = omp_get_wtime();
+        for (r = 0; r < BENCH_REPEATS; r++) {
+            rand_fill(data, length, 0.0, 1.0);
+        }
+        double counter = (omp_get_wtime() - start) / BENCH_REPEATS;
+
+        char name[32];
+        snprintf(name, sizeof(name), "fill %zu values", length);
+        printf("%-26s %16.2f %16.2f %7.2fx\n", name, 1000 * serial, 1000 * counter, serial / counter);
+        free(data);
+    }
+
+    for (i = 0; i < 2; i++) {
+        int n = sizes[i];
+        int *indices = malloc(n * sizeof(int));
+        check_alloc(indices);
+        for (j = 0; j < (unsigned int) n; j++) {
+            indices[j] = j;
+        }
+
+        // The previous shuffle_array: Fisher-Yates with rand()
+        double start = omp_get_wtime();
+        for (r = 0; r < BENCH_REPEATS; r++) {
+            for (j = 0; j + 1 < (unsigned int) n; j++) {
+                unsigned int k = j + rand() / (RAND_MAX / (n - j) + 1);
+                int t = indices[k];
+                indices[k] = indices[j];
+                indices[j] = t;
+            }
+        }
+        double serial = (omp_get_wtime() - start) / BENCH_REPEATS;
+
+        start = omp_get_wtime();
+        for (r = 0; r < BENCH_REPEATS; r++) {
+            shuffle_array(indices, n);
+        }
+        double counter = (omp_get_wtime() - start) / BENCH_REPEATS;
+
+        char name[32];
+        snprintf(name, sizeof(name), "shuffle %d indices", n);
+        printf("%-26s %16.2f %16.2f %7.2fx\n", name, 1000 * serial, 1000 * counter, serial / counter);
+        free(indices);
+    }
+    printf("\n");
+}
+
+benchmark benchmarks[] = {
+    {"sparse_backprop", bench_sparse_backprop},
+    {"small_batch", bench_small_batch},
+    {"inference_threads", bench_inference_threads},
+    {"server", bench_server},
+    {"classify", bench_classify},
+    {"multi_model", bench_multi_model},
+    {"lazy_backprop", bench_lazy_backprop},
+    {"autotune", bench_autotune},
+    {"numa", bench_numa},
+    {"data_parallel", bench_data_parallel},
+    {"hot_swap", bench_hot_swap},
+    {"half_weights", bench_half_weights},
+    {"pruning", bench_pruning},
+    {"conv", bench_conv},
+    {"stream", bench_stream},
+    {"random", bench_random},
+};
+
+int main(int argc, char **argv) {
+    size_t num_benchmarks = sizeof(benchmarks) / sizeof(benchmark);
+    unsigned int i;
+
+    srand(123);
+    rng_seed(123);
+    bench_argv = argv;
+
+    // Worker ranks started by data_parallel
+    if (getenv("NN_RANK") != NULL) {
+        bench_data_parallel();
+        return 0;
+    }
+
+    printf("Kernel variant: %s, threads: %d\n\n", isa_names[kernels.isa], omp_get_max_threads());
+
+    for (i = 0; i < num_benchmarks; i++) {
+        if (argc < 2 || strcmp(argv[1], benchmarks[i].name) == 0) {
+            benchmarks[i].func();
+        }
+    }
+}
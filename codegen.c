@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+// Generates a forward pass specialized to one network topology
+//
+// Usage: codegen <name> <layer sizes> <activations> [--bench]
+// e.g.   codegen mnist 784,512,10 input,relu,softmax > mnist_forward.c
+//
+// The generated <name>_forward(params, result, input, num_inputs) computes the
+// same thing as model_predict for a model with that topology, where params is
+// the model's flat parameter array (model->params) and input and result hold
+// one sample per column. All dimensions and parameter offsets are compile time
+// constants, the activations of a block of samples live in statically sized
+// arrays, and layers with few weights are fully unrolled. Every output sums
+// its products in the same order as mat_mul.
+// With --bench, a main is added that checks the generated code against
+// model_predict and compares their speed, and exits with status 1 if any
+// result differs. The generated code includes
+// simd_kernels.c (and neural_network.c with --bench), so it is compiled with
+// this directory on the include path.
+
+#define MAX_LAYERS 32
+#define MAX_NAME_LENGTH 64
+#define GEN_BLOCK 8
+#define UNROLL_MAX_WEIGHTS 64
+
+char *activation_names[] = {"input", "relu", "sigmoid", "softmax"};
+char *activation_enums[] = {"INPUT", "RELU", "SIGMOID", "SOFTMAX"};
+
+typedef struct {
+    char name[MAX_NAME_LENGTH];
+    char upper[MAX_NAME_LENGTH];
+    size_t num_layers;
+    size_t sizes[MAX_LAYERS];
+    int activations[MAX_LAYERS];
+} topology;
+
+size_t parse_list(char *list, char **items, size_t max_items) {
+    // Split a comma separated list in place
+
+    size_t count = 0;
+    char *item = strtok(list, ",");
+    while (item != NULL) {
+        if (count == max_items) {
+            fprintf(stderr, "Error: At most %zu layers are supported\n\n", max_items);
+            exit(1);
+        }
+        items[count++] = item;
+        item = strtok(NULL, ",");
+    }
+    return count;
+}
+
+void parse_topology(topology *net, char *name, char *sizes, char *activations) {
+    char *items[MAX_LAYERS];
+    size_t num_sizes, num_activations;
+    unsigned int i, a;
+
+    if (strlen(name) == 0 || strlen(name) >= MAX_NAME_LENGTH) {
+        fprintf(stderr, "Error: Invalid name %s\n\n", name);
+        exit(1);
+    }
+    for (i = 0; name[i] != '\0'; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '_') {
+            fprintf(stderr, "Error: Invalid name %s\n\n", name);
+            exit(1);
+        }
+        net->name[i] = name[i];
+        net->upper[i] = toupper((unsigned char) name[i]);
+    }
+    net->name[i] = '\0';
+    net->upper[i] = '\0';
+
+    num_sizes = parse_list(sizes, items, MAX_LAYERS);
+    for (i = 0; i < num_sizes; i++) {
+        net->sizes[i] = strtoul(items[i], NULL, 10);
+        if (net->sizes[i] == 0) {
+            fprintf(stderr, "Error: Invalid layer size %s\n\n", items[i]);
+            exit(1);
+        }
+    }
+
+    num_activations = parse_list(activations, items, MAX_LAYERS);
+    for (i = 0; i < num_activations; i++) {
+        for (a = 0; a < 4; a++) {
+            if (strcmp(items[i], activation_names[a]) == 0) {
+                break;
+            }
+        }
+        if (a == 4 || (a == 0) != (i == 0)) {
+            fprintf(stderr, "Error: Invalid activation %s for layer %u\n\n", items[i], i);
+            exit(1);
+        }
+        net->activations[i] = a;
+    }
+
+    if (num_sizes < 2 || num_sizes != num_activations) {
+        fprintf(stderr, "Error: Expected the same number (at least 2) of layer sizes and activations\n\n");
+        exit(1);
+    }
+    net->num_layers = num_sizes;
+}
+
+void emit_header(topology *net) {
+    char *N = net->upper;
+    size_t offset = 0;
+    unsigned int i;
+
+    printf("// Generated by codegen.c for the ");
+    for (i = 0; i < net->num_layers; i++) {
+        printf("%s%zu", (i == 0) ? "" : "-", net->sizes[i]);
+    }
+    printf(" network (");
+    for (i = 0; i < net->num_layers; i++) {
+        printf("%s%s", (i == 0) ? "" : ", ", activation_names[net->activations[i]]);
+    }
+    printf(")\n// Do not edit\n");
+    printf("// Best compiled for the machine it runs on, e.g. gcc -O2 -march=native -fopenmp\n\n");
+
+    printf("#include <stdlib.h>\n#include <math.h>\n#include \"simd_kernels.c\"\n\n");
+    printf("// No fused multiply-adds, so the results match model_predict exactly\n");
+    printf("#pragma GCC optimize(\"fp-contract=off\")\n\n");
+    printf("#define %s_BLOCK %d\n", N, GEN_BLOCK);
+    for (i = 0; i < net->num_layers; i++) {
+        printf("#define %s_N%u %zu\n", N, i, net->sizes[i]);
+    }
+
+    // Offsets of W and b of every layer in the flat parameter array
+    for (i = 1; i < net->num_layers; i++) {
+        printf("#define %s_W%u %zu\n", N, i, offset);
+        offset += net->sizes[i] * net->sizes[i - 1];
+        printf("#define %s_B%u %zu\n", N, i, offset);
+        offset += net->sizes[i];
+    }
+    printf("#define %s_NUM_PARAMS %zu\n\n", N, offset);
+}
+
+void emit_activation(int activation, char *target, char *value) {
+    // Assign the activation of value to target
+    // Sigmoid and softmax are applied to the whole layer afterwards
+
+    if (activation == 1) {
+        printf("%s = (%s > 0.0) ? %s : 0.0;\n", target, value, value);
+    } else {
+        printf("%s = %s;\n", target, value);
+    }
+}
+
+void emit_layer(topology *net, unsigned int l, bool single) {
+    // Emit <name>_layer<l>, which evaluates layer l on a block of GEN_BLOCK samples,
+    // or <name>_layer<l>_single, which evaluates it on one sample
+
+    char *N = net->upper;
+    size_t n_curr = net->sizes[l];
+    size_t n_prev = net->sizes[l - 1];
+    int activation = net->activations[l];
+    char *s_index = single ? "" : "[s]";
+    char *indent = single ? "    " : "        ";
+    unsigned int r, k;
+
+    if (single) {
+        printf("static void %s_layer%u_single(const double *params, double out[%s_N%u], double in[%s_N%u]) {\n",
+            net->name, l, N, l, N, l - 1);
+    } else {
+        printf("static void %s_layer%u(const double *params, double out[%s_N%u][%s_BLOCK], double in[%s_N%u][%s_BLOCK]) {\n",
+            net->name, l, N, l, N, N, l - 1, N);
+    }
+    printf("    const double *W = params + %s_W%u;\n", N, l);
+    printf("    const double *b = params + %s_B%u;\n", N, l);
+
+    if (n_curr * n_prev <= UNROLL_MAX_WEIGHTS) {
+        // Every output as one expression, summed left to right like mat_mul
+        if (!single) {
+            printf("    unsigned int s;\n\n");
+            printf("    for (s = 0; s < %s_BLOCK; s++) {\n", N);
+        }
+        for (r = 0; r < n_curr; r++) {
+            printf("%sdouble z%u = ", indent, r);
+            for (k = 0; k < n_prev; k++) {
+                printf("(");
+            }
+            printf("0.0");
+            for (k = 0; k < n_prev; k++) {
+                printf(" + W[%zu] * in[%u]%s)", r * n_prev + k, k, s_index);
+            }
+            printf(" + b[%u];\n", r);
+        }
+        for (r = 0; r < n_curr; r++) {
+            char target[32], value[16];
+            sprintf(target, "out[%u]%s", r, s_index);
+            sprintf(value, "z%u", r);
+            printf("%s", indent);
+            emit_activation(activation, target, value);
+        }
+        if (!single) {
+            printf("    }\n");
+        }
+    } else {
+        // Large layers are bound by reading W, so the product uses the
+        // vectorized kernels of mat_mul with the shapes fixed
+        if (single) {
+            printf("    unsigned int r;\n\n");
+            printf("    kernels.gemv_rows(out, W, in, %s_N%u, %s_N%u);\n", N, l, N, l - 1);
+            printf("    for (r = 0; r < %s_N%u; r++) {\n", N, l);
+            printf("        double z = out[r] + b[r];\n");
+            printf("        ");
+            emit_activation(activation, "out[r]", "z");
+            printf("    }\n");
+        } else {
+            printf("    unsigned int r, s;\n\n");
+            printf("    kernels.mat_mul_skinny(&out[0][0], W, &in[0][0], %s_N%u, %s_N%u, %s_BLOCK);\n", N, l, N, l - 1, N);
+            printf("    for (r = 0; r < %s_N%u; r++) {\n", N, l);
+            printf("        for (s = 0; s < %s_BLOCK; s++) {\n", N);
+            printf("            double z = out[r][s] + b[r];\n");
+            printf("            ");
+            emit_activation(activation, "out[r][s]", "z");
+            printf("        }\n");
+            printf("    }\n");
+        }
+    }
+
+    if (activation == 2) {
+        // The vectorized sigmoid kernel, on the whole layer at once
+        if (single) {
+            printf("\n    kernels.sigmoid(out, out, %s_N%u);\n", N, l);
+        } else {
+            printf("\n    kernels.sigmoid(&out[0][0], &out[0][0], %s_N%u * %s_BLOCK);\n", N, l, N);
+        }
+    } else if (activation == 3) {
+        // Same steps as softmax in math_utils.c, one column at a time
+        printf("\n    unsigned int i;\n");
+        if (!single) {
+            printf("    for (s = 0; s < %s_BLOCK; s++) {\n", N);
+        }
+        printf("%sdouble max = out[0]%s;\n", indent, s_index);
+        printf("%sdouble sum = 0.0;\n", indent);
+        printf("%sfor (i = 0; i < %s_N%u; i++) {\n", indent, N, l);
+        printf("%s    max = (out[i]%s > max) ? out[i]%s : max;\n", indent, s_index, s_index);
+        printf("%s}\n", indent);
+        printf("%sfor (i = 0; i < %s_N%u; i++) {\n", indent, N, l);
+        printf("%s    sum += exp(out[i]%s - max);\n", indent, s_index);
+        printf("%s}\n", indent);
+        printf("%sfor (i = 0; i < %s_N%u; i++) {\n", indent, N, l);
+        printf("%s    out[i]%s = exp(out[i]%s - max) / sum;\n", indent, s_index, s_index);
+        printf("%s}\n", indent);
+        if (!single) {
+            printf("    }\n");
+        }
+    }
+    printf("}\n\n");
+}
+
+void emit_forward(topology *net) {
+    char *N = net->upper;
+    unsigned int last = net->num_layers - 1;
+    unsigned int i;
+
+    printf("void %s_forward(const double *params, double *result, const double *input, size_t num_inputs) {\n", net->name);
+    printf("    // Evaluate the network on num_inputs samples, one per column of input and result\n");
+    printf("    // Samples go through the layers in blocks, padded with zeros, except for a single last sample\n\n");
+    printf("    size_t num_single = (num_inputs %% %s_BLOCK == 1) ? 1 : 0;\n", N);
+    printf("    size_t num_blocked = num_inputs - num_single;\n");
+    printf("    size_t j;\n\n");
+    printf("    #pragma omp parallel for if (num_blocked >= 16 * %s_BLOCK)\n", N);
+    printf("    for (j = 0; j < num_blocked; j += %s_BLOCK) {\n", N);
+    for (i = 0; i <= last; i++) {
+        printf("        double a%u[%s_N%u][%s_BLOCK];\n", i, N, i, N);
+    }
+    printf("        size_t count = (num_blocked - j < %s_BLOCK) ? num_blocked - j : %s_BLOCK;\n", N, N);
+    printf("        unsigned int k, s;\n\n");
+    printf("        for (k = 0; k < %s_N0; k++) {\n", N);
+    printf("            for (s = 0; s < %s_BLOCK; s++) {\n", N);
+    printf("                a0[k][s] = (s < count) ? input[k * num_inputs + j + s] : 0.0;\n");
+    printf("            }\n");
+    printf("        }\n");
+    for (i = 1; i <= last; i++) {
+        printf("        %s_layer%u(params, a%u, a%u);\n", net->name, i, i, i - 1);
+    }
+    printf("        for (k = 0; k < %s_N%u; k++) {\n", N, last);
+    printf("            for (s = 0; s < count; s++) {\n");
+    printf("                result[k * num_inputs + j + s] = a%u[k][s];\n", last);
+    printf("            }\n");
+    printf("        }\n");
+    printf("    }\n\n");
+
+    printf("    if (num_single) {\n");
+    for (i = 0; i <= last; i++) {
+        printf("        double a%u[%s_N%u];\n", i, N, i);
+    }
+    printf("        unsigned int k;\n\n");
+    printf("        j = num_inputs - 1;\n");
+    printf("        for (k = 0; k < %s_N0; k++) {\n", N);
+    printf("            a0[k] = input[k * num_inputs + j];\n");
+    printf("        }\n");
+    for (i = 1; i <= last; i++) {
+        printf("        %s_layer%u_single(params, a%u, a%u);\n", net->name, i, i, i - 1);
+    }
+    printf("        for (k = 0; k < %s_N%u; k++) {\n", N, last);
+    printf("            result[k * num_inputs + j] = a%u[k];\n", last);
+    printf("        }\n");
+    printf("    }\n");
+    printf("}\n\n");
+}
+
+void emit_bench(topology *net) {
+    char *N = net->upper;
+    unsigned int last = net->num_layers - 1;
+    unsigned int i;
+
+    printf("#include <omp.h>\n#include \"neural_network.c\"\n\n");
+    printf("int main(void) {\n");
+    printf("    // Check against model_predict, then time both for several batch sizes\n\n");
+    printf("    size_t layer_sizes[] = {");
+    for (i = 0; i <= last; i++) {
+        printf("%s%s_N%u", (i == 0) ? "" : ", ", N, i);
+    }
+    printf("};\n");
+    printf("    enum func layer_activations[] = {");
+    for (i = 0; i <= last; i++) {
+        printf("%s%s", (i == 0) ? "" : ", ", activation_enums[net->activations[i]]);
+    }
+    printf("};\n");
+    printf("    size_t batch_sizes[] = {1, 4, 17, 256, 4096};\n");
+    printf("    size_t max_batch = 4096;\n");
+    printf("    unsigned int i, j;\n");
+    printf("    int status = 0;\n\n");
+    printf("    rng_seed(123);\n");
+    printf("    nn_model *model = create_model(%u, layer_sizes, layer_activations);\n", last + 1);
+    printf("    nn_context *ctx = create_context(model, max_batch);\n\n");
+    printf("    printf(\"Generated %s_forward against model_predict_ctx (kernel variant %%s)\\n\", isa_names[kernels.isa]);\n", net->name);
+    printf("    printf(\"%%-8s %%16s %%16s %%8s %%12s\\n\", \"batch\", \"generic (us)\", \"generated (us)\", \"speedup\", \"max diff\");\n\n");
+    printf("    for (i = 0; i < sizeof(batch_sizes) / sizeof(size_t); i++) {\n");
+    printf("        size_t batch = batch_sizes[i];\n");
+    printf("        unsigned int repeats = 1 + 100000000 / (batch * %s_NUM_PARAMS);\n", N);
+    printf("        matrix *X = rand_mat(%s_N0, batch);\n", N);
+    printf("        matrix *Y = zero_mat(%s_N%u, batch);\n", N, last);
+    printf("        matrix *Y_gen = zero_mat(%s_N%u, batch);\n", N, last);
+    printf("        double max_diff = 0.0;\n\n");
+    printf("        double start = omp_get_wtime();\n");
+    printf("        for (j = 0; j < repeats; j++) {\n");
+    printf("            model_predict_ctx(model, ctx, Y, X, batch);\n");
+    printf("        }\n");
+    printf("        double generic = (omp_get_wtime() - start) / repeats;\n\n");
+    printf("        start = omp_get_wtime();\n");
+    printf("        for (j = 0; j < repeats; j++) {\n");
+    printf("            %s_forward(model->params, Y_gen->data, X->data, batch);\n", net->name);
+    printf("        }\n");
+    printf("        double generated = (omp_get_wtime() - start) / repeats;\n\n");
+    printf("        for (j = 0; j < %s_N%u * batch; j++) {\n", N, last);
+    printf("            max_diff = fmax(max_diff, fabs(Y->data[j] - Y_gen->data[j]));\n");
+    printf("        }\n");
+    printf("        printf(\"%%-8zu %%16.2f %%16.2f %%7.2fx %%12g\\n\", batch, 1e6 * generic, 1e6 * generated, generic / generated, max_diff);\n");
+    printf("        if (max_diff != 0.0) {\n");
+    printf("            status = 1;\n");
+    printf("        }\n\n");
+    printf("        free_mat(X);\n");
+    printf("        free_mat(Y);\n");
+    printf("        free_mat(Y_gen);\n");
+    printf("    }\n\n");
+    printf("    free_context(ctx);\n");
+    printf("    free_model(model);\n");
+    printf("    return status;\n");
+    printf("}\n");
+}
+
+int main(int argc, char **argv) {
+    topology net;
+    unsigned int i;
+
+    if (argc < 4 || (argc == 5 && strcmp(argv[4], "--bench") != 0) || argc > 5) {
+        fprintf(stderr, "Usage: %s <name> <layer sizes> <activations> [--bench]\n", argv[0]);
+        fprintf(stderr, "e.g.   %s mnist 784,512,10 input,relu,softmax > mnist_forward.c\n", argv[0]);
+        exit(1);
+    }
+
+    parse_topology(&net, argv[1], argv[2], argv[3]);
+
+    emit_header(&net);
+    for (i = 1; i < net.num_layers; i++) {
+        emit_layer(&net, i, false);
+        emit_layer(&net, i, true);
+    }
+    emit_forward(&net);
+    if (argc == 5) {
+        emit_bench(&net);
+    }
+}
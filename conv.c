@@ -0,0 +1,207 @@
+#ifndef CONV_C
+#define CONV_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+#include "math_utils.c"
+
+// Kernels of the convolution and max pooling layers
+//
+// A batch of images is a matrix with one row per pixel, in channel, row,
+// column order (row (c * height + y) * width + x), and one column per sample,
+// so the flattened MNIST inputs already are a batch of 1 x 28 x 28 images.
+// im2col copies the patch under every output position into the patch matrix,
+// with the positions outer and the samples inner in its columns. The product
+// of the (filters x patch) weights with it is then laid out exactly like the
+// batch of output images, and a convolution is one mat_mul. The samples of a
+// pixel are contiguous, so every patch entry is copied as one run of samples.
+//
+// Convolutions are unpadded with stride 1, and pooling windows do not overlap.
+
+// Entries of the patch matrix built at a time when the patches are not kept for back_prop
+#define CONV_BLOCK_SIZE 262144
+
+void im2col(matrix *result, matrix *mat, size_t channels, size_t height, size_t width, size_t kernel_size, size_t first, size_t count) {
+    // Patches of the images in mat under the output positions first to first + count - 1
+    // Row (c * kernel_size + ky) * kernel_size + kx, column (p - first) * samples + s of result is
+    // pixel (c, y + ky, x + kx) of sample s, where p = y * (width - kernel_size + 1) + x
+
+    size_t k = kernel_size;
+    size_t m = mat->cols;
+    size_t rows = channels * k * k;
+    unsigned int r;
+
+    if ((k == 0) || (k > height) || (k > width) || (mat->rows != channels * height * width) ||
+        (result->rows != rows) || (result->cols != count * m) || (first + count > (height - k + 1) * (width - k + 1))) {
+        printf("Error: Invalid dimensions for im2col\n\n");
+        exit(0);
+    }
+
+    size_t out_width = width - k + 1;
+    perf_sample start;
+    perf_begin(&start);
+
+    #pragma omp parallel for if (result->rows * result->cols >= PARALLEL_MIN_WORK)
+    for (r = 0; r < rows; r++) {
+        size_t c = r / (k * k);
+        size_t ky = r / k % k;
+        size_t kx = r % k;
+        double *row = result->data + r * count * m;
+        unsigned int p;
+
+        for (p = 0; p < count; p++) {
+            size_t y = (first + p) / out_width + ky;
+            size_t x = (first + p) % out_width + kx;
+            memcpy(row + p * m, mat->data + ((c * height + y) * width + x) * m, m * sizeof(double));
+        }
+    }
+
+    perf_end(&start, PERF_IM2COL);
+}
+
+void col2im(matrix *result, matrix *cols, size_t channels, size_t height, size_t width, size_t kernel_size) {
+    // Inverse of im2col over all output positions, summing the entries of the patches
+    // that overlap: result gets the gradient of every pixel from the gradients of cols
+
+    size_t k = kernel_size;
+    size_t m = result->cols;
+
+    if ((k == 0) || (k > height) || (k > width) || (result->rows != channels * height * width) ||
+        (cols->rows != channels * k * k) || (cols->cols != (height - k + 1) * (width - k + 1) * m)) {
+        printf("Error: Invalid dimensions for col2im\n\n");
+        exit(0);
+    }
+
+    size_t out_height = height - k + 1;
+    size_t out_width = width - k + 1;
+    size_t row_length = out_height * out_width * m;
+    unsigned int r;
+
+    perf_sample start;
+    perf_begin(&start);
+
+    // Every thread sums into its own image rows, in the same order for any number of threads
+    #pragma omp parallel for if (result->rows * m * k * k >= PARALLEL_MIN_WORK)
+    for (r = 0; r < channels * height; r++) {
+        size_t c = r / height;
+        size_t y = r % height;
+        unsigned int x, ky, kx, s;
+
+        for (x = 0; x < width; x++) {
+            double *pixel = result->data + (r * width + x) * m;
+            memset(pixel, 0, m * sizeof(double));
+
+            for (ky = 0; ky < k; ky++) {
+                if (y < ky || y - ky >= out_height) {
+                    continue;
+                }
+                for (kx = 0; kx < k; kx++) {
+                    if (x < kx || x - kx >= out_width) {
+                        continue;
+                    }
+                    double *patch = cols->data + ((c * k + ky) * k + kx) * row_length + ((y - ky) * out_width + x - kx) * m;
+                    for (s = 0; s < m; s++) {
+                        pixel[s] += patch[s];
+                    }
+                }
+            }
+        }
+    }
+
+    perf_end(&start, PERF_COL2IM);
+}
+
+void maxpool(matrix *result, size_t *argmax, matrix *mat, size_t channels, size_t height, size_t width, size_t pool_size) {
+    // Maximum of every pool_size x pool_size window of the images in mat, dropping the
+    // rows and columns past the last whole window
+    // If argmax is not NULL, argmax[o * samples + s] is the row of mat with the maximum of
+    // output o for sample s (the first one on ties)
+
+    size_t k = pool_size;
+    size_t m = mat->cols;
+
+    if ((k == 0) || (k > height) || (k > width) || (mat->rows != channels * height * width) ||
+        (result->rows != channels * (height / k) * (width / k)) || (result->cols != m)) {
+        printf("Error: Invalid dimensions for maxpool\n\n");
+        exit(0);
+    }
+
+    size_t out_height = height / k;
+    size_t out_width = width / k;
+    unsigned int r;
+
+    perf_sample start;
+    perf_begin(&start);
+
+    #pragma omp parallel for if (mat->rows * m >= PARALLEL_MIN_WORK)
+    for (r = 0; r < channels * out_height; r++) {
+        size_t c = r / out_height;
+        size_t y = r % out_height * k;
+        unsigned int x, dy, dx, s;
+
+        for (x = 0; x < out_width; x++) {
+            size_t o = r * out_width + x;
+            size_t first = (c * height + y) * width + x * k;
+            double *out = result->data + o * m;
+            memcpy(out, mat->data + first * m, m * sizeof(double));
+            if (argmax != NULL) {
+                for (s = 0; s < m; s++) {
+                    argmax[o * m + s] = first;
+                }
+            }
+
+            for (dy = 0; dy < k; dy++) {
+                for (dx = (dy == 0) ? 1 : 0; dx < k; dx++) {
+                    size_t i = first + dy * width + dx;
+                    double *in = mat->data + i * m;
+                    if (argmax == NULL) {
+                        for (s = 0; s < m; s++) {
+                            out[s] = (in[s] > out[s]) ? in[s] : out[s];
+                        }
+                        continue;
+                    }
+                    for (s = 0; s < m; s++) {
+                        if (in[s] > out[s]) {
+                            out[s] = in[s];
+                            argmax[o * m + s] = i;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    perf_end(&start, PERF_MAXPOOL);
+}
+
+void dmaxpool(matrix *result, matrix *dZ, size_t *argmax) {
+    // Gradient of maxpool: every entry of dZ goes to the row of result that held the
+    // maximum (as recorded in argmax), and the rest of result is zero
+
+    size_t m = dZ->cols;
+    unsigned int o;
+
+    if (result->cols != m) {
+        printf("Error: Invalid dimensions for dmaxpool\n\n");
+        exit(0);
+    }
+
+    perf_sample start;
+    perf_begin(&start);
+    memset(result->data, 0, result->rows * m * sizeof(double));
+
+    // The windows do not overlap, so no two outputs write the same entry
+    #pragma omp parallel for if (dZ->rows * m >= PARALLEL_MIN_WORK)
+    for (o = 0; o < dZ->rows; o++) {
+        unsigned int s;
+        for (s = 0; s < m; s++) {
+            result->data[argmax[o * m + s] * m + s] = dZ->data[o * m + s];
+        }
+    }
+
+    perf_end(&start, PERF_DMAXPOOL);
+}
+
+#endif
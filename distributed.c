@@ -0,0 +1,518 @@
+#ifndef DISTRIBUTED_C
+#define DISTRIBUTED_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "neural_network.c"
+
+// Data-parallel training over several worker processes
+//
+// start_workers relaunches the running program num_ranks - 1 times, like an
+// MPI launcher, so every rank runs the same main up to train_data_parallel.
+// Each rank trains on its own shard of the training set with a 1 / num_ranks
+// share of the mini-batch, and after back propagation the flat gradient
+// arrays are summed with a ring all-reduce. Every rank ends up with bitwise
+// the same gradients, so the Adam updates keep the weights identical.
+// stop_workers then ends the workers, and only rank 0 returns from it.
+//
+// Processes rather than threads or fork are used because fork is not safe once
+// the OpenMP pool is running. Ranks talk through an nn_transport, whose only
+// operation is a paired send/receive with the ring neighbours. The POSIX
+// shared memory transport below is the one implemented, and a socket transport
+// for several machines only needs to provide the same functions.
+
+#define SHM_SLOT_SIZE 65536
+#define WORKER_POLL_SECONDS 1.0
+
+typedef struct nn_transport {
+    int rank;
+    int size;
+
+    // Send send_count values to rank dest while receiving recv_count values from
+    // rank source. Every rank calls it at the same time, and the matching sender
+    // and receiver use the same count
+    void (*sendrecv)(struct nn_transport *transport, int dest, const double *send_data, size_t send_count,
+        int source, double *recv_data, size_t recv_count);
+    // Wait for the other ranks and release the transport
+    void (*close)(struct nn_transport *transport);
+    void *state;
+    // Time spent in allreduce_sum
+    double comm_seconds;
+} nn_transport;
+
+// Shared memory transport
+//
+// Every rank has one mailbox in a shared mapping, written by its left
+// neighbour and emptied by itself. Messages larger than a mailbox go through
+// it in slots of SHM_SLOT_SIZE values, alternating sends and receives so that
+// all ranks of the ring can make progress.
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool full;
+    size_t count;
+    double data[SHM_SLOT_SIZE];
+} shm_mailbox;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int attached;
+    shm_mailbox mailboxes[];
+} shm_region;
+
+typedef struct {
+    char name[64];
+    shm_region *region;
+    // Size of the mapping of region, or 0 if it is owned by the caller
+    size_t bytes;
+    pid_t launcher;
+    pid_t *workers;
+} shm_state;
+
+void check_workers(nn_transport *transport) {
+    // Give up instead of waiting forever if another rank died
+
+    shm_state *state = transport->state;
+    int status;
+
+    if (transport->rank == 0) {
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            printf("Error: Worker process %d exited during training\n\n", (int) pid);
+            exit(0);
+        }
+    } else if (getppid() != state->launcher) {
+        exit(0);
+    }
+}
+
+void shm_wait(nn_transport *transport, pthread_mutex_t *lock, pthread_cond_t *cond) {
+    // pthread_cond_wait that checks the other ranks every WORKER_POLL_SECONDS
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t) WORKER_POLL_SECONDS;
+    if (pthread_cond_timedwait(cond, lock, &deadline) != 0) {
+        check_workers(transport);
+    }
+}
+
+void shm_send_slot(nn_transport *transport, int dest, const double *data, size_t count) {
+    shm_state *state = transport->state;
+    shm_mailbox *box = &state->region->mailboxes[dest];
+
+    pthread_mutex_lock(&box->lock);
+    while (box->full) {
+        shm_wait(transport, &box->lock, &box->cond);
+    }
+    memcpy(box->data, data, count * sizeof(double));
+    box->count = count;
+    box->full = true;
+    pthread_cond_broadcast(&box->cond);
+    pthread_mutex_unlock(&box->lock);
+}
+
+void shm_recv_slot(nn_transport *transport, double *data, size_t count) {
+    shm_state *state = transport->state;
+    shm_mailbox *box = &state->region->mailboxes[transport->rank];
+
+    pthread_mutex_lock(&box->lock);
+    while (!box->full) {
+        shm_wait(transport, &box->lock, &box->cond);
+    }
+    if (box->count != count) {
+        printf("Error: Message of %zu values received where %zu were expected\n\n", box->count, count);
+        exit(0);
+    }
+    memcpy(data, box->data, count * sizeof(double));
+    box->full = false;
+    pthread_cond_broadcast(&box->cond);
+    pthread_mutex_unlock(&box->lock);
+}
+
+void shm_sendrecv(nn_transport *transport, int dest, const double *send_data, size_t send_count,
+        int source, double *recv_data, size_t recv_count) {
+    // Only the left neighbour writes a rank's mailbox, so source is implied
+    (void) source;
+
+    size_t send_slots = (send_count + SHM_SLOT_SIZE - 1) / SHM_SLOT_SIZE;
+    size_t recv_slots = (recv_count + SHM_SLOT_SIZE - 1) / SHM_SLOT_SIZE;
+    size_t num_slots = (send_slots > recv_slots) ? send_slots : recv_slots;
+    unsigned int k;
+
+    for (k = 0; k < num_slots; k++) {
+        size_t offset = k * SHM_SLOT_SIZE;
+        if (k < send_slots) {
+            size_t count = (send_count - offset < SHM_SLOT_SIZE) ? send_count - offset : SHM_SLOT_SIZE;
+            shm_send_slot(transport, dest, send_data + offset, count);
+        }
+        if (k < recv_slots) {
+            size_t count = (recv_count - offset < SHM_SLOT_SIZE) ? recv_count - offset : SHM_SLOT_SIZE;
+            shm_recv_slot(transport, recv_data + offset, count);
+        }
+    }
+}
+
+void shm_close(nn_transport *transport) {
+    shm_state *state = transport->state;
+    int i, status;
+
+    if (state->workers != NULL) {
+        for (i = 1; i < transport->size; i++) {
+            if (waitpid(state->workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                printf("Warning: Worker process %d did not exit cleanly\n", (int) state->workers[i]);
+            }
+        }
+    }
+    if (state->bytes > 0) {
+        munmap(state->region, state->bytes);
+    }
+    free(state->workers);
+    free(state);
+    free(transport);
+}
+
+void init_process_shared(pthread_mutex_t *lock, pthread_cond_t *cond) {
+    pthread_mutexattr_t lock_attr;
+    pthread_condattr_t cond_attr;
+
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(lock, &lock_attr);
+    pthread_mutexattr_destroy(&lock_attr);
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
+
+void init_shm_region(shm_region *region, int size) {
+    // Set up the locks of a new region with size mailboxes
+
+    int i;
+
+    init_process_shared(&region->lock, &region->cond);
+    for (i = 0; i < size; i++) {
+        init_process_shared(&region->mailboxes[i].lock, &region->mailboxes[i].cond);
+        region->mailboxes[i].full = false;
+    }
+    region->attached = 1;
+}
+
+size_t shm_region_bytes(int size) {
+    return sizeof(shm_region) + size * sizeof(shm_mailbox);
+}
+
+nn_transport* create_shm_transport(shm_region *region, int rank, int size, pid_t launcher) {
+    // Transport of rank through the mailboxes of region
+
+    nn_transport *transport = malloc(sizeof(nn_transport));
+    shm_state *state = calloc(1, sizeof(shm_state));
+    check_alloc(transport);
+    check_alloc(state);
+    transport->rank = rank;
+    transport->size = size;
+    transport->sendrecv = shm_sendrecv;
+    transport->close = shm_close;
+    transport->state = state;
+    transport->comm_seconds = 0.0;
+    state->region = region;
+    state->launcher = launcher;
+    return transport;
+}
+
+extern char **environ;
+
+nn_transport* start_workers(int num_ranks, char **argv) {
+    // In the launched program, start num_ranks - 1 more copies of it and connect
+    // them through shared memory. In the copies, connect to the launcher
+    // Returns the transport of this rank. The OpenMP threads are split between the ranks
+
+    char *rank_env = getenv("NN_RANK");
+    bool launcher = (rank_env == NULL);
+    int rank = launcher ? 0 : atoi(rank_env);
+    int size = launcher ? num_ranks : atoi(getenv("NN_WORLD_SIZE"));
+    char name[64], value[64];
+    int i;
+
+    if (size < 1) {
+        printf("Error: Invalid number of ranks for start_workers\n\n");
+        exit(0);
+    }
+    if (launcher) {
+        snprintf(name, sizeof(name), "/nn_workers_%d", (int) getpid());
+    } else {
+        snprintf(name, sizeof(name), "%s", getenv("NN_SHM_NAME"));
+    }
+
+    // The launcher creates the shared memory, the workers map it
+    size_t bytes = shm_region_bytes(size);
+    int fd = shm_open(name, launcher ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+    if (fd < 0 || (launcher && ftruncate(fd, bytes) != 0)) {
+        printf("Error: Could not create shared memory for the workers\n\n");
+        exit(0);
+    }
+    shm_region *region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) {
+        printf("Error: Could not map shared memory for the workers\n\n");
+        exit(0);
+    }
+
+    nn_transport *transport = create_shm_transport(region, rank, size, launcher ? getpid() : getppid());
+    shm_state *state = transport->state;
+    state->bytes = bytes;
+    snprintf(state->name, sizeof(state->name), "%s", name);
+
+    int threads = omp_get_num_procs() / size;
+    threads = (threads < 1) ? 1 : threads;
+
+    if (launcher) {
+        init_shm_region(region, size);
+        state->workers = calloc(size, sizeof(pid_t));
+        check_alloc(state->workers);
+
+        snprintf(value, sizeof(value), "%d", size);
+        setenv("NN_WORLD_SIZE", value, 1);
+        setenv("NN_SHM_NAME", name, 1);
+        snprintf(value, sizeof(value), "%d", threads);
+        setenv("OMP_NUM_THREADS", value, 1);
+        for (i = 1; i < size; i++) {
+            snprintf(value, sizeof(value), "%d", i);
+            setenv("NN_RANK", value, 1);
+            if (posix_spawn(&state->workers[i], "/proc/self/exe", NULL, NULL, argv, environ) != 0) {
+                printf("Error: Could not start worker process %d\n\n", i);
+                shm_unlink(name);
+                exit(0);
+            }
+        }
+        unsetenv("NN_RANK");
+        unsetenv("NN_WORLD_SIZE");
+        unsetenv("NN_SHM_NAME");
+
+        // Remove the name once everyone has mapped the memory
+        pthread_mutex_lock(&region->lock);
+        while (region->attached < size) {
+            shm_wait(transport, &region->lock, &region->cond);
+        }
+        pthread_mutex_unlock(&region->lock);
+        shm_unlink(name);
+    } else {
+        pthread_mutex_lock(&region->lock);
+        region->attached++;
+        pthread_cond_broadcast(&region->cond);
+        pthread_mutex_unlock(&region->lock);
+    }
+
+    omp_set_num_threads(threads);
+    return transport;
+}
+
+void stop_workers(nn_transport *transport) {
+    // End the workers, which exit here, and return in the launcher once they have
+
+    int rank = transport->rank;
+    transport->close(transport);
+    if (rank != 0) {
+        exit(0);
+    }
+}
+
+void allreduce_sum(nn_transport *transport, double *data, size_t count) {
+    // Sum data over all ranks with a ring all-reduce, leaving bitwise identical
+    // sums on every rank
+    // The array is split into one chunk per rank. In size - 1 steps every rank
+    // passes a chunk to its right neighbour and adds the chunk coming from its left,
+    // after which rank r holds the total of chunk r + 1, and in size - 1 more steps
+    // the totals are passed around the ring
+
+    int size = transport->size;
+    int rank = transport->rank;
+    int right = (rank + 1) % size;
+    int left = (rank + size - 1) % size;
+    int step;
+    size_t i;
+
+    if (size == 1) {
+        return;
+    }
+
+    double start = omp_get_wtime();
+    size_t max_chunk = (count + size - 1) / size;
+    double *buffer = malloc((max_chunk > 0 ? max_chunk : 1) * sizeof(double));
+    check_alloc(buffer);
+
+    // Reduce-scatter
+    for (step = 0; step < size - 1; step++) {
+        int send_chunk = (rank - step + size) % size;
+        int recv_chunk = (rank - step - 1 + 2 * size) % size;
+        size_t send_start = send_chunk * count / size;
+        size_t recv_start = recv_chunk * count / size;
+        size_t send_count = (send_chunk + 1) * count / size - send_start;
+        size_t recv_count = (recv_chunk + 1) * count / size - recv_start;
+
+        transport->sendrecv(transport, right, data + send_start, send_count, left, buffer, recv_count);
+        for (i = 0; i < recv_count; i++) {
+            data[recv_start + i] += buffer[i];
+        }
+    }
+
+    // All-gather
+    for (step = 0; step < size - 1; step++) {
+        int send_chunk = (rank + 1 - step + size) % size;
+        int recv_chunk = (rank - step + size) % size;
+        size_t send_start = send_chunk * count / size;
+        size_t recv_start = recv_chunk * count / size;
+        size_t send_count = (send_chunk + 1) * count / size - send_start;
+        size_t recv_count = (recv_chunk + 1) * count / size - recv_start;
+
+        transport->sendrecv(transport, right, data + send_start, send_count, left, data + recv_start, recv_count);
+    }
+
+    free(buffer);
+    transport->comm_seconds += omp_get_wtime() - start;
+}
+
+void broadcast_params(nn_transport *transport, double *data, size_t count) {
+    // Give every rank the values of rank 0, as a sum with zeros from the other ranks
+
+    if (transport->rank != 0) {
+        memset(data, 0, count * sizeof(double));
+    }
+    allreduce_sum(transport, data, count);
+}
+
+bool params_in_sync(nn_transport *transport, nn_model *model) {
+    // Whether every rank has bitwise the same parameters as rank 0
+
+    double *copy = malloc(model->num_params * sizeof(double));
+    check_alloc(copy);
+    memcpy(copy, model->params, model->num_params * sizeof(double));
+    broadcast_params(transport, copy, model->num_params);
+
+    double mismatch = (memcmp(copy, model->params, model->num_params * sizeof(double)) != 0) ? 1.0 : 0.0;
+    allreduce_sum(transport, &mismatch, 1);
+    free(copy);
+    return mismatch == 0.0;
+}
+
+matrix* column_shard(matrix *mat, int rank, int size) {
+    // Copy of the columns of mat that belong to rank
+
+    size_t start = rank * mat->cols / size;
+    size_t cols = (rank + 1) * mat->cols / size - start;
+    matrix *shard = zero_mat(mat->rows, cols);
+    unsigned int i;
+
+    for (i = 0; i < mat->rows; i++) {
+        memcpy(shard->data + i * cols, mat->data + i * mat->cols + start, cols * sizeof(double));
+    }
+    return shard;
+}
+
+void train_data_parallel(nn_model *model, nn_transport *transport, matrix *X, matrix *Y, size_t mini_batch_size, int epochs,
+        double lr, double beta_1, double beta_2, double epsilon) {
+    // train_model with the mini-batches of mini_batch_size samples split over the ranks
+    // Every rank passes the whole training set, of which it trains on its shard,
+    // and ends up with the same parameters as rank 0
+    // Only rank 0 prints. Validation and lazy back propagation are not supported
+
+    nn_layer *layers = model->layers;
+    size_t num_layers = model->num_layers;
+    int last_i = num_layers - 1;
+    int rank = transport->rank;
+    int size = transport->size;
+    size_t m = mini_batch_size / size;
+    double small_val = pow(10, -16.0);
+    unsigned int i, j, epoch;
+
+    if (m == 0 || X->cols < (size_t) size) {
+        printf("Error: Mini-batch and training set need at least one sample per rank\n\n");
+        exit(0);
+    }
+
+    // Start from the initial parameters of rank 0
+    broadcast_params(transport, model->params, model->num_params);
+
+    matrix *shard_X = column_shard(X, rank, size);
+    matrix *shard_Y = column_shard(Y, rank, size);
+    matrix *mini_X = numa_zero_mat(X->rows, m);
+    matrix *mini_Y = numa_zero_mat(Y->rows, m);
+
+    // Every rank draws different mini-batches from its shard
+    rng_seed(rng_bits(nn_rng.key, rng_reserve(1)) + rank);
+    int *indices = malloc(shard_X->cols * sizeof(int));
+    check_alloc(indices);
+    for (i = 0; i < shard_X->cols; i++) {
+        indices[i] = i;
+    }
+
+    create_train_buffers(model, mini_X);
+
+    if (rank == 0) {
+        printf("Training neural network model on %d ranks (%zu samples per rank and step)\n", size, m);
+    }
+    double start = omp_get_wtime();
+    double comm_start = transport->comm_seconds;
+
+    for (epoch = 0; epoch < epochs; epoch++) {
+        mini_batch(mini_X, mini_Y, shard_X, shard_Y, indices);
+        forward_prop(model);
+        back_prop(model, mini_Y);
+
+        // Average the gradients of the ranks' parts of the mini-batch
+        allreduce_sum(transport, model->grads, model->num_params);
+        for (j = 0; j < model->num_params; j++) {
+            model->grads[j] /= size;
+        }
+
+        grad_descent_adam(model, epoch, lr, beta_1, beta_2, epsilon);
+
+        double loss = 0.0;
+        for (i = 0; i < Y->rows; i++) {
+            for (j = 0; j < m; j++) {
+                loss -= mat_get(mini_Y, i, j) * log(mat_get(layers[last_i].A, i, j) + small_val);
+            }
+        }
+        loss /= (double) (m * size);
+        allreduce_sum(transport, &loss, 1);
+
+        if (rank == 0) {
+            printf("Epoch %d/%d     Loss: %g\n", epoch + 1, epochs, loss);
+        }
+    }
+
+    double seconds = omp_get_wtime() - start;
+    double comm_time = transport->comm_seconds - comm_start;
+    bool in_sync = params_in_sync(transport, model);
+
+    if (rank == 0) {
+        printf("Finished training\n");
+        printf("Time taken: %f s\n", seconds);
+        printf("Throughput: %.0f samples/s     Communication: %.1f%% of the time\n",
+            epochs * m * size / seconds, 100.0 * comm_time / seconds);
+        printf("Parameters identical on all ranks: %s\n\n", in_sync ? "yes" : "no");
+    }
+
+    free_train_buffers(model);
+    free_mat(shard_X);
+    free_mat(shard_Y);
+    free_mat(mini_X);
+    free_mat(mini_Y);
+    free(indices);
+}
+
+#endif
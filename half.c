@@ -0,0 +1,247 @@
+#ifndef HALF_C
+#define HALF_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "neural_network.c"
+
+// Half precision weight storage for inference
+//
+// Small batch inference streams every weight once per sample, so its speed is
+// bound by the memory bandwidth for W. Storing the weights as 16-bit fp16 or
+// bf16 values reads a quarter of the bytes of doubles. The weights are rounded
+// to the nearest 16-bit value once, and the kernels (kernels.gemv_rows_f16 and
+// kernels.gemv_rows_bf16, see simd_kernels.c) convert them back to double in
+// registers, so the products, sums, biases and activations are the same as for
+// a double model with the rounded weights.
+//
+// fp16 keeps 11 bits of precision but only covers magnitudes up to 65504, so
+// larger weights are clamped. bf16 has the exponent range of float and 8 bits
+// of precision.
+
+// Rows of W computed per task, so that a block of the MNIST hidden layer
+// converted to double stays in the L2 cache while every sample uses it
+#define H_ROW_BLOCK 16
+
+enum half_format {
+    HALF_FP16,
+    HALF_BF16,
+    NUM_HALF_FORMATS
+};
+
+char *half_format_names[NUM_HALF_FORMATS] = {"fp16", "bf16"};
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    enum func activation;
+    uint16_t *W;
+    double *b;
+} h_layer;
+
+typedef struct {
+    size_t num_layers;
+    size_t *num_nodes;
+    enum half_format format;
+    h_layer *layers;
+} h_model;
+
+uint16_t float_to_f16(float value) {
+    // Nearest half, ties to even, with finite values clamped to the largest finite half
+
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs_bits = bits & 0x7fffffff;
+
+    if (abs_bits >= 0x7f800000) {
+        return sign | ((abs_bits == 0x7f800000) ? 0x7c00 : 0x7e00);
+    } else if (abs_bits >= 0x477ff000) {
+        // 65520 and above would round to infinity
+        return sign | 0x7bff;
+    } else if (abs_bits < 0x38800000) {
+        // Below the smallest normal half, in units of 2^-24 (1024 units is the smallest normal)
+        float abs_value;
+        memcpy(&abs_value, &abs_bits, sizeof(float));
+        return sign | (uint16_t) lrintf(abs_value * 16777216.0f);
+    }
+
+    uint32_t rounded = abs_bits + 0xfff + ((abs_bits >> 13) & 1);
+    return sign | (uint16_t) ((rounded >> 13) - (112 << 10));
+}
+
+uint16_t float_to_bf16(float value) {
+    // Upper half of the nearest float with a zero lower half, ties to even
+
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (bits >> 16) | 0x40;
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+uint16_t double_to_half(double value, enum half_format format) {
+    return (format == HALF_BF16) ? float_to_bf16((float) value) : float_to_f16((float) value);
+}
+
+double half_to_double(uint16_t value, enum half_format format) {
+    return (format == HALF_BF16) ? bf16_to_float(value) : f16_to_float(value);
+}
+
+h_model* compress_model(nn_model *model, enum half_format format) {
+    // Copy of a trained model for inference with the weights stored in format
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    unsigned int i, k;
+
+    if (format >= NUM_HALF_FORMATS) {
+        printf("Error: Invalid format for compress_model\n\n");
+        exit(0);
+    } else if (!is_dense_model(model)) {
+        printf("Error: compress_model only supports fully connected models\n\n");
+        exit(0);
+    }
+
+    h_model *hmodel = malloc(sizeof(h_model));
+    check_alloc(hmodel);
+    hmodel->num_layers = num_layers;
+    hmodel->format = format;
+    hmodel->num_nodes = malloc(num_layers * sizeof(size_t));
+    hmodel->layers = calloc(num_layers, sizeof(h_layer));
+    check_alloc(hmodel->num_nodes);
+    check_alloc(hmodel->layers);
+
+    for (i = 0; i < num_layers; i++) {
+        hmodel->num_nodes[i] = layers[i].num_nodes;
+    }
+
+    for (i = 1; i < num_layers; i++) {
+        h_layer *hl = &hmodel->layers[i];
+        matrix *W = layers[i].W;
+        size_t length = W->rows * W->cols;
+
+        hl->rows = W->rows;
+        hl->cols = W->cols;
+        hl->activation = layers[i].activation;
+        hl->W = malloc(length * sizeof(uint16_t));
+        hl->b = malloc(hl->rows * sizeof(double));
+        check_alloc(hl->W);
+        check_alloc(hl->b);
+        memcpy(hl->b, layers[i].b->data, hl->rows * sizeof(double));
+
+        #pragma omp parallel for
+        for (k = 0; k < length; k++) {
+            hl->W[k] = double_to_half(W->data[k], format);
+        }
+    }
+
+    return hmodel;
+}
+
+void h_layer_forward(matrix *Z, matrix *A_prev, h_layer *hl, enum half_format format) {
+    // Z = W * A_prev + b
+    // A single sample reads the 16-bit weights straight from the kernel. For larger
+    // batches every block of rows is converted to double once and then multiplied
+    // with all samples, with the kernels and summation order of mat_mul
+
+    size_t rows = hl->rows;
+    size_t cols = hl->cols;
+    size_t num_inputs = Z->cols;
+    unsigned int r_block;
+
+    #pragma omp parallel for if (rows * cols * num_inputs >= PARALLEL_MIN_WORK)
+    for (r_block = 0; r_block < rows; r_block += H_ROW_BLOCK) {
+        size_t block = (r_block + H_ROW_BLOCK < rows) ? H_ROW_BLOCK : rows - r_block;
+        const uint16_t *W = hl->W + r_block * cols;
+        double *z = Z->data + r_block * num_inputs;
+        unsigned int r, s;
+
+        if (num_inputs == 1) {
+            if (format == HALF_BF16) {
+                kernels.gemv_rows_bf16(z, W, A_prev->data, block, cols);
+            } else {
+                kernels.gemv_rows_f16(z, W, A_prev->data, block, cols);
+            }
+        } else {
+            double *W_block = malloc(block * cols * sizeof(double));
+            check_alloc(W_block);
+            if (format == HALF_BF16) {
+                kernels.bf16_to_double(W_block, W, block * cols);
+            } else {
+                kernels.f16_to_double(W_block, W, block * cols);
+            }
+            if (num_inputs <= SKINNY_MAX_COLS) {
+                kernels.mat_mul_skinny(z, W_block, A_prev->data, block, cols, num_inputs);
+            } else {
+                for (r = 0; r < block; r++) {
+                    kernels.mat_mul_row(z + r * num_inputs, W_block + r * cols, A_prev->data, cols, num_inputs);
+                }
+            }
+            free(W_block);
+        }
+
+        for (r = 0; r < block; r++) {
+            for (s = 0; s < num_inputs; s++) {
+                z[r * num_inputs + s] += hl->b[r_block + r];
+            }
+        }
+    }
+}
+
+void h_model_predict(h_model *hmodel, matrix *result, matrix *input, size_t num_inputs) {
+    // Evaluate a half precision model on input
+
+    size_t num_layers = hmodel->num_layers;
+    size_t n_out = hmodel->num_nodes[num_layers - 1];
+    size_t n_in = hmodel->num_nodes[0];
+    unsigned int i;
+
+    if ((result->cols != num_inputs) || (result->rows != n_out)) {
+        printf("Error: Invalid result vector for h_model_predict\n\n");
+        exit(0);
+    } else if ((input->cols != num_inputs) || (input->rows != n_in)) {
+        printf("Error: Invalid input vector for h_model_predict\n\n");
+        exit(0);
+    }
+
+    matrix *A_prev = input;
+    for (i = 1; i < num_layers; i++) {
+        h_layer *hl = &hmodel->layers[i];
+        matrix *Z = zero_mat(hl->rows, num_inputs);
+        matrix *A = (i == num_layers - 1) ? result : zero_mat(hl->rows, num_inputs);
+
+        h_layer_forward(Z, A_prev, hl, hmodel->format);
+
+        apply_activation(A, Z, hl->activation);
+
+        free_mat(Z);
+        if (A_prev != input) {
+            free_mat(A_prev);
+        }
+        A_prev = A;
+    }
+}
+
+void free_h_model(h_model *hmodel) {
+    if (hmodel == NULL) {
+        return;
+    }
+
+    unsigned int i;
+    for (i = 1; i < hmodel->num_layers; i++) {
+        free(hmodel->layers[i].W);
+        free(hmodel->layers[i].b);
+    }
+
+    free(hmodel->num_nodes);
+    free(hmodel->layers);
+    free(hmodel);
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef INFERENCE_SERVER_C
+#define INFERENCE_SERVER_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "neural_network.c"
+
+// In-process inference server with dynamic batching
+//
+// Client threads submit single samples with server_predict, which blocks
+// until the result is ready. A worker thread takes the queued requests as
+// one batch once max_batch requests are waiting or the oldest request has
+// waited max_delay seconds, evaluates the batch with one model_predict_ctx
+// call and hands every result back to its client. stop_server finishes the
+// queued requests and refuses new ones, and waits for every client to leave
+// server_predict before freeing the server.
+
+#define SERVER_QUEUE_SIZE 1024
+
+typedef struct {
+    double *input;
+    double *output;
+    bool done;
+} nn_request;
+
+typedef struct {
+    nn_model *model;
+    size_t max_batch;
+    double max_delay;
+
+    // Ring buffer of pending requests, guarded by lock
+    nn_request *queue[SERVER_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    bool stop;
+    // Clients inside server_predict, which stop_server waits for
+    size_t num_clients;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // Signaled when a batch is done, or when the last client leaves after stop
+    pthread_cond_t done;
+    pthread_t worker;
+
+    // Statistics, updated by the worker
+    size_t num_batches;
+    size_t num_requests;
+} nn_server;
+
+void deadline_after(struct timespec *deadline, double seconds) {
+    // Absolute CLOCK_MONOTONIC time seconds from now, for pthread_cond_timedwait
+    // on not_empty, so that changes of the wall clock do not affect the delay
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    long nsec = deadline->tv_nsec + (long) (seconds * 1e9);
+    deadline->tv_sec += nsec / 1000000000L;
+    deadline->tv_nsec = nsec % 1000000000L;
+}
+
+void* server_worker(void *arg) {
+    nn_server *server = arg;
+    nn_model *model = server->model;
+    size_t n_in = model->layers[0].num_nodes;
+    size_t n_out = model->layers[model->num_layers - 1].num_nodes;
+    size_t max_batch = server->max_batch;
+    nn_request **batch = malloc(max_batch * sizeof(nn_request*));
+    check_alloc(batch);
+
+    nn_context *ctx = create_context(model, max_batch);
+    matrix *X = zero_mat(n_in, max_batch);
+    matrix *Y = zero_mat(n_out, max_batch);
+    struct timespec deadline;
+    unsigned int i, j;
+
+    while (true) {
+        pthread_mutex_lock(&server->lock);
+        while (server->count == 0 && !server->stop) {
+            pthread_cond_wait(&server->not_empty, &server->lock);
+        }
+        if (server->count == 0 && server->stop) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        // Wait for the batch to fill up, at most max_delay after the first request
+        deadline_after(&deadline, server->max_delay);
+        while (server->count < max_batch && !server->stop) {
+            if (pthread_cond_timedwait(&server->not_empty, &server->lock, &deadline) != 0) {
+                break;
+            }
+        }
+
+        size_t batch_size = (server->count < max_batch) ? server->count : max_batch;
+        for (i = 0; i < batch_size; i++) {
+            batch[i] = server->queue[server->head];
+            server->head = (server->head + 1) % SERVER_QUEUE_SIZE;
+        }
+        server->count -= batch_size;
+        pthread_cond_broadcast(&server->not_full);
+        pthread_mutex_unlock(&server->lock);
+
+        // Gather the samples as the columns of X, evaluate, and scatter the columns of Y
+        X->cols = batch_size;
+        Y->cols = batch_size;
+        for (i = 0; i < n_in; i++) {
+            for (j = 0; j < batch_size; j++) {
+                X->data[i * batch_size + j] = batch[j]->input[i];
+            }
+        }
+
+        model_predict_ctx(model, ctx, Y, X, batch_size);
+
+        pthread_mutex_lock(&server->lock);
+        for (j = 0; j < batch_size; j++) {
+            for (i = 0; i < n_out; i++) {
+                batch[j]->output[i] = Y->data[i * batch_size + j];
+            }
+            batch[j]->done = true;
+        }
+        server->num_batches++;
+        server->num_requests += batch_size;
+        pthread_cond_broadcast(&server->done);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    free_context(ctx);
+    free_mat(X);
+    free_mat(Y);
+    free(batch);
+    return NULL;
+}
+
+nn_server* start_server(nn_model *model, size_t max_batch, double max_delay) {
+    // Start a worker that evaluates model on batches of up to max_batch requests,
+    // waiting at most max_delay seconds for a batch to fill up
+
+    if (max_batch == 0 || max_batch > SERVER_QUEUE_SIZE) {
+        printf("Error: Invalid batch size for start_server\n\n");
+        exit(0);
+    }
+
+    nn_server *server = calloc(1, sizeof(nn_server));
+    check_alloc(server);
+    server->model = model;
+    server->max_batch = max_batch;
+    server->max_delay = max_delay;
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->not_empty, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_cond_init(&server->not_full, NULL);
+    pthread_cond_init(&server->done, NULL);
+
+    if (pthread_create(&server->worker, NULL, server_worker, server) != 0) {
+        printf("Error: Could not start server thread\n\n");
+        exit(0);
+    }
+    return server;
+}
+
+void leave_server(nn_server *server) {
+    // A client leaves server_predict, called with lock held
+
+    server->num_clients--;
+    if (server->stop && server->num_clients == 0) {
+        pthread_cond_broadcast(&server->done);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+bool server_predict(nn_server *server, double *output, double *input) {
+    // Evaluate the model on one sample (input has num_nodes of the input layer values,
+    // output of the output layer), blocking until its batch has been evaluated
+    // Returns false, without evaluating the sample, once stop_server has been called
+
+    nn_request request = {input, output, false};
+
+    pthread_mutex_lock(&server->lock);
+    server->num_clients++;
+    while (server->count == SERVER_QUEUE_SIZE && !server->stop) {
+        pthread_cond_wait(&server->not_full, &server->lock);
+    }
+    if (server->stop) {
+        leave_server(server);
+        return false;
+    }
+    server->queue[(server->head + server->count) % SERVER_QUEUE_SIZE] = &request;
+    server->count++;
+    pthread_cond_signal(&server->not_empty);
+
+    // The worker only exits with an empty queue, so a queued request is always evaluated
+    while (!request.done) {
+        pthread_cond_wait(&server->done, &server->lock);
+    }
+    leave_server(server);
+    return true;
+}
+
+void stop_server(nn_server *server) {
+    // Finish the pending requests and refuse new ones, then stop the worker and
+    // free the server once no client is inside server_predict
+    // The model is owned by the caller
+
+    pthread_mutex_lock(&server->lock);
+    server->stop = true;
+    pthread_cond_signal(&server->not_empty);
+    pthread_cond_broadcast(&server->not_full);
+    pthread_mutex_unlock(&server->lock);
+    pthread_join(server->worker, NULL);
+
+    pthread_mutex_lock(&server->lock);
+    while (server->num_clients > 0) {
+        pthread_cond_wait(&server->done, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->not_empty);
+    pthread_cond_destroy(&server->not_full);
+    pthread_cond_destroy(&server->done);
+    free(server);
+}
+
+#endif
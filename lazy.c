@@ -0,0 +1,454 @@
+#ifndef LAZY_C
+#define LAZY_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "math_utils.c"
+
+// Deferred execution of matrix operations with fusion
+//
+// The lazy_* functions record an operation in a graph instead of running it,
+// and lazy_eval runs everything recorded so far. Before running, consecutive
+// elementwise operations and row sums on matrices of the same shape are
+// grouped into one loop over the rows, which applies every operation of the
+// group to one segment of a row before moving to the next, so intermediates
+// are reused from cache instead of being written to and read from memory
+// once per operation. Row sums and elementwise operations further down the
+// graph join a group when nothing in between depends on them. A scalar
+// multiplication of the result of a matrix product or row sum is folded into
+// it. The results are exactly the same as running the operations one by one.
+
+#define LAZY_MAX_GROUP 16
+
+enum lazy_op {
+    LAZY_LIN_COMBO,
+    LAZY_ELEM_MUL,
+    LAZY_SCALAR_MUL,
+    LAZY_RELU,
+    LAZY_SIGMOID,
+    LAZY_DRELU_MUL,
+    LAZY_DSIGMOID_MUL,
+    LAZY_VEC_ADD,
+    LAZY_SUM_ROWS,
+    LAZY_MAT_MUL
+};
+
+typedef struct {
+    enum lazy_op op;
+    matrix *result;
+    matrix *a;
+    matrix *b;
+    double c1;
+    double c2;
+    bool t1;
+    bool t2;
+
+    // Scale folded into a matrix product or row sum
+    bool scaled;
+    double scale;
+
+    // Memory passes and bytes of the operations recorded into this node
+    size_t passes;
+    size_t bytes;
+} lazy_node;
+
+typedef struct {
+    lazy_node *nodes;
+    size_t num_nodes;
+    size_t capacity;
+
+    // Totals over every lazy_eval, for lazy_report
+    size_t num_evals;
+    size_t passes;
+    size_t fused_passes;
+    size_t bytes;
+    size_t fused_bytes;
+} lazy_graph;
+
+lazy_graph* create_lazy_graph(void) {
+    lazy_graph *graph = calloc(1, sizeof(lazy_graph));
+    check_alloc(graph);
+    graph->capacity = 32;
+    graph->nodes = malloc(graph->capacity * sizeof(lazy_node));
+    check_alloc(graph->nodes);
+    return graph;
+}
+
+void free_lazy_graph(lazy_graph *graph) {
+    if (graph == NULL) {
+        return;
+    }
+
+    free(graph->nodes);
+    free(graph);
+}
+
+size_t mat_bytes(matrix *mat) {
+    return (mat == NULL) ? 0 : mat->rows * mat->cols * sizeof(double);
+}
+
+bool mats_overlap(matrix *mat1, matrix *mat2) {
+    // Whether the data of mat1 and mat2 share any memory
+
+    if (mat1 == NULL || mat2 == NULL) {
+        return false;
+    }
+    return (mat1->data < mat2->data + mat2->rows * mat2->cols) && (mat2->data < mat1->data + mat1->rows * mat1->cols);
+}
+
+void lazy_record(lazy_graph *graph, enum lazy_op op, matrix *result, matrix *a, matrix *b, double c1, double c2) {
+    if (graph->num_nodes == graph->capacity) {
+        graph->capacity *= 2;
+        graph->nodes = realloc(graph->nodes, graph->capacity * sizeof(lazy_node));
+        check_alloc(graph->nodes);
+    }
+
+    lazy_node *node = &graph->nodes[graph->num_nodes++];
+    node->op = op;
+    node->result = result;
+    node->a = a;
+    node->b = b;
+    node->c1 = c1;
+    node->c2 = c2;
+    node->t1 = false;
+    node->t2 = false;
+    node->scaled = false;
+    node->scale = 1.0;
+    node->passes = 1;
+    node->bytes = mat_bytes(result) + mat_bytes(a) + mat_bytes(b);
+}
+
+void lazy_lin_combo(lazy_graph *graph, matrix *result, matrix *mat1, matrix *mat2, double c1, double c2) {
+    check_same_dims(mat1, mat2, "lazy_lin_combo");
+    check_same_dims(mat2, result, "lazy_lin_combo");
+    lazy_record(graph, LAZY_LIN_COMBO, result, mat1, mat2, c1, c2);
+}
+
+void lazy_sub(lazy_graph *graph, matrix *result, matrix *mat1, matrix *mat2) {
+    lazy_lin_combo(graph, result, mat1, mat2, 1, -1);
+}
+
+void lazy_elem_mul(lazy_graph *graph, matrix *result, matrix *mat1, matrix *mat2) {
+    check_same_dims(mat1, mat2, "lazy_elem_mul");
+    check_same_dims(mat2, result, "lazy_elem_mul");
+    lazy_record(graph, LAZY_ELEM_MUL, result, mat1, mat2, 0.0, 0.0);
+}
+
+void lazy_scalar_mul(lazy_graph *graph, matrix *result, matrix *mat, double c) {
+    // result = c * mat, folded into the previous node if it is a matrix product or
+    // row sum that produced mat in place
+
+    check_same_dims(result, mat, "lazy_scalar_mul");
+    if (graph->num_nodes > 0 && result == mat) {
+        lazy_node *prev = &graph->nodes[graph->num_nodes - 1];
+        if ((prev->op == LAZY_MAT_MUL || prev->op == LAZY_SUM_ROWS) && prev->result == mat && !prev->scaled) {
+            prev->scaled = true;
+            prev->scale = c;
+            prev->passes++;
+            prev->bytes += 2 * mat_bytes(mat);
+            return;
+        }
+    }
+    lazy_record(graph, LAZY_SCALAR_MUL, result, mat, NULL, c, 0.0);
+}
+
+void lazy_relu(lazy_graph *graph, matrix *result, matrix *mat) {
+    check_same_dims(result, mat, "lazy_relu");
+    lazy_record(graph, LAZY_RELU, result, mat, NULL, 0.0, 0.0);
+}
+
+void lazy_sigmoid(lazy_graph *graph, matrix *result, matrix *mat) {
+    check_same_dims(result, mat, "lazy_sigmoid");
+    lazy_record(graph, LAZY_SIGMOID, result, mat, NULL, 0.0, 0.0);
+}
+
+void lazy_drelu_mul(lazy_graph *graph, matrix *result, matrix *dA, matrix *Z) {
+    check_same_dims(dA, Z, "lazy_drelu_mul");
+    check_same_dims(Z, result, "lazy_drelu_mul");
+    lazy_record(graph, LAZY_DRELU_MUL, result, dA, Z, 0.0, 0.0);
+}
+
+void lazy_dsigmoid_mul(lazy_graph *graph, matrix *result, matrix *dA, matrix *A) {
+    check_same_dims(dA, A, "lazy_dsigmoid_mul");
+    check_same_dims(A, result, "lazy_dsigmoid_mul");
+    lazy_record(graph, LAZY_DSIGMOID_MUL, result, dA, A, 0.0, 0.0);
+}
+
+void lazy_vec_add(lazy_graph *graph, matrix *result, matrix *mat, matrix *vec) {
+    check_same_dims(result, mat, "lazy_vec_add");
+    if (vec->rows != mat->rows || vec->cols != 1) {
+        printf("Error: Invalid vector dimensions for lazy_vec_add\n\n");
+        exit(0);
+    }
+    lazy_record(graph, LAZY_VEC_ADD, result, mat, vec, 0.0, 0.0);
+}
+
+void lazy_sum_rows(lazy_graph *graph, matrix *result, matrix *mat) {
+    if ((result->cols != 1) || (result->rows != mat->rows)) {
+        printf("Error: Invalid result dimensions for lazy_sum_rows\n\n");
+        exit(0);
+    }
+    lazy_record(graph, LAZY_SUM_ROWS, result, mat, NULL, 0.0, 0.0);
+}
+
+void lazy_mat_mul_trans(lazy_graph *graph, matrix *result, matrix *mat1, matrix *mat2, bool t1, bool t2) {
+    size_t rows1 = t1 ? mat1->cols : mat1->rows;
+    size_t cols1 = t1 ? mat1->rows : mat1->cols;
+    size_t rows2 = t2 ? mat2->cols : mat2->rows;
+    size_t cols2 = t2 ? mat2->rows : mat2->cols;
+
+    if ((cols1 != rows2) || (rows1 != result->rows) || (cols2 != result->cols)) {
+        printf("Error: Dimensions are invalid for lazy_mat_mul_trans\n\n");
+        exit(0);
+    }
+    lazy_record(graph, LAZY_MAT_MUL, result, mat1, mat2, 0.0, 0.0);
+    graph->nodes[graph->num_nodes - 1].t1 = t1;
+    graph->nodes[graph->num_nodes - 1].t2 = t2;
+}
+
+bool node_is_fusable(lazy_node *node) {
+    return node->op != LAZY_MAT_MUL;
+}
+
+bool node_depends_on(lazy_node *later, lazy_node *earlier) {
+    // Whether later has to run after earlier (reads or writes what earlier writes,
+    // or writes what earlier reads)
+
+    return mats_overlap(later->a, earlier->result) || mats_overlap(later->b, earlier->result) ||
+        mats_overlap(later->result, earlier->result) || mats_overlap(later->result, earlier->a) ||
+        mats_overlap(later->result, earlier->b);
+}
+
+bool node_fits_group(lazy_node *node, lazy_node **group, size_t group_size) {
+    // Whether node can be applied row segment by row segment together with group
+
+    matrix *shape = group[0]->a;
+    unsigned int g;
+
+    if (!node_is_fusable(node) || group_size == LAZY_MAX_GROUP ||
+        node->a->rows != shape->rows || node->a->cols != shape->cols) {
+        return false;
+    }
+
+    // Row sums and the vector of vec_add are only complete after the whole group
+    for (g = 0; g < group_size; g++) {
+        if (group[g]->op == LAZY_SUM_ROWS && (mats_overlap(node->a, group[g]->result) ||
+            mats_overlap(node->b, group[g]->result) || mats_overlap(node->result, group[g]->result))) {
+            return false;
+        }
+        if (node->op == LAZY_VEC_ADD && mats_overlap(node->b, group[g]->result)) {
+            return false;
+        }
+        if (group[g]->op == LAZY_VEC_ADD && mats_overlap(node->result, group[g]->b)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void apply_segment(lazy_node *node, size_t row, size_t offset, size_t length, double *row_sum) {
+    // Apply node to elements offset to offset + length - 1, all in the given row
+
+    double *result = node->result->data + offset;
+    double *a = node->a->data + offset;
+    double *b = (node->b == NULL) ? NULL : node->b->data + offset;
+    unsigned int j;
+
+    switch (node->op) {
+        case LAZY_LIN_COMBO:
+            kernels.lin_combo(result, a, b, node->c1, node->c2, length);
+            break;
+        case LAZY_ELEM_MUL:
+            kernels.elem_mul(result, a, b, length);
+            break;
+        case LAZY_SCALAR_MUL:
+            kernels.scalar_mul(result, a, node->c1, length);
+            break;
+        case LAZY_RELU:
+            kernels.relu(result, a, length);
+            break;
+        case LAZY_SIGMOID:
+            kernels.sigmoid(result, a, length);
+            break;
+        case LAZY_DRELU_MUL:
+            kernels.drelu_mul(result, a, b, length);
+            break;
+        case LAZY_DSIGMOID_MUL:
+            kernels.dsigmoid_mul(result, a, b, length);
+            break;
+        case LAZY_VEC_ADD:
+            for (j = 0; j < length; j++) {
+                result[j] = a[j] + node->b->data[row];
+            }
+            break;
+        case LAZY_SUM_ROWS:
+            for (j = 0; j < length; j++) {
+                *row_sum += a[j];
+            }
+            break;
+        case LAZY_MAT_MUL:
+            break;
+    }
+}
+
+void run_group(lazy_node **group, size_t group_size) {
+    // Run the nodes of group one row segment at a time
+
+    size_t rows = group[0]->a->rows;
+    size_t cols = group[0]->a->cols;
+    bool parallel = rows * cols * group_size >= PARALLEL_MIN_WORK;
+    unsigned int i;
+
+    #pragma omp parallel for if (parallel)
+    for (i = 0; i < rows; i++) {
+        double row_sums[LAZY_MAX_GROUP] = {0.0};
+        unsigned int j, g;
+
+        for (j = 0; j < cols; j += CHUNK_SIZE) {
+            size_t length = (cols - j < CHUNK_SIZE) ? cols - j : CHUNK_SIZE;
+            for (g = 0; g < group_size; g++) {
+                apply_segment(group[g], i, i * cols + j, length, &row_sums[g]);
+            }
+        }
+
+        for (g = 0; g < group_size; g++) {
+            if (group[g]->op == LAZY_SUM_ROWS) {
+                group[g]->result->data[i] = group[g]->scaled ? row_sums[g] * group[g]->scale : row_sums[g];
+            }
+        }
+    }
+}
+
+void run_mat_mul(lazy_node *node) {
+    // mat_mul_trans, with a folded scale applied to each row of the result while it is in cache
+
+    matrix *matA = node->a;
+    matrix *matB = node->b;
+    matrix *result = node->result;
+
+    if (node->t1) {
+        matA = zero_mat(node->a->cols, node->a->rows);
+        transpose(matA, node->a);
+    }
+    if (node->t2) {
+        matB = zero_mat(node->b->cols, node->b->rows);
+        transpose(matB, node->b);
+    }
+
+    size_t cols1 = matA->cols;
+    size_t cols2 = matB->cols;
+    unsigned int i;
+
+    if (!node->scaled) {
+        mat_mul(result, matA, matB);
+    } else if (cols2 <= SKINNY_MAX_COLS) {
+        mat_mul(result, matA, matB);
+        mat_scalar_mul(result, result, node->scale);
+    } else {
+        #pragma omp parallel for
+        for (i = 0; i < matA->rows; i++) {
+            double *row = result->data + i * cols2;
+            kernels.mat_mul_row(row, matA->data + i * cols1, matB->data, cols1, cols2);
+            kernels.scalar_mul(row, row, node->scale, cols2);
+        }
+    }
+
+    if (node->t1) {
+        free_mat(matA);
+    }
+    if (node->t2) {
+        free_mat(matB);
+    }
+}
+
+void lazy_eval(lazy_graph *graph) {
+    // Run every recorded operation, fusing where possible, and clear the graph
+
+    size_t num_nodes = graph->num_nodes;
+    lazy_node *nodes = graph->nodes;
+    lazy_node *group[LAZY_MAX_GROUP];
+    bool *done = calloc(num_nodes, sizeof(bool));
+    check_alloc(done);
+    unsigned int n, k, s;
+
+    for (n = 0; n < num_nodes; n++) {
+        graph->passes += nodes[n].passes;
+        graph->bytes += nodes[n].bytes;
+    }
+
+    for (n = 0; n < num_nodes; n++) {
+        if (done[n]) {
+            continue;
+        }
+        done[n] = true;
+
+        if (!node_is_fusable(&nodes[n])) {
+            run_mat_mul(&nodes[n]);
+            graph->fused_passes++;
+            graph->fused_bytes += mat_bytes(nodes[n].result) + mat_bytes(nodes[n].a) + mat_bytes(nodes[n].b);
+            continue;
+        }
+
+        // Grow the group with later nodes that fit, as long as they do not depend on
+        // a node that is left out (which has to run first)
+        size_t group_size = 1;
+        group[0] = &nodes[n];
+        for (k = n + 1; k < num_nodes; k++) {
+            if (done[k]) {
+                continue;
+            }
+            bool independent = true;
+            for (s = n + 1; s < k && independent; s++) {
+                if (!done[s] && node_depends_on(&nodes[k], &nodes[s])) {
+                    independent = false;
+                }
+            }
+            if (independent && node_fits_group(&nodes[k], group, group_size)) {
+                group[group_size++] = &nodes[k];
+                done[k] = true;
+            }
+        }
+
+        run_group(group, group_size);
+        graph->fused_passes++;
+
+        // Bytes of every matrix the group touches, each counted once
+        matrix *touched[3 * LAZY_MAX_GROUP];
+        size_t num_touched = 0;
+        for (k = 0; k < group_size; k++) {
+            matrix *operands[3] = {group[k]->result, group[k]->a, group[k]->b};
+            for (s = 0; s < 3; s++) {
+                unsigned int t;
+                bool seen = (operands[s] == NULL);
+                for (t = 0; t < num_touched && !seen; t++) {
+                    seen = (touched[t]->data == operands[s]->data);
+                }
+                if (!seen) {
+                    touched[num_touched++] = operands[s];
+                    graph->fused_bytes += mat_bytes(operands[s]);
+                }
+            }
+        }
+    }
+
+    graph->num_evals++;
+    graph->num_nodes = 0;
+    free(done);
+}
+
+void lazy_report(lazy_graph *graph) {
+    // Average memory passes and bytes per lazy_eval, without and with fusion
+
+    if (graph->num_evals == 0) {
+        return;
+    }
+
+    double evals = (double) graph->num_evals;
+    printf("Fused execution: %.1f passes per step instead of %.1f, %.2f MB instead of %.2f MB (%.2f MB saved)\n",
+        graph->fused_passes / evals, graph->passes / evals,
+        graph->fused_bytes / evals / 1e6, graph->bytes / evals / 1e6,
+        ((double) graph->bytes - (double) graph->fused_bytes) / evals / 1e6);
+}
+
+#endif
@@ -1,7 +1,102 @@
+#ifndef MATH_UTILS_C
+#define MATH_UTILS_C
+
 #include "matrix.c"
-#include <immintrin.h>
+#include "simd_kernels.c"
+#include "autotune.c"
+#include "perf_counters.c"
+#include <string.h>
 #include <omp.h>
 
+#define CHUNK_SIZE 4096
+#define SPARSE_THRESHOLD 0.3
+#define SKINNY_MAX_COLS 16
+#define ROW_BLOCK_SIZE 16
+#define PARALLEL_MIN_WORK 65536
+#define ARGMAX_BLOCK_COLS 256
+#define SHUFFLE_PARALLEL_MIN 65536
+#define SHUFFLE_BUCKETS 256
+#define SHUFFLE_CHUNKS 64
+
+typedef struct {
+    enum tune_kernel kernel;
+    size_t length;
+    double *data1;
+    double *data2;
+    double *result;
+} elementwise_args;
+
+void run_elementwise(tune_config config, void *arg) {
+    // Representative kernel of a class of elementwise kernels on scratch data,
+    // lin_combo for the memory bound ones and sigmoid for the compute bound ones
+
+    elementwise_args *args = arg;
+    size_t length = args->length;
+    unsigned int i;
+
+    // Allocated on the first (untimed) run, without touching the random number generator
+    if (args->result == NULL) {
+        args->data1 = malloc(length * sizeof(double));
+        args->data2 = calloc(length, sizeof(double));
+        args->result = calloc(length, sizeof(double));
+        check_alloc(args->data1);
+        check_alloc(args->data2);
+        check_alloc(args->result);
+        for (i = 0; i < length; i++) {
+            args->data1[i] = (double) (i % 17) / 8.0 - 1.0;
+        }
+    }
+
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        if (args->kernel == TUNE_ELEM_COMPUTE) {
+            kernels.sigmoid(args->result + i, args->data1 + i, chunk);
+        } else {
+            kernels.lin_combo(args->result + i, args->data1 + i, args->data2 + i, 1.0, -1.0, chunk);
+        }
+    }
+}
+
+tune_config elementwise_config(enum tune_kernel kernel, size_t length) {
+    // Chunk size and number of threads of the elementwise loops over length elements
+    // Defaults to CHUNK_SIZE elements per chunk on all threads
+
+    tune_config fixed = {CHUNK_SIZE, omp_get_max_threads()};
+    if (!tuner.enabled) {
+        return fixed;
+    }
+
+    size_t chunks[] = {1024, 4096, 16384, 65536};
+    size_t num_chunks = sizeof(chunks) / sizeof(size_t);
+    tune_config candidates[TUNE_MAX_CANDIDATES];
+    int threads[TUNE_MAX_CANDIDATES];
+    size_t num_threads = thread_candidates(threads);
+    size_t num_candidates = 0;
+    size_t dims[3] = {length, 1, 1};
+    unsigned int c, t;
+
+    for (c = 0; c < num_chunks; c++) {
+        for (t = 0; t < num_threads && num_candidates < TUNE_MAX_CANDIDATES; t++) {
+            candidates[num_candidates].block = chunks[c];
+            candidates[num_candidates++].threads = threads[t];
+        }
+        // Larger chunks than the whole array all run the same way
+        if (chunks[c] >= length) {
+            break;
+        }
+    }
+
+    elementwise_args args = {kernel, length, NULL, NULL, NULL};
+    tune_config config = tuned_config(kernel, dims, fixed, candidates, num_candidates, run_elementwise, &args);
+    if (args.result != NULL) {
+        free(args.data1);
+        free(args.data2);
+        free(args.result);
+    }
+    return config;
+}
+
 void mat_lin_combo(matrix *result, matrix *mat1, matrix *mat2, double c1, double c2) {
     // Computes c1 * mat1 + c2 * mat2 for matrices mat1, mat2 and scalars c1, c2
 
@@ -13,23 +108,15 @@ void mat_lin_combo(matrix *result, matrix *mat1, matrix *mat2, double c1, double
     double *data = result->data;
     unsigned int i;
 
-    size_t length_for_vec = length / 4 * 4;
-    __m256d c1_vec = _mm256_set1_pd(c1);
-    __m256d c2_vec = _mm256_set1_pd(c2);
-
-    #pragma omp parallel for
-    for (i = 0; i < length_for_vec; i += 4) {
-        _mm256_storeu_pd(data + i, 
-            _mm256_add_pd(
-                _mm256_mul_pd(_mm256_loadu_pd(data1 + i), c1_vec), 
-                _mm256_mul_pd(_mm256_loadu_pd(data2 + i), c2_vec)
-            )
-        );
-    }
-
-    for (i = length_for_vec; i < length; i++) {
-        data[i] = c1 * data1[i] + c2 * data2[i];
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.lin_combo(data + i, data1 + i, data2 + i, c1, c2, chunk);
     }
+    perf_end(&start, PERF_LIN_COMBO);
 }
 
 void mat_add(matrix *result, matrix *mat1, matrix *mat2) {
@@ -53,13 +140,17 @@ void mat_vec_add(matrix *result, matrix *mat, matrix *vec) {
         exit(0);
     }
     
+    perf_sample start;
+    perf_begin(&start);
+
     #pragma omp parallel for collapse(2)
     for (i = 0; i < rows; i++) {
         for (j = 0; j < cols; j++) {
             mat_set(result, i, j, mat_get(mat, i, j) + mat_get(vec, i, 0));
         }
     }
-    
+
+    perf_end(&start, PERF_VEC_ADD);
 }
 
 void transpose(matrix *result, matrix *mat) {
@@ -74,12 +165,86 @@ void transpose(matrix *result, matrix *mat) {
         exit(0);
     }
 
+    perf_sample start;
+    perf_begin(&start);
+
     #pragma omp parallel for collapse(2)
     for (i = 0; i < rows; i++) {
         for (j = 0; j < cols; j++) {
             result_data[j * rows + i] = data[i * cols + j];
         }
     }
+
+    perf_end(&start, PERF_TRANSPOSE);
+}
+
+void mat_mul_config(matrix *result, matrix *mat1, matrix *mat2, tune_config config) {
+    // mat_mul with config.threads threads and config.block rows per task for
+    // small batches, or mat2 split into tiles of config.block columns otherwise
+    // Every configuration gives the same result
+
+    size_t rows1 = mat1->rows;
+    size_t cols1 = mat1->cols;
+    size_t cols2 = mat2->cols;
+    double *data1 = mat1->data;
+    double *data2 = mat2->data;
+    double *data = result->data;
+    size_t block = config.block;
+    unsigned int i, j, k;
+
+    if (cols2 == 1) {
+        // Matrix-vector product (e.g. inference on a single sample)
+        #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+        for (i = 0; i < rows1; i += block) {
+            size_t rows = (rows1 - i < block) ? rows1 - i : block;
+            kernels.gemv_rows(data + i, data1 + i * cols1, data2, rows, cols1);
+        }
+    } else if (cols2 <= SKINNY_MAX_COLS) {
+        // Small batches
+        #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+        for (i = 0; i < rows1; i += block) {
+            size_t rows = (rows1 - i < block) ? rows1 - i : block;
+            kernels.mat_mul_skinny(data + i * cols2, data1 + i * cols1, data2, rows, cols1, cols2);
+        }
+    } else if (block == 0 || block >= cols2) {
+        #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+        for (i = 0; i < rows1; i++) {
+            kernels.mat_mul_row(data + i * cols2, data1 + i * cols1, data2, cols1, cols2);
+        }
+    } else {
+        // Copy each tile of columns of mat2 into a contiguous buffer that stays in
+        // cache while every row of mat1 is multiplied with it
+        double *tile = malloc(cols1 * block * sizeof(double));
+        check_alloc(tile);
+
+        for (j = 0; j < cols2; j += block) {
+            size_t width = (cols2 - j < block) ? cols2 - j : block;
+
+            #pragma omp parallel num_threads(config.threads) if (config.threads > 1)
+            {
+                #pragma omp for
+                for (k = 0; k < cols1; k++) {
+                    memcpy(tile + k * width, data2 + k * cols2 + j, width * sizeof(double));
+                }
+                #pragma omp for
+                for (i = 0; i < rows1; i++) {
+                    kernels.mat_mul_row(data + i * cols2 + j, data1 + i * cols1, tile, cols1, width);
+                }
+            }
+        }
+        free(tile);
+    }
+}
+
+typedef struct {
+    matrix *result;
+    matrix *mat1;
+    matrix *mat2;
+} mat_mul_args;
+
+void run_mat_mul_config(tune_config config, void *arg) {
+    mat_mul_args *args = arg;
+    mat_mul_config(args->result, args->mat1, args->mat2, config);
 }
 
 void mat_mul(matrix *result, matrix *mat1, matrix *mat2) {
@@ -94,42 +259,147 @@ void mat_mul(matrix *result, matrix *mat1, matrix *mat2) {
         exit(0);
     }
 
+    enum tune_kernel kernel = (cols2 == 1) ? TUNE_GEMV : (cols2 <= SKINNY_MAX_COLS) ? TUNE_SKINNY : TUNE_MAT_MUL;
+
+    // Only split small products between threads if there is enough work
+    bool parallel = (kernel == TUNE_MAT_MUL) || (rows1 * cols1 * cols2 >= PARALLEL_MIN_WORK);
+    tune_config config = {(kernel == TUNE_MAT_MUL) ? 0 : ROW_BLOCK_SIZE, parallel ? omp_get_max_threads() : 1};
+
+    if (tuner.enabled) {
+        size_t row_blocks[] = {4, 8, 16, 32, 64};
+        size_t tiles[] = {0, 32, 64, 128, 256, 512};
+        size_t *blocks = (kernel == TUNE_MAT_MUL) ? tiles : row_blocks;
+        size_t num_blocks = (kernel == TUNE_MAT_MUL) ? sizeof(tiles) / sizeof(size_t) : sizeof(row_blocks) / sizeof(size_t);
+        size_t limit = (kernel == TUNE_MAT_MUL) ? cols2 : rows1;
+        tune_config candidates[TUNE_MAX_CANDIDATES];
+        int threads[TUNE_MAX_CANDIDATES];
+        size_t num_threads = thread_candidates(threads);
+        size_t num_candidates = 0;
+        size_t dims[3] = {rows1, cols1, cols2};
+        unsigned int b, t;
+
+        for (b = 0; b < num_blocks; b++) {
+            // Blocks past the whole matrix all run the same way as the largest useful one
+            if (b > 0 && blocks[b - 1] >= limit) {
+                break;
+            }
+            for (t = 0; t < num_threads && num_candidates < TUNE_MAX_CANDIDATES; t++) {
+                candidates[num_candidates].block = blocks[b];
+                candidates[num_candidates++].threads = threads[t];
+            }
+        }
+
+        mat_mul_args args = {result, mat1, mat2};
+        config = tuned_config(kernel, dims, config, candidates, num_candidates, run_mat_mul_config, &args);
+    }
+
+    perf_sample start;
+    perf_begin(&start);
+    mat_mul_config(result, mat1, mat2, config);
+    perf_end(&start, PERF_MAT_MUL);
+}
+
+void mat_mul_batched(matrix **results, matrix **mat1s, matrix **mat2s, size_t count) {
+    // results[p] = mat1s[p] * mat2s[p] for count products of the same shape
+    // The rows of all products are split between threads in one parallel loop,
+    // and products that share mat2 read it while it is still in cache
+
+    size_t rows1 = mat1s[0]->rows;
+    size_t cols1 = mat1s[0]->cols;
+    size_t cols2 = mat2s[0]->cols;
+    unsigned int p, r;
+
+    for (p = 0; p < count; p++) {
+        if ((mat1s[p]->rows != rows1) || (mat1s[p]->cols != cols1) || (mat2s[p]->rows != cols1) ||
+            (mat2s[p]->cols != cols2) || (results[p]->rows != rows1) || (results[p]->cols != cols2)) {
+            printf("Error: Dimensions are invalid for mat_mul_batched\n\n");
+            exit(0);
+        }
+    }
+
+    if (cols2 <= SKINNY_MAX_COLS) {
+        for (p = 0; p < count; p++) {
+            mat_mul(results[p], mat1s[p], mat2s[p]);
+        }
+        return;
+    }
+
+    // Row r of the loop is row r / count of product r % count
+    #pragma omp parallel for
+    for (r = 0; r < rows1 * count; r++) {
+        size_t i = r / count;
+        size_t q = r % count;
+        kernels.mat_mul_row(results[q]->data + i * cols2, mat1s[q]->data + i * cols1, mat2s[q]->data, cols1, cols2);
+    }
+}
+
+void mat_mul_sparse(matrix *result, matrix *mat1, matrix *mat2) {
+    // Same as mat_mul, but skips the zero entries of mat1
+    // Faster than mat_mul when a large fraction of mat1 is zero (e.g. after relu)
+
+    size_t rows1 = mat1->rows;
+    size_t cols1 = mat1->cols;
+    size_t rows2 = mat2->rows;
+    size_t cols2 = mat2->cols; 
+
+    if ((cols1 != rows2) || (rows1 != result->rows) || (cols2 != result->cols)) {
+        printf("Error: Dimensions are invalid for mat_mul_sparse\n\n");
+        exit(0);
+    }
+
+    perf_sample start;
+    perf_begin(&start);
+
     double *data1 = mat1->data;
     double *data2 = mat2->data;
     double *data = result->data;
-    size_t cols2_for_vec = cols2 / 4 * 4;
-    unsigned int i;
 
-    #pragma omp parallel for
-    for (i = 0; i < rows1; i++) {
+    #pragma omp parallel
+    {
+        // Nonzero entries of the current row of mat1 and their indices
+        unsigned int *idx = malloc(cols1 * sizeof(unsigned int));
+        double *values = malloc(cols1 * sizeof(double));
+        check_alloc(idx);
+        check_alloc(values);
+        unsigned int i, k;
         
-        unsigned int j, k;
-        double val1, val2, dot_prod;
-        __m256d sum_vec;
-        for (j = 0; j < cols2_for_vec; j += 4) {
-
-            sum_vec = _mm256_setzero_pd();
-            for (k = 0; k < cols1; k++) {
-                sum_vec = _mm256_add_pd(
-                    sum_vec,
-                    _mm256_mul_pd(
-                        _mm256_set1_pd(mat_get(mat1, i, k)),
-                        _mm256_loadu_pd(data2 + (k * cols2 + j))
-                    )
-                );
-            }
-            _mm256_storeu_pd(data + (i * cols2 + j), sum_vec);
-        }
-        for (j = cols2_for_vec; j < cols2; j++) {
-            dot_prod = 0; 
+        #pragma omp for
+        for (i = 0; i < rows1; i++) {
+            double *row1 = data1 + i * cols1;
+            size_t nnz = 0;
             for (k = 0; k < cols1; k++) {
-                val1 = mat_get(mat1, i, k);
-                val2 = mat_get(mat2, k, j);
-                dot_prod += val1 * val2;
+                if (row1[k] != 0.0) {
+                    values[nnz] = row1[k];
+                    idx[nnz++] = k;
+                }
             }
-            mat_set(result, i, j, dot_prod);
+            kernels.mat_mul_row_indexed(data + i * cols2, values, idx, nnz, data2, cols2);
         }
+
+        free(idx);
+        free(values);
+    }
+
+    perf_end(&start, PERF_MAT_MUL_SPARSE);
+}
+
+double mat_sparsity(matrix *mat) {
+    // Fraction of entries of mat that are exactly zero
+
+    size_t length = mat->rows * mat->cols;
+    double *data = mat->data;
+    size_t zeros = 0;
+    unsigned int i;
+
+    if (length == 0) {
+        return 0.0;
     }
+
+    #pragma omp parallel for reduction(+:zeros)
+    for (i = 0; i < length; i++) {
+        zeros += (data[i] == 0.0);
+    }
+    return (double) zeros / (double) length;
 }
 
 void mat_mul_trans(matrix *result, matrix *mat1, matrix *mat2, bool t1, bool t2) {
@@ -159,6 +429,97 @@ void mat_mul_trans(matrix *result, matrix *mat1, matrix *mat2, bool t1, bool t2)
     
 }
 
+void mat_mul_nt(matrix *result, matrix *mat1, matrix *mat2) {
+    // result = mat1 * mat2^T, as dot products of the rows of mat1 and mat2 without transposing mat2
+    // For few, long rows (e.g. the filter gradients of a conv layer, summed over every
+    // position of every sample), where transposing mat2 would cost more than the product
+    // Gives the same result as mat_mul_trans(result, mat1, mat2, false, true)
+
+    size_t rows1 = mat1->rows;
+    size_t rows2 = mat2->rows;
+    size_t cols = mat1->cols;
+    unsigned int t;
+
+    if ((cols != mat2->cols) || (rows1 != result->rows) || (rows2 != result->cols)) {
+        printf("Error: Dimensions are invalid for mat_mul_nt\n\n");
+        exit(0);
+    }
+
+    perf_sample start;
+    perf_begin(&start);
+
+    // One task per row of mat1 and block of ROW_BLOCK_SIZE rows of mat2
+    size_t blocks = (rows2 + ROW_BLOCK_SIZE - 1) / ROW_BLOCK_SIZE;
+    #pragma omp parallel for if (rows1 * rows2 * cols >= PARALLEL_MIN_WORK)
+    for (t = 0; t < rows1 * blocks; t++) {
+        size_t i = t / blocks;
+        size_t j = t % blocks * ROW_BLOCK_SIZE;
+        size_t rows = (rows2 - j < ROW_BLOCK_SIZE) ? rows2 - j : ROW_BLOCK_SIZE;
+        kernels.gemv_rows(result->data + i * rows2 + j, mat2->data + j * cols, mat1->data + i * cols, rows, cols);
+    }
+
+    perf_end(&start, PERF_MAT_MUL);
+}
+
+void mat_mul_trans_sparse(matrix *result, matrix *mat1, matrix *mat2, bool t1, bool t2) {
+    // Same as mat_mul_trans, but skips the zero entries of whichever operand is sparser
+    // Falls back to the dense product if neither has at least SPARSE_THRESHOLD zeros
+    // A sparse mat2 is used through the transposed product result^T = op(mat2)^T * op(mat1)^T
+
+    double sparsity1 = mat_sparsity(mat1);
+    double sparsity2 = mat_sparsity(mat2);
+
+    if (sparsity1 < SPARSE_THRESHOLD && sparsity2 < SPARSE_THRESHOLD) {
+        mat_mul_trans(result, mat1, mat2, t1, t2);
+        return;
+    }
+
+    if (sparsity1 >= sparsity2) {
+        matrix *matA = mat1;
+        matrix *matB = mat2;
+        if (t1) {
+            matA = zero_mat(mat1->cols, mat1->rows);
+            transpose(matA, mat1);
+        }
+        if (t2) {
+            matB = zero_mat(mat2->cols, mat2->rows);
+            transpose(matB, mat2);
+        }
+
+        mat_mul_sparse(result, matA, matB);
+
+        if (t1) {
+            free_mat(matA);
+        }
+        if (t2) {
+            free_mat(matB);
+        }
+    } else {
+        matrix *matA = mat2;
+        matrix *matB = mat1;
+        matrix *result_t = zero_mat(result->cols, result->rows);
+        if (!t2) {
+            matA = zero_mat(mat2->cols, mat2->rows);
+            transpose(matA, mat2);
+        }
+        if (!t1) {
+            matB = zero_mat(mat1->cols, mat1->rows);
+            transpose(matB, mat1);
+        }
+
+        mat_mul_sparse(result_t, matA, matB);
+        transpose(result, result_t);
+
+        if (!t2) {
+            free_mat(matA);
+        }
+        if (!t1) {
+            free_mat(matB);
+        }
+        free_mat(result_t);
+    }
+}
+
 void mat_scalar_mul(matrix *result, matrix *mat, double c) {
     // Multiply each element in matrix mat by a scalar c
 
@@ -168,14 +529,30 @@ void mat_scalar_mul(matrix *result, matrix *mat, double c) {
     double *data = mat->data;
     unsigned int i;
 
-    #pragma omp parallel for
-    for (i = 0; i < length; i++) {
-        result_data[i] = c * data[i];
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.scalar_mul(result_data + i, data + i, c, chunk);
     }
+    perf_end(&start, PERF_SCALAR_MUL);
 }
 
 void mat_copy(matrix *result, matrix *mat) {
-    mat_scalar_mul(result, mat, 1.0);
+    check_same_dims(result, mat, "mat_copy");
+    size_t length = result->rows * result->cols;
+    double *result_data = result->data;
+    double *data = mat->data;
+    unsigned int i;
+
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        memcpy(result_data + i, data + i, chunk * sizeof(double));
+    }
 }
 
 void mat_elem_mul(matrix *result, matrix *mat1, matrix *mat2) {
@@ -190,10 +567,15 @@ void mat_elem_mul(matrix *result, matrix *mat1, matrix *mat2) {
     double *data = result->data;
     unsigned int i;
     
-    #pragma omp parallel for
-    for (i = 0; i < length; i++) {
-        data[i] = data1[i] * data2[i];
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.elem_mul(data + i, data1 + i, data2 + i, chunk);
     }
+    perf_end(&start, PERF_ELEM_MUL);
 }
 
 void mat_sum_rows(matrix *result, matrix *mat) {
@@ -209,6 +591,9 @@ void mat_sum_rows(matrix *result, matrix *mat) {
         exit(0);
     }
 
+    perf_sample start;
+    perf_begin(&start);
+
     #pragma omp parallel for
     for (i = 0; i < rows; i++) {
         double sum = 0;
@@ -218,6 +603,8 @@ void mat_sum_rows(matrix *result, matrix *mat) {
         }
         mat_set(result, i, 0, sum);
     }
+
+    perf_end(&start, PERF_SUM_ROWS);
 }
 
 void sigmoid(matrix *result, matrix *mat) {
@@ -229,10 +616,15 @@ void sigmoid(matrix *result, matrix *mat) {
     double *result_data = result->data;
     unsigned int i;
 
-    #pragma omp parallel for
-    for (i = 0; i < length; i++) {
-        result_data[i] = 1 / (1 + exp(-1 * data[i]));
+    tune_config config = elementwise_config(TUNE_ELEM_COMPUTE, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.sigmoid(result_data + i, data + i, chunk);
     }
+    perf_end(&start, PERF_SIGMOID);
 }
 
 void dsigmoid(matrix *result, matrix *mat) {
@@ -245,10 +637,35 @@ void dsigmoid(matrix *result, matrix *mat) {
     double *result_data = result->data;
     unsigned int i;
 
-    #pragma omp parallel for
-    for (i = 0; i < length; i++) {
-        result_data[i] = data[i] * (1 - data[i]);
+    tune_config config = elementwise_config(TUNE_ELEM_COMPUTE, length);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.dsigmoid(result_data + i, data + i, chunk);
+    }
+}
+
+void dsigmoid_mul(matrix *result, matrix *dA, matrix *A) {
+    // Computes dA * dsigmoid(A) element wise in one pass
+    // Expects A to be result of sigmoid(A, X) for some X
+
+    check_same_dims(result, dA, "dsigmoid_mul");
+    check_same_dims(result, A, "dsigmoid_mul");
+    size_t length = result->rows * result->cols;
+    double *result_data = result->data;
+    double *data_dA = dA->data;
+    double *data_A = A->data;
+    unsigned int i;
+
+    tune_config config = elementwise_config(TUNE_ELEM_COMPUTE, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.dsigmoid_mul(result_data + i, data_dA + i, data_A + i, chunk);
     }
+    perf_end(&start, PERF_DSIGMOID_MUL);
 }
 
 void softmax(matrix *result, matrix *mat) {
@@ -260,6 +677,9 @@ void softmax(matrix *result, matrix *mat) {
     double sum, val, max;
     unsigned int i, j;
 
+    perf_sample start;
+    perf_begin(&start);
+
     for (j = 0; j < cols; j++) {
         sum = 0;
         max = mat_get(mat, 0, j);
@@ -276,6 +696,8 @@ void softmax(matrix *result, matrix *mat) {
             mat_set(result, i, j, val);
         }
     }
+
+    perf_end(&start, PERF_SOFTMAX);
 }
 
 void relu(matrix *result, matrix *mat) {
@@ -287,10 +709,15 @@ void relu(matrix *result, matrix *mat) {
     double *result_data = result->data;
     unsigned int i;
 
-    #pragma omp parallel for
-    for (i = 0; i < length; i++) {
-        result_data[i] = fmax(0.0, data[i]);
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.relu(result_data + i, data + i, chunk);
     }
+    perf_end(&start, PERF_RELU);
 }
 
 void drelu(matrix *result, matrix *mat) {
@@ -302,25 +729,114 @@ void drelu(matrix *result, matrix *mat) {
     double *result_data = result->data;
     unsigned int i;
 
-    #pragma omp parallel for
-    for (i = 0; i < length; i++) {
-        result_data[i] = (data[i] > 0.0) ? 1.0 : 0.0;
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.drelu(result_data + i, data + i, chunk);
+    }
+}
+
+void drelu_mul(matrix *result, matrix *dA, matrix *Z) {
+    // Computes dA * drelu(Z) element wise in one pass
+
+    check_same_dims(result, dA, "drelu_mul");
+    check_same_dims(result, Z, "drelu_mul");
+    size_t length = result->rows * result->cols;
+    double *result_data = result->data;
+    double *data_dA = dA->data;
+    double *data_Z = Z->data;
+    unsigned int i;
+
+    tune_config config = elementwise_config(TUNE_ELEM_MEMORY, length);
+    perf_sample start;
+    perf_begin(&start);
+    #pragma omp parallel for num_threads(config.threads) if (config.threads > 1)
+    for (i = 0; i < length; i += config.block) {
+        size_t chunk = (length - i < config.block) ? length - i : config.block;
+        kernels.drelu_mul(result_data + i, data_dA + i, data_Z + i, chunk);
+    }
+    perf_end(&start, PERF_DRELU_MUL);
+}
+
+void fisher_yates(int *array, size_t n, uint64_t key, uint64_t first) {
+    // Shuffle array with random numbers first to first + n - 2 of key
+
+    unsigned int i;
+    for (i = 0; i + 1 < n; i++) {
+        size_t j = i + rng_below(key, first + i, n - i);
+        int t = array[j];
+        array[j] = array[i];
+        array[i] = t;
     }
 }
 
 void shuffle_array(int *array, int n) {
     // Randomly shuffle the values in array
+    // Large arrays are scattered into SHUFFLE_BUCKETS buckets at random, in parallel over
+    // fixed chunks of the array, and the buckets are then shuffled in parallel. Random
+    // buckets followed by uniform shuffles of every bucket is a uniform permutation, and
+    // it only depends on the random numbers, not on the number of threads
+
+    uint64_t key = nn_rng.key;
+    uint64_t first = rng_reserve(2 * (size_t) n);
+    unsigned int c, b;
+
+    if (n < SHUFFLE_PARALLEL_MIN) {
+        fisher_yates(array, n, key, first);
+        return;
+    }
 
-    unsigned int i, j, t;
+    unsigned char *buckets = malloc(n * sizeof(unsigned char));
+    int *scattered = malloc(n * sizeof(int));
+    size_t *offsets = calloc(SHUFFLE_CHUNKS * SHUFFLE_BUCKETS, sizeof(size_t));
+    size_t bucket_start[SHUFFLE_BUCKETS + 1];
+    check_alloc(buckets);
+    check_alloc(scattered);
+    check_alloc(offsets);
+
+    // Bucket of every value, and the size of every bucket in every chunk
+    #pragma omp parallel for
+    for (c = 0; c < SHUFFLE_CHUNKS; c++) {
+        size_t *counts = offsets + c * SHUFFLE_BUCKETS;
+        size_t i;
+        for (i = (size_t) n * c / SHUFFLE_CHUNKS; i < (size_t) n * (c + 1) / SHUFFLE_CHUNKS; i++) {
+            buckets[i] = rng_bits(key, first + i) >> 56;
+            counts[buckets[i]]++;
+        }
+    }
 
-    if (n > 1) {
-        for (i = 0; i < n - 1; i++) {
-            j = i + rand() / (RAND_MAX / (n - i) + 1);
-            t = array[j];
-            array[j] = array[i];
-            array[i] = t;
+    // Where every chunk starts writing into every bucket
+    size_t total = 0;
+    for (b = 0; b < SHUFFLE_BUCKETS; b++) {
+        bucket_start[b] = total;
+        for (c = 0; c < SHUFFLE_CHUNKS; c++) {
+            size_t count = offsets[c * SHUFFLE_BUCKETS + b];
+            offsets[c * SHUFFLE_BUCKETS + b] = total;
+            total += count;
         }
     }
+    bucket_start[SHUFFLE_BUCKETS] = total;
+
+    #pragma omp parallel for
+    for (c = 0; c < SHUFFLE_CHUNKS; c++) {
+        size_t *next = offsets + c * SHUFFLE_BUCKETS;
+        size_t i;
+        for (i = (size_t) n * c / SHUFFLE_CHUNKS; i < (size_t) n * (c + 1) / SHUFFLE_CHUNKS; i++) {
+            scattered[next[buckets[i]]++] = array[i];
+        }
+    }
+
+    // Bucket b uses the random numbers after the first n from its start on
+    #pragma omp parallel for schedule(dynamic)
+    for (b = 0; b < SHUFFLE_BUCKETS; b++) {
+        fisher_yates(scattered + bucket_start[b], bucket_start[b + 1] - bucket_start[b], key, first + n + bucket_start[b]);
+    }
+
+    memcpy(array, scattered, n * sizeof(int));
+    free(buckets);
+    free(scattered);
+    free(offsets);
 }
 
 void mat_get_col(matrix *result, matrix *mat, int idx) {
@@ -357,6 +873,42 @@ void mat_get_row(matrix *result, matrix *mat, int idx) {
     }
 }
 
+void mat_get_cols(matrix *result, matrix *mat, size_t first) {
+    // Copy columns first to first + result->cols - 1 of mat into result
+
+    size_t rows = mat->rows;
+    size_t cols = result->cols;
+    unsigned int i;
+
+    if ((result->rows != rows) || (first + cols > mat->cols)) {
+        printf("Error: Result dimensions invalid for mat_get_cols\n\n");
+        exit(0);
+    }
+
+    #pragma omp parallel for if (rows * cols >= PARALLEL_MIN_WORK)
+    for (i = 0; i < rows; i++) {
+        memcpy(result->data + i * cols, mat->data + i * mat->cols + first, cols * sizeof(double));
+    }
+}
+
+void mat_set_cols(matrix *result, matrix *mat, size_t first) {
+    // Copy mat into columns first to first + mat->cols - 1 of result
+
+    size_t rows = mat->rows;
+    size_t cols = mat->cols;
+    unsigned int i;
+
+    if ((result->rows != rows) || (first + cols > result->cols)) {
+        printf("Error: Dimensions invalid for mat_set_cols\n\n");
+        exit(0);
+    }
+
+    #pragma omp parallel for if (rows * cols >= PARALLEL_MIN_WORK)
+    for (i = 0; i < rows; i++) {
+        memcpy(result->data + i * result->cols + first, mat->data + i * cols, cols * sizeof(double));
+    }
+}
+
 int max_index(matrix *vec) {
     // Return the index of the maximum value in vec
 
@@ -368,7 +920,7 @@ int max_index(matrix *vec) {
 
     double *data = vec->data;
     double max_val = data[0];
-    unsigned int max_idx, i = 0;
+    unsigned int max_idx = 0, i = 0;
     
     for (i = 0; i < rows; i++) {
         if (data[i] > max_val) {
@@ -378,3 +930,116 @@ int max_index(matrix *vec) {
     }
     return max_idx;
 }
+
+void col_argmax_block(size_t *result, matrix *mat, size_t j_start, size_t j_end) {
+    // Index of the maximum value of columns j_start to j_end - 1 of mat (the first one on ties)
+    // into result[0] to result[j_end - j_start - 1]
+    // The rows are scanned in order, so every access is contiguous
+
+    size_t rows = mat->rows;
+    size_t cols = mat->cols;
+    double max_vals[ARGMAX_BLOCK_COLS];
+    unsigned int i, j;
+
+    for (j = j_start; j < j_end; j++) {
+        max_vals[j - j_start] = mat->data[j];
+        result[j - j_start] = 0;
+    }
+    for (i = 1; i < rows; i++) {
+        double *row = mat->data + i * cols;
+        for (j = j_start; j < j_end; j++) {
+            if (row[j] > max_vals[j - j_start]) {
+                max_vals[j - j_start] = row[j];
+                result[j - j_start] = i;
+            }
+        }
+    }
+}
+
+void mat_col_argmax(size_t *result, matrix *mat) {
+    // Index of the maximum value of every column of mat, equal to max_index of each column
+
+    size_t cols = mat->cols;
+    bool parallel = mat->rows * cols >= PARALLEL_MIN_WORK;
+    unsigned int j;
+
+    if (mat->rows == 0) {
+        printf("Error: mat_col_argmax expects a non-empty matrix\n\n");
+        exit(0);
+    }
+
+    #pragma omp parallel for if (parallel)
+    for (j = 0; j < cols; j += ARGMAX_BLOCK_COLS) {
+        size_t j_end = (cols - j < ARGMAX_BLOCK_COLS) ? cols : j + ARGMAX_BLOCK_COLS;
+        col_argmax_block(result + j, mat, j, j_end);
+    }
+}
+
+size_t mat_count_argmax_equal(matrix *mat1, matrix *mat2) {
+    // Number of columns where mat1 and mat2 have their maximum at the same index
+    // (e.g. correct predictions, given scores and one-hot labels)
+
+    check_same_dims(mat1, mat2, "mat_count_argmax_equal");
+    size_t cols = mat1->cols;
+    bool parallel = mat1->rows * cols >= PARALLEL_MIN_WORK;
+    size_t count = 0;
+    unsigned int j;
+
+    if (mat1->rows == 0) {
+        printf("Error: mat_count_argmax_equal expects non-empty matrices\n\n");
+        exit(0);
+    }
+
+    #pragma omp parallel for if (parallel) reduction(+:count)
+    for (j = 0; j < cols; j += ARGMAX_BLOCK_COLS) {
+        size_t j_end = (cols - j < ARGMAX_BLOCK_COLS) ? cols : j + ARGMAX_BLOCK_COLS;
+        size_t idx1[ARGMAX_BLOCK_COLS];
+        size_t idx2[ARGMAX_BLOCK_COLS];
+        unsigned int k;
+
+        col_argmax_block(idx1, mat1, j, j_end);
+        col_argmax_block(idx2, mat2, j, j_end);
+        for (k = 0; k < j_end - j; k++) {
+            count += (idx1[k] == idx2[k]);
+        }
+    }
+    return count;
+}
+
+void mat_col_top_k(size_t *result, matrix *mat, size_t k) {
+    // Indices of the k largest values of every column of mat, in decreasing order
+    // result[j * k] to result[j * k + k - 1] belong to column j
+
+    size_t rows = mat->rows;
+    size_t cols = mat->cols;
+    bool parallel = rows * cols >= PARALLEL_MIN_WORK;
+    unsigned int j;
+
+    if (k == 0 || k > rows) {
+        printf("Error: Invalid k for mat_col_top_k\n\n");
+        exit(0);
+    }
+
+    #pragma omp parallel for if (parallel)
+    for (j = 0; j < cols; j++) {
+        size_t *top = result + j * k;
+        size_t num_top = 0;
+        unsigned int i, r;
+
+        // Insertion into a sorted list of the best k, earlier indices win ties
+        for (i = 0; i < rows; i++) {
+            double val = mat->data[i * cols + j];
+            if (num_top == k && val <= mat->data[top[k - 1] * cols + j]) {
+                continue;
+            }
+            r = (num_top < k) ? num_top++ : k - 1;
+            while (r > 0 && val > mat->data[top[r - 1] * cols + j]) {
+                top[r] = top[r - 1];
+                r--;
+            }
+            top[r] = i;
+        }
+    }
+}
+
+#endif
@@ -1,14 +1,21 @@
+#ifndef MATRIX_C
+#define MATRIX_C
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdbool.h>
+#include "random.c"
 
 typedef struct {
     size_t rows;
     size_t cols;
     double *data; 
+    bool is_view;
 } matrix;
 
+// Uniform on [0, 1] from the C rand(), only for the tests and benchmarks
+// The library draws its random numbers from random.c
 double rand_weight() { return ((double) rand()) / ((double) RAND_MAX); }
 
 void check_alloc(void *ptr) {
@@ -27,20 +34,28 @@ matrix* zero_mat(size_t rows, size_t cols) {
     mat->cols = cols; 
     mat->data = calloc(rows * cols, sizeof(double));
     check_alloc(mat->data);
+    mat->is_view = false;
+    return mat;
+}
+
+matrix* mat_view(double *data, size_t rows, size_t cols) {
+    // Create a matrix that points into an existing buffer
+    // The buffer is owned by the caller and is not freed by free_mat
+
+    matrix *mat = malloc(sizeof(matrix));
+    check_alloc(mat);
+    mat->rows = rows;
+    mat->cols = cols;
+    mat->data = data;
+    mat->is_view = true;
     return mat;
 }
 
 matrix* rand_mat(size_t rows, size_t cols) {
-    // Create a matrix with random values
+    // Create a matrix with random values on [0, 1)
 
     matrix *mat = zero_mat(rows, cols);
-    double *data = mat->data;
-    size_t length = rows * cols;
-    unsigned int i;
-
-    for (i = 0; i < length; i++) {
-        data[i] = rand_weight();
-    }
+    rand_fill(mat->data, rows * cols, 0.0, 1.0);
     return mat; 
 }
 
@@ -59,7 +74,7 @@ void free_mat(matrix *mat) {
     if (mat == NULL) {
         return;
     }
-    if (mat->data != NULL) {
+    if (mat->data != NULL && !mat->is_view) {
         free(mat->data);
     }
     free(mat);
@@ -123,4 +138,6 @@ bool mat_is_equal(matrix *mat1, matrix *mat2) {
         }
     }
     return true; 
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef MNIST_DATA_C
+#define MNIST_DATA_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "neural_network.c"
+
+#define MAX_LINE_LENGTH 8192
+#define INPUT_SIZE 784
+#define OUTPUT_CLASSES 10
+#define TRAINING_SET_SIZE 42000
+#define TEST_SET_SIZE 28000
+
+void load_training_data(matrix *X, matrix *Y, char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Error opening file %s\n", filename);
+        exit(0);
+    }
+
+    printf("Loading training data from file %s\n", filename);
+
+    char line[MAX_LINE_LENGTH];
+    char *field; 
+    double val;
+    unsigned int i, j;
+
+    fgets(line, sizeof(line), file);
+    for (i = 0; i < TRAINING_SET_SIZE; i++) {
+        fgets(line, sizeof(line), file);
+        if ((i + 1) % 2000 == 0) {
+            printf("Data loading progress: %d/%d\n", i + 1, TRAINING_SET_SIZE);
+        }
+
+        field = strtok(line, ",");
+        val = strtod(field, NULL);
+        mat_set(Y, val, i, 1.0f);
+        field = strtok(NULL, ",");
+        for (j = 0; j < INPUT_SIZE; j++) {
+            val = strtod(field, NULL) / 255.0;
+            mat_set(X, j, i, val);
+            field = strtok(NULL, ",");
+        }
+    }
+
+    fclose(file);
+    printf("Finished loading data\n\n");
+}
+
+void load_test_data(matrix *X, char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Error opening file %s\n", filename);
+        exit(0);
+    }
+
+    printf("Loading test data from %s\n", filename);
+
+    char line[MAX_LINE_LENGTH];
+    char *field;
+    double val;
+    unsigned int i, j;
+
+    fgets(line, sizeof(line), file);
+    for (i = 0; i < TEST_SET_SIZE; i++) {
+        fgets(line, sizeof(line), file);
+        if ((i + 1) % 2000 == 0) {
+            printf("Data loading progress: %d/%d\n", i + 1, TEST_SET_SIZE);
+        }
+
+        field = strtok(line, ",");
+        for (j = 0; j < INPUT_SIZE; j++) {
+            val = strtod(field, NULL) / 255.0;
+            mat_set(X, j, i, val);
+            field = strtok(NULL, ",");
+        }
+    }
+
+    printf("Finished loading data\n\n");
+    fclose(file);
+}
+
+typedef struct {
+    FILE *file;
+    size_t passes;
+    char line[MAX_LINE_LENGTH];
+} csv_source;
+
+csv_source* open_csv_source(char *filename, size_t passes) {
+    // Source of the samples of a training data file for csv_producer, read passes times
+
+    csv_source *source = malloc(sizeof(csv_source));
+    check_alloc(source);
+    source->file = fopen(filename, "r");
+    if (source->file == NULL) {
+        printf("Error opening file %s\n", filename);
+        exit(0);
+    }
+    source->passes = passes;
+    fgets(source->line, sizeof(source->line), source->file);
+    return source;
+}
+
+bool csv_producer(double *x, double *y, void *arg) {
+    // Next sample of a csv_source, one line at a time, so that the file is never in memory
+
+    csv_source *source = arg;
+    char *field, *save;
+    unsigned int j;
+
+    while (fgets(source->line, sizeof(source->line), source->file) == NULL) {
+        if (--source->passes == 0) {
+            return false;
+        }
+        rewind(source->file);
+        fgets(source->line, sizeof(source->line), source->file);
+    }
+
+    memset(y, 0, OUTPUT_CLASSES * sizeof(double));
+    // strtok_r, as the producer runs on its own thread
+    field = strtok_r(source->line, ",", &save);
+    y[(size_t) strtod(field, NULL)] = 1.0;
+    field = strtok_r(NULL, ",", &save);
+    for (j = 0; j < INPUT_SIZE; j++) {
+        x[j] = strtod(field, NULL) / 255.0;
+        field = strtok_r(NULL, ",", &save);
+    }
+    return true;
+}
+
+void close_csv_source(csv_source *source) {
+    fclose(source->file);
+    free(source);
+}
+
+void split_columns(matrix *X1, matrix *X2, matrix *X) {
+    // Copy the first X1->cols columns of X into X1 and the rest into X2
+
+    size_t rows = X->rows;
+    size_t cols1 = X1->cols;
+    size_t cols2 = X2->cols;
+    unsigned int i;
+
+    if ((X1->rows != rows) || (X2->rows != rows) || (cols1 + cols2 != X->cols)) {
+        printf("Error: Invalid dimensions for split_columns\n\n");
+        exit(0);
+    }
+
+    for (i = 0; i < rows; i++) {
+        memcpy(X1->data + i * cols1, X->data + i * X->cols, cols1 * sizeof(double));
+        memcpy(X2->data + i * cols2, X->data + i * X->cols + cols1, cols2 * sizeof(double));
+    }
+}
+
+void write_prediction(size_t *labels, size_t num_inputs, char *filename) {
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        printf("Error opening file %s\n", filename);
+        exit(0);
+    }
+
+    printf("Writing predictions to file %s\n", filename);
+
+    unsigned int i;
+
+    fprintf(file, "ImageId,Label\n");
+
+    for (i = 0; i < num_inputs; i++) {
+        fprintf(file, "%d,%zu\n", i + 1, labels[i]);
+    }
+
+    printf("Finished writing data\n\n");
+    fclose(file);
+}
+
+#endif
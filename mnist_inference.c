@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <omp.h>
+#include "mnist_data.c"
+#include "quantize.c"
+#include "half.c"
+#include "sparse.c"
+
+// Compares optimized inference paths against the fp64 model_predict path
+// Expects data/model.bin, written by mnist_model.c
+// The Kaggle test set has no labels, so accuracy is measured on the labeled
+// training data and agreement with the fp64 predictions on the test set
+
+#define CALIBRATION_SIZE 1000
+#define SINGLE_SAMPLE_REPEATS 1000
+
+size_t count_agreement(matrix *Y1, matrix *Y2) {
+    // Number of columns where Y1 and Y2 have the same maximum index
+
+    return mat_count_argmax_equal(Y1, Y2);
+}
+
+void report(char *name, double seconds, size_t num_inputs, size_t train_corrects, size_t test_agree) {
+    printf("%-8s  %10.0f samples/s   train accuracy: %6.3f%%   test agreement with fp64: %6.3f%%\n",
+        name, num_inputs / seconds,
+        100.0 * train_corrects / (double) TRAINING_SET_SIZE,
+        100.0 * test_agree / (double) TEST_SET_SIZE);
+}
+
+int main(void) {
+    matrix *train_X = zero_mat(INPUT_SIZE, TRAINING_SET_SIZE);
+    matrix *Y = zero_mat(OUTPUT_CLASSES, TRAINING_SET_SIZE);
+    matrix *test_X = zero_mat(INPUT_SIZE, TEST_SET_SIZE);
+    load_training_data(train_X, Y, "data/train.csv");
+    load_test_data(test_X, "data/test.csv");
+
+    nn_model *model = load_model("data/model.bin");
+
+    matrix *Y_train = zero_mat(OUTPUT_CLASSES, TRAINING_SET_SIZE);
+    matrix *Y_ref = zero_mat(OUTPUT_CLASSES, TEST_SET_SIZE);
+    matrix *Y_hat = zero_mat(OUTPUT_CLASSES, TEST_SET_SIZE);
+    double start, seconds;
+
+    // fp64 reference
+    model_predict(model, Y_train, train_X, TRAINING_SET_SIZE);
+    start = omp_get_wtime();
+    model_predict(model, Y_ref, test_X, TEST_SET_SIZE);
+    seconds = omp_get_wtime() - start;
+    report("fp64", seconds, TEST_SET_SIZE, count_agreement(Y_train, Y), TEST_SET_SIZE);
+
+    // int8, calibrated on the first CALIBRATION_SIZE training samples
+    matrix *X_calib = zero_mat(INPUT_SIZE, CALIBRATION_SIZE);
+    unsigned int i, j;
+    for (i = 0; i < INPUT_SIZE; i++) {
+        for (j = 0; j < CALIBRATION_SIZE; j++) {
+            mat_set(X_calib, i, j, mat_get(train_X, i, j));
+        }
+    }
+    q_model *qmodel = quantize_model(model, X_calib);
+
+    q_model_predict(qmodel, Y_train, train_X, TRAINING_SET_SIZE);
+    start = omp_get_wtime();
+    q_model_predict(qmodel, Y_hat, test_X, TEST_SET_SIZE);
+    seconds = omp_get_wtime() - start;
+    report("int8", seconds, TEST_SET_SIZE, count_agreement(Y_train, Y), count_agreement(Y_hat, Y_ref));
+
+    // fp16 and bf16 weights, timed one sample at a time as well, where reading W dominates
+    matrix *x = zero_mat(INPUT_SIZE, 1);
+    matrix *y_hat = zero_mat(OUTPUT_CLASSES, 1);
+    for (i = 0; i < INPUT_SIZE; i++) {
+        mat_set(x, i, 0, mat_get(test_X, i, 0));
+    }
+    start = omp_get_wtime();
+    for (j = 0; j < SINGLE_SAMPLE_REPEATS; j++) {
+        model_predict(model, y_hat, x, 1);
+    }
+    printf("fp64 latency for one sample: %.1f us\n", 1e6 * (omp_get_wtime() - start) / SINGLE_SAMPLE_REPEATS);
+
+    enum half_format format;
+    for (format = 0; format < NUM_HALF_FORMATS; format++) {
+        h_model *hmodel = compress_model(model, format);
+
+        h_model_predict(hmodel, Y_train, train_X, TRAINING_SET_SIZE);
+        start = omp_get_wtime();
+        h_model_predict(hmodel, Y_hat, test_X, TEST_SET_SIZE);
+        seconds = omp_get_wtime() - start;
+        report(half_format_names[format], seconds, TEST_SET_SIZE, count_agreement(Y_train, Y), count_agreement(Y_hat, Y_ref));
+
+        start = omp_get_wtime();
+        for (j = 0; j < SINGLE_SAMPLE_REPEATS; j++) {
+            h_model_predict(hmodel, y_hat, x, 1);
+        }
+        printf("%s latency for one sample: %.1f us\n", half_format_names[format], 1e6 * (omp_get_wtime() - start) / SINGLE_SAMPLE_REPEATS);
+        free_h_model(hmodel);
+    }
+
+    // Magnitude pruning with CSR weights. Every step prunes further, so the fp64
+    // model is modified last
+    double sparsities[] = {0.5, 0.75, 0.9, 0.95};
+    for (i = 0; i < sizeof(sparsities) / sizeof(double); i++) {
+        char name[16];
+        prune_to_sparsity(model, sparsities[i]);
+        s_model *smodel = sparse_model(model);
+        snprintf(name, sizeof(name), "csr %.0f%%", 100.0 * sparsities[i]);
+
+        s_model_predict(smodel, Y_train, train_X, TRAINING_SET_SIZE);
+        start = omp_get_wtime();
+        s_model_predict(smodel, Y_hat, test_X, TEST_SET_SIZE);
+        seconds = omp_get_wtime() - start;
+        report(name, seconds, TEST_SET_SIZE, count_agreement(Y_train, Y), count_agreement(Y_hat, Y_ref));
+
+        start = omp_get_wtime();
+        for (j = 0; j < SINGLE_SAMPLE_REPEATS; j++) {
+            s_model_predict(smodel, y_hat, x, 1);
+        }
+        printf("%s latency for one sample: %.1f us\n", name, 1e6 * (omp_get_wtime() - start) / SINGLE_SAMPLE_REPEATS);
+        free_s_model(smodel);
+    }
+
+    free_q_model(qmodel);
+    free_mat(x);
+    free_mat(y_hat);
+    free_model(model);
+    free_mat(X_calib);
+    free_mat(train_X);
+    free_mat(Y);
+    free_mat(test_X);
+    free_mat(Y_train);
+    free_mat(Y_ref);
+    free_mat(Y_hat);
+}
@@ -1,113 +1,19 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include "neural_network.c"
+#include <stdbool.h>
+#include "mnist_data.c"
 
-#define MAX_LINE_LENGTH 8192
-#define INPUT_SIZE 784
-#define OUTPUT_CLASSES 10
-#define TRAINING_SET_SIZE 42000
-#define TEST_SET_SIZE 28000
+// Training samples held out for validation during training
+#define VALIDATION_SIZE 4200
+#define VALIDATION_INTERVAL 50
+#define VALIDATION_PATIENCE 5
 
-void load_training_data(matrix *X, matrix *Y, char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Error opening file %s\n", filename);
-        exit(0);
-    }
+int main(int argc, char **argv) {
+    // With the argument conv, trains a small convolutional network instead of the fully connected one
+    bool conv = (argc > 1) && (strcmp(argv[1], "conv") == 0);
 
-    printf("Loading training data from file %s\n", filename);
-
-    char line[MAX_LINE_LENGTH];
-    char *field; 
-    double val;
-    unsigned int i, j;
-
-    fgets(line, sizeof(line), file);
-    for (i = 0; i < TRAINING_SET_SIZE; i++) {
-        fgets(line, sizeof(line), file);
-        if ((i + 1) % 2000 == 0) {
-            printf("Data loading progress: %d/%d\n", i + 1, TRAINING_SET_SIZE);
-        }
-
-        field = strtok(line, ",");
-        val = strtod(field, NULL);
-        mat_set(Y, val, i, 1.0f);
-        field = strtok(NULL, ",");
-        for (j = 0; j < INPUT_SIZE; j++) {
-            val = strtod(field, NULL) / 255.0;
-            mat_set(X, j, i, val);
-            field = strtok(NULL, ",");
-        }
-    }
-
-    fclose(file);
-    printf("Finished loading data\n\n");
-}
-
-void load_test_data(matrix *X, char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Error opening file %s\n", filename);
-        exit(0);
-    }
-
-    printf("Loading test data from %s\n", filename);
-
-    char line[MAX_LINE_LENGTH];
-    char *field;
-    double val;
-    unsigned int i, j;
-
-    fgets(line, sizeof(line), file);
-    for (i = 0; i < TEST_SET_SIZE; i++) {
-        fgets(line, sizeof(line), file);
-        if ((i + 1) % 2000 == 0) {
-            printf("Data loading progress: %d/%d\n", i + 1, TEST_SET_SIZE);
-        }
-
-        field = strtok(line, ",");
-        for (j = 0; j < INPUT_SIZE; j++) {
-            val = strtod(field, NULL) / 255.0;
-            mat_set(X, j, i, val);
-            field = strtok(NULL, ",");
-        }
-    }
-
-    printf("Finished loading data\n\n");
-    fclose(file);
-}
-
-void write_prediction(matrix *Y, char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        printf("Error opening file %s\n", filename);
-        exit(0);
-    }
-
-    printf("Writing predictions to file %s\n", filename);
-
-    size_t rows = Y->rows;
-    size_t cols = Y->cols;
-    unsigned int i, pred;
-
-    matrix *y = zero_mat(rows, 1);
-
-    fprintf(file, "ImageId,Label\n");
-
-    for (i = 0; i < cols; i++) {
-        mat_get_col(y, Y, i);
-        pred = max_index(y);
-        fprintf(file, "%d,%d\n", i + 1, pred);
-    }
-
-    printf("Finished writing data\n\n");
-    free_mat(y);
-    fclose(file);
-}
-
-int main(void) {
-    srand(123);
+    rng_seed(123);
     const double lr = 0.01f;
     const double beta_1 = 0.9f;
     const double beta_2 = 0.999f;
@@ -115,27 +21,44 @@ int main(void) {
     const double epochs = 1000;
     const size_t mini_batch_size = 1024;
 
-    matrix *train_X = zero_mat(INPUT_SIZE, TRAINING_SET_SIZE);
+    matrix *X = zero_mat(INPUT_SIZE, TRAINING_SET_SIZE);
     matrix *Y = zero_mat(OUTPUT_CLASSES, TRAINING_SET_SIZE);
-    load_training_data(train_X, Y, "data/train.csv");
+    load_training_data(X, Y, "data/train.csv");
+
+    matrix *train_X = zero_mat(INPUT_SIZE, TRAINING_SET_SIZE - VALIDATION_SIZE);
+    matrix *train_Y = zero_mat(OUTPUT_CLASSES, TRAINING_SET_SIZE - VALIDATION_SIZE);
+    matrix *val_X = zero_mat(INPUT_SIZE, VALIDATION_SIZE);
+    matrix *val_Y = zero_mat(OUTPUT_CLASSES, VALIDATION_SIZE);
+    split_columns(train_X, val_X, X);
+    split_columns(train_Y, val_Y, Y);
+    free_mat(X);
+    free_mat(Y);
     
     size_t num_layers = 3;
     size_t layer_sizes[] = {INPUT_SIZE, 512, 10};
     enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
-    nn_model *model = create_model(num_layers, layer_sizes, layer_activations);
+    nn_layer_spec conv_specs[] = {input_layer(1, 28, 28), conv_layer(8, 5, RELU), maxpool_layer(2),
+        conv_layer(16, 5, RELU), maxpool_layer(2), dense_layer(10, SOFTMAX)};
+    nn_model *model = conv ? create_model_layers(6, conv_specs) : create_model(num_layers, layer_sizes, layer_activations);
+    init_model(model, INIT_HE);
 
-    train_model(model, train_X, Y, mini_batch_size, epochs, lr, beta_1, beta_2, epsilon);
+    create_validation(model, val_X, val_Y, VALIDATION_INTERVAL, VALIDATION_PATIENCE);
+    train_model(model, train_X, train_Y, mini_batch_size, epochs, lr, beta_1, beta_2, epsilon);
+    save_model(model, conv ? "data/conv_model.bin" : "data/model.bin");
 
     matrix *test_X = zero_mat(INPUT_SIZE, TEST_SET_SIZE);
-    matrix *Y_hat = zero_mat(OUTPUT_CLASSES, TEST_SET_SIZE);
+    size_t *labels = malloc(TEST_SET_SIZE * sizeof(size_t));
+    check_alloc(labels);
     load_test_data(test_X, "data/test.csv");
 
-    model_predict(model, Y_hat, test_X, TEST_SET_SIZE);
-    write_prediction(Y_hat, "data/output.csv");
+    model_classify(model, labels, test_X, TEST_SET_SIZE);
+    write_prediction(labels, TEST_SET_SIZE, "data/output.csv");
 
     free_model(model);
     free_mat(train_X);
-    free_mat(Y);
+    free_mat(train_Y);
+    free_mat(val_X);
+    free_mat(val_Y);
     free_mat(test_X);
-    free_mat(Y_hat);
+    free(labels);
 }
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "mnist_data.c"
+#include "stream.c"
+
+// Trains the MNIST model on a stream read from the training data file, which is never
+// held in memory: a producer thread parses it line by line while the model trains
+
+#define STREAM_PASSES 6
+#define STREAM_CAPACITY 4096
+#define SHUFFLE_SIZE 8192
+
+int main(void) {
+    rng_seed(123);
+    const double lr = 0.01f;
+    const double beta_1 = 0.9f;
+    const double beta_2 = 0.999f;
+    const double epsilon = pow(10.0, -8.0);
+    const size_t mini_batch_size = 1024;
+
+    size_t num_layers = 3;
+    size_t layer_sizes[] = {INPUT_SIZE, 512, 10};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(num_layers, layer_sizes, layer_activations);
+    init_model(model, INIT_HE);
+
+    csv_source *source = open_csv_source("data/train.csv", STREAM_PASSES);
+    sample_stream *stream = create_stream(INPUT_SIZE, OUTPUT_CLASSES, STREAM_CAPACITY);
+    start_producer(stream, csv_producer, source);
+    train_stream(model, stream, mini_batch_size, SHUFFLE_SIZE, 0, lr, beta_1, beta_2, epsilon);
+    free_stream(stream);
+    close_csv_source(source);
+
+    save_model(model, "data/stream_model.bin");
+    free_model(model);
+}
@@ -0,0 +1,261 @@
+#ifndef MULTI_TRAIN_C
+#define MULTI_TRAIN_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <omp.h>
+#include "neural_network.c"
+
+// Training several models of the same topology side by side, e.g. for a
+// hyperparameter sweep
+//
+// Every step draws one mini-batch that all models train on, and the matrix
+// products of each layer are run for all models as one batched product.
+// The transpose of the mini-batch needed for the first layer's dW is also
+// computed once and shared. Each model has its own Adam hyperparameters, and
+// different seeds come from creating the models after different rng_seed calls.
+
+typedef struct {
+    double lr;
+    double beta_1;
+    double beta_2;
+    double epsilon;
+} adam_config;
+
+void check_same_topology(nn_model **models, size_t num_models) {
+    unsigned int k, i;
+
+    if (!is_dense_model(models[0])) {
+        printf("Error: train_models only supports fully connected models\n\n");
+        exit(0);
+    }
+
+    for (k = 1; k < num_models; k++) {
+        if (models[k]->num_layers != models[0]->num_layers) {
+            printf("Error: train_models expects models of the same topology\n\n");
+            exit(0);
+        }
+        for (i = 0; i < models[0]->num_layers; i++) {
+            if ((models[k]->layers[i].num_nodes != models[0]->layers[i].num_nodes) ||
+                (models[k]->layers[i].activation != models[0]->layers[i].activation)) {
+                printf("Error: train_models expects models of the same topology\n\n");
+                exit(0);
+            }
+        }
+    }
+}
+
+void forward_prop_batched(nn_model **models, size_t num_models, matrix **Zs, matrix **Ws, matrix **A_prevs) {
+    // forward_prop for every model, with the products of each layer as one batched product
+    // Zs, Ws and A_prevs are scratch arrays of num_models pointers
+
+    size_t num_layers = models[0]->num_layers;
+    unsigned int i, k;
+
+    for (i = 1; i < num_layers; i++) {
+        for (k = 0; k < num_models; k++) {
+            Zs[k] = models[k]->layers[i].Z;
+            Ws[k] = models[k]->layers[i].W;
+            A_prevs[k] = models[k]->layers[i - 1].A;
+        }
+        mat_mul_batched(Zs, Ws, A_prevs, num_models);
+
+        for (k = 0; k < num_models; k++) {
+            nn_layer *layer = &models[k]->layers[i];
+            mat_vec_add(layer->Z, layer->Z, layer->b);
+            if (layer->activation == SIGMOID) {
+                sigmoid(layer->A, layer->Z);
+            } else if (layer->activation == SOFTMAX) {
+                softmax(layer->A, layer->Z);
+            } else if (layer->activation == RELU) {
+                relu(layer->A, layer->Z);
+            }
+        }
+    }
+}
+
+void back_prop_batched(nn_model **models, size_t num_models, matrix *Y, matrix *X_T, matrix **trans, matrix **results, matrix **mat1s, matrix **mat2s) {
+    // back_prop for every model, with the products of each layer as one batched product
+    // X_T is the transpose of the shared mini-batch, trans[k] holds room for the
+    // transposes of the larger of each model's W and A. results, mat1s and mat2s are
+    // scratch arrays of num_models pointers
+    // Always uses the dense products (sparse_backprop is ignored)
+
+    size_t num_layers = models[0]->num_layers;
+    int last_i = num_layers - 1;
+    size_t m = Y->cols;
+    unsigned int i, k;
+
+    for (k = 0; k < num_models; k++) {
+        mat_sub(models[k]->layers[last_i].dZ, models[k]->layers[last_i].A, Y);
+    }
+
+    for (i = last_i; i > 0; i--) {
+        if (i != last_i) {
+            // dA = W^T * dZ of the next layer
+            for (k = 0; k < num_models; k++) {
+                nn_layer *next = &models[k]->layers[i + 1];
+                matrix *W_T = mat_view(trans[k]->data, next->W->cols, next->W->rows);
+                transpose(W_T, next->W);
+                results[k] = models[k]->layers[i].dA;
+                mat1s[k] = W_T;
+                mat2s[k] = next->dZ;
+            }
+            mat_mul_batched(results, mat1s, mat2s, num_models);
+
+            for (k = 0; k < num_models; k++) {
+                nn_layer *layer = &models[k]->layers[i];
+                free_mat(mat1s[k]);
+                if (layer->activation == SIGMOID) {
+                    dsigmoid_mul(layer->dZ, layer->dA, layer->A);
+                } else if (layer->activation == RELU) {
+                    drelu_mul(layer->dZ, layer->dA, layer->Z);
+                } else {
+                    mat_elem_mul(layer->dZ, layer->dA, layer->dZ);
+                }
+            }
+        }
+
+        // dW = dZ * A^T of the previous layer, which for the first layer is the shared mini-batch
+        for (k = 0; k < num_models; k++) {
+            matrix *A_prev = models[k]->layers[i - 1].A;
+            results[k] = models[k]->layers[i].dW;
+            mat1s[k] = models[k]->layers[i].dZ;
+            if (i == 1) {
+                mat2s[k] = X_T;
+            } else {
+                mat2s[k] = mat_view(trans[k]->data, A_prev->cols, A_prev->rows);
+                transpose(mat2s[k], A_prev);
+            }
+        }
+        mat_mul_batched(results, mat1s, mat2s, num_models);
+
+        for (k = 0; k < num_models; k++) {
+            nn_layer *layer = &models[k]->layers[i];
+            if (i != 1) {
+                free_mat(mat2s[k]);
+            }
+            mat_scalar_mul(layer->dW, layer->dW, 1.0 / m);
+            mat_sum_rows(layer->db, layer->dZ);
+            mat_scalar_mul(layer->db, layer->db, 1.0 / m);
+        }
+    }
+}
+
+void train_models(nn_model **models, size_t num_models, matrix *X, matrix *Y, size_t mini_batch_size, int epochs, adam_config *configs) {
+    // train_model for num_models models of the same topology on the same mini-batches,
+    // model k using the Adam hyperparameters configs[k]
+
+    check_same_topology(models, num_models);
+
+    size_t num_layers = models[0]->num_layers;
+    int last_i = num_layers - 1;
+    size_t m = mini_batch_size;
+    size_t training_set_size = X->cols;
+    double small_val = pow(10, -16.0);
+    unsigned int i, j, k, epoch;
+
+    matrix *mini_X = zero_mat(X->rows, m);
+    matrix *mini_Y = zero_mat(Y->rows, m);
+    matrix *X_T = zero_mat(m, X->rows);
+
+    int *indices = malloc(training_set_size * sizeof(int));
+    double *losses = malloc(num_models * sizeof(double));
+    matrix **trans = malloc(num_models * sizeof(matrix*));
+    matrix **scratch = malloc(3 * num_models * sizeof(matrix*));
+    check_alloc(indices);
+    check_alloc(losses);
+    check_alloc(trans);
+    check_alloc(scratch);
+    for (i = 0; i < training_set_size; i++) {
+        indices[i] = i;
+    }
+
+    // Room for the transposes of the W and A matrices of any layer after the first
+    size_t max_trans = 0;
+    for (i = 1; i < num_layers; i++) {
+        size_t n_curr = models[0]->layers[i].num_nodes;
+        size_t n_prev = models[0]->layers[i - 1].num_nodes;
+        max_trans = (n_curr * n_prev > max_trans) ? n_curr * n_prev : max_trans;
+        max_trans = (n_curr * m > max_trans) ? n_curr * m : max_trans;
+    }
+
+    // Create matrices used in forward and back prop
+    for (k = 0; k < num_models; k++) {
+        nn_layer *layers = models[k]->layers;
+        layers[0].A = mini_X;
+        for (i = 1; i < num_layers; i++) {
+            size_t n_curr = layers[i].num_nodes;
+            layers[i].A = zero_mat(n_curr, m);
+            layers[i].Z = zero_mat(n_curr, m);
+            layers[i].dA = zero_mat(n_curr, m);
+            layers[i].dZ = zero_mat(n_curr, m);
+        }
+        trans[k] = zero_mat(max_trans, 1);
+    }
+
+    printf("Training %zu neural network models\n", num_models);
+    double start = omp_get_wtime();
+
+    for (epoch = 0; epoch < epochs; epoch++) {
+
+        mini_batch(mini_X, mini_Y, X, Y, indices);
+        transpose(X_T, mini_X);
+
+        forward_prop_batched(models, num_models, scratch, scratch + num_models, scratch + 2 * num_models);
+        back_prop_batched(models, num_models, mini_Y, X_T, trans, scratch, scratch + num_models, scratch + 2 * num_models);
+
+        printf("Epoch %d/%d     Loss:", epoch + 1, epochs);
+        for (k = 0; k < num_models; k++) {
+            adam_config *config = &configs[k];
+            grad_descent_adam(models[k], epoch, config->lr, config->beta_1, config->beta_2, config->epsilon);
+
+            matrix *A = models[k]->layers[last_i].A;
+            losses[k] = 0.0;
+            for (j = 0; j < Y->rows * m; j++) {
+                losses[k] -= mini_Y->data[j] * log(A->data[j] + small_val);
+            }
+            losses[k] /= (double) m;
+            printf(" %g", losses[k]);
+        }
+        printf("\n");
+    }
+
+    printf("Finished training\n");
+    printf("Time taken: %f s\n\n", omp_get_wtime() - start);
+
+    for (k = 0; k < num_models; k++) {
+        nn_layer *layers = models[k]->layers;
+        layers[0].A = NULL;
+        for (i = 1; i < num_layers; i++) {
+            free_mat(layers[i].A);
+            free_mat(layers[i].Z);
+            free_mat(layers[i].dA);
+            free_mat(layers[i].dZ);
+            layers[i].A = NULL;
+            layers[i].Z = NULL;
+            layers[i].dA = NULL;
+            layers[i].dZ = NULL;
+        }
+        free_mat(trans[k]);
+    }
+
+    printf("Evaluating models on training data\n");
+    for (k = 0; k < num_models; k++) {
+        size_t corrects = model_count_correct(models[k], X, Y);
+        printf("Model %u (lr %g, beta_1 %g, beta_2 %g)     Training accuracy: %g%%\n",
+            k, configs[k].lr, configs[k].beta_1, configs[k].beta_2, 100.0 * corrects / (double) Y->cols);
+    }
+    printf("\n");
+
+    free_mat(mini_X);
+    free_mat(mini_Y);
+    free_mat(X_T);
+    free(indices);
+    free(losses);
+    free(trans);
+    free(scratch);
+}
+
+#endif
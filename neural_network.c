@@ -1,19 +1,44 @@
+#ifndef NEURAL_NETWORK_C
+#define NEURAL_NETWORK_C
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "math_utils.c"
+#include "lazy.c"
+#include "conv.c"
+#include "numa.c"
 
 enum func {
     INPUT,
     RELU,
     SIGMOID,
-    SOFTMAX
+    SOFTMAX,
+    NUM_FUNCS
+};
+
+enum layer_type {
+    DENSE,
+    CONV,
+    MAXPOOL,
+    NUM_LAYER_TYPES
 };
 
 typedef struct {
     size_t num_nodes;
     enum func activation;
+    enum layer_type type;
+    // Output of the layer as a channels x height x width image per sample (see conv.c),
+    // with num_nodes = channels * height * width. Dense layers are num_nodes x 1 x 1
+    size_t channels;
+    size_t height;
+    size_t width;
+    // Side of the filters of a conv layer or of the windows of a max pool layer
+    size_t kernel_size;
     matrix *W;
     matrix *b;
     matrix *A;
@@ -26,162 +51,1551 @@ typedef struct {
     matrix *V_db;
     matrix *S_dW;
     matrix *S_db;
+    // Training buffers (see create_train_buffers): the im2col patches of the previous
+    // layer's activations for a conv layer, and the row of every maximum for a max pool layer
+    matrix *cols;
+    size_t *argmax;
 } nn_layer; 
 
-typedef struct {
-    size_t num_layers;
-    nn_layer *layers; 
-} nn_model;
+// Description of a layer for create_model_layers, made by input_layer, dense_layer,
+// conv_layer or maxpool_layer
+typedef struct {
+    enum layer_type type;
+    enum func activation;
+    size_t num_nodes;
+    size_t channels;
+    size_t height;
+    size_t width;
+    size_t kernel_size;
+} nn_layer_spec;
+
+typedef struct {
+    size_t num_layers;
+    nn_layer *layers; 
+
+    // All parameters, gradients and Adam moments are stored as one flat 
+    // array each, in layer order (W then b for each layer)
+    // The per-layer matrices (W, b, dW, db, ...) are views into these arrays
+    size_t num_params;
+    double *params;
+    double *grads;
+    double *V;
+    double *S;
+
+    // Skip the zero entries of sparse activations and gradients (e.g. after relu)
+    // in the back propagation matrix products
+    bool sparse_backprop;
+
+    // Record back propagation in a lazy graph and run it with fused passes (see lazy.c)
+    // Takes precedence over sparse_backprop
+    bool lazy_backprop;
+    lazy_graph *lazy;
+
+    // Optional held-out set evaluated during training (see create_validation)
+    struct nn_validation *validation;
+
+    // Optional publication of weight snapshots for concurrent readers (see create_publisher)
+    struct nn_publisher *publisher;
+} nn_model;
+
+// Activation buffers for evaluating a model outside of training
+// A[i] and Z[i] are views into buffer with room for max_inputs columns
+typedef struct {
+    size_t num_layers;
+    size_t max_inputs;
+    double *buffer;
+    matrix **A;
+    matrix **Z;
+} nn_context;
+
+enum param_buffer {
+    PARAMS,
+    GRADS,
+    ADAM_V,
+    ADAM_S
+};
+
+nn_layer_spec input_layer(size_t channels, size_t height, size_t width) {
+    // Input of channels x height x width images, for models with conv or max pool layers
+
+    return (nn_layer_spec) {DENSE, INPUT, channels * height * width, channels, height, width, 0};
+}
+
+nn_layer_spec dense_layer(size_t num_nodes, enum func activation) {
+    // Fully connected layer (or flat input layer, with activation INPUT)
+
+    return (nn_layer_spec) {DENSE, activation, num_nodes, num_nodes, 1, 1, 0};
+}
+
+nn_layer_spec conv_layer(size_t channels, size_t kernel_size, enum func activation) {
+    // channels filters of kernel_size x kernel_size pixels over all channels of the previous layer
+
+    return (nn_layer_spec) {CONV, activation, 0, channels, 0, 0, kernel_size};
+}
+
+nn_layer_spec maxpool_layer(size_t pool_size) {
+    // Maximum of every pool_size x pool_size window of each channel, without an activation
+
+    return (nn_layer_spec) {MAXPOOL, INPUT, 0, 0, 0, 0, pool_size};
+}
+
+nn_layer_spec layer_spec(nn_layer *layer) {
+    // Spec that recreates layer after the same previous layers
+
+    return (nn_layer_spec) {layer->type, layer->activation, layer->num_nodes, layer->channels,
+        layer->height, layer->width, layer->kernel_size};
+}
+
+nn_layer_spec* dense_specs(size_t num_layers, size_t *layer_sizes, enum func *layer_activations) {
+    // Specs of a fully connected model
+
+    nn_layer_spec *specs = malloc(num_layers * sizeof(nn_layer_spec));
+    check_alloc(specs);
+    unsigned int i;
+
+    for (i = 0; i < num_layers; i++) {
+        specs[i] = dense_layer(layer_sizes[i], layer_activations[i]);
+    }
+    return specs;
+}
+
+void set_layer_shape(nn_layer *layer, nn_layer *prev, nn_layer_spec spec) {
+    // Type, activation and output shape of layer from spec and the previous layer (NULL for the input layer)
+
+    size_t k = spec.kernel_size;
+    bool valid;
+
+    layer->type = spec.type;
+    layer->activation = spec.activation;
+    layer->kernel_size = k;
+
+    if (spec.type == CONV || spec.type == MAXPOOL) {
+        valid = (prev != NULL) && (k > 0) && (k <= prev->height) && (k <= prev->width);
+        if (valid && spec.type == CONV) {
+            valid = spec.channels > 0;
+            layer->channels = spec.channels;
+            layer->height = prev->height - k + 1;
+            layer->width = prev->width - k + 1;
+        } else if (valid) {
+            layer->channels = prev->channels;
+            layer->height = prev->height / k;
+            layer->width = prev->width / k;
+        }
+    } else {
+        valid = (spec.type == DENSE) && (spec.channels * spec.height * spec.width == spec.num_nodes);
+        layer->channels = spec.channels;
+        layer->height = spec.height;
+        layer->width = spec.width;
+    }
+
+    if (!valid) {
+        printf("Error: Invalid layer shape for create_model\n\n");
+        exit(0);
+    }
+    layer->num_nodes = layer->channels * layer->height * layer->width;
+}
+
+bool is_dense_model(nn_model *model) {
+    // Whether every layer of model is fully connected
+
+    unsigned int i;
+    for (i = 0; i < model->num_layers; i++) {
+        if (model->layers[i].type != DENSE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void layer_weight_shape(nn_layer *layers, unsigned int i, size_t *rows, size_t *cols) {
+    // Shape of W of layer i: a row per node of a dense layer, a row per filter of a conv layer
+    // with a column per entry of its patches, and empty for a max pool layer
+    // b has the same number of rows
+
+    if (layers[i].type == CONV) {
+        *rows = layers[i].channels;
+        *cols = layers[i - 1].channels * layers[i].kernel_size * layers[i].kernel_size;
+    } else if (layers[i].type == MAXPOOL) {
+        *rows = 0;
+        *cols = 0;
+    } else {
+        *rows = layers[i].num_nodes;
+        *cols = layers[i - 1].num_nodes;
+    }
+}
+
+size_t count_params(nn_model *model) {
+    // Number of weights and biases in the model
+
+    nn_layer *layers = model->layers;
+    size_t num_params = 0;
+    size_t rows, cols;
+    unsigned int i;
+
+    for (i = 1; i < model->num_layers; i++) {
+        layer_weight_shape(layers, i, &rows, &cols);
+        num_params += rows * cols + rows;
+    }
+    return num_params;
+}
+
+void create_param_views(nn_model *model, enum param_buffer buffer_type, double *buffer) {
+    // Point the per-layer matrices of buffer_type at consecutive slices of buffer
+
+    nn_layer *layers = model->layers;
+    size_t offset = 0;
+    size_t n_curr, n_prev;
+    matrix *W, *b;
+    unsigned int i;
+
+    for (i = 1; i < model->num_layers; i++) {
+        layer_weight_shape(layers, i, &n_curr, &n_prev);
+
+        W = mat_view(buffer + offset, n_curr, n_prev);
+        offset += n_curr * n_prev;
+        b = mat_view(buffer + offset, n_curr, 1);
+        offset += n_curr;
+
+        switch (buffer_type) {
+            case PARAMS:
+                layers[i].W = W;
+                layers[i].b = b;
+                break;
+            case GRADS:
+                layers[i].dW = W;
+                layers[i].db = b;
+                break;
+            case ADAM_V:
+                layers[i].V_dW = W;
+                layers[i].V_db = b;
+                break;
+            case ADAM_S:
+                layers[i].S_dW = W;
+                layers[i].S_db = b;
+                break;
+        }
+    }
+}
+
+double* alloc_param_buffer(nn_model *model) {
+    // Zeroed buffer of num_params values
+    // With NUMA placement, the rows of every layer are first touched by the
+    // threads that work on them in mat_mul
+
+    nn_layer *layers = model->layers;
+    size_t offset = 0;
+    unsigned int i;
+
+    if (!numa.enabled) {
+        double *buffer = calloc(model->num_params, sizeof(double));
+        check_alloc(buffer);
+        return buffer;
+    }
+
+    double *buffer = malloc(model->num_params * sizeof(double));
+    check_alloc(buffer);
+    for (i = 1; i < model->num_layers; i++) {
+        size_t n_curr, n_prev;
+        layer_weight_shape(layers, i, &n_curr, &n_prev);
+        numa_touch_rows(buffer + offset, n_curr, n_prev);
+        offset += n_curr * n_prev;
+        numa_touch_rows(buffer + offset, n_curr, 1);
+        offset += n_curr;
+    }
+    return buffer;
+}
+
+nn_model* alloc_model_layers(size_t num_layers, nn_layer_spec *specs) {
+    // Create a model with all parameters, gradients and moments set to zero
+
+    nn_model *model = malloc(sizeof(nn_model));
+
+    check_alloc(model);
+    model->num_layers = num_layers;
+    model->sparse_backprop = false;
+    model->lazy_backprop = false;
+    model->lazy = NULL;
+    model->validation = NULL;
+    model->publisher = NULL;
+
+    nn_layer *layers = calloc(num_layers, sizeof(nn_layer));
+    check_alloc(layers);
+    model->layers = layers;
+    unsigned int i;
+
+    for (i = 0; i < num_layers; i++) {
+        set_layer_shape(&layers[i], (i > 0) ? &layers[i - 1] : NULL, specs[i]);
+    }
+
+    size_t num_params = count_params(model);
+    model->num_params = num_params;
+    model->params = alloc_param_buffer(model);
+    model->grads = alloc_param_buffer(model);
+    model->V = alloc_param_buffer(model);
+    model->S = alloc_param_buffer(model);
+
+    create_param_views(model, PARAMS, model->params);
+    create_param_views(model, GRADS, model->grads);
+    create_param_views(model, ADAM_V, model->V);
+    create_param_views(model, ADAM_S, model->S);
+
+    return model;
+}
+
+nn_model* alloc_model(size_t num_layers, size_t *layer_sizes, enum func *layer_activations) {
+    // Create a fully connected model with all parameters, gradients and moments set to zero
+
+    nn_layer_spec *specs = dense_specs(num_layers, layer_sizes, layer_activations);
+    nn_model *model = alloc_model_layers(num_layers, specs);
+    free(specs);
+    return model;
+}
+
+nn_model* alloc_model_like(nn_model *model) {
+    // Create a model with the layers of model and all parameters, gradients and moments set to zero
+
+    nn_layer_spec *specs = malloc(model->num_layers * sizeof(nn_layer_spec));
+    check_alloc(specs);
+    unsigned int i;
+
+    for (i = 0; i < model->num_layers; i++) {
+        specs[i] = layer_spec(&model->layers[i]);
+    }
+    nn_model *copy = alloc_model_layers(model->num_layers, specs);
+    free(specs);
+    return copy;
+}
+
+enum init_scheme {
+    INIT_UNIFORM,
+    INIT_XAVIER,
+    INIT_HE
+};
+
+void init_model(nn_model *model, enum init_scheme scheme) {
+    // Set the parameters of model to random values (see random.c), the same for any
+    // number of threads:
+    //   INIT_UNIFORM: weights and biases uniform on [0, 1), the default of create_model
+    //   INIT_XAVIER: weights uniform on +-sqrt(6 / (fan_in + fan_out)) and zero biases,
+    //     for sigmoid and softmax layers
+    //   INIT_HE: weights uniform on +-sqrt(6 / fan_in) and zero biases, for relu layers
+    // The fans of a convolution count every position of its kernel
+
+    nn_layer *layers = model->layers;
+    unsigned int i;
+
+    if (scheme == INIT_UNIFORM) {
+        rand_fill(model->params, model->num_params, 0.0, 1.0);
+        return;
+    }
+
+    for (i = 1; i < model->num_layers; i++) {
+        matrix *W = layers[i].W;
+        if (W->rows * W->cols == 0) {
+            continue;
+        }
+
+        double fan_in = W->cols;
+        double fan_out = W->rows;
+        if (layers[i].type == CONV) {
+            fan_out *= layers[i].kernel_size * layers[i].kernel_size;
+        }
+        double limit = (scheme == INIT_HE) ? sqrt(6.0 / fan_in) : sqrt(6.0 / (fan_in + fan_out));
+
+        rand_fill(W->data, W->rows * W->cols, -limit, limit);
+        memset(layers[i].b->data, 0, layers[i].b->rows * sizeof(double));
+    }
+}
+
+nn_model* create_model_layers(size_t num_layers, nn_layer_spec *specs) {
+    // Create a model with the layers in specs, e.g.
+    //   {input_layer(1, 28, 28), conv_layer(8, 5, RELU), maxpool_layer(2), dense_layer(10, SOFTMAX)}
+
+    nn_model *model = alloc_model_layers(num_layers, specs);
+    init_model(model, INIT_UNIFORM);
+    return model;
+}
+
+nn_model* create_model(size_t num_layers, size_t *layer_sizes, enum func *layer_activations) {
+    nn_layer_spec *specs = dense_specs(num_layers, layer_sizes, layer_activations);
+    nn_model *model = create_model_layers(num_layers, specs);
+    free(specs);
+    return model;
+}
+
+// A layer is saved as its number of nodes and an int with its activation, and its type
+// shifted by 8 bits. Layers other than flat dense ones also have LAYER_SHAPE_FLAG set
+// and are followed by their channels, height, width and kernel size
+#define LAYER_SHAPE_FLAG 0x10000
+
+void save_model(nn_model *model, char *filename) {
+    // Write the model layout followed by the flat parameter array to a binary file
+
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        printf("Error opening file %s\n", filename);
+        exit(0);
+    }
+
+    size_t num_layers = model->num_layers;
+    unsigned int i;
+    int activation;
+
+    fwrite(&num_layers, sizeof(size_t), 1, file);
+    for (i = 0; i < num_layers; i++) {
+        nn_layer *layer = &model->layers[i];
+        bool shaped = (layer->type != DENSE) || (layer->channels != layer->num_nodes);
+        activation = layer->activation | (layer->type << 8) | (shaped ? LAYER_SHAPE_FLAG : 0);
+        fwrite(&layer->num_nodes, sizeof(size_t), 1, file);
+        fwrite(&activation, sizeof(int), 1, file);
+        if (shaped) {
+            size_t shape[] = {layer->channels, layer->height, layer->width, layer->kernel_size};
+            fwrite(shape, sizeof(size_t), 4, file);
+        }
+    }
+
+    if (fwrite(model->params, sizeof(double), model->num_params, file) != model->num_params) {
+        printf("Error writing model to file %s\n", filename);
+        exit(0);
+    }
+    fclose(file);
+}
+
+nn_model* load_model(char *filename) {
+    // Read a model written by save_model
+
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        printf("Error opening file %s\n", filename);
+        exit(0);
+    }
+
+    size_t num_layers;
+    unsigned int i;
+    int activation;
+
+    if (fread(&num_layers, sizeof(size_t), 1, file) != 1 || num_layers < 2) {
+        printf("Error: Invalid model file %s\n", filename);
+        exit(0);
+    }
+
+    nn_layer_spec *specs = malloc(num_layers * sizeof(nn_layer_spec));
+    check_alloc(specs);
+
+    for (i = 0; i < num_layers; i++) {
+        size_t num_nodes;
+        if (fread(&num_nodes, sizeof(size_t), 1, file) != 1 ||
+            fread(&activation, sizeof(int), 1, file) != 1) {
+            printf("Error: Invalid model file %s\n", filename);
+            exit(0);
+        }
+        if ((activation & 0xff) >= NUM_FUNCS || ((activation >> 8) & 0xff) >= NUM_LAYER_TYPES) {
+            printf("Error: Invalid model file %s\n", filename);
+            exit(0);
+        }
+        specs[i] = dense_layer(num_nodes, activation & 0xff);
+        specs[i].type = (activation >> 8) & 0xff;
+
+        size_t shape[4];
+        if (activation & LAYER_SHAPE_FLAG) {
+            if (fread(shape, sizeof(size_t), 4, file) != 4) {
+                printf("Error: Invalid model file %s\n", filename);
+                exit(0);
+            }
+            specs[i].channels = shape[0];
+            specs[i].height = shape[1];
+            specs[i].width = shape[2];
+            specs[i].kernel_size = shape[3];
+        }
+    }
+
+    nn_model *model = alloc_model_layers(num_layers, specs);
+    for (i = 0; i < num_layers; i++) {
+        if (model->layers[i].num_nodes != specs[i].num_nodes) {
+            printf("Error: Invalid model file %s\n", filename);
+            exit(0);
+        }
+    }
+    if (fread(model->params, sizeof(double), model->num_params, file) != model->num_params) {
+        printf("Error: Invalid model file %s\n", filename);
+        exit(0);
+    }
+
+    free(specs);
+    fclose(file);
+    return model;
+}
+
+void mini_batch(matrix *mini_X, matrix *mini_Y, matrix *X, matrix *Y, int *indices) {
+    // Put random subset of X and Y into mini_X and mini_Y respectively 
+
+    size_t rows_X = X->rows;
+    size_t rows_Y = Y->rows;
+    size_t cols = mini_X->cols;
+    size_t n = X->cols; 
+    shuffle_array(indices, n);
+    unsigned int j; 
+
+    #pragma omp parallel for if (rows_X * cols >= PARALLEL_MIN_WORK)
+    for (j = 0; j < cols; j++) {
+        unsigned int index = indices[j];
+        unsigned int i_X, i_Y;
+        for (i_X = 0; i_X < rows_X; i_X++) {
+            mat_set(mini_X, i_X, j, mat_get(X, i_X, index));
+        }
+        for (i_Y = 0; i_Y < rows_Y; i_Y++) {
+            mat_set(mini_Y, i_Y, j, mat_get(Y, i_Y, index));
+        }
+    }
+}
+
+void conv_forward(nn_layer *layer, nn_layer *prev, matrix *Z, matrix *A_prev, matrix *cols) {
+    // Z = W * im2col(A_prev) + b, every filter of a conv layer applied to the previous layer's images
+    // With cols (during training) the patches of all output positions are kept in it for back_prop,
+    // otherwise they are built CONV_BLOCK_SIZE entries at a time
+
+    size_t m = Z->cols;
+    size_t positions = layer->height * layer->width;
+    size_t patch = layer->W->cols;
+    size_t filters = layer->channels;
+    unsigned int p, c;
+
+    // Row c of Z_conv is channel c of every output image
+    matrix *Z_conv = mat_view(Z->data, filters, positions * m);
+
+    if (cols != NULL) {
+        im2col(cols, A_prev, prev->channels, prev->height, prev->width, layer->kernel_size, 0, positions);
+        mat_mul(Z_conv, layer->W, cols);
+    } else {
+        size_t block = CONV_BLOCK_SIZE / (patch * m);
+        block = (block < 1) ? 1 : (block > positions) ? positions : block;
+        matrix *block_cols = zero_mat(patch, block * m);
+        matrix *block_Z = zero_mat(filters, block * m);
+
+        for (p = 0; p < positions; p += block) {
+            size_t count = (positions - p < block) ? positions - p : block;
+            block_cols->cols = count * m;
+            block_Z->cols = count * m;
+            im2col(block_cols, A_prev, prev->channels, prev->height, prev->width, layer->kernel_size, p, count);
+            mat_mul(block_Z, layer->W, block_cols);
+            for (c = 0; c < filters; c++) {
+                memcpy(Z->data + (c * positions + p) * m, block_Z->data + c * count * m, count * m * sizeof(double));
+            }
+        }
+
+        free_mat(block_cols);
+        free_mat(block_Z);
+    }
+
+    mat_vec_add(Z_conv, Z_conv, layer->b);
+    free_mat(Z_conv);
+}
+
+void layer_linear(nn_layer *layer, nn_layer *prev, matrix *Z, matrix *A_prev, matrix *cols) {
+    // Z = W * A_prev + b of a dense layer, or the convolution of A_prev for a conv layer
+
+    if (layer->type == CONV) {
+        conv_forward(layer, prev, Z, A_prev, cols);
+    } else {
+        mat_mul(Z, layer->W, A_prev);
+        mat_vec_add(Z, Z, layer->b);
+    }
+}
+
+void apply_activation(matrix *A, matrix *Z, enum func activation) {
+    // A = activation(Z), or a copy of Z for a linear (INPUT) layer
+    // Shared by the predict loops of the sparse, int8 and half precision models
+
+    if (activation == SIGMOID) {
+        sigmoid(A, Z);
+    } else if (activation == SOFTMAX) {
+        softmax(A, Z);
+    } else if (activation == RELU) {
+        relu(A, Z);
+    } else {
+        mat_copy(A, Z);
+    }
+}
+
+void layer_forward_cached(nn_layer *layer, nn_layer *prev, matrix *Z, matrix *A, matrix *A_prev, matrix *cols, size_t *argmax) {
+    // layer_forward, keeping the patches of a conv layer in cols and the positions of the
+    // maxima of a max pool layer in argmax for back_prop, unless they are NULL
+
+    if (layer->type == MAXPOOL) {
+        maxpool(Z, argmax, A_prev, prev->channels, prev->height, prev->width, layer->kernel_size);
+        mat_copy(A, Z);
+        return;
+    }
+
+    layer_linear(layer, prev, Z, A_prev, cols);
+
+    if (layer->activation == SIGMOID) {
+        sigmoid(A, Z);
+    } else if (layer->activation == SOFTMAX) {
+        softmax(A, Z);
+    } else if (layer->activation == RELU) {
+        relu(A, Z);
+    }
+}
+
+void layer_forward(nn_layer *layer, nn_layer *prev, matrix *Z, matrix *A, matrix *A_prev) {
+    // Z = W * A_prev + b (or the convolution or pooling of A_prev) and A = activation(Z) for one layer
+    // Only reads the layer, so it is safe to call from several threads at once
+
+    layer_forward_cached(layer, prev, Z, A, A_prev, NULL, NULL);
+}
+
+void forward_prop(nn_model *model) {
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    unsigned int i;
+
+    for (i = 1; i < num_layers; i++) {
+        perf_set_layer(i);
+        layer_forward_cached(&layers[i], &layers[i - 1], layers[i].Z, layers[i].A, layers[i - 1].A,
+            layers[i].cols, layers[i].argmax);
+    }
+    perf_set_layer(-1);
+}
+
+nn_context* create_context(nn_model *model, size_t max_inputs) {
+    // Create the activation buffers for evaluating model on up to max_inputs inputs per call
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    size_t offset = 0;
+    unsigned int i;
+
+    nn_context *ctx = malloc(sizeof(nn_context));
+    check_alloc(ctx);
+    ctx->num_layers = num_layers;
+    ctx->max_inputs = max_inputs;
+    ctx->A = calloc(num_layers, sizeof(matrix*));
+    ctx->Z = calloc(num_layers, sizeof(matrix*));
+    check_alloc(ctx->A);
+    check_alloc(ctx->Z);
+
+    size_t length = 0;
+    for (i = 1; i < num_layers; i++) {
+        length += 2 * layers[i].num_nodes * max_inputs;
+    }
+    ctx->buffer = calloc(length, sizeof(double));
+    check_alloc(ctx->buffer);
+
+    for (i = 1; i < num_layers; i++) {
+        ctx->A[i] = mat_view(ctx->buffer + offset, layers[i].num_nodes, max_inputs);
+        offset += layers[i].num_nodes * max_inputs;
+        ctx->Z[i] = mat_view(ctx->buffer + offset, layers[i].num_nodes, max_inputs);
+        offset += layers[i].num_nodes * max_inputs;
+    }
+
+    return ctx;
+}
+
+void free_context(nn_context *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+
+    unsigned int i;
+    for (i = 1; i < ctx->num_layers; i++) {
+        free_mat(ctx->A[i]);
+        free_mat(ctx->Z[i]);
+    }
+
+    free(ctx->A);
+    free(ctx->Z);
+    free(ctx->buffer);
+    free(ctx);
+}
+
+void model_predict_ctx(nn_model *model, nn_context *ctx, matrix *result, matrix *input, size_t num_inputs) {
+    // Evaluate a trained model on input, using only the buffers of ctx for intermediate values
+    // The model is not modified, so any number of threads can share it with one context each
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    size_t n_out = layers[num_layers - 1].num_nodes;
+    size_t n_in = layers[0].num_nodes;
+    unsigned int i;
+
+    if ((result->cols != num_inputs) || (result->rows != n_out)) {
+        printf("Error: Invalid result vector for model_predict\n\n");
+        exit(0);
+    } else if ((input->cols != num_inputs) || (input->rows != n_in)) {
+        printf("Error: Invalid input vector for model_predict\n\n");
+        exit(0);
+    } else if ((ctx->num_layers != num_layers) || (num_inputs > ctx->max_inputs)) {
+        printf("Error: Invalid context for model_predict\n\n");
+        exit(0);
+    }
+
+    // The buffers hold max_inputs columns, only the first num_inputs are used
+    for (i = 1; i < num_layers; i++) {
+        ctx->A[i]->cols = num_inputs;
+        ctx->Z[i]->cols = num_inputs;
+    }
+
+    matrix *A_prev = input;
+    for (i = 1; i < num_layers; i++) {
+        layer_forward(&layers[i], &layers[i - 1], ctx->Z[i], ctx->A[i], A_prev);
+        A_prev = ctx->A[i];
+    }
+
+    mat_copy(result, A_prev);
+}
+
+// Inputs evaluated at a time by model_predict, model_classify, model_top_k and
+// model_count_correct, which bounds the activations of a data set with conv layers
+#define EVAL_CHUNK_SIZE 1024
+
+size_t eval_chunk_size(size_t num_inputs) {
+    return (num_inputs < EVAL_CHUNK_SIZE) ? num_inputs : EVAL_CHUNK_SIZE;
+}
+
+matrix* eval_chunk(matrix *buffer, matrix *mat, size_t first, size_t count) {
+    // Columns first to first + count - 1 of mat, copied into buffer, or mat itself if it is one
+    // chunk (or there is no buffer, leaving the dimension checks to the caller)
+
+    if (count == mat->cols || buffer == NULL) {
+        return mat;
+    }
+    buffer->cols = count;
+    mat_get_cols(buffer, mat, first);
+    return buffer;
+}
+
+void model_predict(nn_model *model, matrix *result, matrix *input, size_t num_inputs) {
+    // Evaluate a trained model on input
+    // Callers that predict repeatedly should keep a context and call model_predict_ctx
+
+    if ((input->cols != num_inputs) || (result->cols != num_inputs)) {
+        printf("Error: Invalid input or result vector for model_predict\n\n");
+        exit(0);
+    }
+
+    size_t chunk = eval_chunk_size(num_inputs);
+    nn_context *ctx = create_context(model, chunk);
+    size_t first;
+
+    if (chunk == num_inputs) {
+        model_predict_ctx(model, ctx, result, input, num_inputs);
+        free_context(ctx);
+        return;
+    }
+
+    matrix *X = zero_mat(input->rows, chunk);
+    matrix *Y_hat = zero_mat(result->rows, chunk);
+    for (first = 0; first < num_inputs; first += chunk) {
+        size_t count = (num_inputs - first < chunk) ? num_inputs - first : chunk;
+        Y_hat->cols = count;
+        model_predict_ctx(model, ctx, Y_hat, eval_chunk(X, input, first, count), count);
+        mat_set_cols(result, Y_hat, first);
+    }
+
+    free_mat(X);
+    free_mat(Y_hat);
+    free_context(ctx);
+}
+
+void free_model(nn_model *model);
+
+// Read-only copies of a model's weights, one on every NUMA node, so that
+// inference threads on any socket read their weights from local memory
+typedef struct {
+    size_t num_replicas;
+    nn_model **models;
+} nn_replicas;
+
+nn_model* create_replica(nn_model *model, double *params) {
+    // Model with the layout of model that reads its weights from params
+    // Only for inference, it has no gradients or Adam moments
+
+    nn_model *replica = calloc(1, sizeof(nn_model));
+    check_alloc(replica);
+    replica->num_layers = model->num_layers;
+    replica->num_params = model->num_params;
+    replica->params = params;
+
+    replica->layers = calloc(model->num_layers, sizeof(nn_layer));
+    check_alloc(replica->layers);
+    unsigned int i;
+    for (i = 0; i < model->num_layers; i++) {
+        set_layer_shape(&replica->layers[i], (i > 0) ? &replica->layers[i - 1] : NULL, layer_spec(&model->layers[i]));
+    }
+    create_param_views(replica, PARAMS, params);
+    return replica;
+}
+
+nn_replicas* create_replicas(nn_model *model) {
+    // Copy the weights of model to every NUMA node
+    // The replicas do not follow later changes to model
+
+    nn_replicas *replicas = malloc(sizeof(nn_replicas));
+    check_alloc(replicas);
+    replicas->num_replicas = numa.num_nodes;
+    replicas->models = malloc(numa.num_nodes * sizeof(nn_model*));
+    check_alloc(replicas->models);
+
+    unsigned int node;
+    for (node = 0; node < replicas->num_replicas; node++) {
+        double *params = numa_copy_to_node(model->params, model->num_params, node);
+        replicas->models[node] = create_replica(model, params);
+    }
+    return replicas;
+}
+
+nn_model* local_replica(nn_replicas *replicas) {
+    // Replica on the node the calling thread runs on
+    // Threads should be pinned to one node for this to stay local
+
+    return replicas->models[numa_current_node()];
+}
+
+void free_replicas(nn_replicas *replicas) {
+    unsigned int i;
+
+    for (i = 0; i < replicas->num_replicas; i++) {
+        // The weights were mapped by numa_copy_to_node, not allocated by free_model's malloc
+        numa_free_copy(replicas->models[i]->params, replicas->models[i]->num_params);
+        replicas->models[i]->params = NULL;
+        free_model(replicas->models[i]);
+    }
+    free(replicas->models);
+    free(replicas);
+}
+
+matrix* model_scores_ctx(nn_model *model, nn_context *ctx, matrix *input, size_t num_inputs) {
+    // Evaluate model on input up to the output layer's scores, whose column argmax is the predicted class
+    // Softmax and sigmoid preserve the order of the logits, so for those the logits are returned
+    // without applying the activation. The result is a matrix of ctx
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    nn_layer *last = &layers[num_layers - 1];
+    unsigned int i;
+
+    if ((input->cols != num_inputs) || (input->rows != layers[0].num_nodes)) {
+        printf("Error: Invalid input vector for model_classify\n\n");
+        exit(0);
+    } else if ((ctx->num_layers != num_layers) || (num_inputs > ctx->max_inputs)) {
+        printf("Error: Invalid context for model_classify\n\n");
+        exit(0);
+    }
+
+    for (i = 1; i < num_layers; i++) {
+        ctx->A[i]->cols = num_inputs;
+        ctx->Z[i]->cols = num_inputs;
+    }
+
+    matrix *A_prev = input;
+    for (i = 1; i < num_layers - 1; i++) {
+        layer_forward(&layers[i], &layers[i - 1], ctx->Z[i], ctx->A[i], A_prev);
+        A_prev = ctx->A[i];
+    }
+
+    if (last->type != MAXPOOL && (last->activation == SOFTMAX || last->activation == SIGMOID)) {
+        layer_linear(last, &layers[num_layers - 2], ctx->Z[num_layers - 1], A_prev, NULL);
+        return ctx->Z[num_layers - 1];
+    }
+    layer_forward(last, &layers[num_layers - 2], ctx->Z[num_layers - 1], ctx->A[num_layers - 1], A_prev);
+    return ctx->A[num_layers - 1];
+}
+
+void model_classify_ctx(nn_model *model, nn_context *ctx, size_t *labels, matrix *input, size_t num_inputs) {
+    // Predicted class of every input, without computing the output probabilities
+
+    mat_col_argmax(labels, model_scores_ctx(model, ctx, input, num_inputs));
+}
+
+void model_top_k(nn_model *model, size_t *labels, size_t k, matrix *input, size_t num_inputs) {
+    // The k most likely classes of every input, most likely first
+    // labels[j * k] to labels[j * k + k - 1] belong to input j
+
+    if (input->cols != num_inputs) {
+        printf("Error: Invalid input vector for model_top_k\n\n");
+        exit(0);
+    }
+
+    size_t chunk = eval_chunk_size(num_inputs);
+    nn_context *ctx = create_context(model, chunk);
+    matrix *X = (chunk < num_inputs) ? zero_mat(input->rows, chunk) : NULL;
+    size_t first;
+
+    for (first = 0; first < num_inputs; first += chunk) {
+        size_t count = (num_inputs - first < chunk) ? num_inputs - first : chunk;
+        matrix *scores = model_scores_ctx(model, ctx, eval_chunk(X, input, first, count), count);
+        if (k == 1) {
+            mat_col_argmax(labels + first, scores);
+        } else {
+            mat_col_top_k(labels + first * k, scores, k);
+        }
+    }
+
+    free_mat(X);
+    free_context(ctx);
+}
+
+void model_classify(nn_model *model, size_t *labels, matrix *input, size_t num_inputs) {
+    // Predicted class of every input, without computing the output probabilities
+
+    model_top_k(model, labels, 1, input, num_inputs);
+}
+
+size_t model_count_correct(nn_model *model, matrix *X, matrix *Y) {
+    // Number of inputs in X whose predicted class is the one-hot label in Y
+
+    size_t num_inputs = X->cols;
+    size_t chunk = eval_chunk_size(num_inputs);
+    nn_context *ctx = create_context(model, chunk);
+    matrix *X_chunk = (chunk < num_inputs) ? zero_mat(X->rows, chunk) : NULL;
+    matrix *Y_chunk = (chunk < num_inputs) ? zero_mat(Y->rows, chunk) : NULL;
+    size_t corrects = 0;
+    size_t first;
+
+    for (first = 0; first < num_inputs; first += chunk) {
+        size_t count = (num_inputs - first < chunk) ? num_inputs - first : chunk;
+        matrix *scores = model_scores_ctx(model, ctx, eval_chunk(X_chunk, X, first, count), count);
+        corrects += mat_count_argmax_equal(scores, eval_chunk(Y_chunk, Y, first, count));
+    }
+
+    free_mat(X_chunk);
+    free_mat(Y_chunk);
+    free_context(ctx);
+    return corrects;
+}
+
+void back_prop_lazy(nn_model *model, matrix *Y) {
+    // back_prop recorded in model->lazy and run with fused passes
+    // Gives exactly the same gradients as the dense back_prop
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    int last_i = num_layers - 1;
+    size_t m = Y->cols;
+    unsigned int i;
+
+    if (!is_dense_model(model)) {
+        printf("Error: lazy_backprop only supports fully connected models\n\n");
+        exit(0);
+    }
+
+    if (model->lazy == NULL) {
+        model->lazy = create_lazy_graph();
+    }
+    lazy_graph *graph = model->lazy;
 
-nn_model* create_model(size_t num_layers, size_t *layer_sizes, enum func *layer_activations) {
-    nn_model *model = malloc(sizeof(nn_model));
+    lazy_sub(graph, layers[last_i].dZ, layers[last_i].A, Y);
 
-    check_alloc(model);
-    model->num_layers = num_layers;
+    for (i = last_i; i > 0; i--) {
+        if (i != last_i) {
+            lazy_mat_mul_trans(graph, layers[i].dA, layers[i + 1].W, layers[i + 1].dZ, true, false);
 
-    nn_layer *layers = calloc(num_layers, sizeof(nn_layer));
-    check_alloc(layers);
-    model->layers = layers;
-    unsigned int i;
+            if (layers[i].activation == SIGMOID) {
+                lazy_dsigmoid_mul(graph, layers[i].dZ, layers[i].dA, layers[i].A);
+            } else if (layers[i].activation == RELU) {
+                lazy_drelu_mul(graph, layers[i].dZ, layers[i].dA, layers[i].Z);
+            } else {
+                lazy_elem_mul(graph, layers[i].dZ, layers[i].dA, layers[i].dZ);
+            }
+        }
 
-    // Initalize weights and layer sizes
-    layers[0].num_nodes = layer_sizes[0];
-    size_t n_curr, n_prev;
-    for (i = 1; i < num_layers; i++) {
-        n_curr = layer_sizes[i];
-        n_prev = layer_sizes[i - 1];
-        layers[i].num_nodes = n_curr;
-
-        layers[i].W = rand_mat(n_curr, n_prev);
-        layers[i].dW = zero_mat(n_curr, n_prev);
-        layers[i].S_dW = zero_mat(n_curr, n_prev);
-        layers[i].V_dW = zero_mat(n_curr, n_prev);
-        
-        layers[i].b = rand_mat(n_curr, 1);
-        layers[i].db = zero_mat(n_curr, 1);
-        layers[i].S_db = zero_mat(n_curr, 1);
-        layers[i].V_db = zero_mat(n_curr, 1);
-
-        layers[i].activation = layer_activations[i];
-    }
-    
-    return model;
+        lazy_mat_mul_trans(graph, layers[i].dW, layers[i].dZ, layers[i - 1].A, false, true);
+        lazy_scalar_mul(graph, layers[i].dW, layers[i].dW, 1.0 / m);
+
+        lazy_sum_rows(graph, layers[i].db, layers[i].dZ);
+        lazy_scalar_mul(graph, layers[i].db, layers[i].db, 1.0 / m);
+    }
+
+    lazy_eval(graph);
 }
 
-void mini_batch(matrix *mini_X, matrix *mini_Y, matrix *X, matrix *Y, int *indices) {
-    // Put random subset of X and Y into mini_X and mini_Y respectively 
+void layer_backward_input(nn_model *model, unsigned int i) {
+    // dA of layer i - 1 from dZ of layer i
 
-    size_t rows_X = X->rows;
-    size_t rows_Y = Y->rows;
-    size_t cols = mini_X->cols;
-    size_t n = X->cols; 
-    shuffle_array(indices, n);
-    unsigned int index, i_X, i_Y, j; 
+    nn_layer *layer = &model->layers[i];
+    nn_layer *prev = &model->layers[i - 1];
 
-    for (j = 0; j < cols; j++) {
-        index = indices[j];
-        for (i_X = 0; i_X < rows_X; i_X++) {
-            mat_set(mini_X, i_X, j, mat_get(X, i_X, index));
-        }
-        for (i_Y = 0; i_Y < rows_Y; i_Y++) {
-            mat_set(mini_Y, i_Y, j, mat_get(Y, i_Y, index));
+    if (layer->type == MAXPOOL) {
+        dmaxpool(prev->dA, layer->dZ, layer->argmax);
+    } else if (layer->type == CONV) {
+        // dW already used the patches, so their gradient takes their place
+        matrix *dZ_conv = mat_view(layer->dZ->data, layer->channels, layer->cols->cols);
+        if (model->sparse_backprop) {
+            mat_mul_trans_sparse(layer->cols, layer->W, dZ_conv, true, false);
+        } else {
+            mat_mul_trans(layer->cols, layer->W, dZ_conv, true, false);
         }
+        col2im(prev->dA, layer->cols, prev->channels, prev->height, prev->width, layer->kernel_size);
+        free_mat(dZ_conv);
+    } else if (model->sparse_backprop) {
+        mat_mul_trans_sparse(prev->dA, layer->W, layer->dZ, true, false);
+    } else {
+        mat_mul_trans(prev->dA, layer->W, layer->dZ, true, false);
     }
 }
 
-void forward_prop(nn_model *model) {
+void layer_backward_params(nn_model *model, unsigned int i, size_t m) {
+    // dW and db of layer i from its dZ, averaged over the m samples
+
+    nn_layer *layer = &model->layers[i];
+    matrix *dZ = layer->dZ;
+    matrix *A_prev = model->layers[i - 1].A;
+
+    // Every output position of a conv layer adds to its filters' gradients like a
+    // sample of a dense layer, with the patches as inputs
+    if (layer->type == CONV) {
+        dZ = mat_view(layer->dZ->data, layer->channels, layer->cols->cols);
+        A_prev = layer->cols;
+    }
+
+    if (model->sparse_backprop) {
+        mat_mul_trans_sparse(layer->dW, dZ, A_prev, false, true);
+    } else if (layer->type == CONV) {
+        mat_mul_nt(layer->dW, dZ, A_prev);
+    } else {
+        mat_mul_trans(layer->dW, dZ, A_prev, false, true);
+    }
+    mat_scalar_mul(layer->dW, layer->dW, 1.0 / m);
+
+    mat_sum_rows(layer->db, dZ);
+    mat_scalar_mul(layer->db, layer->db, 1.0 / m);
+
+    if (dZ != layer->dZ) {
+        free_mat(dZ);
+    }
+}
+
+void back_prop(nn_model *model, matrix *Y) {
+    // Compute dW and db of every layer for the batch in layers[0].A with labels Y
+    // Expects forward_prop to have been run on the batch
+    // Models with conv or max pool layers need the buffers of create_train_buffers
+
     size_t num_layers = model->num_layers;
     nn_layer *layers = model->layers;
+    int last_i = num_layers - 1;
+    size_t m = Y->cols;
     unsigned int i;
 
+    if (model->lazy_backprop) {
+        back_prop_lazy(model, Y);
+        return;
+    }
+
     for (i = 1; i < num_layers; i++) {
-        mat_mul(layers[i].Z, layers[i].W, layers[i - 1].A);
-        mat_vec_add(layers[i].Z, layers[i].Z, layers[i].b);
+        if ((layers[i].type == CONV && layers[i].cols == NULL) || (layers[i].type == MAXPOOL && layers[i].argmax == NULL)) {
+            printf("Error: back_prop needs the buffers of create_train_buffers\n\n");
+            exit(0);
+        }
+    }
+
+    // Compute dZ for last layer
+    perf_set_layer(last_i);
+    mat_sub(layers[last_i].dZ, layers[last_i].A, Y);
+
+    for (i = last_i; i > 0; i--) {
+        perf_set_layer(i);
+        if (i != last_i) {
+            layer_backward_input(model, i + 1);
+
+            if (layers[i].type == MAXPOOL) {
+                mat_copy(layers[i].dZ, layers[i].dA);
+            } else if (layers[i].activation == SIGMOID) {
+                dsigmoid_mul(layers[i].dZ, layers[i].dA, layers[i].A);
+            } else if (layers[i].activation == RELU) {
+                drelu_mul(layers[i].dZ, layers[i].dA, layers[i].Z);
+            } else {
+                mat_elem_mul(layers[i].dZ, layers[i].dA, layers[i].dZ);
+            }
+        }
 
-        if (layers[i].activation == SIGMOID) {
-            sigmoid(layers[i].A, layers[i].Z);
-        } else if (layers[i].activation == SOFTMAX) {
-            softmax(layers[i].A, layers[i].Z);
-        } else if (layers[i].activation == RELU) {
-            relu(layers[i].A, layers[i].Z);
+        if (layers[i].type != MAXPOOL) {
+            layer_backward_params(model, i, m);
         }
     }
+    perf_set_layer(-1);
 }
 
-void model_predict(nn_model *model, matrix *result, matrix *input, size_t num_inputs) {
-    // Evaluate a trained model on input
+void grad_descent_adam(nn_model *model, int epoch, double lr, double beta_1, double beta_2, double epsilon) {
+    // Adam update of every parameter in the model as one sweep over the flat arrays
+
+    size_t length = model->num_params;
+    double *data_v = model->V;
+    double *data_s = model->S;
+    double *data_d = model->grads;
+    double *data_p = model->params;
+    unsigned int j;
+    epoch++;
+
+    double corr_1 = (1 - pow(beta_1, (double) epoch));
+    double corr_2 = (1 - pow(beta_2, (double) epoch));
+
+    #pragma omp parallel for 
+    for (j = 0; j < length; j++) {
+        data_v[j] = beta_1 * data_v[j] + (1 - beta_1) * data_d[j];
+        data_s[j] = beta_2 * data_s[j] + (1 - beta_2) * data_d[j] * data_d[j];
+        double v_corr = data_v[j] / corr_1;
+        double s_corr = data_s[j] / corr_2;
+        data_p[j] -= lr * v_corr / (sqrt(s_corr) + epsilon);
+    }   
+}
+
+// Evaluation of a held-out set every interval training steps, on a background thread
+//
+// At every interval steps train_model copies the parameters into a pending
+// snapshot and carries on. The evaluator thread evaluates the latest
+// snapshot, so snapshots taken while it is busy replace each other instead of
+// stalling training. The parameters with the best validation accuracy (lower
+// loss on ties) are kept, and training stops early once patience evaluations
+// in a row did not improve on them. At the end of training the model is set
+// to the best parameters.
+typedef struct nn_validation {
+    matrix *X;
+    matrix *Y;
+    size_t interval;
+    size_t patience;
+
+    // Best evaluation so far
+    double best_loss;
+    size_t best_corrects;
+    size_t best_step;
+    double *best_params;
+    size_t num_evals;
+    size_t evals_since_best;
+    bool stop;
+
+    // Snapshot handed from the training loop to the evaluator, guarded by lock
+    nn_model *eval_model;
+    double *pending;
+    size_t pending_step;
+    bool has_pending;
+    bool busy;
+    bool quit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} nn_validation;
+
+void evaluate_snapshot(nn_validation *val, size_t step) {
+    // Loss and accuracy of eval_model on the validation set, updating the best parameters
+
+    nn_model *eval_model = val->eval_model;
+    size_t num_inputs = val->X->cols;
+    size_t chunk = eval_chunk_size(num_inputs);
+    double small_val = pow(10, -16.0);
+    double loss = 0.0;
+    size_t corrects = 0;
+    size_t first;
+    unsigned int i;
+
+    nn_context *ctx = create_context(eval_model, chunk);
+    matrix *Y_hat = zero_mat(val->Y->rows, chunk);
+    matrix *X_chunk = (chunk < num_inputs) ? zero_mat(val->X->rows, chunk) : NULL;
+    matrix *Y_chunk = (chunk < num_inputs) ? zero_mat(val->Y->rows, chunk) : NULL;
+
+    for (first = 0; first < num_inputs; first += chunk) {
+        size_t count = (num_inputs - first < chunk) ? num_inputs - first : chunk;
+        matrix *Y = eval_chunk(Y_chunk, val->Y, first, count);
+        Y_hat->cols = count;
+        model_predict_ctx(eval_model, ctx, Y_hat, eval_chunk(X_chunk, val->X, first, count), count);
+
+        for (i = 0; i < Y->rows * count; i++) {
+            loss -= Y->data[i] * log(Y_hat->data[i] + small_val);
+        }
+        corrects += mat_count_argmax_equal(Y_hat, Y);
+    }
+    loss /= (double) num_inputs;
+
+    free_mat(Y_hat);
+    free_mat(X_chunk);
+    free_mat(Y_chunk);
+    free_context(ctx);
+
+    printf("Validation at step %zu     Loss: %g     Accuracy: %g%%\n", step, loss, 100.0 * corrects / (double) num_inputs);
+
+    val->num_evals++;
+    if (val->num_evals == 1 || corrects > val->best_corrects || (corrects == val->best_corrects && loss < val->best_loss)) {
+        val->best_loss = loss;
+        val->best_corrects = corrects;
+        val->best_step = step;
+        val->evals_since_best = 0;
+        memcpy(val->best_params, eval_model->params, eval_model->num_params * sizeof(double));
+    } else {
+        val->evals_since_best++;
+    }
+}
+
+void* validation_worker(void *arg) {
+    nn_validation *val = arg;
+    size_t num_params = val->eval_model->num_params;
+
+    // Kernels run single threaded, to leave the cores to the training loop
+    omp_set_num_threads(1);
+
+    pthread_mutex_lock(&val->lock);
+    while (true) {
+        while (!val->has_pending && !val->quit) {
+            pthread_cond_wait(&val->cond, &val->lock);
+        }
+        if (!val->has_pending) {
+            break;
+        }
+
+        size_t step = val->pending_step;
+        memcpy(val->eval_model->params, val->pending, num_params * sizeof(double));
+        val->has_pending = false;
+        val->busy = true;
+        pthread_mutex_unlock(&val->lock);
+
+        evaluate_snapshot(val, step);
+
+        pthread_mutex_lock(&val->lock);
+        val->busy = false;
+        if (val->patience > 0 && val->evals_since_best >= val->patience) {
+            val->stop = true;
+        }
+        pthread_cond_broadcast(&val->cond);
+    }
+    pthread_mutex_unlock(&val->lock);
+    return NULL;
+}
+
+nn_validation* create_validation(nn_model *model, matrix *X, matrix *Y, size_t interval, size_t patience) {
+    // Evaluate model on X and Y every interval steps of train_model
+    // Training stops after patience evaluations without improvement (0 to never stop early)
 
     size_t num_layers = model->num_layers;
-    nn_layer *layers = model->layers;
-    size_t n_out = layers[num_layers - 1].num_nodes;
-    size_t n_in = layers[0].num_nodes;
-    if ((result->cols != num_inputs) || (result->rows != n_out)) {
-        printf("Error: Invalid result vector for model_predict\n\n");
+
+    if (interval == 0) {
+        printf("Error: Invalid interval for create_validation\n\n");
         exit(0);
-    } else if ((input->cols != num_inputs) || (input->rows != n_in)) {
-        printf("Error: Invalid input vector for model_predict\n\n");
+    } else if ((X->rows != model->layers[0].num_nodes) || (Y->rows != model->layers[num_layers - 1].num_nodes) || (X->cols != Y->cols)) {
+        printf("Error: Invalid validation data for create_validation\n\n");
         exit(0);
     }
 
-    layers[0].A = input;
-    for (int i = 1; i < num_layers; i++) {
-        // Initialize intermediate vectors 
-        layers[i].A = zero_mat(layers[i].num_nodes, num_inputs);
-        layers[i].Z = zero_mat(layers[i].num_nodes, num_inputs);
+    nn_validation *val = calloc(1, sizeof(nn_validation));
+    check_alloc(val);
+    val->X = X;
+    val->Y = Y;
+    val->interval = interval;
+    val->patience = patience;
+
+    val->eval_model = alloc_model_like(model);
+    val->pending = malloc(model->num_params * sizeof(double));
+    val->best_params = malloc(model->num_params * sizeof(double));
+    check_alloc(val->pending);
+    check_alloc(val->best_params);
+
+    pthread_mutex_init(&val->lock, NULL);
+    pthread_cond_init(&val->cond, NULL);
+    if (pthread_create(&val->thread, NULL, validation_worker, val) != 0) {
+        printf("Error: Could not start validation thread\n\n");
+        exit(0);
     }
-    
-    // Evaluate model on input using trained weights
-    forward_prop(model);
 
-    mat_copy(result, layers[num_layers - 1].A);
+    model->validation = val;
+    return val;
+}
 
-    layers[0].A = NULL;
-    for (int i = 1; i < num_layers; i++) {
-        free_mat(layers[i].A);
-        free_mat(layers[i].Z);
-        layers[i].A = NULL;
-        layers[i].Z = NULL;
+bool validation_step(nn_validation *val, nn_model *model, size_t step) {
+    // Hand a snapshot of the parameters after step to the evaluator, replacing an older
+    // snapshot it has not started on
+    // Returns true if training should stop early
+
+    pthread_mutex_lock(&val->lock);
+    memcpy(val->pending, model->params, model->num_params * sizeof(double));
+    val->pending_step = step;
+    val->has_pending = true;
+    pthread_cond_broadcast(&val->cond);
+    bool stop = val->stop;
+    pthread_mutex_unlock(&val->lock);
+    return stop;
+}
+
+void validation_wait(nn_validation *val) {
+    // Block until every snapshot handed to the evaluator has been evaluated
+
+    pthread_mutex_lock(&val->lock);
+    while (val->has_pending || val->busy) {
+        pthread_cond_wait(&val->cond, &val->lock);
     }
-    
+    pthread_mutex_unlock(&val->lock);
 }
 
-void grad_descent_adam(nn_layer *layers, int i, int epoch, double lr, double beta_1, double beta_2, double epsilon) {
+void free_validation(nn_validation *val) {
+    // Stop the evaluator thread and free the validation state
+    // The validation data is owned by the caller
 
-    size_t length_w = layers[i].dW->rows * layers[i].dW->cols;
-    size_t length_b = layers[i].db->rows;
-    unsigned int j;
-    epoch++;
+    if (val == NULL) {
+        return;
+    }
 
-    double *data_vw = layers[i].V_dW->data;
-    double *data_vb = layers[i].V_db->data;
-    double *data_sw = layers[i].S_dW->data;
-    double *data_sb = layers[i].S_db->data;
-    double *data_dw = layers[i].dW->data;
-    double *data_db = layers[i].db->data;
-    double *data_w = layers[i].W->data;
-    double *data_b = layers[i].b->data;
+    pthread_mutex_lock(&val->lock);
+    val->quit = true;
+    pthread_cond_broadcast(&val->cond);
+    pthread_mutex_unlock(&val->lock);
+    pthread_join(val->thread, NULL);
 
-    mat_lin_combo(layers[i].V_dW, layers[i].V_dW, layers[i].dW, beta_1, 1 - beta_1);
-    mat_lin_combo(layers[i].V_db, layers[i].V_db, layers[i].db, beta_1, 1 - beta_1);
+    pthread_mutex_destroy(&val->lock);
+    pthread_cond_destroy(&val->cond);
+    free_model(val->eval_model);
+    free(val->pending);
+    free(val->best_params);
+    free(val);
+}
 
-    double corr_1 = (1 - pow(beta_1, (double) epoch));
-    double corr_2 = (1 - pow(beta_2, (double) epoch));
+// Publication of weight snapshots to inference threads while training continues
+//
+// grad_descent_adam updates the weights in place, so readers cannot predict from
+// the training model itself. Every interval steps train_model copies the weights
+// into a new immutable snapshot and swaps it in with one atomic exchange. Readers
+// never lock: they announce the snapshot they are about to use in their own slot
+// (a hazard pointer) and check that it is still the current one. A replaced
+// snapshot is freed by the next publication after no slot announces it.
 
-    #pragma omp parallel for 
-    for (j = 0; j < length_w; j++) {
-        data_sw[j] = beta_2 * data_sw[j] + (1 - beta_2) * pow(data_dw[j], 2.0);
-        double vw_corr = data_vw[j] / corr_1;
-        double sw_corr = data_sw[j] / corr_2;
-        data_w[j] -= lr * vw_corr / (sqrt(sw_corr) + epsilon);
-    }   
+#define MAX_SNAPSHOT_READERS 64
 
+typedef struct nn_snapshot {
+    // Replica with its own copy of the weights
+    nn_model *model;
+    size_t step;
+    struct nn_snapshot *next_retired;
+} nn_snapshot;
 
-    #pragma omp parallel for 
-    for (j = 0; j < length_b; j++) {
-        data_sb[j] = beta_2 * data_sb[j] + (1 - beta_2) * pow(data_db[j], 2.0);
-        double vb_corr = data_vb[j] / corr_1;
-        double sb_corr = data_sb[j] / corr_2;
-        data_b[j] -= lr * vb_corr / (sqrt(sb_corr) + epsilon);
+typedef struct nn_publisher {
+    size_t interval;
+    _Atomic(nn_snapshot*) current;
+
+    // Snapshot each reader is using, NULL when it is not predicting
+    _Atomic(nn_snapshot*) hazards[MAX_SNAPSHOT_READERS];
+    atomic_bool slot_used[MAX_SNAPSHOT_READERS];
+
+    // Replaced snapshots that readers may still hold, guarded by publish_lock
+    // Only publishers take the lock
+    nn_snapshot *retired;
+    size_t num_published;
+    size_t num_reclaimed;
+    pthread_mutex_t publish_lock;
+} nn_publisher;
+
+typedef struct {
+    nn_publisher *publisher;
+    size_t slot;
+    nn_context *ctx;
+} nn_reader;
+
+nn_snapshot* create_snapshot(nn_model *model, size_t step) {
+    double *params = malloc(model->num_params * sizeof(double));
+    check_alloc(params);
+    memcpy(params, model->params, model->num_params * sizeof(double));
+
+    nn_snapshot *snapshot = malloc(sizeof(nn_snapshot));
+    check_alloc(snapshot);
+    snapshot->model = create_replica(model, params);
+    snapshot->step = step;
+    snapshot->next_retired = NULL;
+    return snapshot;
+}
+
+void free_snapshot(nn_snapshot *snapshot) {
+    free_model(snapshot->model);
+    free(snapshot);
+}
+
+bool snapshot_in_use(nn_publisher *publisher, nn_snapshot *snapshot) {
+    unsigned int i;
+
+    for (i = 0; i < MAX_SNAPSHOT_READERS; i++) {
+        if (atomic_load(&publisher->hazards[i]) == snapshot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void reclaim_snapshots(nn_publisher *publisher) {
+    // Free the retired snapshots that no reader announces
+    // A reader that has not announced a retired snapshot yet will see that it is
+    // no longer current and move on, so it cannot start using it after this check
+
+    nn_snapshot **link = &publisher->retired;
+    while (*link != NULL) {
+        nn_snapshot *snapshot = *link;
+        if (snapshot_in_use(publisher, snapshot)) {
+            link = &snapshot->next_retired;
+        } else {
+            *link = snapshot->next_retired;
+            free_snapshot(snapshot);
+            publisher->num_reclaimed++;
+        }
+    }
+}
+
+void publish_snapshot(nn_publisher *publisher, nn_model *model, size_t step) {
+    // Make a copy of the current weights of model, taken after step, the one readers use
+
+    nn_snapshot *snapshot = create_snapshot(model, step);
+
+    pthread_mutex_lock(&publisher->publish_lock);
+    nn_snapshot *old = atomic_exchange(&publisher->current, snapshot);
+    if (old != NULL) {
+        old->next_retired = publisher->retired;
+        publisher->retired = old;
+    }
+    publisher->num_published++;
+    reclaim_snapshots(publisher);
+    pthread_mutex_unlock(&publisher->publish_lock);
+}
+
+nn_publisher* create_publisher(nn_model *model, size_t interval) {
+    // Publish the weights of model now and every interval steps of train_model
+
+    if (interval == 0) {
+        printf("Error: Invalid interval for create_publisher\n\n");
+        exit(0);
+    }
+
+    nn_publisher *publisher = calloc(1, sizeof(nn_publisher));
+    check_alloc(publisher);
+    publisher->interval = interval;
+    atomic_init(&publisher->current, NULL);
+    unsigned int i;
+    for (i = 0; i < MAX_SNAPSHOT_READERS; i++) {
+        atomic_init(&publisher->hazards[i], NULL);
+        atomic_init(&publisher->slot_used[i], false);
+    }
+    pthread_mutex_init(&publisher->publish_lock, NULL);
+
+    publish_snapshot(publisher, model, 0);
+    model->publisher = publisher;
+    return publisher;
+}
+
+nn_snapshot* acquire_snapshot(nn_publisher *publisher, size_t slot) {
+    // Newest snapshot, which stays valid until slot is cleared
+    // Announce the snapshot, then make sure it was not replaced (and possibly
+    // reclaimed) before the announcement became visible
+
+    nn_snapshot *snapshot = atomic_load(&publisher->current);
+    while (true) {
+        atomic_store(&publisher->hazards[slot], snapshot);
+        nn_snapshot *current = atomic_load(&publisher->current);
+        if (current == snapshot) {
+            return snapshot;
+        }
+        snapshot = current;
+    }
+}
+
+size_t snapshot_predict(nn_reader *reader, matrix *result, matrix *input, size_t num_inputs) {
+    // model_predict with the newest published weights, without taking any lock
+    // Returns the training step of the snapshot that was used
+
+    nn_publisher *publisher = reader->publisher;
+    nn_snapshot *snapshot = acquire_snapshot(publisher, reader->slot);
+
+    model_predict_ctx(snapshot->model, reader->ctx, result, input, num_inputs);
+    size_t step = snapshot->step;
+    atomic_store(&publisher->hazards[reader->slot], NULL);
+    return step;
+}
+
+nn_reader* create_reader(nn_publisher *publisher, size_t max_inputs) {
+    // Reader for one inference thread, predicting up to max_inputs samples at a time
+
+    nn_reader *reader = malloc(sizeof(nn_reader));
+    check_alloc(reader);
+    reader->publisher = publisher;
+
+    size_t slot;
+    for (slot = 0; slot < MAX_SNAPSHOT_READERS; slot++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&publisher->slot_used[slot], &expected, true)) {
+            break;
+        }
+    }
+    if (slot == MAX_SNAPSHOT_READERS) {
+        printf("Error: More than %d readers for create_reader\n\n", MAX_SNAPSHOT_READERS);
+        exit(0);
+    }
+    reader->slot = slot;
+    reader->ctx = create_context(acquire_snapshot(publisher, slot)->model, max_inputs);
+    atomic_store(&publisher->hazards[slot], NULL);
+    return reader;
+}
+
+void free_reader(nn_reader *reader) {
+    atomic_store(&reader->publisher->hazards[reader->slot], NULL);
+    atomic_store(&reader->publisher->slot_used[reader->slot], false);
+    free_context(reader->ctx);
+    free(reader);
+}
+
+void free_publisher(nn_publisher *publisher) {
+    // Free the publisher and all its snapshots, once every reader has been freed
+
+    if (publisher == NULL) {
+        return;
+    }
+
+    reclaim_snapshots(publisher);
+    if (publisher->retired != NULL) {
+        printf("Warning: Freeing weight snapshots that are still being read\n");
+    }
+    while (publisher->retired != NULL) {
+        nn_snapshot *snapshot = publisher->retired;
+        publisher->retired = snapshot->next_retired;
+        free_snapshot(snapshot);
+    }
+    free_snapshot(atomic_load(&publisher->current));
+    pthread_mutex_destroy(&publisher->publish_lock);
+    free(publisher);
+}
+
+void create_train_buffers(nn_model *model, matrix *mini_X) {
+    // Activations, gradients, patches and pooling positions of every layer for forward_prop
+    // and back_prop on the mini-batch mini_X
+
+    nn_layer *layers = model->layers;
+    size_t m = mini_X->cols;
+    unsigned int i;
+
+    layers[0].A = mini_X;
+    for (i = 1; i < model->num_layers; i++) {
+        size_t n_curr = layers[i].num_nodes;
+        layers[i].A = numa_zero_mat(n_curr, m);
+        layers[i].Z = numa_zero_mat(n_curr, m);
+        layers[i].dA = numa_zero_mat(n_curr, m);
+        layers[i].dZ = numa_zero_mat(n_curr, m);
+
+        if (layers[i].type == CONV) {
+            layers[i].cols = numa_zero_mat(layers[i].W->cols, layers[i].height * layers[i].width * m);
+        } else if (layers[i].type == MAXPOOL) {
+            layers[i].argmax = malloc(n_curr * m * sizeof(size_t));
+            check_alloc(layers[i].argmax);
+        }
+    }
+}
+
+void free_train_buffers(nn_model *model) {
+    nn_layer *layers = model->layers;
+    unsigned int i;
+
+    layers[0].A = NULL;
+    for (i = 1; i < model->num_layers; i++) {
+        free_mat(layers[i].A);
+        free_mat(layers[i].Z);
+        free_mat(layers[i].dA);
+        free_mat(layers[i].dZ);
+        free_mat(layers[i].cols);
+        free(layers[i].argmax);
+        layers[i].A = NULL;
+        layers[i].Z = NULL;
+        layers[i].dA = NULL;
+        layers[i].dZ = NULL;
+        layers[i].cols = NULL;
+        layers[i].argmax = NULL;
     }
 }
 
@@ -194,9 +1608,15 @@ void train_model(nn_model *model, matrix *X, matrix *Y, size_t mini_batch_size,
     unsigned int i, j, epoch;
     double loss;
     double small_val = pow(10, -16.0); 
+    nn_validation *val = model->validation;
+    bool stopped = false;
+
+    matrix *mini_X = numa_zero_mat(X->rows, m);
+    matrix *mini_Y = numa_zero_mat(Y->rows, m);
 
-    matrix *mini_X = zero_mat(X->rows, m);
-    matrix *mini_Y = zero_mat(Y->rows, m);
+    // mini_batch reads the training set at random from every thread
+    numa_interleave(X);
+    numa_interleave(Y);
 
     int *indices = malloc(training_set_size * sizeof(int));
     check_alloc(indices);
@@ -205,63 +1625,35 @@ void train_model(nn_model *model, matrix *X, matrix *Y, size_t mini_batch_size,
     }
 
     // Create matrices used in forward and back prop
-    layers[0].A = mini_X; 
-    size_t n_curr; 
-    for (i = 1; i < num_layers; i++) {
-        n_curr = layers[i].num_nodes;
-        layers[i].A = zero_mat(n_curr, m);
-        layers[i].Z = zero_mat(n_curr, m);
-        layers[i].dA = zero_mat(n_curr, m);
-        layers[i].dZ = zero_mat(n_curr, m);
-    }
+    create_train_buffers(model, mini_X);
 
     printf("Training neural network model\n");
     clock_t start = clock();
+    perf_sample phase;
 
     for (epoch = 0; epoch < epochs; epoch++) {
 
+        perf_begin(&phase);
         mini_batch(mini_X, mini_Y, X, Y, indices);
+        perf_end(&phase, PERF_MINI_BATCH);
 
         // Forward propagation
+        perf_begin(&phase);
         forward_prop(model);
+        perf_end(&phase, PERF_FORWARD_PROP);
 
         // Back propagation
+        perf_begin(&phase);
+        back_prop(model, mini_Y);
+        perf_end(&phase, PERF_BACK_PROP);
 
-        // Compute dZ for last layer
-        mat_sub(layers[last_i].dZ, layers[last_i].A, mini_Y);
-
-        for (i = last_i; i > 0; i--) {
-            if (i != last_i) {
-                mat_mul_trans(layers[i].dA, layers[i + 1].W, layers[i + 1].dZ, true, false);
-
-                if (layers[i].activation == SIGMOID) {
-                    dsigmoid(layers[i].dZ, layers[i].A);
-                } else if (layers[i].activation == RELU) {
-                    drelu(layers[i].dZ, layers[i].Z);
-                }
-
-                mat_elem_mul(layers[i].dZ, layers[i].dA, layers[i].dZ);
-            }
-            
-            mat_mul_trans(layers[i].dW, layers[i].dZ, layers[i - 1].A, false, true);
-            mat_scalar_mul(layers[i].dW, layers[i].dW, 1.0 / m);
-
-            mat_sum_rows(layers[i].db, layers[i].dZ);
-            mat_scalar_mul(layers[i].db, layers[i].db, 1.0 / m);
-
-        }
-
-        // Gradient descent
-        for (i = last_i; i > 0; i--) {
-
-            // Adam optimizer 
-            grad_descent_adam(layers, i, epoch, lr, beta_1, beta_2, epsilon);
-
-            // mat_lin_combo(layers[i].W, layers[i].W, layers[i].dW, 1.0, -lr);
-            // mat_lin_combo(layers[i].b, layers[i].b, layers[i].db, 1.0, -lr);
-        }
+        // Gradient descent (Adam optimizer)
+        perf_begin(&phase);
+        grad_descent_adam(model, epoch, lr, beta_1, beta_2, epsilon);
+        perf_end(&phase, PERF_GRAD_DESCENT);
 
         // Calculate loss
+        perf_begin(&phase);
         loss = 0.0;
         for (i = 0; i < Y->rows; i++) {
             for (j = 0; j < m; j++) {
@@ -269,53 +1661,56 @@ void train_model(nn_model *model, matrix *X, matrix *Y, size_t mini_batch_size,
             }
         }    
         loss /= (double) m;
+        perf_end(&phase, PERF_LOSS);
 
         if ((epoch + 1) % 1 == 0) {
             printf("Epoch %d/%d     Loss: %g\n", epoch + 1, epochs, loss);
         }
-    }
 
-    clock_t end = clock();
-    printf("Finished training\n");
-    printf("Time taken: %Lf s\n\n", (long double)(end - start) / CLOCKS_PER_SEC);
+        if (model->publisher != NULL && (epoch + 1) % model->publisher->interval == 0) {
+            publish_snapshot(model->publisher, model, epoch + 1);
+        }
 
-    layers[0].A = NULL;
-    for (i = 1; i < num_layers; i++) {
-        free_mat(layers[i].A);
-        free_mat(layers[i].Z);
-        free_mat(layers[i].dA);
-        free_mat(layers[i].dZ);
-        layers[i].A = NULL;
-        layers[i].Z = NULL;
-        layers[i].dA = NULL;
-        layers[i].dZ = NULL;
+        if (val != NULL && (epoch + 1) % val->interval == 0 && validation_step(val, model, epoch + 1)) {
+            printf("Stopping early: no validation improvement in %zu evaluations\n", val->patience);
+            stopped = true;
+            break;
+        }
     }
 
-    double corrects = 0.0;
-    matrix *Y_hat = zero_mat(Y->rows, Y->cols);
-    matrix *y = zero_mat(Y->rows, 1);
-    matrix *y_hat = zero_mat(Y->rows, 1);
-
-    printf("Evaluating model on training data\n");
-    model_predict(model, Y_hat, X, X->cols);
+    if (val != NULL) {
+        // Evaluate the final parameters, then keep the best ones
+        if (!stopped) {
+            validation_step(val, model, epochs);
+        }
+        validation_wait(val);
+        memcpy(model->params, val->best_params, model->num_params * sizeof(double));
+        printf("Keeping parameters from step %zu     Validation loss: %g     Validation accuracy: %g%%\n",
+            val->best_step, val->best_loss, 100.0 * val->best_corrects / (double) val->X->cols);
+    }
 
-    printf("Calculating training accuracy\n");
-    for (i = 0; i < Y->cols; i++) {
-        mat_get_col(y, Y, i);
-        mat_get_col(y_hat, Y_hat, i);
+    // Readers end with the final weights, which validation may have replaced
+    if (model->publisher != NULL && (val != NULL || stopped || epochs % model->publisher->interval != 0)) {
+        publish_snapshot(model->publisher, model, stopped ? epoch + 1 : epochs);
+    }
 
-        if (max_index(y) == max_index(y_hat)) {
-            corrects += 1.0;
-        }
+    clock_t end = clock();
+    printf("Finished training\n");
+    printf("Time taken: %Lf s\n", (long double)(end - start) / CLOCKS_PER_SEC);
+    if (model->lazy_backprop) {
+        lazy_report(model->lazy);
     }
+    printf("\n");
+    print_perf_report();
+
+    free_train_buffers(model);
 
+    printf("Evaluating model on training data\n");
+    size_t corrects = model_count_correct(model, X, Y);
     printf("Training accuracy: %g%%\n\n", 100.0 * corrects / (double) Y->cols);
 
     free_mat(mini_X);
     free_mat(mini_Y);
-    free_mat(Y_hat);
-    free_mat(y);
-    free_mat(y_hat);
     free(indices);
 }
 
@@ -341,8 +1736,19 @@ void free_model(nn_model *model) {
         free_mat(layers[i].V_db);
         free_mat(layers[i].S_dW);
         free_mat(layers[i].S_db);
+        free_mat(layers[i].cols);
+        free(layers[i].argmax);
     }
 
+    free_validation(model->validation);
+    free_publisher(model->publisher);
+    free_lazy_graph(model->lazy);
+    free(model->params);
+    free(model->grads);
+    free(model->V);
+    free(model->S);
     free(layers);
     free(model);
-}
\ No newline at end of file
+}
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef NUMA_C
+#define NUMA_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <omp.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+#include "matrix.c"
+
+// NUMA-aware placement of buffers and threads
+//
+// Linux places a page on the node of the thread that first writes it, so a
+// buffer zeroed by one thread ends up on one node, and OpenMP workers on the
+// other sockets read it remotely. With NUMA placement enabled (NN_NUMA=1, or
+// NN_NUMA=pin to also pin the OpenMP threads, or enable_numa):
+//  - the activations and parameters of train_model are zeroed in parallel with
+//    the same static partition of rows as the mat_mul and elementwise loops,
+//    so each worker's rows live on its own node
+//  - the training set, which mini_batch reads at random, is interleaved
+//    across the nodes
+//  - create_replicas gives every node its own copy of the weights for inference
+// On a single node nothing moves, and only the threads that zero the buffers change.
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+// Serve every allocation above this from fresh pages, so first touch decides placement
+#define NUMA_MMAP_THRESHOLD (128 * 1024)
+
+typedef struct {
+    bool enabled;
+    bool pinned;
+    int num_nodes;
+    // Kernel ids of the nodes with CPUs, which need not be consecutive
+    int node_ids[NUMA_MAX_NODES];
+    int num_node_cpus[NUMA_MAX_NODES];
+    int node_cpus[NUMA_MAX_NODES][NUMA_MAX_CPUS];
+} numa_topology;
+
+numa_topology numa;
+
+size_t parse_cpulist(char *list, int *cpus) {
+    // CPUs of a list like "0-3,8-11", returns their number
+
+    size_t num = 0;
+    char *token = strtok(list, ",\n");
+    while (token != NULL) {
+        int first, last, cpu;
+        if (sscanf(token, "%d-%d", &first, &last) != 2) {
+            last = (sscanf(token, "%d", &first) == 1) ? first : -1;
+        }
+        for (cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS && num < NUMA_MAX_CPUS; cpu++) {
+            cpus[num++] = cpu;
+        }
+        token = strtok(NULL, ",\n");
+    }
+    return num;
+}
+
+void read_numa_topology(void) {
+    // Nodes and their CPUs from sysfs, or one node with every CPU
+
+    char path[64], list[4096];
+    int node, cpu;
+
+    numa.num_nodes = 0;
+    for (node = 0; node < NUMA_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue;
+        }
+        size_t num_cpus = 0;
+        if (fgets(list, sizeof(list), file) != NULL) {
+            num_cpus = parse_cpulist(list, numa.node_cpus[numa.num_nodes]);
+        }
+        fclose(file);
+
+        // Memory-only nodes have no CPUs to run workers on
+        if (num_cpus > 0) {
+            numa.node_ids[numa.num_nodes] = node;
+            numa.num_node_cpus[numa.num_nodes] = num_cpus;
+            numa.num_nodes++;
+        }
+    }
+
+    if (numa.num_nodes == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        numa.num_nodes = 1;
+        numa.node_ids[0] = 0;
+        numa.num_node_cpus[0] = (num_cpus > 0 && num_cpus <= NUMA_MAX_CPUS) ? num_cpus : 1;
+        for (cpu = 0; cpu < numa.num_node_cpus[0]; cpu++) {
+            numa.node_cpus[0][cpu] = cpu;
+        }
+    }
+}
+
+bool numa_pin_to_node(int node, int index) {
+    // Pin the calling thread to CPU index (modulo the number of CPUs) of node
+
+    int cpu = numa.node_cpus[node][index % numa.num_node_cpus[node]];
+    unsigned long mask[NUMA_MAX_CPUS / (8 * sizeof(unsigned long))] = {0};
+    mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+#ifdef __linux__
+    return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0;
+#else
+    return false;
+#endif
+}
+
+int numa_thread_node(int thread, int num_threads) {
+    // Node of OpenMP thread thread, so that consecutive threads, which get
+    // consecutive rows under a static schedule, share a node
+
+    return (int) ((long) thread * numa.num_nodes / num_threads);
+}
+
+void pin_threads(void) {
+    // Pin every OpenMP thread to its own CPU on its node
+
+    int num_threads = omp_get_max_threads();
+    bool pinned = true;
+
+    #pragma omp parallel num_threads(num_threads) reduction(&&:pinned)
+    {
+        int thread = omp_get_thread_num();
+        int node = numa_thread_node(thread, num_threads);
+        // First thread on this node
+        int first = (int) (((long) node * num_threads + numa.num_nodes - 1) / numa.num_nodes);
+        pinned = numa_pin_to_node(node, thread - first);
+    }
+
+    if (!pinned) {
+        printf("Warning: Could not pin threads to CPUs\n");
+    }
+    numa.pinned = pinned;
+}
+
+void enable_numa(bool pin) {
+    // Use NUMA-aware placement from now on, optionally pinning the OpenMP threads
+
+    mallopt(M_MMAP_THRESHOLD, NUMA_MMAP_THRESHOLD);
+    numa.enabled = true;
+    if (pin) {
+        pin_threads();
+    }
+}
+
+__attribute__((constructor))
+void init_numa(void) {
+    read_numa_topology();
+
+    char *enabled = getenv("NN_NUMA");
+    if (enabled != NULL && strcmp(enabled, "0") != 0) {
+        enable_numa(strcmp(enabled, "pin") == 0);
+    }
+}
+
+int numa_current_node(void) {
+    // Index (not kernel id) of the node the calling thread runs on
+
+    int node = 0;
+    unsigned int cpu, node_id;
+#ifdef __linux__
+    if (syscall(SYS_getcpu, &cpu, &node_id, NULL) == 0) {
+        for (node = 0; node < numa.num_nodes && numa.node_ids[node] != (int) node_id; node++);
+    }
+#endif
+    return (node < numa.num_nodes) ? node : 0;
+}
+
+void numa_touch_rows(double *data, size_t rows, size_t cols) {
+    // Zero a new buffer of rows rows with the static partition of the row loops,
+    // placing each thread's rows on its node
+
+    unsigned int i;
+
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < rows; i++) {
+        memset(data + i * cols, 0, cols * sizeof(double));
+    }
+}
+
+matrix* numa_zero_mat(size_t rows, size_t cols) {
+    // zero_mat, first touched by the threads that work on its rows
+
+    if (!numa.enabled) {
+        return zero_mat(rows, cols);
+    }
+
+    matrix *mat = malloc(sizeof(matrix));
+    check_alloc(mat);
+    mat->rows = rows;
+    mat->cols = cols;
+    mat->data = malloc(rows * cols * sizeof(double));
+    check_alloc(mat->data);
+    mat->is_view = false;
+    numa_touch_rows(mat->data, rows, cols);
+    return mat;
+}
+
+bool numa_set_policy(void *data, size_t bytes, int mode, int node) {
+    // Apply the memory policy mode (interleaved over all nodes, or bound to node)
+    // to the whole pages of data, moving the pages already touched
+
+#if defined(__linux__) && defined(SYS_mbind)
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) data + page - 1) / page * page;
+    uintptr_t end = ((uintptr_t) data + bytes) / page * page;
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    int i;
+
+    if (end <= start) {
+        return false;
+    }
+    for (i = 0; i < numa.num_nodes; i++) {
+        if (mode == MPOL_INTERLEAVE || i == node) {
+            mask[numa.node_ids[i] / (8 * sizeof(unsigned long))] |= 1UL << (numa.node_ids[i] % (8 * sizeof(unsigned long)));
+        }
+    }
+    return syscall(SYS_mbind, start, end - start, mode, mask, 8 * sizeof(mask), MPOL_MF_MOVE) == 0;
+#else
+    return false;
+#endif
+}
+
+void numa_interleave(matrix *mat) {
+    // Spread the pages of mat over all nodes, for data read at random by every thread
+
+    if (numa.enabled && numa.num_nodes > 1) {
+        numa_set_policy(mat->data, mat->rows * mat->cols * sizeof(double), MPOL_INTERLEAVE, 0);
+    }
+}
+
+double* numa_copy_to_node(double *data, size_t length, int node) {
+    // Copy of data whose pages are on node, freed with numa_free_copy
+    // The pages are mapped for the copy alone, so that the policy bound to them
+    // is dropped with them instead of going back to the heap
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = (length * sizeof(double) + page - 1) / page * page;
+    double *copy = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check_alloc((copy == MAP_FAILED) ? NULL : copy);
+
+    if (numa.num_nodes > 1) {
+        numa_set_policy(copy, bytes, MPOL_BIND, node);
+    }
+    memcpy(copy, data, length * sizeof(double));
+    return copy;
+}
+
+void numa_free_copy(double *copy, size_t length) {
+    // Unmap a copy made by numa_copy_to_node of length values
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = (length * sizeof(double) + page - 1) / page * page;
+    munmap(copy, bytes);
+}
+
+#endif
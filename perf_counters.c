@@ -0,0 +1,356 @@
+#ifndef PERF_COUNTERS_C
+#define PERF_COUNTERS_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <omp.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#include "matrix.c"
+
+// Hardware performance counters around the kernels and training phases
+//
+// enable_perf_counters (or NN_PERF=1) opens Linux perf counters for every
+// OpenMP thread, and the instrumented kernels in math_utils.c and phases of
+// train_model then add the counts of all threads to per kernel and per layer
+// totals, printed by print_perf_report. Counters the CPU, kernel or
+// perf_event_paranoid setting do not allow are reported as n/a, and calls
+// and wall-clock times are always recorded.
+//
+// Only the thread that enabled the counters is instrumented (e.g. the
+// training loop), and threads added to the OpenMP pool later are not counted.
+
+#define PERF_MAX_LAYERS 16
+
+enum perf_event {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_PAGE_FAULTS,
+    NUM_PERF_EVENTS
+};
+
+char *perf_event_names[NUM_PERF_EVENTS] = {"cycles", "instructions", "LLC misses", "dTLB misses", "branch misses", "page faults"};
+
+enum perf_region {
+    // Kernels
+    PERF_MAT_MUL,
+    PERF_MAT_MUL_SPARSE,
+    PERF_TRANSPOSE,
+    PERF_VEC_ADD,
+    PERF_LIN_COMBO,
+    PERF_SCALAR_MUL,
+    PERF_ELEM_MUL,
+    PERF_SUM_ROWS,
+    PERF_SIGMOID,
+    PERF_SOFTMAX,
+    PERF_RELU,
+    PERF_DSIGMOID_MUL,
+    PERF_DRELU_MUL,
+    PERF_IM2COL,
+    PERF_COL2IM,
+    PERF_MAXPOOL,
+    PERF_DMAXPOOL,
+    // Training phases
+    PERF_MINI_BATCH,
+    PERF_FORWARD_PROP,
+    PERF_BACK_PROP,
+    PERF_GRAD_DESCENT,
+    PERF_LOSS,
+    NUM_PERF_REGIONS
+};
+
+#define PERF_FIRST_PHASE PERF_MINI_BATCH
+
+char *perf_region_names[NUM_PERF_REGIONS] = {
+    "mat_mul", "mat_mul_sparse", "transpose", "mat_vec_add", "mat_lin_combo", "mat_scalar_mul", "mat_elem_mul",
+    "mat_sum_rows", "sigmoid", "softmax", "relu", "dsigmoid_mul", "drelu_mul",
+    "im2col", "col2im", "maxpool", "dmaxpool",
+    "mini_batch", "forward_prop", "back_prop", "grad_descent", "loss"
+};
+
+typedef struct {
+    double time;
+    double values[NUM_PERF_EVENTS];
+} perf_sample;
+
+typedef struct {
+    size_t calls;
+    double time;
+    double values[NUM_PERF_EVENTS];
+} perf_total;
+
+typedef struct {
+    bool enabled;
+    bool warned;
+    pthread_t owner;
+    int num_threads;
+    // num_threads * NUM_PERF_EVENTS descriptors, thread t's at t * NUM_PERF_EVENTS
+    int *fds;
+    bool available[NUM_PERF_EVENTS];
+    // Layer the kernels currently run for, or -1 outside the layers
+    int layer;
+    // Totals of layer l at index l + 1, index 0 for kernels outside the layers
+    perf_total totals[NUM_PERF_REGIONS][PERF_MAX_LAYERS + 1];
+} perf_state;
+
+perf_state perf = {.layer = -1};
+
+int open_perf_event(enum perf_event event) {
+    // Counter of event for the calling thread, or -1 if unavailable
+
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    switch (event) {
+        case PERF_CYCLES:
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PERF_PAGE_FAULTS:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+            break;
+        default:
+            return -1;
+    }
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+double read_perf_event(int fd) {
+    // Count of one counter, scaled up for the time it was multiplexed out
+
+    uint64_t counts[3];
+    if (read(fd, counts, sizeof(counts)) != sizeof(counts) || counts[2] == 0) {
+        return 0.0;
+    }
+    return (double) counts[0] * ((double) counts[1] / (double) counts[2]);
+}
+
+void disable_perf_counters(void) {
+    int i;
+
+    if (perf.fds != NULL) {
+        for (i = 0; i < perf.num_threads * NUM_PERF_EVENTS; i++) {
+            if (perf.fds[i] >= 0) {
+                close(perf.fds[i]);
+            }
+        }
+        free(perf.fds);
+        perf.fds = NULL;
+    }
+    perf.enabled = false;
+}
+
+void reset_perf_counters(void) {
+    memset(perf.totals, 0, sizeof(perf.totals));
+}
+
+bool enable_perf_counters(void) {
+    // Start instrumenting the kernels and training phases run by the calling thread
+    // Returns whether any hardware counter could be opened
+
+    int t, e;
+    bool any = false;
+
+    disable_perf_counters();
+    reset_perf_counters();
+    perf.num_threads = omp_get_max_threads();
+    perf.fds = malloc(perf.num_threads * NUM_PERF_EVENTS * sizeof(int));
+    check_alloc(perf.fds);
+
+    // Counters are per thread, so every thread of the pool opens its own
+    #pragma omp parallel num_threads(perf.num_threads)
+    {
+        int thread = omp_get_thread_num();
+        int event;
+        for (event = 0; event < NUM_PERF_EVENTS; event++) {
+            perf.fds[thread * NUM_PERF_EVENTS + event] = open_perf_event(event);
+        }
+    }
+
+    // Only use events that every thread could open
+    for (e = 0; e < NUM_PERF_EVENTS; e++) {
+        perf.available[e] = true;
+        for (t = 0; t < perf.num_threads; t++) {
+            perf.available[e] = perf.available[e] && (perf.fds[t * NUM_PERF_EVENTS + e] >= 0);
+        }
+        if (!perf.available[e]) {
+            for (t = 0; t < perf.num_threads; t++) {
+                if (perf.fds[t * NUM_PERF_EVENTS + e] >= 0) {
+                    close(perf.fds[t * NUM_PERF_EVENTS + e]);
+                    perf.fds[t * NUM_PERF_EVENTS + e] = -1;
+                }
+            }
+        } else if (e != PERF_PAGE_FAULTS) {
+            any = true;
+        }
+    }
+    if (!any && !perf.warned) {
+        perf.warned = true;
+        printf("Warning: Hardware performance counters are unavailable and will be reported as n/a\n");
+    }
+
+    perf.owner = pthread_self();
+    perf.layer = -1;
+    perf.enabled = true;
+    return any;
+}
+
+__attribute__((constructor))
+void init_perf_counters(void) {
+    char *enabled = getenv("NN_PERF");
+    if (enabled != NULL && strcmp(enabled, "0") != 0) {
+        enable_perf_counters();
+    }
+}
+
+bool perf_active(void) {
+    return perf.enabled && !omp_in_parallel() && pthread_equal(pthread_self(), perf.owner);
+}
+
+void read_perf_sample(perf_sample *sample) {
+    int t, e;
+
+    for (e = 0; e < NUM_PERF_EVENTS; e++) {
+        sample->values[e] = 0.0;
+        if (perf.available[e]) {
+            for (t = 0; t < perf.num_threads; t++) {
+                sample->values[e] += read_perf_event(perf.fds[t * NUM_PERF_EVENTS + e]);
+            }
+        }
+    }
+    sample->time = omp_get_wtime();
+}
+
+void perf_begin(perf_sample *start) {
+    // Start counting a region, ended by perf_end with the same sample
+    // Regions may nest
+
+    if (perf_active()) {
+        read_perf_sample(start);
+    }
+}
+
+void perf_end(perf_sample *start, enum perf_region region) {
+    // Add the counts since perf_begin(start) to region, for the current layer
+
+    if (!perf_active()) {
+        return;
+    }
+
+    perf_sample end;
+    read_perf_sample(&end);
+
+    int slot = (perf.layer < 0) ? 0 : ((perf.layer < PERF_MAX_LAYERS) ? perf.layer + 1 : PERF_MAX_LAYERS);
+    perf_total *total = &perf.totals[region][slot];
+    int e;
+
+    total->calls++;
+    total->time += end.time - start->time;
+    for (e = 0; e < NUM_PERF_EVENTS; e++) {
+        total->values[e] += end.values[e] - start->values[e];
+    }
+}
+
+void perf_set_layer(int layer) {
+    // Attribute the following kernels to layer (-1 for none)
+
+    perf.layer = layer;
+}
+
+void print_perf_ratio(double value, double per, double scale, bool available) {
+    if (available && per > 0.0) {
+        printf(" %10.2f", scale * value / per);
+    } else {
+        printf(" %10s", "n/a");
+    }
+}
+
+void print_perf_row(char *name, char *layer, perf_total *total) {
+    double *v = total->values;
+    bool *available = perf.available;
+    bool per_instruction = available[PERF_INSTRUCTIONS];
+
+    printf("%-16s %-6s %8zu %10.2f", name, layer, total->calls, 1000 * total->time);
+    if (available[PERF_CYCLES]) {
+        printf(" %12.4g", v[PERF_CYCLES]);
+    } else {
+        printf(" %12s", "n/a");
+    }
+    print_perf_ratio(v[PERF_INSTRUCTIONS], v[PERF_CYCLES], 1.0, per_instruction && available[PERF_CYCLES]);
+    print_perf_ratio(v[PERF_LLC_MISSES], v[PERF_INSTRUCTIONS], 1000.0, per_instruction && available[PERF_LLC_MISSES]);
+    print_perf_ratio(v[PERF_DTLB_MISSES], v[PERF_INSTRUCTIONS], 1000.0, per_instruction && available[PERF_DTLB_MISSES]);
+    print_perf_ratio(v[PERF_BRANCH_MISSES], v[PERF_INSTRUCTIONS], 1000.0, per_instruction && available[PERF_BRANCH_MISSES]);
+    print_perf_ratio(v[PERF_PAGE_FAULTS], 1.0, 1.0, available[PERF_PAGE_FAULTS]);
+    printf("\n");
+}
+
+void print_perf_report(void) {
+    // Totals of every training phase, and of every kernel per layer
+    // IPC is instructions per cycle, misses are per 1000 instructions
+
+    unsigned int r, l;
+    char layer[16];
+
+    if (!perf.enabled) {
+        return;
+    }
+
+    printf("Performance counters (%d threads)\n", perf.num_threads);
+    printf("%-16s %-6s %8s %10s %12s %10s %10s %10s %10s %10s\n",
+        "region", "layer", "calls", "time (ms)", "cycles", "IPC", "LLC/ki", "dTLB/ki", "br/ki", "faults");
+
+    for (r = PERF_FIRST_PHASE; r < NUM_PERF_REGIONS; r++) {
+        if (perf.totals[r][0].calls > 0) {
+            print_perf_row(perf_region_names[r], "-", &perf.totals[r][0]);
+        }
+    }
+    for (r = 0; r < PERF_FIRST_PHASE; r++) {
+        for (l = 0; l <= PERF_MAX_LAYERS; l++) {
+            if (perf.totals[r][l].calls == 0) {
+                continue;
+            }
+            if (l == 0) {
+                strcpy(layer, "-");
+            } else {
+                snprintf(layer, sizeof(layer), (l == PERF_MAX_LAYERS) ? "%u+" : "%u", l - 1);
+            }
+            print_perf_row(perf_region_names[r], layer, &perf.totals[r][l]);
+        }
+    }
+    printf("\n");
+}
+
+#endif
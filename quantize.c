@@ -0,0 +1,273 @@
+#ifndef QUANTIZE_C
+#define QUANTIZE_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "neural_network.c"
+
+// Post-training int8 quantization for inference
+//
+// Weights are quantized symmetrically to int8 with one scale per output
+// channel (row of W). Layer inputs are quantized asymmetrically to 7-bit
+// unsigned values (0..127) with one scale and zero point per layer, found by
+// calibrating on a sample of inputs. 7 bits keep the pairwise sums of
+// _mm256_maddubs_epi16 from saturating int16.
+// The integer dot products use kernels.dot_u8s8 (see simd_kernels.c).
+
+#define Q_MAX_WEIGHT 127
+#define Q_MAX_INPUT 127
+#define Q_ALIGN 32
+#define Q_SAMPLE_BLOCK 16
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    size_t cols_padded;
+    enum func activation;
+    int8_t *W;
+    int32_t *W_row_sums;
+    double *W_scales;
+    double *b;
+    double in_scale;
+    int32_t in_zero;
+} q_layer;
+
+typedef struct {
+    size_t num_layers;
+    size_t *num_nodes;
+    q_layer *layers;
+} q_model;
+
+void calibrate_model(nn_model *model, matrix *X_calib, double *in_min, double *in_max) {
+    // Record the range of the input to every layer i >= 1 while running X_calib through the model
+    // in_min[i] and in_max[i] are the range of the activations of layer i - 1
+
+    size_t num_layers = model->num_layers;
+    size_t num_inputs = X_calib->cols;
+    unsigned int i, j;
+
+    nn_context *ctx = create_context(model, num_inputs);
+    matrix *Y_hat = zero_mat(model->layers[num_layers - 1].num_nodes, num_inputs);
+    model_predict_ctx(model, ctx, Y_hat, X_calib, num_inputs);
+
+    for (i = 1; i < num_layers; i++) {
+        matrix *A = (i == 1) ? X_calib : ctx->A[i - 1];
+        size_t length = A->rows * A->cols;
+        double min = A->data[0];
+        double max = A->data[0];
+        for (j = 0; j < length; j++) {
+            min = fmin(min, A->data[j]);
+            max = fmax(max, A->data[j]);
+        }
+        in_min[i] = min;
+        in_max[i] = max;
+    }
+
+    free_mat(Y_hat);
+    free_context(ctx);
+}
+
+q_model* quantize_model(nn_model *model, matrix *X_calib) {
+    // Convert a trained model to int8, calibrating the input ranges on X_calib
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    unsigned int i, r;
+
+    if (!is_dense_model(model)) {
+        printf("Error: quantize_model only supports fully connected models\n\n");
+        exit(0);
+    }
+
+    q_model *qmodel = malloc(sizeof(q_model));
+    check_alloc(qmodel);
+    qmodel->num_layers = num_layers;
+    qmodel->num_nodes = malloc(num_layers * sizeof(size_t));
+    qmodel->layers = calloc(num_layers, sizeof(q_layer));
+    check_alloc(qmodel->num_nodes);
+    check_alloc(qmodel->layers);
+
+    double *in_min = calloc(num_layers, sizeof(double));
+    double *in_max = calloc(num_layers, sizeof(double));
+    check_alloc(in_min);
+    check_alloc(in_max);
+    calibrate_model(model, X_calib, in_min, in_max);
+
+    for (i = 0; i < num_layers; i++) {
+        qmodel->num_nodes[i] = layers[i].num_nodes;
+    }
+
+    for (i = 1; i < num_layers; i++) {
+        q_layer *ql = &qmodel->layers[i];
+        matrix *W = layers[i].W;
+        size_t rows = W->rows;
+        size_t cols = W->cols;
+        size_t cols_padded = (cols + Q_ALIGN - 1) / Q_ALIGN * Q_ALIGN;
+
+        ql->rows = rows;
+        ql->cols = cols;
+        ql->cols_padded = cols_padded;
+        ql->activation = layers[i].activation;
+        ql->W = calloc(rows * cols_padded, sizeof(int8_t));
+        ql->W_row_sums = calloc(rows, sizeof(int32_t));
+        ql->W_scales = calloc(rows, sizeof(double));
+        ql->b = malloc(rows * sizeof(double));
+        check_alloc(ql->W);
+        check_alloc(ql->W_row_sums);
+        check_alloc(ql->W_scales);
+        check_alloc(ql->b);
+        memcpy(ql->b, layers[i].b->data, rows * sizeof(double));
+
+        // Per output channel symmetric weight scales
+        #pragma omp parallel for
+        for (r = 0; r < rows; r++) {
+            double *w_row = W->data + r * cols;
+            double max_abs = 0.0;
+            unsigned int k;
+            for (k = 0; k < cols; k++) {
+                max_abs = fmax(max_abs, fabs(w_row[k]));
+            }
+            double scale = (max_abs > 0.0) ? max_abs / Q_MAX_WEIGHT : 1.0;
+            int32_t row_sum = 0;
+            for (k = 0; k < cols; k++) {
+                int32_t q = (int32_t) lrint(w_row[k] / scale);
+                q = (q > Q_MAX_WEIGHT) ? Q_MAX_WEIGHT : ((q < -Q_MAX_WEIGHT) ? -Q_MAX_WEIGHT : q);
+                ql->W[r * cols_padded + k] = (int8_t) q;
+                row_sum += q;
+            }
+            ql->W_scales[r] = scale;
+            ql->W_row_sums[r] = row_sum;
+        }
+
+        // Per layer asymmetric input scale, with zero always exactly representable
+        double min = fmin(in_min[i], 0.0);
+        double max = fmax(in_max[i], 0.0);
+        double range = max - min;
+        ql->in_scale = (range > 0.0) ? range / Q_MAX_INPUT : 1.0;
+        ql->in_zero = (int32_t) lrint(-min / ql->in_scale);
+    }
+
+    free(in_min);
+    free(in_max);
+    return qmodel;
+}
+
+void quantize_input(uint8_t *result, matrix *A, q_layer *ql) {
+    // Quantize A (features x samples) into sample-major rows of length ql->cols_padded
+
+    size_t rows = A->rows;
+    size_t cols = A->cols;
+    size_t stride = ql->cols_padded;
+    double inv_scale = 1.0 / ql->in_scale;
+    int32_t zero = ql->in_zero;
+    unsigned int s;
+
+    #pragma omp parallel for
+    for (s = 0; s < cols; s++) {
+        uint8_t *x = result + (size_t) s * stride;
+        unsigned int k;
+        for (k = 0; k < rows; k++) {
+            int32_t q = (int32_t) lrint(A->data[k * cols + s] * inv_scale) + zero;
+            x[k] = (uint8_t) ((q > Q_MAX_INPUT) ? Q_MAX_INPUT : ((q < 0) ? 0 : q));
+        }
+        for (k = rows; k < stride; k++) {
+            x[k] = (uint8_t) zero;
+        }
+    }
+}
+
+void q_layer_forward(matrix *Z, uint8_t *x_q, q_layer *ql) {
+    // Z = dequantize(W_q * x_q) + b for every sample
+
+    size_t rows = ql->rows;
+    size_t stride = ql->cols_padded;
+    size_t num_inputs = Z->cols;
+    int32_t zero = ql->in_zero;
+    unsigned int s_block;
+
+    // Padding columns of x_q hold the zero point, which the row sums correct for
+    // only over the real columns, so padded weights must be zero (set by calloc)
+    #pragma omp parallel for
+    for (s_block = 0; s_block < num_inputs; s_block += Q_SAMPLE_BLOCK) {
+        size_t s_end = (s_block + Q_SAMPLE_BLOCK < num_inputs) ? s_block + Q_SAMPLE_BLOCK : num_inputs;
+        unsigned int r, s;
+        for (r = 0; r < rows; r++) {
+            const int8_t *w = ql->W + r * stride;
+            double scale = ql->W_scales[r] * ql->in_scale;
+            int32_t offset = zero * ql->W_row_sums[r];
+            for (s = s_block; s < s_end; s++) {
+                int32_t acc = kernels.dot_u8s8(x_q + s * stride, w, stride);
+                Z->data[r * num_inputs + s] = scale * (double) (acc - offset) + ql->b[r];
+            }
+        }
+    }
+}
+
+void q_model_predict(q_model *qmodel, matrix *result, matrix *input, size_t num_inputs) {
+    // Evaluate a quantized model on input
+
+    size_t num_layers = qmodel->num_layers;
+    size_t n_out = qmodel->num_nodes[num_layers - 1];
+    size_t n_in = qmodel->num_nodes[0];
+    unsigned int i;
+
+    if ((result->cols != num_inputs) || (result->rows != n_out)) {
+        printf("Error: Invalid result vector for q_model_predict\n\n");
+        exit(0);
+    } else if ((input->cols != num_inputs) || (input->rows != n_in)) {
+        printf("Error: Invalid input vector for q_model_predict\n\n");
+        exit(0);
+    }
+
+    size_t max_stride = 0;
+    for (i = 1; i < num_layers; i++) {
+        if (qmodel->layers[i].cols_padded > max_stride) {
+            max_stride = qmodel->layers[i].cols_padded;
+        }
+    }
+    uint8_t *x_q = malloc(max_stride * num_inputs);
+    check_alloc(x_q);
+
+    matrix *A_prev = input;
+    for (i = 1; i < num_layers; i++) {
+        q_layer *ql = &qmodel->layers[i];
+        matrix *Z = zero_mat(ql->rows, num_inputs);
+        matrix *A = (i == num_layers - 1) ? result : zero_mat(ql->rows, num_inputs);
+
+        quantize_input(x_q, A_prev, ql);
+        q_layer_forward(Z, x_q, ql);
+
+        apply_activation(A, Z, ql->activation);
+
+        free_mat(Z);
+        if (A_prev != input) {
+            free_mat(A_prev);
+        }
+        A_prev = A;
+    }
+
+    free(x_q);
+}
+
+void free_q_model(q_model *qmodel) {
+    if (qmodel == NULL) {
+        return;
+    }
+
+    unsigned int i;
+    for (i = 1; i < qmodel->num_layers; i++) {
+        free(qmodel->layers[i].W);
+        free(qmodel->layers[i].W_row_sums);
+        free(qmodel->layers[i].W_scales);
+        free(qmodel->layers[i].b);
+    }
+
+    free(qmodel->num_nodes);
+    free(qmodel->layers);
+    free(qmodel);
+}
+
+#endif
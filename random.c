@@ -0,0 +1,89 @@
+#ifndef RANDOM_C
+#define RANDOM_C
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Counter-based random numbers
+//
+// The random numbers of a seed are numbered, and number n is a hash of the
+// seed and n (the SplitMix64 finalizer over a Weyl sequence), so any thread
+// can compute any of them without shared state. An operation that needs
+// random numbers (rand_mat, init_model, shuffle_array, ...) reserves a range
+// of numbers with rng_reserve on the calling thread, and element i uses
+// number first + i of the range. Loops over the elements can then run in
+// parallel and give bitwise the same result for any number of threads.
+//
+// rng_seed sets the seed and starts the numbering over, like srand. Without
+// it every run uses the same default seed. The C rand() is left to the tests
+// and benchmarks for picking sizes.
+
+// Elements below which the fill loops run single threaded
+#define RNG_PARALLEL_MIN 65536
+
+// Seed used before the first rng_seed, and its hash rng_mix(RNG_DEFAULT_SEED)
+#define RNG_DEFAULT_SEED 0x9e3779b97f4a7c15
+#define RNG_DEFAULT_KEY 0xe220a8397b1dcdaf
+
+typedef struct {
+    uint64_t seed;
+    // Hash of the seed, mixed into every number
+    uint64_t key;
+    // First number not reserved yet
+    uint64_t counter;
+} rng_state;
+
+uint64_t rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+// Same state as rng_seed(RNG_DEFAULT_SEED)
+rng_state nn_rng = {RNG_DEFAULT_SEED, RNG_DEFAULT_KEY, 0};
+
+void rng_seed(uint64_t seed) {
+    nn_rng.seed = seed;
+    nn_rng.key = rng_mix(seed);
+    nn_rng.counter = 0;
+}
+
+uint64_t rng_reserve(size_t count) {
+    // Reserve count random numbers, returns the number of the first one
+    // Only called from the thread that starts the operation, before its parallel loops
+
+    uint64_t first = nn_rng.counter;
+    nn_rng.counter += count;
+    return first;
+}
+
+static inline uint64_t rng_bits(uint64_t key, uint64_t n) {
+    // Random number n of the seed with hash key, as 64 random bits
+    return rng_mix(key + (n + 1) * 0x9e3779b97f4a7c15);
+}
+
+static inline double rng_uniform(uint64_t key, uint64_t n) {
+    // Random number n, uniform on [0, 1) with 53 bits
+    return (rng_bits(key, n) >> 11) * 0x1.0p-53;
+}
+
+static inline size_t rng_below(uint64_t key, uint64_t n, size_t bound) {
+    // Random number n, uniform on 0 to bound - 1 (bias below bound / 2^64)
+    return (size_t) (((unsigned __int128) rng_bits(key, n) * bound) >> 64);
+}
+
+void rand_fill(double *data, size_t length, double low, double high) {
+    // Fill data with values uniform on [low, high)
+
+    uint64_t key = nn_rng.key;
+    uint64_t first = rng_reserve(length);
+    double scale = high - low;
+    unsigned int i;
+
+    #pragma omp parallel for if (length >= RNG_PARALLEL_MIN)
+    for (i = 0; i < length; i++) {
+        data[i] = low + scale * rng_uniform(key, first + i);
+    }
+}
+
+#endif
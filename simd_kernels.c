@@ -0,0 +1,1477 @@
+#ifndef SIMD_KERNELS_C
+#define SIMD_KERNELS_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <immintrin.h>
+
+// Hot loops compiled once per instruction set and selected at startup via CPUID
+// Each variant is built with a target attribute, so the program itself does not
+// need to be compiled for AVX and runs on any x86-64 CPU
+//
+// Kernels are compiled without FMA contraction and accumulate in the same order
+// as the scalar variant, so every variant produces bitwise identical results
+//
+// The variant can be forced by setting the NN_KERNELS environment variable to
+// scalar, sse2, avx2 or avx512, or by calling set_kernel_isa
+//
+// Sigmoid uses a polynomial exp (fast_exp) instead of libm, so that it can be
+// vectorized. The relative error of fast_exp is below EXP_MAX_REL_ERROR for
+// arguments in [EXP_MIN_ARG, EXP_MAX_ARG]; arguments outside are clamped
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+// exp(x) = 2^n * exp(r), with n = round(x / ln 2) and |r| <= ln(2) / 2
+// exp(r) is a degree 12 Taylor polynomial, ln 2 is split in two for an exact r
+#define EXP_MIN_ARG -708.0
+#define EXP_MAX_ARG 709.0
+#define EXP_MAX_REL_ERROR 1e-14
+#define EXP_DEGREE 12
+#define LOG2E 1.4426950408889634074
+#define LN2_HI 6.93145751953125e-1
+#define LN2_LO 1.42860682030941723212e-6
+
+double exp_coeffs[EXP_DEGREE + 1] = {
+    1.0, 1.0, 1.0 / 2.0, 1.0 / 6.0, 1.0 / 24.0, 1.0 / 120.0, 1.0 / 720.0, 
+    1.0 / 5040.0, 1.0 / 40320.0, 1.0 / 362880.0, 1.0 / 3628800.0, 
+    1.0 / 39916800.0, 1.0 / 479001600.0
+};
+
+enum isa {
+    ISA_SCALAR,
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512,
+    NUM_ISAS
+};
+
+char *isa_names[NUM_ISAS] = {"scalar", "sse2", "avx2", "avx512"};
+
+typedef struct {
+    enum isa isa;
+
+    // result[j] = sum over k of row1[k] * data2[k * cols2 + j]
+    void (*mat_mul_row)(double *result, const double *row1, const double *data2, size_t cols1, size_t cols2);
+
+    // Matrix-vector product for rows consecutive rows of data1
+    // result[i] = sum over k of data1[i * cols1 + k] * vec[k]
+    void (*gemv_rows)(double *result, const double *data1, const double *vec, size_t rows, size_t cols1);
+
+    // gemv_rows with data1 stored as fp16 or bf16 values (see half.c), each
+    // converted to double as it is loaded
+    void (*gemv_rows_f16)(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1);
+    void (*gemv_rows_bf16)(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1);
+    void (*f16_to_double)(double *result, const uint16_t *data, size_t length);
+    void (*bf16_to_double)(double *result, const uint16_t *data, size_t length);
+
+    // mat_mul_row for rows consecutive rows of data1, for a small cols2
+    void (*mat_mul_skinny)(double *result, const double *data1, const double *data2, size_t rows, size_t cols1, size_t cols2);
+
+    // mat_mul_row for a row given by its nnz nonzero entries, values[t] in column idx[t]
+    // result[j] = sum over t of values[t] * data2[idx[t] * cols2 + j]
+    // Used to skip the zero entries of row1, and for compressed sparse rows (see sparse.c)
+    void (*mat_mul_row_indexed)(double *result, const double *values, const unsigned int *idx, size_t nnz, const double *data2, size_t cols2);
+
+    // result[i] = c1 * data1[i] + c2 * data2[i]
+    void (*lin_combo)(double *result, const double *data1, const double *data2, double c1, double c2, size_t length);
+
+    void (*relu)(double *result, const double *data, size_t length);
+    void (*drelu)(double *result, const double *data, size_t length);
+    void (*sigmoid)(double *result, const double *data, size_t length);
+    void (*dsigmoid)(double *result, const double *data, size_t length);
+
+    // Activation derivative times the upstream gradient dA, in one pass
+    // drelu_mul takes the pre-activation Z, dsigmoid_mul the activation A
+    void (*drelu_mul)(double *result, const double *dA, const double *Z, size_t length);
+    void (*dsigmoid_mul)(double *result, const double *dA, const double *A, size_t length);
+
+    void (*elem_mul)(double *result, const double *data1, const double *data2, size_t length);
+    void (*scalar_mul)(double *result, const double *data, double c, size_t length);
+
+    // Dot product of unsigned and signed 8-bit vectors, length a multiple of 32
+    int32_t (*dot_u8s8)(const uint8_t *x, const int8_t *w, size_t length);
+} kernel_table;
+
+// Scalar reference kernels
+
+void mat_mul_row_tail(double *result, const double *row1, const double *data2, size_t cols1, size_t cols2, size_t j_start) {
+    // Scalar computation of result[j] for j_start <= j < cols2
+    
+    size_t j, k;
+    double dot_prod;
+
+    for (j = j_start; j < cols2; j++) {
+        dot_prod = 0;
+        for (k = 0; k < cols1; k++) {
+            dot_prod += row1[k] * data2[k * cols2 + j];
+        }
+        result[j] = dot_prod;
+    }
+}
+
+void lin_combo_scalar(double *result, const double *data1, const double *data2, double c1, double c2, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = c1 * data1[i] + c2 * data2[i];
+    }
+}
+
+void relu_scalar(double *result, const double *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = (data[i] > 0.0) ? data[i] : 0.0;
+    }
+}
+
+void drelu_scalar(double *result, const double *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = (data[i] > 0.0) ? 1.0 : 0.0;
+    }
+}
+
+int32_t dot_u8s8_scalar(const uint8_t *x, const int8_t *w, size_t length) {
+    size_t i;
+    int32_t sum = 0;
+    for (i = 0; i < length; i++) {
+        sum += (int32_t) x[i] * (int32_t) w[i];
+    }
+    return sum;
+}
+
+void mat_mul_row_scalar(double *result, const double *row1, const double *data2, size_t cols1, size_t cols2) {
+    mat_mul_row_tail(result, row1, data2, cols1, cols2, 0);
+}
+
+void gemv_rows_scalar(double *result, const double *data1, const double *vec, size_t rows, size_t cols1) {
+    size_t i, k;
+    double dot_prod;
+
+    for (i = 0; i < rows; i++) {
+        const double *row1 = data1 + i * cols1;
+        dot_prod = 0;
+        for (k = 0; k < cols1; k++) {
+            dot_prod += row1[k] * vec[k];
+        }
+        result[i] = dot_prod;
+    }
+}
+
+float f16_to_float(uint16_t value) {
+    // IEEE half precision to float, which represents every half value exactly
+
+    uint32_t sign = (uint32_t) (value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1f;
+    uint32_t mantissa = value & 0x3ff;
+    uint32_t bits;
+    float result;
+
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else {
+        // Zero or subnormal, mantissa * 2^-24
+        result = (float) mantissa * 5.9604644775390625e-8f;
+        return sign ? -result : result;
+    }
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+float bf16_to_float(uint16_t value) {
+    // bfloat16 is the upper half of a float
+
+    uint32_t bits = (uint32_t) value << 16;
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+void f16_to_double_scalar(double *result, const uint16_t *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = f16_to_float(data[i]);
+    }
+}
+
+void bf16_to_double_scalar(double *result, const uint16_t *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = bf16_to_float(data[i]);
+    }
+}
+
+void gemv_rows_f16_scalar(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1) {
+    size_t i, k;
+    double dot_prod;
+
+    for (i = 0; i < rows; i++) {
+        const uint16_t *row1 = data1 + i * cols1;
+        dot_prod = 0;
+        for (k = 0; k < cols1; k++) {
+            dot_prod += (double) f16_to_float(row1[k]) * vec[k];
+        }
+        result[i] = dot_prod;
+    }
+}
+
+void gemv_rows_bf16_scalar(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1) {
+    size_t i, k;
+    double dot_prod;
+
+    for (i = 0; i < rows; i++) {
+        const uint16_t *row1 = data1 + i * cols1;
+        dot_prod = 0;
+        for (k = 0; k < cols1; k++) {
+            dot_prod += (double) bf16_to_float(row1[k]) * vec[k];
+        }
+        result[i] = dot_prod;
+    }
+}
+
+void mat_mul_skinny_scalar(double *result, const double *data1, const double *data2, size_t rows, size_t cols1, size_t cols2) {
+    size_t i;
+    for (i = 0; i < rows; i++) {
+        mat_mul_row_tail(result + i * cols2, data1 + i * cols1, data2, cols1, cols2, 0);
+    }
+}
+
+void mat_mul_row_indexed_tail(double *result, const double *values, const unsigned int *idx, size_t nnz, const double *data2, size_t cols2, size_t j_start) {
+    size_t j, t;
+    double dot_prod;
+
+    for (j = j_start; j < cols2; j++) {
+        dot_prod = 0;
+        for (t = 0; t < nnz; t++) {
+            dot_prod += values[t] * data2[idx[t] * cols2 + j];
+        }
+        result[j] = dot_prod;
+    }
+}
+
+void mat_mul_row_indexed_scalar(double *result, const double *values, const unsigned int *idx, size_t nnz, const double *data2, size_t cols2) {
+    mat_mul_row_indexed_tail(result, values, idx, nnz, data2, cols2, 0);
+}
+
+double fast_exp(double x) {
+    // Polynomial approximation of exp(x), see EXP_MAX_REL_ERROR
+
+    x = fmin(fmax(x, EXP_MIN_ARG), EXP_MAX_ARG);
+    double n = nearbyint(x * LOG2E);
+    double r = (x - n * LN2_HI) - n * LN2_LO;
+    double p = exp_coeffs[EXP_DEGREE];
+    int k;
+
+    for (k = EXP_DEGREE - 1; k >= 0; k--) {
+        p = p * r + exp_coeffs[k];
+    }
+
+    uint64_t bits = (uint64_t) ((int64_t) n + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(double));
+    return p * scale;
+}
+
+void sigmoid_scalar(double *result, const double *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = 1.0 / (1.0 + fast_exp(-data[i]));
+    }
+}
+
+void dsigmoid_scalar(double *result, const double *data, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = data[i] * (1.0 - data[i]);
+    }
+}
+
+void drelu_mul_scalar(double *result, const double *dA, const double *Z, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = (Z[i] > 0.0) ? dA[i] : 0.0;
+    }
+}
+
+void dsigmoid_mul_scalar(double *result, const double *dA, const double *A, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = dA[i] * (A[i] * (1.0 - A[i]));
+    }
+}
+
+void elem_mul_scalar(double *result, const double *data1, const double *data2, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = data1[i] * data2[i];
+    }
+}
+
+void scalar_mul_scalar(double *result, const double *data, double c, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        result[i] = c * data[i];
+    }
+}
+
+// SSE2 kernels (2 doubles per vector)
+
+__attribute__((target("sse2")))
+void mat_mul_row_sse2(double *result, const double *row1, const double *data2, size_t cols1, size_t cols2) {
+    size_t cols2_for_tile = cols2 / 8 * 8;
+    size_t cols2_for_vec = cols2 / 2 * 2;
+    size_t j, k;
+
+    for (j = 0; j < cols2_for_tile; j += 8) {
+        __m128d sum0 = _mm_setzero_pd();
+        __m128d sum1 = _mm_setzero_pd();
+        __m128d sum2 = _mm_setzero_pd();
+        __m128d sum3 = _mm_setzero_pd();
+        for (k = 0; k < cols1; k++) {
+            __m128d a = _mm_set1_pd(row1[k]);
+            const double *b = data2 + k * cols2 + j;
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(a, _mm_loadu_pd(b)));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(a, _mm_loadu_pd(b + 2)));
+            sum2 = _mm_add_pd(sum2, _mm_mul_pd(a, _mm_loadu_pd(b + 4)));
+            sum3 = _mm_add_pd(sum3, _mm_mul_pd(a, _mm_loadu_pd(b + 6)));
+        }
+        _mm_storeu_pd(result + j, sum0);
+        _mm_storeu_pd(result + j + 2, sum1);
+        _mm_storeu_pd(result + j + 4, sum2);
+        _mm_storeu_pd(result + j + 6, sum3);
+    }
+    for (; j < cols2_for_vec; j += 2) {
+        __m128d sum = _mm_setzero_pd();
+        for (k = 0; k < cols1; k++) {
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_set1_pd(row1[k]), _mm_loadu_pd(data2 + k * cols2 + j)));
+        }
+        _mm_storeu_pd(result + j, sum);
+    }
+    mat_mul_row_tail(result, row1, data2, cols1, cols2, j);
+}
+
+__attribute__((target("sse2")))
+void mat_mul_row_indexed_sse2(double *result, const double *values, const unsigned int *idx, size_t nnz, const double *data2, size_t cols2) {
+    size_t cols2_for_tile = cols2 / 8 * 8;
+    size_t cols2_for_vec = cols2 / 2 * 2;
+    size_t j, t;
+
+    for (j = 0; j < cols2_for_tile; j += 8) {
+        __m128d sum0 = _mm_setzero_pd();
+        __m128d sum1 = _mm_setzero_pd();
+        __m128d sum2 = _mm_setzero_pd();
+        __m128d sum3 = _mm_setzero_pd();
+        for (t = 0; t < nnz; t++) {
+            __m128d a = _mm_set1_pd(values[t]);
+            const double *b = data2 + idx[t] * cols2 + j;
+            sum0 = _mm_add_pd(sum0, _mm_mul_pd(a, _mm_loadu_pd(b)));
+            sum1 = _mm_add_pd(sum1, _mm_mul_pd(a, _mm_loadu_pd(b + 2)));
+            sum2 = _mm_add_pd(sum2, _mm_mul_pd(a, _mm_loadu_pd(b + 4)));
+            sum3 = _mm_add_pd(sum3, _mm_mul_pd(a, _mm_loadu_pd(b + 6)));
+        }
+        _mm_storeu_pd(result + j, sum0);
+        _mm_storeu_pd(result + j + 2, sum1);
+        _mm_storeu_pd(result + j + 4, sum2);
+        _mm_storeu_pd(result + j + 6, sum3);
+    }
+    for (; j < cols2_for_vec; j += 2) {
+        __m128d sum = _mm_setzero_pd();
+        for (t = 0; t < nnz; t++) {
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_set1_pd(values[t]), _mm_loadu_pd(data2 + idx[t] * cols2 + j)));
+        }
+        _mm_storeu_pd(result + j, sum);
+    }
+    mat_mul_row_indexed_tail(result, values, idx, nnz, data2, cols2, j);
+}
+
+__attribute__((target("sse2")))
+void gemv_rows_sse2(double *result, const double *data1, const double *vec, size_t rows, size_t cols1) {
+    // Two rows at a time, one per lane, so each row is still summed in order of k
+    // 2x2 blocks of the rows are transposed in registers
+
+    size_t rows_for_vec = rows / 2 * 2;
+    size_t cols1_for_vec = cols1 / 2 * 2;
+    size_t i, k;
+
+    for (i = 0; i < rows_for_vec; i += 2) {
+        const double *row0 = data1 + i * cols1;
+        const double *row1 = row0 + cols1;
+        __m128d sum = _mm_setzero_pd();
+        for (k = 0; k < cols1_for_vec; k += 2) {
+            __m128d a0 = _mm_loadu_pd(row0 + k);
+            __m128d a1 = _mm_loadu_pd(row1 + k);
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_unpacklo_pd(a0, a1), _mm_set1_pd(vec[k])));
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_unpackhi_pd(a0, a1), _mm_set1_pd(vec[k + 1])));
+        }
+        for (; k < cols1; k++) {
+            sum = _mm_add_pd(sum, _mm_mul_pd(_mm_set_pd(row1[k], row0[k]), _mm_set1_pd(vec[k])));
+        }
+        _mm_storeu_pd(result + i, sum);
+    }
+    gemv_rows_scalar(result + i, data1 + i * cols1, vec, rows - i, cols1);
+}
+
+__attribute__((target("sse2")))
+void mat_mul_skinny_sse2(double *result, const double *data1, const double *data2, size_t rows, size_t cols1, size_t cols2) {
+    // Four rows at a time, so the four sums are independent of each other
+
+    size_t rows_for_tile = rows / 4 * 4;
+    size_t cols2_for_vec = cols2 / 2 * 2;
+    size_t i, j, k;
+
+    for (i = 0; i < rows_for_tile; i += 4) {
+        const double *row0 = data1 + i * cols1;
+        const double *row1 = row0 + cols1;
+        const double *row2 = row1 + cols1;
+        const double *row3 = row2 + cols1;
+        for (j = 0; j < cols2_for_vec; j += 2) {
+            __m128d sum0 = _mm_setzero_pd();
+            __m128d sum1 = _mm_setzero_pd();
+            __m128d sum2 = _mm_setzero_pd();
+            __m128d sum3 = _mm_setzero_pd();
+            for (k = 0; k < cols1; k++) {
+                __m128d b = _mm_loadu_pd(data2 + k * cols2 + j);
+                sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_set1_pd(row0[k]), b));
+                sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_set1_pd(row1[k]), b));
+                sum2 = _mm_add_pd(sum2, _mm_mul_pd(_mm_set1_pd(row2[k]), b));
+                sum3 = _mm_add_pd(sum3, _mm_mul_pd(_mm_set1_pd(row3[k]), b));
+            }
+            _mm_storeu_pd(result + i * cols2 + j, sum0);
+            _mm_storeu_pd(result + (i + 1) * cols2 + j, sum1);
+            _mm_storeu_pd(result + (i + 2) * cols2 + j, sum2);
+            _mm_storeu_pd(result + (i + 3) * cols2 + j, sum3);
+        }
+        for (k = 0; k < 4; k++) {
+            mat_mul_row_tail(result + (i + k) * cols2, data1 + (i + k) * cols1, data2, cols1, cols2, cols2_for_vec);
+        }
+    }
+    mat_mul_skinny_scalar(result + i * cols2, data1 + i * cols1, data2, rows - i, cols1, cols2);
+}
+
+__attribute__((target("sse2")))
+void lin_combo_sse2(double *result, const double *data1, const double *data2, double c1, double c2, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d c1_vec = _mm_set1_pd(c1);
+    __m128d c2_vec = _mm_set1_pd(c2);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        _mm_storeu_pd(result + i, _mm_add_pd(
+            _mm_mul_pd(_mm_loadu_pd(data1 + i), c1_vec),
+            _mm_mul_pd(_mm_loadu_pd(data2 + i), c2_vec)
+        ));
+    }
+    for (; i < length; i++) {
+        result[i] = c1 * data1[i] + c2 * data2[i];
+    }
+}
+
+__attribute__((target("sse2")))
+void relu_sse2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d zero = _mm_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        __m128d x = _mm_loadu_pd(data + i);
+        _mm_storeu_pd(result + i, _mm_and_pd(x, _mm_cmpgt_pd(x, zero)));
+    }
+    relu_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+void drelu_sse2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d zero = _mm_setzero_pd();
+    __m128d one = _mm_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        __m128d x = _mm_loadu_pd(data + i);
+        _mm_storeu_pd(result + i, _mm_and_pd(one, _mm_cmpgt_pd(x, zero)));
+    }
+    drelu_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+__m128d exp_sse2(__m128d x) {
+    // Vector version of fast_exp
+
+    x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(EXP_MIN_ARG)), _mm_set1_pd(EXP_MAX_ARG));
+    __m128i n_int = _mm_cvtpd_epi32(_mm_mul_pd(x, _mm_set1_pd(LOG2E)));
+    __m128d n = _mm_cvtepi32_pd(n_int);
+    __m128i bits = _mm_unpacklo_epi32(_mm_add_epi32(n_int, _mm_set1_epi32(1023)), _mm_setzero_si128());
+    __m128d scale = _mm_castsi128_pd(_mm_slli_epi64(bits, 52));
+    __m128d r = _mm_sub_pd(
+        _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(LN2_HI))), 
+        _mm_mul_pd(n, _mm_set1_pd(LN2_LO))
+    );
+    __m128d p = _mm_set1_pd(exp_coeffs[EXP_DEGREE]);
+    int k;
+
+    for (k = EXP_DEGREE - 1; k >= 0; k--) {
+        p = _mm_add_pd(_mm_mul_pd(p, r), _mm_set1_pd(exp_coeffs[k]));
+    }
+    return _mm_mul_pd(p, scale);
+}
+
+__attribute__((target("sse2")))
+void sigmoid_sse2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d one = _mm_set1_pd(1.0);
+    __m128d zero = _mm_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        __m128d e = exp_sse2(_mm_sub_pd(zero, _mm_loadu_pd(data + i)));
+        _mm_storeu_pd(result + i, _mm_div_pd(one, _mm_add_pd(one, e)));
+    }
+    sigmoid_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+void dsigmoid_sse2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d one = _mm_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        __m128d a = _mm_loadu_pd(data + i);
+        _mm_storeu_pd(result + i, _mm_mul_pd(a, _mm_sub_pd(one, a)));
+    }
+    dsigmoid_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("sse2")))
+void dsigmoid_mul_sse2(double *result, const double *dA, const double *A, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d one = _mm_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        __m128d a = _mm_loadu_pd(A + i);
+        _mm_storeu_pd(result + i, _mm_mul_pd(_mm_loadu_pd(dA + i), _mm_mul_pd(a, _mm_sub_pd(one, a))));
+    }
+    dsigmoid_mul_scalar(result + i, dA + i, A + i, length - i);
+}
+
+__attribute__((target("sse2")))
+void elem_mul_sse2(double *result, const double *data1, const double *data2, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        _mm_storeu_pd(result + i, _mm_mul_pd(_mm_loadu_pd(data1 + i), _mm_loadu_pd(data2 + i)));
+    }
+    elem_mul_scalar(result + i, data1 + i, data2 + i, length - i);
+}
+
+__attribute__((target("sse2")))
+void scalar_mul_sse2(double *result, const double *data, double c, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d c_vec = _mm_set1_pd(c);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        _mm_storeu_pd(result + i, _mm_mul_pd(c_vec, _mm_loadu_pd(data + i)));
+    }
+    scalar_mul_scalar(result + i, data + i, c, length - i);
+}
+
+__attribute__((target("sse2")))
+void drelu_mul_sse2(double *result, const double *dA, const double *Z, size_t length) {
+    size_t length_for_vec = length / 2 * 2;
+    __m128d zero = _mm_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 2) {
+        __m128d positive = _mm_cmpgt_pd(_mm_loadu_pd(Z + i), zero);
+        _mm_storeu_pd(result + i, _mm_and_pd(_mm_loadu_pd(dA + i), positive));
+    }
+    drelu_mul_scalar(result + i, dA + i, Z + i, length - i);
+}
+
+// AVX2 kernels (4 doubles per vector)
+
+__attribute__((target("avx2")))
+void mat_mul_row_avx2(double *result, const double *row1, const double *data2, size_t cols1, size_t cols2) {
+    size_t cols2_for_tile = cols2 / 16 * 16;
+    size_t cols2_for_vec = cols2 / 4 * 4;
+    size_t j, k;
+
+    for (j = 0; j < cols2_for_tile; j += 16) {
+        __m256d sum0 = _mm256_setzero_pd();
+        __m256d sum1 = _mm256_setzero_pd();
+        __m256d sum2 = _mm256_setzero_pd();
+        __m256d sum3 = _mm256_setzero_pd();
+        for (k = 0; k < cols1; k++) {
+            __m256d a = _mm256_broadcast_sd(row1 + k);
+            const double *b = data2 + k * cols2 + j;
+            sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(a, _mm256_loadu_pd(b)));
+            sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(a, _mm256_loadu_pd(b + 4)));
+            sum2 = _mm256_add_pd(sum2, _mm256_mul_pd(a, _mm256_loadu_pd(b + 8)));
+            sum3 = _mm256_add_pd(sum3, _mm256_mul_pd(a, _mm256_loadu_pd(b + 12)));
+        }
+        _mm256_storeu_pd(result + j, sum0);
+        _mm256_storeu_pd(result + j + 4, sum1);
+        _mm256_storeu_pd(result + j + 8, sum2);
+        _mm256_storeu_pd(result + j + 12, sum3);
+    }
+    for (; j < cols2_for_vec; j += 4) {
+        __m256d sum = _mm256_setzero_pd();
+        for (k = 0; k < cols1; k++) {
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_broadcast_sd(row1 + k), _mm256_loadu_pd(data2 + k * cols2 + j)));
+        }
+        _mm256_storeu_pd(result + j, sum);
+    }
+    mat_mul_row_tail(result, row1, data2, cols1, cols2, j);
+}
+
+__attribute__((target("avx2")))
+void mat_mul_row_indexed_avx2(double *result, const double *values, const unsigned int *idx, size_t nnz, const double *data2, size_t cols2) {
+    size_t cols2_for_tile = cols2 / 16 * 16;
+    size_t cols2_for_vec = cols2 / 4 * 4;
+    size_t j, t;
+
+    for (j = 0; j < cols2_for_tile; j += 16) {
+        __m256d sum0 = _mm256_setzero_pd();
+        __m256d sum1 = _mm256_setzero_pd();
+        __m256d sum2 = _mm256_setzero_pd();
+        __m256d sum3 = _mm256_setzero_pd();
+        for (t = 0; t < nnz; t++) {
+            __m256d a = _mm256_set1_pd(values[t]);
+            const double *b = data2 + idx[t] * cols2 + j;
+            sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(a, _mm256_loadu_pd(b)));
+            sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(a, _mm256_loadu_pd(b + 4)));
+            sum2 = _mm256_add_pd(sum2, _mm256_mul_pd(a, _mm256_loadu_pd(b + 8)));
+            sum3 = _mm256_add_pd(sum3, _mm256_mul_pd(a, _mm256_loadu_pd(b + 12)));
+        }
+        _mm256_storeu_pd(result + j, sum0);
+        _mm256_storeu_pd(result + j + 4, sum1);
+        _mm256_storeu_pd(result + j + 8, sum2);
+        _mm256_storeu_pd(result + j + 12, sum3);
+    }
+    for (; j < cols2_for_vec; j += 4) {
+        __m256d sum = _mm256_setzero_pd();
+        for (t = 0; t < nnz; t++) {
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_set1_pd(values[t]), _mm256_loadu_pd(data2 + idx[t] * cols2 + j)));
+        }
+        _mm256_storeu_pd(result + j, sum);
+    }
+    mat_mul_row_indexed_tail(result, values, idx, nnz, data2, cols2, j);
+}
+
+__attribute__((target("avx2")))
+void gemv_rows_avx2(double *result, const double *data1, const double *vec, size_t rows, size_t cols1) {
+    // Four rows at a time, one per lane, so each row is still summed in order of k
+    // 4x4 blocks of the rows are transposed in registers
+
+    size_t rows_for_vec = rows / 4 * 4;
+    size_t cols1_for_vec = cols1 / 4 * 4;
+    size_t i, k;
+
+    for (i = 0; i < rows_for_vec; i += 4) {
+        const double *row0 = data1 + i * cols1;
+        const double *row1 = row0 + cols1;
+        const double *row2 = row1 + cols1;
+        const double *row3 = row2 + cols1;
+        __m256d sum = _mm256_setzero_pd();
+        for (k = 0; k < cols1_for_vec; k += 4) {
+            __m256d a0 = _mm256_loadu_pd(row0 + k);
+            __m256d a1 = _mm256_loadu_pd(row1 + k);
+            __m256d a2 = _mm256_loadu_pd(row2 + k);
+            __m256d a3 = _mm256_loadu_pd(row3 + k);
+            __m256d t0 = _mm256_unpacklo_pd(a0, a1);
+            __m256d t1 = _mm256_unpackhi_pd(a0, a1);
+            __m256d t2 = _mm256_unpacklo_pd(a2, a3);
+            __m256d t3 = _mm256_unpackhi_pd(a2, a3);
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t0, t2, 0x20), _mm256_broadcast_sd(vec + k)));
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t1, t3, 0x20), _mm256_broadcast_sd(vec + k + 1)));
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t0, t2, 0x31), _mm256_broadcast_sd(vec + k + 2)));
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t1, t3, 0x31), _mm256_broadcast_sd(vec + k + 3)));
+        }
+        for (; k < cols1; k++) {
+            __m256d a = _mm256_set_pd(row3[k], row2[k], row1[k], row0[k]);
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(a, _mm256_broadcast_sd(vec + k)));
+        }
+        _mm256_storeu_pd(result + i, sum);
+    }
+    gemv_rows_scalar(result + i, data1 + i * cols1, vec, rows - i, cols1);
+}
+
+__attribute__((target("avx2,f16c")))
+static inline __m256 load_half_avx2(const uint16_t *data, bool bf16) {
+    // Eight fp16 or bf16 values as floats
+
+    __m128i half = _mm_loadu_si128((const __m128i *) data);
+    if (bf16) {
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(half), 16));
+    }
+    return _mm256_cvtph_ps(half);
+}
+
+__attribute__((target("avx2,f16c")))
+static inline __m256d gemv_block_avx2(__m256d sum, __m256d a0, __m256d a1, __m256d a2, __m256d a3, const double *vec) {
+    // Add a 4x4 block of four rows times vec[0..3], transposed so that each lane sums one row in order
+
+    __m256d t0 = _mm256_unpacklo_pd(a0, a1);
+    __m256d t1 = _mm256_unpackhi_pd(a0, a1);
+    __m256d t2 = _mm256_unpacklo_pd(a2, a3);
+    __m256d t3 = _mm256_unpackhi_pd(a2, a3);
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t0, t2, 0x20), _mm256_broadcast_sd(vec)));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t1, t3, 0x20), _mm256_broadcast_sd(vec + 1)));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t0, t2, 0x31), _mm256_broadcast_sd(vec + 2)));
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_permute2f128_pd(t1, t3, 0x31), _mm256_broadcast_sd(vec + 3)));
+    return sum;
+}
+
+__attribute__((target("avx2,f16c")))
+static inline void gemv_rows_half_avx2(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1, bool bf16) {
+    // gemv_rows_avx2 on weights converted from fp16 or bf16 eight at a time as they
+    // are loaded, which reads a quarter of the bytes of double weights
+
+    size_t rows_for_vec = rows / 4 * 4;
+    size_t cols1_for_vec = cols1 / 8 * 8;
+    size_t i, k;
+
+    for (i = 0; i < rows_for_vec; i += 4) {
+        const uint16_t *row0 = data1 + i * cols1;
+        const uint16_t *row1 = row0 + cols1;
+        const uint16_t *row2 = row1 + cols1;
+        const uint16_t *row3 = row2 + cols1;
+        __m256d sum = _mm256_setzero_pd();
+        for (k = 0; k < cols1_for_vec; k += 8) {
+            __m256 a0 = load_half_avx2(row0 + k, bf16);
+            __m256 a1 = load_half_avx2(row1 + k, bf16);
+            __m256 a2 = load_half_avx2(row2 + k, bf16);
+            __m256 a3 = load_half_avx2(row3 + k, bf16);
+            sum = gemv_block_avx2(sum, _mm256_cvtps_pd(_mm256_castps256_ps128(a0)), _mm256_cvtps_pd(_mm256_castps256_ps128(a1)),
+                _mm256_cvtps_pd(_mm256_castps256_ps128(a2)), _mm256_cvtps_pd(_mm256_castps256_ps128(a3)), vec + k);
+            sum = gemv_block_avx2(sum, _mm256_cvtps_pd(_mm256_extractf128_ps(a0, 1)), _mm256_cvtps_pd(_mm256_extractf128_ps(a1, 1)),
+                _mm256_cvtps_pd(_mm256_extractf128_ps(a2, 1)), _mm256_cvtps_pd(_mm256_extractf128_ps(a3, 1)), vec + k + 4);
+        }
+        for (; k < cols1; k++) {
+            __m256d a = bf16
+                ? _mm256_set_pd(bf16_to_float(row3[k]), bf16_to_float(row2[k]), bf16_to_float(row1[k]), bf16_to_float(row0[k]))
+                : _mm256_set_pd(f16_to_float(row3[k]), f16_to_float(row2[k]), f16_to_float(row1[k]), f16_to_float(row0[k]));
+            sum = _mm256_add_pd(sum, _mm256_mul_pd(a, _mm256_broadcast_sd(vec + k)));
+        }
+        _mm256_storeu_pd(result + i, sum);
+    }
+    if (bf16) {
+        gemv_rows_bf16_scalar(result + i, data1 + i * cols1, vec, rows - i, cols1);
+    } else {
+        gemv_rows_f16_scalar(result + i, data1 + i * cols1, vec, rows - i, cols1);
+    }
+}
+
+__attribute__((target("avx2,f16c")))
+void f16_to_double_avx2(double *result, const uint16_t *data, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __m256 a = load_half_avx2(data + i, false);
+        _mm256_storeu_pd(result + i, _mm256_cvtps_pd(_mm256_castps256_ps128(a)));
+        _mm256_storeu_pd(result + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1)));
+    }
+    f16_to_double_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void bf16_to_double_avx2(double *result, const uint16_t *data, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __m256 a = load_half_avx2(data + i, true);
+        _mm256_storeu_pd(result + i, _mm256_cvtps_pd(_mm256_castps256_ps128(a)));
+        _mm256_storeu_pd(result + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(a, 1)));
+    }
+    bf16_to_double_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void gemv_rows_f16_avx2(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1) {
+    gemv_rows_half_avx2(result, data1, vec, rows, cols1, false);
+}
+
+__attribute__((target("avx2,f16c")))
+void gemv_rows_bf16_avx2(double *result, const uint16_t *data1, const double *vec, size_t rows, size_t cols1) {
+    gemv_rows_half_avx2(result, data1, vec, rows, cols1, true);
+}
+
+__attribute__((target("avx2")))
+void mat_mul_skinny_avx2(double *result, const double *data1, const double *data2, size_t rows, size_t cols1, size_t cols2) {
+    // Four rows at a time, so the four sums are independent of each other
+    // The last partial vector of columns uses masked loads and stores
+    // Above 8 columns, two rows are done at a time with all columns in registers
+
+    size_t rows_for_tile = rows / 4 * 4;
+    __m256i lane = _mm256_set_epi64x(3, 2, 1, 0);
+    size_t i, j, k;
+
+    if (cols2 > 8) {
+        __m256i mask2 = _mm256_cmpgt_epi64(_mm256_set1_epi64x(cols2 - 8), lane);
+        __m256i mask3 = _mm256_cmpgt_epi64(_mm256_set1_epi64x(cols2 - 12), lane);
+        rows_for_tile = rows / 2 * 2;
+
+        for (i = 0; i < rows_for_tile; i += 2) {
+            const double *row0 = data1 + i * cols1;
+            const double *row1 = row0 + cols1;
+            __m256d sum00 = _mm256_setzero_pd();
+            __m256d sum01 = _mm256_setzero_pd();
+            __m256d sum02 = _mm256_setzero_pd();
+            __m256d sum03 = _mm256_setzero_pd();
+            __m256d sum10 = _mm256_setzero_pd();
+            __m256d sum11 = _mm256_setzero_pd();
+            __m256d sum12 = _mm256_setzero_pd();
+            __m256d sum13 = _mm256_setzero_pd();
+            for (k = 0; k < cols1; k++) {
+                const double *b = data2 + k * cols2;
+                __m256d b0 = _mm256_loadu_pd(b);
+                __m256d b1 = _mm256_loadu_pd(b + 4);
+                __m256d b2 = _mm256_maskload_pd(b + 8, mask2);
+                __m256d b3 = _mm256_maskload_pd(b + 12, mask3);
+                __m256d a0 = _mm256_broadcast_sd(row0 + k);
+                __m256d a1 = _mm256_broadcast_sd(row1 + k);
+                sum00 = _mm256_add_pd(sum00, _mm256_mul_pd(a0, b0));
+                sum01 = _mm256_add_pd(sum01, _mm256_mul_pd(a0, b1));
+                sum02 = _mm256_add_pd(sum02, _mm256_mul_pd(a0, b2));
+                sum03 = _mm256_add_pd(sum03, _mm256_mul_pd(a0, b3));
+                sum10 = _mm256_add_pd(sum10, _mm256_mul_pd(a1, b0));
+                sum11 = _mm256_add_pd(sum11, _mm256_mul_pd(a1, b1));
+                sum12 = _mm256_add_pd(sum12, _mm256_mul_pd(a1, b2));
+                sum13 = _mm256_add_pd(sum13, _mm256_mul_pd(a1, b3));
+            }
+            double *result0 = result + i * cols2;
+            double *result1 = result0 + cols2;
+            _mm256_storeu_pd(result0, sum00);
+            _mm256_storeu_pd(result0 + 4, sum01);
+            _mm256_maskstore_pd(result0 + 8, mask2, sum02);
+            _mm256_maskstore_pd(result0 + 12, mask3, sum03);
+            _mm256_storeu_pd(result1, sum10);
+            _mm256_storeu_pd(result1 + 4, sum11);
+            _mm256_maskstore_pd(result1 + 8, mask2, sum12);
+            _mm256_maskstore_pd(result1 + 12, mask3, sum13);
+        }
+        mat_mul_skinny_scalar(result + i * cols2, data1 + i * cols1, data2, rows - i, cols1, cols2);
+        return;
+    }
+
+    for (i = 0; i < rows_for_tile; i += 4) {
+        const double *row0 = data1 + i * cols1;
+        const double *row1 = row0 + cols1;
+        const double *row2 = row1 + cols1;
+        const double *row3 = row2 + cols1;
+        for (j = 0; j < cols2; j += 4) {
+            __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(cols2 - j), lane);
+            __m256d sum0 = _mm256_setzero_pd();
+            __m256d sum1 = _mm256_setzero_pd();
+            __m256d sum2 = _mm256_setzero_pd();
+            __m256d sum3 = _mm256_setzero_pd();
+            for (k = 0; k < cols1; k++) {
+                __m256d b = _mm256_maskload_pd(data2 + k * cols2 + j, mask);
+                sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_broadcast_sd(row0 + k), b));
+                sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_broadcast_sd(row1 + k), b));
+                sum2 = _mm256_add_pd(sum2, _mm256_mul_pd(_mm256_broadcast_sd(row2 + k), b));
+                sum3 = _mm256_add_pd(sum3, _mm256_mul_pd(_mm256_broadcast_sd(row3 + k), b));
+            }
+            _mm256_maskstore_pd(result + i * cols2 + j, mask, sum0);
+            _mm256_maskstore_pd(result + (i + 1) * cols2 + j, mask, sum1);
+            _mm256_maskstore_pd(result + (i + 2) * cols2 + j, mask, sum2);
+            _mm256_maskstore_pd(result + (i + 3) * cols2 + j, mask, sum3);
+        }
+    }
+    mat_mul_skinny_scalar(result + i * cols2, data1 + i * cols1, data2, rows - i, cols1, cols2);
+}
+
+__attribute__((target("avx2")))
+void lin_combo_avx2(double *result, const double *data1, const double *data2, double c1, double c2, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d c1_vec = _mm256_set1_pd(c1);
+    __m256d c2_vec = _mm256_set1_pd(c2);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_add_pd(
+            _mm256_mul_pd(_mm256_loadu_pd(data1 + i), c1_vec),
+            _mm256_mul_pd(_mm256_loadu_pd(data2 + i), c2_vec)
+        ));
+    }
+    for (; i < length; i++) {
+        result[i] = c1 * data1[i] + c2 * data2[i];
+    }
+}
+
+__attribute__((target("avx2")))
+void relu_avx2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d zero = _mm256_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        __m256d x = _mm256_loadu_pd(data + i);
+        _mm256_storeu_pd(result + i, _mm256_and_pd(x, _mm256_cmp_pd(x, zero, _CMP_GT_OQ)));
+    }
+    relu_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void drelu_avx2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d zero = _mm256_setzero_pd();
+    __m256d one = _mm256_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        __m256d x = _mm256_loadu_pd(data + i);
+        _mm256_storeu_pd(result + i, _mm256_and_pd(one, _mm256_cmp_pd(x, zero, _CMP_GT_OQ)));
+    }
+    drelu_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+__m256d exp_avx2(__m256d x) {
+    // Vector version of fast_exp
+
+    x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(EXP_MIN_ARG)), _mm256_set1_pd(EXP_MAX_ARG));
+    __m128i n_int = _mm256_cvtpd_epi32(_mm256_mul_pd(x, _mm256_set1_pd(LOG2E)));
+    __m256d n = _mm256_cvtepi32_pd(n_int);
+    __m256i bits = _mm256_cvtepi32_epi64(_mm_add_epi32(n_int, _mm_set1_epi32(1023)));
+    __m256d scale = _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52));
+    __m256d r = _mm256_sub_pd(
+        _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(LN2_HI))), 
+        _mm256_mul_pd(n, _mm256_set1_pd(LN2_LO))
+    );
+    __m256d p = _mm256_set1_pd(exp_coeffs[EXP_DEGREE]);
+    int k;
+
+    for (k = EXP_DEGREE - 1; k >= 0; k--) {
+        p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(exp_coeffs[k]));
+    }
+    return _mm256_mul_pd(p, scale);
+}
+
+__attribute__((target("avx2")))
+void sigmoid_avx2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d zero = _mm256_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        __m256d e = exp_avx2(_mm256_sub_pd(zero, _mm256_loadu_pd(data + i)));
+        _mm256_storeu_pd(result + i, _mm256_div_pd(one, _mm256_add_pd(one, e)));
+    }
+    sigmoid_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void dsigmoid_avx2(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d one = _mm256_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        __m256d a = _mm256_loadu_pd(data + i);
+        _mm256_storeu_pd(result + i, _mm256_mul_pd(a, _mm256_sub_pd(one, a)));
+    }
+    dsigmoid_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void dsigmoid_mul_avx2(double *result, const double *dA, const double *A, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d one = _mm256_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        __m256d a = _mm256_loadu_pd(A + i);
+        _mm256_storeu_pd(result + i, _mm256_mul_pd(_mm256_loadu_pd(dA + i), _mm256_mul_pd(a, _mm256_sub_pd(one, a))));
+    }
+    dsigmoid_mul_scalar(result + i, dA + i, A + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void elem_mul_avx2(double *result, const double *data1, const double *data2, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_mul_pd(_mm256_loadu_pd(data1 + i), _mm256_loadu_pd(data2 + i)));
+    }
+    elem_mul_scalar(result + i, data1 + i, data2 + i, length - i);
+}
+
+__attribute__((target("avx2")))
+void scalar_mul_avx2(double *result, const double *data, double c, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d c_vec = _mm256_set1_pd(c);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_mul_pd(c_vec, _mm256_loadu_pd(data + i)));
+    }
+    scalar_mul_scalar(result + i, data + i, c, length - i);
+}
+
+__attribute__((target("avx2")))
+void drelu_mul_avx2(double *result, const double *dA, const double *Z, size_t length) {
+    size_t length_for_vec = length / 4 * 4;
+    __m256d zero = _mm256_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 4) {
+        __m256d positive = _mm256_cmp_pd(_mm256_loadu_pd(Z + i), zero, _CMP_GT_OQ);
+        _mm256_storeu_pd(result + i, _mm256_and_pd(_mm256_loadu_pd(dA + i), positive));
+    }
+    drelu_mul_scalar(result + i, dA + i, Z + i, length - i);
+}
+
+__attribute__((target("avx2")))
+int32_t hsum_epi32_avx2(__m256i sum_vec) {
+    __m128i sum_128 = _mm_add_epi32(
+        _mm256_castsi256_si128(sum_vec),
+        _mm256_extracti128_si256(sum_vec, 1)
+    );
+    sum_128 = _mm_hadd_epi32(sum_128, sum_128);
+    sum_128 = _mm_hadd_epi32(sum_128, sum_128);
+    return _mm_cvtsi128_si32(sum_128);
+}
+
+__attribute__((target("avx2")))
+int32_t dot_u8s8_avx2(const uint8_t *x, const int8_t *w, size_t length) {
+    // _mm256_maddubs_epi16 saturates int16, so x must hold 7-bit values
+
+    __m256i sum_vec = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi16(1);
+    size_t i;
+
+    for (i = 0; i < length; i += 32) {
+        __m256i prod = _mm256_maddubs_epi16(
+            _mm256_loadu_si256((const __m256i *) (x + i)),
+            _mm256_loadu_si256((const __m256i *) (w + i))
+        );
+        sum_vec = _mm256_add_epi32(sum_vec, _mm256_madd_epi16(prod, ones));
+    }
+    return hsum_epi32_avx2(sum_vec);
+}
+
+// AVX-512 kernels (8 doubles per vector)
+
+__attribute__((target("avx512f")))
+void mat_mul_row_avx512(double *result, const double *row1, const double *data2, size_t cols1, size_t cols2) {
+    size_t cols2_for_tile = cols2 / 32 * 32;
+    size_t cols2_for_vec = cols2 / 8 * 8;
+    size_t j, k;
+
+    for (j = 0; j < cols2_for_tile; j += 32) {
+        __m512d sum0 = _mm512_setzero_pd();
+        __m512d sum1 = _mm512_setzero_pd();
+        __m512d sum2 = _mm512_setzero_pd();
+        __m512d sum3 = _mm512_setzero_pd();
+        for (k = 0; k < cols1; k++) {
+            __m512d a = _mm512_set1_pd(row1[k]);
+            const double *b = data2 + k * cols2 + j;
+            sum0 = _mm512_add_pd(sum0, _mm512_mul_pd(a, _mm512_loadu_pd(b)));
+            sum1 = _mm512_add_pd(sum1, _mm512_mul_pd(a, _mm512_loadu_pd(b + 8)));
+            sum2 = _mm512_add_pd(sum2, _mm512_mul_pd(a, _mm512_loadu_pd(b + 16)));
+            sum3 = _mm512_add_pd(sum3, _mm512_mul_pd(a, _mm512_loadu_pd(b + 24)));
+        }
+        _mm512_storeu_pd(result + j, sum0);
+        _mm512_storeu_pd(result + j + 8, sum1);
+        _mm512_storeu_pd(result + j + 16, sum2);
+        _mm512_storeu_pd(result + j + 24, sum3);
+    }
+    for (; j < cols2_for_vec; j += 8) {
+        __m512d sum = _mm512_setzero_pd();
+        for (k = 0; k < cols1; k++) {
+            sum = _mm512_add_pd(sum, _mm512_mul_pd(_mm512_set1_pd(row1[k]), _mm512_loadu_pd(data2 + k * cols2 + j)));
+        }
+        _mm512_storeu_pd(result + j, sum);
+    }
+    mat_mul_row_tail(result, row1, data2, cols1, cols2, j);
+}
+
+__attribute__((target("avx512f")))
+void mat_mul_row_indexed_avx512(double *result, const double *values, const unsigned int *idx, size_t nnz, const double *data2, size_t cols2) {
+    size_t cols2_for_tile = cols2 / 32 * 32;
+    size_t cols2_for_vec = cols2 / 8 * 8;
+    size_t j, t;
+
+    for (j = 0; j < cols2_for_tile; j += 32) {
+        __m512d sum0 = _mm512_setzero_pd();
+        __m512d sum1 = _mm512_setzero_pd();
+        __m512d sum2 = _mm512_setzero_pd();
+        __m512d sum3 = _mm512_setzero_pd();
+        for (t = 0; t < nnz; t++) {
+            __m512d a = _mm512_set1_pd(values[t]);
+            const double *b = data2 + idx[t] * cols2 + j;
+            sum0 = _mm512_add_pd(sum0, _mm512_mul_pd(a, _mm512_loadu_pd(b)));
+            sum1 = _mm512_add_pd(sum1, _mm512_mul_pd(a, _mm512_loadu_pd(b + 8)));
+            sum2 = _mm512_add_pd(sum2, _mm512_mul_pd(a, _mm512_loadu_pd(b + 16)));
+            sum3 = _mm512_add_pd(sum3, _mm512_mul_pd(a, _mm512_loadu_pd(b + 24)));
+        }
+        _mm512_storeu_pd(result + j, sum0);
+        _mm512_storeu_pd(result + j + 8, sum1);
+        _mm512_storeu_pd(result + j + 16, sum2);
+        _mm512_storeu_pd(result + j + 24, sum3);
+    }
+    for (; j < cols2_for_vec; j += 8) {
+        __m512d sum = _mm512_setzero_pd();
+        for (t = 0; t < nnz; t++) {
+            sum = _mm512_add_pd(sum, _mm512_mul_pd(_mm512_set1_pd(values[t]), _mm512_loadu_pd(data2 + idx[t] * cols2 + j)));
+        }
+        _mm512_storeu_pd(result + j, sum);
+    }
+    mat_mul_row_indexed_tail(result, values, idx, nnz, data2, cols2, j);
+}
+
+__attribute__((target("avx512f")))
+void mat_mul_skinny_avx512(double *result, const double *data1, const double *data2, size_t rows, size_t cols1, size_t cols2) {
+    // Four rows at a time, so the four sums are independent of each other
+    // The last partial vector of columns uses masked loads and stores
+
+    size_t rows_for_tile = rows / 4 * 4;
+    size_t i, j, k;
+
+    for (i = 0; i < rows_for_tile; i += 4) {
+        const double *row0 = data1 + i * cols1;
+        const double *row1 = row0 + cols1;
+        const double *row2 = row1 + cols1;
+        const double *row3 = row2 + cols1;
+        for (j = 0; j < cols2; j += 8) {
+            __mmask8 mask = (cols2 - j >= 8) ? 0xFF : (__mmask8) ((1 << (cols2 - j)) - 1);
+            __m512d sum0 = _mm512_setzero_pd();
+            __m512d sum1 = _mm512_setzero_pd();
+            __m512d sum2 = _mm512_setzero_pd();
+            __m512d sum3 = _mm512_setzero_pd();
+            for (k = 0; k < cols1; k++) {
+                __m512d b = _mm512_maskz_loadu_pd(mask, data2 + k * cols2 + j);
+                sum0 = _mm512_add_pd(sum0, _mm512_mul_pd(_mm512_set1_pd(row0[k]), b));
+                sum1 = _mm512_add_pd(sum1, _mm512_mul_pd(_mm512_set1_pd(row1[k]), b));
+                sum2 = _mm512_add_pd(sum2, _mm512_mul_pd(_mm512_set1_pd(row2[k]), b));
+                sum3 = _mm512_add_pd(sum3, _mm512_mul_pd(_mm512_set1_pd(row3[k]), b));
+            }
+            _mm512_mask_storeu_pd(result + i * cols2 + j, mask, sum0);
+            _mm512_mask_storeu_pd(result + (i + 1) * cols2 + j, mask, sum1);
+            _mm512_mask_storeu_pd(result + (i + 2) * cols2 + j, mask, sum2);
+            _mm512_mask_storeu_pd(result + (i + 3) * cols2 + j, mask, sum3);
+        }
+    }
+    mat_mul_skinny_scalar(result + i * cols2, data1 + i * cols1, data2, rows - i, cols1, cols2);
+}
+
+__attribute__((target("avx512f")))
+void lin_combo_avx512(double *result, const double *data1, const double *data2, double c1, double c2, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d c1_vec = _mm512_set1_pd(c1);
+    __m512d c2_vec = _mm512_set1_pd(c2);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_add_pd(
+            _mm512_mul_pd(_mm512_loadu_pd(data1 + i), c1_vec),
+            _mm512_mul_pd(_mm512_loadu_pd(data2 + i), c2_vec)
+        ));
+    }
+    for (; i < length; i++) {
+        result[i] = c1 * data1[i] + c2 * data2[i];
+    }
+}
+
+__attribute__((target("avx512f")))
+void relu_avx512(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d zero = _mm512_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __m512d x = _mm512_loadu_pd(data + i);
+        __mmask8 positive = _mm512_cmp_pd_mask(x, zero, _CMP_GT_OQ);
+        _mm512_storeu_pd(result + i, _mm512_maskz_mov_pd(positive, x));
+    }
+    relu_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+void drelu_avx512(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d zero = _mm512_setzero_pd();
+    __m512d one = _mm512_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __mmask8 positive = _mm512_cmp_pd_mask(_mm512_loadu_pd(data + i), zero, _CMP_GT_OQ);
+        _mm512_storeu_pd(result + i, _mm512_maskz_mov_pd(positive, one));
+    }
+    drelu_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+__m512d exp_avx512(__m512d x) {
+    // Vector version of fast_exp
+
+    x = _mm512_min_pd(_mm512_max_pd(x, _mm512_set1_pd(EXP_MIN_ARG)), _mm512_set1_pd(EXP_MAX_ARG));
+    __m256i n_int = _mm512_cvtpd_epi32(_mm512_mul_pd(x, _mm512_set1_pd(LOG2E)));
+    __m512d n = _mm512_cvtepi32_pd(n_int);
+    __m512i bits = _mm512_cvtepi32_epi64(_mm256_add_epi32(n_int, _mm256_set1_epi32(1023)));
+    __m512d scale = _mm512_castsi512_pd(_mm512_slli_epi64(bits, 52));
+    __m512d r = _mm512_sub_pd(
+        _mm512_sub_pd(x, _mm512_mul_pd(n, _mm512_set1_pd(LN2_HI))), 
+        _mm512_mul_pd(n, _mm512_set1_pd(LN2_LO))
+    );
+    __m512d p = _mm512_set1_pd(exp_coeffs[EXP_DEGREE]);
+    int k;
+
+    for (k = EXP_DEGREE - 1; k >= 0; k--) {
+        p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(exp_coeffs[k]));
+    }
+    return _mm512_mul_pd(p, scale);
+}
+
+__attribute__((target("avx512f")))
+void sigmoid_avx512(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d one = _mm512_set1_pd(1.0);
+    __m512d zero = _mm512_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __m512d e = exp_avx512(_mm512_sub_pd(zero, _mm512_loadu_pd(data + i)));
+        _mm512_storeu_pd(result + i, _mm512_div_pd(one, _mm512_add_pd(one, e)));
+    }
+    sigmoid_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+void dsigmoid_avx512(double *result, const double *data, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d one = _mm512_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __m512d a = _mm512_loadu_pd(data + i);
+        _mm512_storeu_pd(result + i, _mm512_mul_pd(a, _mm512_sub_pd(one, a)));
+    }
+    dsigmoid_scalar(result + i, data + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+void dsigmoid_mul_avx512(double *result, const double *dA, const double *A, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d one = _mm512_set1_pd(1.0);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __m512d a = _mm512_loadu_pd(A + i);
+        _mm512_storeu_pd(result + i, _mm512_mul_pd(_mm512_loadu_pd(dA + i), _mm512_mul_pd(a, _mm512_sub_pd(one, a))));
+    }
+    dsigmoid_mul_scalar(result + i, dA + i, A + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+void elem_mul_avx512(double *result, const double *data1, const double *data2, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_mul_pd(_mm512_loadu_pd(data1 + i), _mm512_loadu_pd(data2 + i)));
+    }
+    elem_mul_scalar(result + i, data1 + i, data2 + i, length - i);
+}
+
+__attribute__((target("avx512f")))
+void scalar_mul_avx512(double *result, const double *data, double c, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d c_vec = _mm512_set1_pd(c);
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_mul_pd(c_vec, _mm512_loadu_pd(data + i)));
+    }
+    scalar_mul_scalar(result + i, data + i, c, length - i);
+}
+
+__attribute__((target("avx512f")))
+void drelu_mul_avx512(double *result, const double *dA, const double *Z, size_t length) {
+    size_t length_for_vec = length / 8 * 8;
+    __m512d zero = _mm512_setzero_pd();
+    size_t i;
+
+    for (i = 0; i < length_for_vec; i += 8) {
+        __mmask8 positive = _mm512_cmp_pd_mask(_mm512_loadu_pd(Z + i), zero, _CMP_GT_OQ);
+        _mm512_storeu_pd(result + i, _mm512_maskz_loadu_pd(positive, dA + i));
+    }
+    drelu_mul_scalar(result + i, dA + i, Z + i, length - i);
+}
+
+__attribute__((target("avx2,avx512vnni,avx512vl")))
+int32_t dot_u8s8_vnni(const uint8_t *x, const int8_t *w, size_t length) {
+    __m256i sum_vec = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i < length; i += 32) {
+        sum_vec = _mm256_dpbusd_epi32(
+            sum_vec,
+            _mm256_loadu_si256((const __m256i *) (x + i)),
+            _mm256_loadu_si256((const __m256i *) (w + i))
+        );
+    }
+    return hsum_epi32_avx2(sum_vec);
+}
+
+#pragma GCC pop_options
+
+// Dispatch
+
+kernel_table kernels;
+
+bool cpu_supports_isa(enum isa isa) {
+    __builtin_cpu_init();
+    switch (isa) {
+        case ISA_SCALAR:
+            return true;
+        case ISA_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case ISA_AVX512:
+            return __builtin_cpu_supports("avx512f");
+        default:
+            return false;
+    }
+}
+
+void set_kernel_isa(enum isa isa) {
+    // Use the kernels compiled for isa
+
+    if (isa >= NUM_ISAS || !cpu_supports_isa(isa)) {
+        printf("Error: Kernel variant not supported by this CPU\n\n");
+        exit(0);
+    }
+
+    kernels.isa = isa;
+    kernels.dot_u8s8 = dot_u8s8_scalar;
+    kernels.gemv_rows_f16 = gemv_rows_f16_scalar;
+    kernels.gemv_rows_bf16 = gemv_rows_bf16_scalar;
+    kernels.f16_to_double = f16_to_double_scalar;
+    kernels.bf16_to_double = bf16_to_double_scalar;
+    if (isa >= ISA_AVX2 && __builtin_cpu_supports("f16c")) {
+        kernels.gemv_rows_f16 = gemv_rows_f16_avx2;
+        kernels.gemv_rows_bf16 = gemv_rows_bf16_avx2;
+        kernels.f16_to_double = f16_to_double_avx2;
+        kernels.bf16_to_double = bf16_to_double_avx2;
+    }
+
+    switch (isa) {
+        case ISA_SCALAR:
+            kernels.mat_mul_row = mat_mul_row_scalar;
+            kernels.gemv_rows = gemv_rows_scalar;
+            kernels.mat_mul_skinny = mat_mul_skinny_scalar;
+            kernels.mat_mul_row_indexed = mat_mul_row_indexed_scalar;
+            kernels.lin_combo = lin_combo_scalar;
+            kernels.relu = relu_scalar;
+            kernels.drelu = drelu_scalar;
+            kernels.sigmoid = sigmoid_scalar;
+            kernels.dsigmoid = dsigmoid_scalar;
+            kernels.drelu_mul = drelu_mul_scalar;
+            kernels.dsigmoid_mul = dsigmoid_mul_scalar;
+            kernels.elem_mul = elem_mul_scalar;
+            kernels.scalar_mul = scalar_mul_scalar;
+            break;
+        case ISA_SSE2:
+            kernels.mat_mul_row = mat_mul_row_sse2;
+            kernels.gemv_rows = gemv_rows_sse2;
+            kernels.mat_mul_skinny = mat_mul_skinny_sse2;
+            kernels.mat_mul_row_indexed = mat_mul_row_indexed_sse2;
+            kernels.lin_combo = lin_combo_sse2;
+            kernels.relu = relu_sse2;
+            kernels.drelu = drelu_sse2;
+            kernels.sigmoid = sigmoid_sse2;
+            kernels.dsigmoid = dsigmoid_sse2;
+            kernels.drelu_mul = drelu_mul_sse2;
+            kernels.dsigmoid_mul = dsigmoid_mul_sse2;
+            kernels.elem_mul = elem_mul_sse2;
+            kernels.scalar_mul = scalar_mul_sse2;
+            break;
+        case ISA_AVX2:
+            kernels.mat_mul_row = mat_mul_row_avx2;
+            kernels.gemv_rows = gemv_rows_avx2;
+            kernels.mat_mul_skinny = mat_mul_skinny_avx2;
+            kernels.mat_mul_row_indexed = mat_mul_row_indexed_avx2;
+            kernels.lin_combo = lin_combo_avx2;
+            kernels.relu = relu_avx2;
+            kernels.drelu = drelu_avx2;
+            kernels.sigmoid = sigmoid_avx2;
+            kernels.dsigmoid = dsigmoid_avx2;
+            kernels.drelu_mul = drelu_mul_avx2;
+            kernels.dsigmoid_mul = dsigmoid_mul_avx2;
+            kernels.elem_mul = elem_mul_avx2;
+            kernels.scalar_mul = scalar_mul_avx2;
+            kernels.dot_u8s8 = dot_u8s8_avx2;
+            break;
+        case ISA_AVX512:
+            kernels.mat_mul_row = mat_mul_row_avx512;
+            // The matrix-vector product is bound by memory bandwidth, so AVX2 is enough
+            kernels.gemv_rows = gemv_rows_avx2;
+            kernels.mat_mul_skinny = mat_mul_skinny_avx512;
+            kernels.mat_mul_row_indexed = mat_mul_row_indexed_avx512;
+            kernels.lin_combo = lin_combo_avx512;
+            kernels.relu = relu_avx512;
+            kernels.drelu = drelu_avx512;
+            kernels.sigmoid = sigmoid_avx512;
+            kernels.dsigmoid = dsigmoid_avx512;
+            kernels.drelu_mul = drelu_mul_avx512;
+            kernels.dsigmoid_mul = dsigmoid_mul_avx512;
+            kernels.elem_mul = elem_mul_avx512;
+            kernels.scalar_mul = scalar_mul_avx512;
+            kernels.dot_u8s8 = dot_u8s8_avx2;
+            if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+                kernels.dot_u8s8 = dot_u8s8_vnni;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+enum isa best_kernel_isa(void) {
+    // Most capable instruction set supported by this CPU
+
+    int isa;
+    for (isa = NUM_ISAS - 1; isa > ISA_SCALAR; isa--) {
+        if (cpu_supports_isa(isa)) {
+            return isa;
+        }
+    }
+    return ISA_SCALAR;
+}
+
+__attribute__((constructor))
+void init_kernels(void) {
+    // Select the kernel variant once at startup
+
+    char *forced = getenv("NN_KERNELS");
+    int isa;
+
+    if (forced != NULL) {
+        for (isa = 0; isa < NUM_ISAS; isa++) {
+            if (strcmp(forced, isa_names[isa]) == 0) {
+                set_kernel_isa(isa);
+                return;
+            }
+        }
+        printf("Warning: Unknown NN_KERNELS value %s, using the best supported variant\n", forced);
+    }
+    set_kernel_isa(best_kernel_isa());
+}
+
+#endif
@@ -0,0 +1,300 @@
+#ifndef SPARSE_C
+#define SPARSE_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "neural_network.c"
+
+// Magnitude pruning and sparse inference
+//
+// prune_model zeroes the weights below a threshold, and prune_to_sparsity the
+// smallest weights of every layer up to a target fraction. sparse_model then
+// stores every W in compressed sparse row (CSR) format, keeping only the
+// nonzero weights and their column indices, and s_model_predict multiplies
+// them with the dense batch of activations, skipping the pruned weights.
+// The nonzero terms are summed in the same order as mat_mul, so a sparse
+// model predicts exactly like the pruned dense model.
+// Biases are never pruned.
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    size_t nnz;
+    // The nonzero entries of row i are values[row_start[i]] to values[row_start[i + 1] - 1]
+    size_t *row_start;
+    unsigned int *col_idx;
+    double *values;
+} csr_matrix;
+
+typedef struct {
+    size_t rows;
+    size_t cols;
+    enum func activation;
+    csr_matrix *W;
+    matrix *b;
+} s_layer;
+
+typedef struct {
+    size_t num_layers;
+    size_t *num_nodes;
+    s_layer *layers;
+} s_model;
+
+size_t prune_model(nn_model *model, double threshold) {
+    // Zero every weight of magnitude below threshold, returns the number of weights zeroed
+
+    size_t pruned = 0;
+    unsigned int i, k;
+
+    for (i = 1; i < model->num_layers; i++) {
+        matrix *W = model->layers[i].W;
+        size_t length = W->rows * W->cols;
+        for (k = 0; k < length; k++) {
+            if (W->data[k] != 0.0 && fabs(W->data[k]) < threshold) {
+                W->data[k] = 0.0;
+                pruned++;
+            }
+        }
+    }
+    return pruned;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+void prune_to_sparsity(nn_model *model, double sparsity) {
+    // Zero the smallest weights of every layer until a fraction sparsity of its
+    // weights is zero
+
+    unsigned int i, k;
+
+    if (sparsity < 0.0 || sparsity > 1.0) {
+        printf("Error: Invalid sparsity for prune_to_sparsity\n\n");
+        exit(0);
+    }
+
+    for (i = 1; i < model->num_layers; i++) {
+        matrix *W = model->layers[i].W;
+        size_t length = W->rows * W->cols;
+        size_t target = (size_t) (sparsity * length);
+        if (target == 0) {
+            continue;
+        }
+
+        double *magnitudes = malloc(length * sizeof(double));
+        check_alloc(magnitudes);
+        for (k = 0; k < length; k++) {
+            magnitudes[k] = fabs(W->data[k]);
+        }
+        qsort(magnitudes, length, sizeof(double), compare_doubles);
+        double threshold = magnitudes[target - 1];
+        free(magnitudes);
+
+        // Weights equal to the threshold are zeroed until the target is reached
+        size_t zeroed = 0;
+        for (k = 0; k < length; k++) {
+            if (fabs(W->data[k]) < threshold) {
+                W->data[k] = 0.0;
+                zeroed++;
+            }
+        }
+        for (k = 0; k < length && zeroed < target; k++) {
+            if (W->data[k] != 0.0 && fabs(W->data[k]) == threshold) {
+                W->data[k] = 0.0;
+                zeroed++;
+            }
+        }
+    }
+}
+
+double model_sparsity(nn_model *model) {
+    // Fraction of the weights (not biases) of model that are zero
+
+    size_t zeros = 0;
+    size_t total = 0;
+    unsigned int i, k;
+
+    for (i = 1; i < model->num_layers; i++) {
+        matrix *W = model->layers[i].W;
+        size_t length = W->rows * W->cols;
+        for (k = 0; k < length; k++) {
+            zeros += (W->data[k] == 0.0);
+        }
+        total += length;
+    }
+    return (total > 0) ? zeros / (double) total : 0.0;
+}
+
+csr_matrix* mat_to_csr(matrix *mat) {
+    // CSR copy of the nonzero entries of mat
+
+    size_t rows = mat->rows;
+    size_t cols = mat->cols;
+    size_t length = rows * cols;
+    unsigned int i, k;
+
+    csr_matrix *csr = malloc(sizeof(csr_matrix));
+    check_alloc(csr);
+    csr->rows = rows;
+    csr->cols = cols;
+    csr->nnz = 0;
+    for (k = 0; k < length; k++) {
+        csr->nnz += (mat->data[k] != 0.0);
+    }
+
+    csr->row_start = malloc((rows + 1) * sizeof(size_t));
+    // At least one entry, so that an all zero matrix is not a failed allocation
+    csr->col_idx = malloc((csr->nnz + 1) * sizeof(unsigned int));
+    csr->values = malloc((csr->nnz + 1) * sizeof(double));
+    check_alloc(csr->row_start);
+    check_alloc(csr->col_idx);
+    check_alloc(csr->values);
+
+    size_t t = 0;
+    for (i = 0; i < rows; i++) {
+        csr->row_start[i] = t;
+        for (k = 0; k < cols; k++) {
+            double value = mat->data[i * cols + k];
+            if (value != 0.0) {
+                csr->values[t] = value;
+                csr->col_idx[t++] = k;
+            }
+        }
+    }
+    csr->row_start[rows] = t;
+    return csr;
+}
+
+void free_csr(csr_matrix *csr) {
+    if (csr == NULL) {
+        return;
+    }
+    free(csr->row_start);
+    free(csr->col_idx);
+    free(csr->values);
+    free(csr);
+}
+
+void csr_mat_mul(matrix *result, csr_matrix *csr, matrix *mat2) {
+    // result = csr * mat2, for a sparse csr and a dense mat2
+
+    size_t rows1 = csr->rows;
+    size_t cols2 = mat2->cols;
+
+    if ((csr->cols != mat2->rows) || (rows1 != result->rows) || (cols2 != result->cols)) {
+        printf("Error: Dimensions are invalid for csr_mat_mul\n\n");
+        exit(0);
+    }
+
+    perf_sample start;
+    perf_begin(&start);
+
+    double *data2 = mat2->data;
+    double *data = result->data;
+    unsigned int i;
+
+    // Rows can have very different numbers of nonzeros, so they are handed out in small chunks
+    #pragma omp parallel for schedule(dynamic, ROW_BLOCK_SIZE) if (csr->nnz * cols2 >= PARALLEL_MIN_WORK)
+    for (i = 0; i < rows1; i++) {
+        size_t first = csr->row_start[i];
+        kernels.mat_mul_row_indexed(data + i * cols2, csr->values + first, csr->col_idx + first,
+            csr->row_start[i + 1] - first, data2, cols2);
+    }
+
+    perf_end(&start, PERF_MAT_MUL_SPARSE);
+}
+
+s_model* sparse_model(nn_model *model) {
+    // Copy of a (pruned) model for inference with the weights stored in CSR format
+
+    size_t num_layers = model->num_layers;
+    nn_layer *layers = model->layers;
+    unsigned int i;
+
+    if (!is_dense_model(model)) {
+        printf("Error: sparse_model only supports fully connected models\n\n");
+        exit(0);
+    }
+
+    s_model *smodel = malloc(sizeof(s_model));
+    check_alloc(smodel);
+    smodel->num_layers = num_layers;
+    smodel->num_nodes = malloc(num_layers * sizeof(size_t));
+    smodel->layers = calloc(num_layers, sizeof(s_layer));
+    check_alloc(smodel->num_nodes);
+    check_alloc(smodel->layers);
+
+    for (i = 0; i < num_layers; i++) {
+        smodel->num_nodes[i] = layers[i].num_nodes;
+    }
+
+    for (i = 1; i < num_layers; i++) {
+        s_layer *sl = &smodel->layers[i];
+        sl->rows = layers[i].W->rows;
+        sl->cols = layers[i].W->cols;
+        sl->activation = layers[i].activation;
+        sl->W = mat_to_csr(layers[i].W);
+        sl->b = zero_mat(sl->rows, 1);
+        mat_copy(sl->b, layers[i].b);
+    }
+
+    return smodel;
+}
+
+void s_model_predict(s_model *smodel, matrix *result, matrix *input, size_t num_inputs) {
+    // Evaluate a sparse model on input
+
+    size_t num_layers = smodel->num_layers;
+    size_t n_out = smodel->num_nodes[num_layers - 1];
+    size_t n_in = smodel->num_nodes[0];
+    unsigned int i;
+
+    if ((result->cols != num_inputs) || (result->rows != n_out)) {
+        printf("Error: Invalid result vector for s_model_predict\n\n");
+        exit(0);
+    } else if ((input->cols != num_inputs) || (input->rows != n_in)) {
+        printf("Error: Invalid input vector for s_model_predict\n\n");
+        exit(0);
+    }
+
+    matrix *A_prev = input;
+    for (i = 1; i < num_layers; i++) {
+        s_layer *sl = &smodel->layers[i];
+        matrix *Z = zero_mat(sl->rows, num_inputs);
+        matrix *A = (i == num_layers - 1) ? result : zero_mat(sl->rows, num_inputs);
+
+        csr_mat_mul(Z, sl->W, A_prev);
+        mat_vec_add(Z, Z, sl->b);
+
+        apply_activation(A, Z, sl->activation);
+
+        free_mat(Z);
+        if (A_prev != input) {
+            free_mat(A_prev);
+        }
+        A_prev = A;
+    }
+}
+
+void free_s_model(s_model *smodel) {
+    if (smodel == NULL) {
+        return;
+    }
+
+    unsigned int i;
+    for (i = 1; i < smodel->num_layers; i++) {
+        free_csr(smodel->layers[i].W);
+        free_mat(smodel->layers[i].b);
+    }
+
+    free(smodel->num_nodes);
+    free(smodel->layers);
+    free(smodel);
+}
+
+#endif
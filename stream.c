@@ -0,0 +1,416 @@
+#ifndef STREAM_C
+#define STREAM_C
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <pthread.h>
+#include "neural_network.c"
+
+// Training on a stream of samples
+//
+// train_model needs the whole training set in memory. train_stream instead
+// reads its mini-batches from a sample_stream, a bounded ring buffer that
+// producer threads fill while the model trains, so the data can come from a
+// file larger than memory, a generator or a live source. Every sample is one
+// record of the input values followed by the target values.
+//
+// Samples arrive in the order they were produced, which is rarely random. A
+// shuffle buffer keeps a pool of samples: every mini-batch takes random
+// samples out of the pool and the incoming samples take their place. Training
+// holds at most the ring, the pool and one mini-batch of samples, however long
+// the stream is. Once the stream ends the pool is drained, and a last partial
+// mini-batch is dropped.
+
+// Steps between the loss and throughput reports of train_stream
+#define STREAM_REPORT_INTERVAL 100
+
+// Producer callback: write the next sample into x and y, returns false at the end of the data
+typedef bool (*sample_producer)(double *x, double *y, void *arg);
+
+typedef struct {
+    size_t input_size;
+    size_t output_size;
+
+    // Ring of capacity records of input_size + output_size values, guarded by lock
+    size_t capacity;
+    double *data;
+    size_t head;
+    size_t count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    // Thread of start_producer
+    sample_producer producer;
+    void *producer_arg;
+    pthread_t thread;
+    bool has_thread;
+
+    // Samples pushed, and time the reader spent waiting for them
+    size_t num_pushed;
+    double wait_seconds;
+} sample_stream;
+
+typedef struct {
+    sample_stream *stream;
+    size_t size;
+    size_t count;
+    bool filled;
+    double *pool;
+    // Records read from the stream for one mini-batch
+    double *incoming;
+    size_t incoming_size;
+} shuffle_buffer;
+
+sample_stream* create_stream(size_t input_size, size_t output_size, size_t capacity) {
+    // Stream of samples with input_size inputs and output_size targets, holding at most
+    // capacity samples that were pushed but not read yet
+
+    if (input_size == 0 || output_size == 0 || capacity == 0) {
+        printf("Error: Invalid dimensions for create_stream\n\n");
+        exit(0);
+    }
+
+    sample_stream *stream = calloc(1, sizeof(sample_stream));
+    check_alloc(stream);
+    stream->input_size = input_size;
+    stream->output_size = output_size;
+    stream->capacity = capacity;
+    stream->data = malloc(capacity * (input_size + output_size) * sizeof(double));
+    check_alloc(stream->data);
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->not_empty, NULL);
+    pthread_cond_init(&stream->not_full, NULL);
+    return stream;
+}
+
+bool stream_push(sample_stream *stream, const double *x, const double *y) {
+    // Append one sample, waiting while the stream is full
+    // Returns false, without adding the sample, once the stream is closed
+
+    size_t record = stream->input_size + stream->output_size;
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count == stream->capacity && !stream->closed) {
+        pthread_cond_wait(&stream->not_full, &stream->lock);
+    }
+    if (stream->closed) {
+        pthread_mutex_unlock(&stream->lock);
+        return false;
+    }
+
+    double *dest = stream->data + (stream->head + stream->count) % stream->capacity * record;
+    memcpy(dest, x, stream->input_size * sizeof(double));
+    memcpy(dest + stream->input_size, y, stream->output_size * sizeof(double));
+    stream->count++;
+    stream->num_pushed++;
+    pthread_cond_signal(&stream->not_empty);
+    pthread_mutex_unlock(&stream->lock);
+    return true;
+}
+
+void stream_close(sample_stream *stream) {
+    // End the stream: the samples already pushed can still be read, later pushes fail
+
+    pthread_mutex_lock(&stream->lock);
+    stream->closed = true;
+    pthread_cond_broadcast(&stream->not_empty);
+    pthread_cond_broadcast(&stream->not_full);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+size_t stream_pull(sample_stream *stream, double *records, size_t count) {
+    // Read up to count samples into records, waiting until count samples were pushed or
+    // the stream is closed
+    // Returns the number of samples read, which is less than count only at the end of the stream
+
+    size_t record = stream->input_size + stream->output_size;
+    size_t read = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    while (read < count) {
+        if (stream->count == 0) {
+            if (stream->closed) {
+                break;
+            }
+            double start = omp_get_wtime();
+            while (stream->count == 0 && !stream->closed) {
+                pthread_cond_wait(&stream->not_empty, &stream->lock);
+            }
+            stream->wait_seconds += omp_get_wtime() - start;
+            continue;
+        }
+
+        // Everything available up to the end of the ring in one copy
+        size_t n = count - read;
+        n = (stream->count < n) ? stream->count : n;
+        n = (stream->capacity - stream->head < n) ? stream->capacity - stream->head : n;
+        memcpy(records + read * record, stream->data + stream->head * record, n * record * sizeof(double));
+        stream->head = (stream->head + n) % stream->capacity;
+        stream->count -= n;
+        read += n;
+        pthread_cond_broadcast(&stream->not_full);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return read;
+}
+
+void* producer_worker(void *arg) {
+    sample_stream *stream = arg;
+    double *x = malloc(stream->input_size * sizeof(double));
+    double *y = malloc(stream->output_size * sizeof(double));
+    check_alloc(x);
+    check_alloc(y);
+
+    while (stream->producer(x, y, stream->producer_arg) && stream_push(stream, x, y));
+    stream_close(stream);
+
+    free(x);
+    free(y);
+    return NULL;
+}
+
+void start_producer(sample_stream *stream, sample_producer producer, void *arg) {
+    // Fill the stream from producer on a new thread, which closes the stream once the
+    // producer runs out of samples
+
+    if (stream->has_thread) {
+        printf("Error: The stream already has a producer thread\n\n");
+        exit(0);
+    }
+
+    stream->producer = producer;
+    stream->producer_arg = arg;
+    if (pthread_create(&stream->thread, NULL, producer_worker, stream) != 0) {
+        printf("Error: Could not start producer thread\n\n");
+        exit(0);
+    }
+    stream->has_thread = true;
+}
+
+void free_stream(sample_stream *stream) {
+    // Close the stream, stop its producer thread and free it
+
+    if (stream == NULL) {
+        return;
+    }
+
+    stream_close(stream);
+    if (stream->has_thread) {
+        pthread_join(stream->thread, NULL);
+    }
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->not_empty);
+    pthread_cond_destroy(&stream->not_full);
+    free(stream->data);
+    free(stream);
+}
+
+shuffle_buffer* create_shuffle_buffer(sample_stream *stream, size_t size, size_t mini_batch_size) {
+    // Mini-batches of mini_batch_size samples drawn at random from a pool of size samples
+    // of stream, or in stream order if size is 0
+
+    size_t record = stream->input_size + stream->output_size;
+
+    if (mini_batch_size == 0) {
+        printf("Error: Invalid mini-batch size for create_shuffle_buffer\n\n");
+        exit(0);
+    }
+
+    shuffle_buffer *shuffle = calloc(1, sizeof(shuffle_buffer));
+    check_alloc(shuffle);
+    shuffle->stream = stream;
+    shuffle->size = size;
+    shuffle->incoming_size = mini_batch_size;
+    shuffle->incoming = malloc(mini_batch_size * record * sizeof(double));
+    check_alloc(shuffle->incoming);
+    if (size > 0) {
+        shuffle->pool = malloc(size * record * sizeof(double));
+        check_alloc(shuffle->pool);
+    }
+    return shuffle;
+}
+
+bool stream_batch(shuffle_buffer *shuffle, matrix *mini_X, matrix *mini_Y) {
+    // Fill the columns of mini_X and mini_Y with the next mini-batch
+    // Returns false if the stream and pool ran out before a whole mini-batch
+
+    sample_stream *stream = shuffle->stream;
+    size_t n_in = stream->input_size;
+    size_t n_out = stream->output_size;
+    size_t record = n_in + n_out;
+    size_t m = mini_X->cols;
+    unsigned int i, j;
+
+    if ((mini_X->rows != n_in) || (mini_Y->rows != n_out) || (mini_Y->cols != m) || (m > shuffle->incoming_size)) {
+        printf("Error: Invalid mini-batch for stream_batch\n\n");
+        exit(0);
+    }
+
+    // The pool is filled on the first mini-batch
+    if (shuffle->size > 0 && !shuffle->filled) {
+        shuffle->count = stream_pull(stream, shuffle->pool, shuffle->size);
+        shuffle->filled = true;
+    }
+
+    size_t incoming = stream_pull(stream, shuffle->incoming, m);
+    if (shuffle->size == 0 && incoming < m) {
+        return false;
+    }
+    uint64_t key = nn_rng.key;
+    uint64_t first = rng_reserve(m);
+
+    for (j = 0; j < m; j++) {
+        double *sample = shuffle->incoming + j * record;
+
+        if (shuffle->size > 0) {
+            if (shuffle->count == 0) {
+                return false;
+            }
+            // Take a random sample out of the pool, and put the next incoming sample in its place
+            size_t r = rng_below(key, first + j, shuffle->count);
+            double *slot = shuffle->pool + r * record;
+            for (i = 0; i < record; i++) {
+                double t = slot[i];
+                slot[i] = sample[i];
+                sample[i] = t;
+            }
+            if (j >= incoming) {
+                memcpy(slot, shuffle->pool + --shuffle->count * record, record * sizeof(double));
+            }
+        }
+
+        for (i = 0; i < n_in; i++) {
+            mini_X->data[i * m + j] = sample[i];
+        }
+        for (i = 0; i < n_out; i++) {
+            mini_Y->data[i * m + j] = sample[n_in + i];
+        }
+    }
+    return true;
+}
+
+void free_shuffle_buffer(shuffle_buffer *shuffle) {
+    if (shuffle == NULL) {
+        return;
+    }
+    free(shuffle->pool);
+    free(shuffle->incoming);
+    free(shuffle);
+}
+
+size_t train_stream(nn_model *model, sample_stream *stream, size_t mini_batch_size, size_t shuffle_size, size_t max_steps,
+        double lr, double beta_1, double beta_2, double epsilon) {
+    // train_model on the samples of stream until it ends or after max_steps steps (0 for no limit)
+    // Mini-batches are drawn from a shuffle buffer of shuffle_size samples (0 to keep the stream order)
+    // Returns the number of steps trained
+
+    nn_layer *layers = model->layers;
+    size_t num_layers = model->num_layers;
+    int last_i = num_layers - 1;
+    size_t m = mini_batch_size;
+    size_t step = 0;
+    double small_val = pow(10, -16.0);
+    double interval_loss = 0.0;
+    nn_validation *val = model->validation;
+    bool stopped = false;
+    unsigned int i;
+
+    if ((stream->input_size != layers[0].num_nodes) || (stream->output_size != layers[last_i].num_nodes)) {
+        printf("Error: Stream samples do not match the model in train_stream\n\n");
+        exit(0);
+    }
+
+    matrix *mini_X = numa_zero_mat(stream->input_size, m);
+    matrix *mini_Y = numa_zero_mat(stream->output_size, m);
+    shuffle_buffer *shuffle = create_shuffle_buffer(stream, shuffle_size, m);
+    create_train_buffers(model, mini_X);
+
+    printf("Training neural network model on a stream (buffering at most %zu samples)\n", stream->capacity + shuffle_size + 2 * m);
+    double start = omp_get_wtime();
+    double interval_start = start;
+    double wait_start = stream->wait_seconds;
+    perf_sample phase;
+
+    while (max_steps == 0 || step < max_steps) {
+        perf_begin(&phase);
+        bool full = stream_batch(shuffle, mini_X, mini_Y);
+        perf_end(&phase, PERF_MINI_BATCH);
+        if (!full) {
+            break;
+        }
+
+        perf_begin(&phase);
+        forward_prop(model);
+        perf_end(&phase, PERF_FORWARD_PROP);
+
+        perf_begin(&phase);
+        back_prop(model, mini_Y);
+        perf_end(&phase, PERF_BACK_PROP);
+
+        perf_begin(&phase);
+        grad_descent_adam(model, step, lr, beta_1, beta_2, epsilon);
+        perf_end(&phase, PERF_GRAD_DESCENT);
+
+        perf_begin(&phase);
+        double loss = 0.0;
+        for (i = 0; i < mini_Y->rows * m; i++) {
+            loss -= mini_Y->data[i] * log(layers[last_i].A->data[i] + small_val);
+        }
+        interval_loss += loss / (double) m;
+        perf_end(&phase, PERF_LOSS);
+
+        step++;
+        if (step % STREAM_REPORT_INTERVAL == 0) {
+            double now = omp_get_wtime();
+            printf("Step %zu     Loss: %g     Throughput: %.0f samples/s\n", step, interval_loss / STREAM_REPORT_INTERVAL,
+                STREAM_REPORT_INTERVAL * m / (now - interval_start));
+            interval_loss = 0.0;
+            interval_start = now;
+        }
+
+        if (model->publisher != NULL && step % model->publisher->interval == 0) {
+            publish_snapshot(model->publisher, model, step);
+        }
+
+        if (val != NULL && step % val->interval == 0 && validation_step(val, model, step)) {
+            printf("Stopping early: no validation improvement in %zu evaluations\n", val->patience);
+            stopped = true;
+            break;
+        }
+    }
+
+    if (val != NULL && step > 0) {
+        if (!stopped && step % val->interval != 0) {
+            validation_step(val, model, step);
+        }
+        validation_wait(val);
+        memcpy(model->params, val->best_params, model->num_params * sizeof(double));
+        printf("Keeping parameters from step %zu     Validation loss: %g     Validation accuracy: %g%%\n",
+            val->best_step, val->best_loss, 100.0 * val->best_corrects / (double) val->X->cols);
+    }
+
+    if (model->publisher != NULL && step > 0 && (val != NULL || step % model->publisher->interval != 0)) {
+        publish_snapshot(model->publisher, model, step);
+    }
+
+    double seconds = omp_get_wtime() - start;
+    printf("Finished training after %zu steps\n", step);
+    printf("Time taken: %f s\n", seconds);
+    printf("Throughput: %.0f samples/s     Waiting for samples: %.1f%% of the time\n\n",
+        (seconds > 0.0) ? step * m / seconds : 0.0, (seconds > 0.0) ? 100.0 * (stream->wait_seconds - wait_start) / seconds : 0.0);
+    print_perf_report();
+
+    free_train_buffers(model);
+    free_shuffle_buffer(shuffle);
+    free_mat(mini_X);
+    free_mat(mini_Y);
+    return step;
+}
+
+#endif
@@ -1,9 +1,25 @@
-#include "math_utils.c"
+#include "neural_network.c"
+#include "inference_server.c"
+#include "distributed.c"
+#include "half.c"
+#include "sparse.c"
+#include "quantize.c"
+#include "multi_train.c"
+#include "stream.c"
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
 #define MIN_DIM 1
 #define MAX_DIM 100
 #define NUM_TESTS 1000
+#define NUM_PREDICT_THREADS 4
+#define MAX_RANKS 5
+#define NUM_PUBLICATIONS 20
+// Largest difference of the probabilities of an int8 and a double model in test_quantized_model
+#define Q_TEST_TOLERANCE 0.05
 
 size_t rand_dim() {
     return rand() % (MAX_DIM - MIN_DIM + 1) + MIN_DIM;
@@ -146,6 +162,1997 @@ bool test_mat_mul_trans(bool test, bool debug) {
     return output;
 }
 
+bool test_mat_mul_skinny(bool test, bool debug) {
+    // Matrix-vector and small batch products
+
+    size_t dim1 = rand_dim();
+    size_t dim2 = rand_dim();
+    size_t dim3 = rand() % SKINNY_MAX_COLS + 1;
+
+    matrix *mat1 = rand_mat(dim1, dim2);
+    matrix *mat2 = rand_mat(dim2, dim3);
+    matrix *result = zero_mat(dim1, dim3);
+    matrix *true_result = zero_mat(dim1, dim3);
+
+    mat_mul(result, mat1, mat2);
+
+    bool output = true;
+
+    if (test) {
+        unsigned int i, j, k;
+        double dot_prod;
+        for (i = 0; i < dim1; i++) {
+            for (j = 0; j < dim3; j++) {
+                dot_prod = 0; 
+                for (k = 0; k < dim2; k++) {
+                    dot_prod += mat_get(mat1, i, k) * mat_get(mat2, k, j);
+                }
+                mat_set(true_result, i, j, dot_prod);
+            }
+        }
+
+        output = mat_is_equal(result, true_result);
+
+        if (!output && debug) {
+            print_mat(mat1);
+            print_mat(mat2);
+            print_mat(result);
+            print_mat(true_result);
+        }
+    }
+    
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(result);
+    free_mat(true_result);
+
+    return output;
+}
+
+void sparsify(matrix *mat, double sparsity) {
+    // Set a random fraction sparsity of the entries of mat to zero
+
+    size_t length = mat->rows * mat->cols;
+    unsigned int i;
+    for (i = 0; i < length; i++) {
+        if (rand_weight() < sparsity) {
+            mat->data[i] = 0.0;
+        }
+    }
+}
+
+bool test_mat_mul_trans_sparse(bool test, bool debug) {
+    
+    size_t dim1 = rand_dim();
+    size_t dim2 = rand_dim();
+    size_t dim3 = rand_dim();
+    bool t1 = (bool) (rand() % 2);
+    bool t2 = (bool) (rand() % 2);
+
+    matrix *mat1 = t1 ? rand_mat(dim2, dim1) : rand_mat(dim1, dim2);
+    matrix *mat2 = t2 ? rand_mat(dim3, dim2) : rand_mat(dim2, dim3);
+    matrix *result = zero_mat(dim1, dim3);
+    matrix *true_result = zero_mat(dim1, dim3);
+    sparsify(mat1, rand_weight());
+    sparsify(mat2, rand_weight());
+
+    mat_mul_trans_sparse(result, mat1, mat2, t1, t2);
+
+    bool output = true;
+
+    if (test) {
+        mat_mul_trans(true_result, mat1, mat2, t1, t2);
+        output = mat_is_equal(result, true_result);
+
+        if (!output && debug) {
+            print_mat(mat1);
+            print_mat(mat2);
+            print_mat(result);
+            print_mat(true_result);
+        }
+    }
+    
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(result);
+    free_mat(true_result);
+
+    return output;
+}
+
+bool test_kernel_variants(bool test, bool debug) {
+    // Compare every kernel variant supported by this CPU against the scalar reference
+
+    size_t dim1 = rand_dim();
+    size_t dim2 = rand_dim();
+    size_t dim3 = rand_dim();
+    enum isa default_isa = kernels.isa;
+
+    matrix *mat1 = rand_mat(dim1, dim2);
+    matrix *mat2 = rand_mat(dim2, dim3);
+    matrix *mat3 = rand_mat(dim1, dim2);
+    mat_lin_combo(mat3, mat3, mat3, 1.0, -0.5);
+    matrix *true_mul = zero_mat(dim1, dim3);
+    matrix *true_combo = zero_mat(dim1, dim2);
+    matrix *true_relu = zero_mat(dim1, dim2);
+    matrix *true_drelu = zero_mat(dim1, dim2);
+    matrix *true_sigmoid = zero_mat(dim1, dim2);
+    matrix *true_dsigmoid_mul = zero_mat(dim1, dim2);
+    matrix *true_drelu_mul = zero_mat(dim1, dim2);
+    matrix *true_scalar_mul = zero_mat(dim1, dim2);
+    matrix *result_mul = zero_mat(dim1, dim3);
+    matrix *result_combo = zero_mat(dim1, dim2);
+    matrix *result_relu = zero_mat(dim1, dim2);
+    matrix *result_drelu = zero_mat(dim1, dim2);
+    matrix *result_sigmoid = zero_mat(dim1, dim2);
+    matrix *result_dsigmoid_mul = zero_mat(dim1, dim2);
+    matrix *result_drelu_mul = zero_mat(dim1, dim2);
+    matrix *result_scalar_mul = zero_mat(dim1, dim2);
+    double c1 = rand_weight();
+    double c2 = rand_weight();
+
+    size_t length_q = (dim2 + 31) / 32 * 32;
+    uint8_t *x_q = malloc(length_q);
+    int8_t *w_q = malloc(length_q);
+    unsigned int i;
+    for (i = 0; i < length_q; i++) {
+        x_q[i] = rand() % 128;
+        w_q[i] = rand() % 255 - 127;
+    }
+
+    set_kernel_isa(ISA_SCALAR);
+    mat_mul(true_mul, mat1, mat2);
+    mat_lin_combo(true_combo, mat1, mat3, c1, c2);
+    relu(true_relu, mat3);
+    drelu(true_drelu, mat3);
+    sigmoid(true_sigmoid, mat3);
+    dsigmoid_mul(true_dsigmoid_mul, mat1, true_sigmoid);
+    drelu_mul(true_drelu_mul, mat1, mat3);
+    mat_scalar_mul(true_scalar_mul, mat3, c1);
+    int32_t true_dot = kernels.dot_u8s8(x_q, w_q, length_q);
+
+    bool output = true;
+    int isa;
+
+    for (isa = ISA_SCALAR + 1; isa < NUM_ISAS && test; isa++) {
+        if (!cpu_supports_isa(isa)) {
+            continue;
+        }
+        set_kernel_isa(isa);
+        mat_mul(result_mul, mat1, mat2);
+        mat_lin_combo(result_combo, mat1, mat3, c1, c2);
+        relu(result_relu, mat3);
+        drelu(result_drelu, mat3);
+        sigmoid(result_sigmoid, mat3);
+        dsigmoid_mul(result_dsigmoid_mul, mat1, true_sigmoid);
+        drelu_mul(result_drelu_mul, mat1, mat3);
+        mat_scalar_mul(result_scalar_mul, mat3, c1);
+
+        bool isa_output = mat_is_equal(result_mul, true_mul) 
+            && mat_is_equal(result_combo, true_combo)
+            && mat_is_equal(result_relu, true_relu)
+            && mat_is_equal(result_drelu, true_drelu)
+            && mat_is_equal(result_sigmoid, true_sigmoid)
+            && mat_is_equal(result_dsigmoid_mul, true_dsigmoid_mul)
+            && mat_is_equal(result_drelu_mul, true_drelu_mul)
+            && mat_is_equal(result_scalar_mul, true_scalar_mul)
+            && kernels.dot_u8s8(x_q, w_q, length_q) == true_dot;
+
+        if (!isa_output && debug) {
+            printf("Kernel variant %s differs from the scalar reference\n", isa_names[isa]);
+        }
+        output = output && isa_output;
+    }
+
+    set_kernel_isa(default_isa);
+
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(mat3);
+    free_mat(true_mul);
+    free_mat(true_combo);
+    free_mat(true_relu);
+    free_mat(true_drelu);
+    free_mat(result_mul);
+    free_mat(result_combo);
+    free_mat(result_relu);
+    free_mat(result_drelu);
+    free_mat(true_sigmoid);
+    free_mat(true_dsigmoid_mul);
+    free_mat(true_drelu_mul);
+    free_mat(true_scalar_mul);
+    free_mat(result_sigmoid);
+    free_mat(result_dsigmoid_mul);
+    free_mat(result_drelu_mul);
+    free_mat(result_scalar_mul);
+    free(x_q);
+    free(w_q);
+
+    return output;
+}
+
+bool test_fast_exp(bool test, bool debug) {
+    // Bound the error of fast_exp and of the vectorized sigmoid against libm
+
+    size_t rows = rand_dim();
+    size_t cols = rand_dim();
+    size_t length = rows * cols;
+
+    matrix *mat = rand_mat(rows, cols);
+    matrix *result = zero_mat(rows, cols);
+    double *data = mat->data;
+    unsigned int i;
+
+    // Spread the values over [-700, 700]
+    for (i = 0; i < length; i++) {
+        data[i] = 1400.0 * data[i] - 700.0;
+    }
+    sigmoid(result, mat);
+
+    bool output = true;
+
+    if (test) {
+        double max_exp_error = 0.0;
+        double max_sigmoid_error = 0.0;
+        for (i = 0; i < length; i++) {
+            double true_exp = exp(data[i]);
+            double true_sigmoid = 1.0 / (1.0 + exp(-data[i]));
+            max_exp_error = fmax(max_exp_error, fabs(fast_exp(data[i]) - true_exp) / true_exp);
+            max_sigmoid_error = fmax(max_sigmoid_error, fabs(result->data[i] - true_sigmoid) / true_sigmoid);
+        }
+
+        output = (max_exp_error <= EXP_MAX_REL_ERROR) && (max_sigmoid_error <= EXP_MAX_REL_ERROR);
+
+        if (!output && debug) {
+            printf("Max relative error of exp: %g, sigmoid: %g\n", max_exp_error, max_sigmoid_error);
+        }
+    }
+
+    free_mat(mat);
+    free_mat(result);
+
+    return output;
+}
+
+typedef struct {
+    nn_model *model;
+    matrix *input;
+    matrix *result;
+} predict_args;
+
+void* predict_thread(void *arg) {
+    predict_args *args = arg;
+    size_t num_inputs = args->input->cols;
+    nn_context *ctx = create_context(args->model, num_inputs);
+    model_predict_ctx(args->model, ctx, args->result, args->input, num_inputs);
+    free_context(ctx);
+    return NULL;
+}
+
+bool test_model_predict_threads(bool test, bool debug) {
+    // Concurrent predictions on one shared model match sequential predictions
+
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand_dim()};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    size_t num_inputs = rand_dim();
+
+    predict_args args[NUM_PREDICT_THREADS];
+    pthread_t threads[NUM_PREDICT_THREADS];
+    unsigned int i;
+
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        args[i].model = model;
+        args[i].input = rand_mat(layer_sizes[0], num_inputs);
+        args[i].result = zero_mat(layer_sizes[2], num_inputs);
+    }
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        pthread_create(&threads[i], NULL, predict_thread, &args[i]);
+    }
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool output = true;
+
+    if (test) {
+        matrix *true_result = zero_mat(layer_sizes[2], num_inputs);
+        for (i = 0; i < NUM_PREDICT_THREADS && output; i++) {
+            model_predict(model, true_result, args[i].input, num_inputs);
+            output = mat_is_equal(args[i].result, true_result);
+
+            if (!output && debug) {
+                print_mat(args[i].result);
+                print_mat(true_result);
+            }
+        }
+        free_mat(true_result);
+    }
+
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        free_mat(args[i].input);
+        free_mat(args[i].result);
+    }
+    free_model(model);
+
+    return output;
+}
+
+bool test_mat_col_argmax(bool test, bool debug) {
+    // Column argmax, top-k and argmax match counts against max_index of every column
+
+    size_t rows = rand_dim();
+    size_t cols = rand_dim() * 10;
+    size_t k = rand() % rows + 1;
+
+    matrix *mat1 = rand_mat(rows, cols);
+    matrix *mat2 = rand_mat(rows, cols);
+    size_t *argmax = malloc(cols * sizeof(size_t));
+    size_t *top = malloc(cols * k * sizeof(size_t));
+    check_alloc(argmax);
+    check_alloc(top);
+
+    // Some columns with repeated values, to check that ties go to the first index
+    unsigned int i, j;
+    for (j = 0; j < cols; j += 3) {
+        for (i = 0; i < rows; i++) {
+            mat_set(mat1, i, j, (double) (i % 4));
+        }
+    }
+
+    mat_col_argmax(argmax, mat1);
+    mat_col_top_k(top, mat1, k);
+    size_t count = mat_count_argmax_equal(mat1, mat2);
+
+    bool output = true;
+
+    if (test) {
+        matrix *col1 = zero_mat(rows, 1);
+        matrix *col2 = zero_mat(rows, 1);
+        size_t true_count = 0;
+
+        for (j = 0; j < cols && output; j++) {
+            mat_get_col(col1, mat1, j);
+            mat_get_col(col2, mat2, j);
+            true_count += (max_index(col1) == max_index(col2));
+            output = (argmax[j] == max_index(col1)) && (top[j * k] == argmax[j]);
+
+            // Decreasing values, and nothing outside the top k is larger than the last
+            for (i = 1; i < k && output; i++) {
+                output = mat_get(mat1, top[j * k + i], j) <= mat_get(mat1, top[j * k + i - 1], j);
+            }
+            for (i = 0; i < rows && output; i++) {
+                bool in_top = false;
+                unsigned int r;
+                for (r = 0; r < k; r++) {
+                    in_top = in_top || (top[j * k + r] == i);
+                }
+                output = in_top || mat_get(mat1, i, j) <= mat_get(mat1, top[j * k + k - 1], j);
+            }
+
+            if (!output && debug) {
+                printf("Column %u: argmax %zu, max_index %d, top %zu\n", j, argmax[j], max_index(col1), top[j * k]);
+            }
+        }
+        output = output && (count == true_count);
+
+        free_mat(col1);
+        free_mat(col2);
+    }
+
+    free_mat(mat1);
+    free_mat(mat2);
+    free(argmax);
+    free(top);
+
+    return output;
+}
+
+bool test_model_classify(bool test, bool debug) {
+    // Classes from the logits match the argmax of the model_predict probabilities
+
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    size_t num_inputs = rand_dim();
+
+    matrix *input = rand_mat(layer_sizes[0], num_inputs);
+    matrix *Y_hat = zero_mat(layer_sizes[2], num_inputs);
+    size_t *labels = malloc(num_inputs * sizeof(size_t));
+    check_alloc(labels);
+
+    model_classify(model, labels, input, num_inputs);
+
+    bool output = true;
+
+    if (test) {
+        matrix *y_hat = zero_mat(layer_sizes[2], 1);
+        unsigned int j;
+
+        model_predict(model, Y_hat, input, num_inputs);
+        for (j = 0; j < num_inputs && output; j++) {
+            mat_get_col(y_hat, Y_hat, j);
+            output = (labels[j] == max_index(y_hat));
+
+            if (!output && debug) {
+                print_mat(y_hat);
+                printf("model_classify: %zu\n", labels[j]);
+            }
+        }
+        free_mat(y_hat);
+    }
+
+    free_mat(input);
+    free_mat(Y_hat);
+    free(labels);
+    free_model(model);
+
+    return output;
+}
+
+bool test_invalid_num_inputs(bool test, bool debug) {
+    // model_classify and model_predict stop with an error, rather than crash or read past
+    // the input, when num_inputs is not the number of columns of the input
+    // The error exits the program, so the call runs in a child process
+
+    size_t layer_sizes[] = {rand() % 10 + 1, rand() % 10 + 1, rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    size_t num_inputs = (rand() % 2) ? rand() % 20 + 1 : EVAL_CHUNK_SIZE + rand() % 100 + 1;
+    size_t cols = (rand() % 2) ? num_inputs + rand() % 10 + 1 : rand() % num_inputs;
+    bool classify = rand() % 2;
+    char message[256] = "";
+    int fds[2];
+    int status;
+
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        nn_model *model = create_model(3, layer_sizes, layer_activations);
+        matrix *input = zero_mat(layer_sizes[0], cols);
+        matrix *result = zero_mat(layer_sizes[2], num_inputs);
+        size_t *labels = malloc(num_inputs * sizeof(size_t));
+        if (classify) {
+            model_classify(model, labels, input, num_inputs);
+        } else {
+            model_predict(model, result, input, num_inputs);
+        }
+        fflush(stdout);
+        _exit(1);
+    }
+    close(fds[1]);
+    ssize_t length = read(fds[0], message, sizeof(message) - 1);
+    message[(length > 0) ? length : 0] = '\0';
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    bool output = WIFEXITED(status) && (WEXITSTATUS(status) == 0) && (strstr(message, "Error: Invalid input") != NULL);
+    if (!output && debug) {
+        printf("%s with %zu inputs and %zu columns did not stop with an error\n", classify ? "model_classify" : "model_predict", num_inputs, cols);
+    }
+
+    return output;
+}
+
+bool test_save_load(bool test, bool debug) {
+    // load_model gives back the layers and bitwise the same parameters that save_model wrote
+
+    size_t num_layers = rand() % 4 + 2;
+    size_t layer_sizes[5];
+    enum func layer_activations[5];
+    enum func hidden[] = {RELU, SIGMOID, SOFTMAX};
+    char *path = "test_save_load.bin";
+    unsigned int i;
+
+    for (i = 0; i < num_layers; i++) {
+        layer_sizes[i] = rand_dim();
+        layer_activations[i] = (i == 0) ? INPUT : hidden[rand() % 3];
+    }
+    nn_model *model = create_model(num_layers, layer_sizes, layer_activations);
+    save_model(model, path);
+    nn_model *loaded = load_model(path);
+    remove(path);
+
+    bool output = (loaded->num_layers == num_layers) && (loaded->num_params == model->num_params);
+    for (i = 0; i < num_layers && output; i++) {
+        output = (loaded->layers[i].num_nodes == layer_sizes[i]) && (loaded->layers[i].activation == layer_activations[i]);
+    }
+    output = output && (memcmp(loaded->params, model->params, model->num_params * sizeof(double)) == 0);
+
+    if (!output && debug) {
+        printf("Loaded model differs from the saved one\n");
+    }
+
+    free_model(model);
+    free_model(loaded);
+
+    return output;
+}
+
+bool test_load_invalid_model(bool test, bool debug) {
+    // load_model stops with an error when a layer has an activation or layer type
+    // past the last one, instead of building a model with an unknown layer
+    // The error exits the program, so the load runs in a child process
+
+    size_t num_layers = rand() % 4 + 2;
+    size_t layer_sizes[5];
+    enum func layer_activations[5];
+    char *path = "test_load_invalid.bin";
+    size_t layer = rand() % num_layers;
+    // Byte 0 of the layer's int holds the activation, byte 1 the layer type
+    size_t byte = rand() % 2;
+    unsigned char value = (byte == 0) ? NUM_FUNCS + rand() % (256 - NUM_FUNCS) : NUM_LAYER_TYPES + rand() % (256 - NUM_LAYER_TYPES);
+    char message[256] = "";
+    int fds[2];
+    int status;
+    unsigned int i;
+
+    for (i = 0; i < num_layers; i++) {
+        layer_sizes[i] = rand_dim();
+        layer_activations[i] = (i == 0) ? INPUT : SIGMOID;
+    }
+    nn_model *model = create_model(num_layers, layer_sizes, layer_activations);
+    save_model(model, path);
+    free_model(model);
+
+    // Dense layers are stored as num_nodes and the activation int, after num_layers
+    FILE *file = fopen(path, "r+b");
+    check_alloc(file);
+    fseek(file, sizeof(size_t) + layer * (sizeof(size_t) + sizeof(int)) + sizeof(size_t) + byte, SEEK_SET);
+    fwrite(&value, 1, 1, file);
+    fclose(file);
+
+    if (pipe(fds) != 0) {
+        remove(path);
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        load_model(path);
+        fflush(stdout);
+        _exit(1);
+    }
+    close(fds[1]);
+    ssize_t length = read(fds[0], message, sizeof(message) - 1);
+    message[(length > 0) ? length : 0] = '\0';
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    remove(path);
+
+    bool output = WIFEXITED(status) && (WEXITSTATUS(status) == 0) && (strstr(message, "Error: Invalid model file") != NULL);
+    if (!output && debug) {
+        printf("load_model accepted %s %u in layer %zu\n", (byte == 0) ? "activation" : "layer type", value, layer);
+    }
+
+    return output;
+}
+
+bool test_lazy_back_prop(bool test, bool debug) {
+    // Fused lazy back propagation and forward activations match the eager operations exactly
+
+    size_t m = rand_dim();
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SIGMOID, SOFTMAX};
+    nn_model *model = create_model(4, layer_sizes, layer_activations);
+    nn_layer *layers = model->layers;
+    unsigned int i;
+
+    matrix *X = rand_mat(layer_sizes[0], m);
+    matrix *Y = zero_mat(layer_sizes[3], m);
+    for (i = 0; i < m; i++) {
+        mat_set(Y, rand() % layer_sizes[3], i, 1.0);
+    }
+
+    layers[0].A = X;
+    for (i = 1; i < 4; i++) {
+        layers[i].A = zero_mat(layer_sizes[i], m);
+        layers[i].Z = zero_mat(layer_sizes[i], m);
+        layers[i].dA = zero_mat(layer_sizes[i], m);
+        layers[i].dZ = zero_mat(layer_sizes[i], m);
+    }
+
+    forward_prop(model);
+    back_prop(model, Y);
+    double *grads = malloc(model->num_params * sizeof(double));
+    check_alloc(grads);
+    memcpy(grads, model->grads, model->num_params * sizeof(double));
+
+    model->lazy_backprop = true;
+    memset(model->grads, 0, model->num_params * sizeof(double));
+    back_prop(model, Y);
+
+    // Bias and activation of the first two layers as one fused pass each, or a
+    // single pass when both layers have the same shape
+    lazy_graph *graph = create_lazy_graph();
+    matrix *A1 = zero_mat(layer_sizes[1], m);
+    matrix *A2 = zero_mat(layer_sizes[2], m);
+    lazy_vec_add(graph, layers[1].dZ, layers[1].Z, layers[1].b);
+    lazy_relu(graph, A1, layers[1].dZ);
+    lazy_vec_add(graph, layers[2].dZ, layers[2].Z, layers[2].b);
+    lazy_sigmoid(graph, A2, layers[2].dZ);
+    lazy_eval(graph);
+
+    bool output = true;
+
+    if (test) {
+        output = memcmp(grads, model->grads, model->num_params * sizeof(double)) == 0;
+
+        mat_vec_add(layers[1].Z, layers[1].Z, layers[1].b);
+        relu(layers[1].A, layers[1].Z);
+        mat_vec_add(layers[2].Z, layers[2].Z, layers[2].b);
+        sigmoid(layers[2].A, layers[2].Z);
+        output = output && mat_is_equal(A1, layers[1].A) && mat_is_equal(A2, layers[2].A);
+        size_t fused = (layer_sizes[1] == layer_sizes[2]) ? 1 : 2;
+        output = output && (graph->fused_passes == fused) && (graph->passes == 4);
+
+        if (!output && debug) {
+            printf("Lazy results differ from eager results\n");
+        }
+    }
+
+    layers[0].A = NULL;
+    free_mat(X);
+    free_mat(Y);
+    free_mat(A1);
+    free_mat(A2);
+    free(grads);
+    free_lazy_graph(graph);
+    free_model(model);
+
+    return output;
+}
+
+bool test_mat_mul_configs(bool test, bool debug) {
+    // Every row block and column tiling the autotuner can pick gives the same product
+
+    size_t dim1 = rand_dim();
+    size_t dim2 = rand_dim();
+    size_t dim3 = (rand() % 2) ? rand() % SKINNY_MAX_COLS + 1 : rand_dim();
+    size_t blocks[] = {1, 4, 16, 32, 64, 0};
+    size_t num_blocks = sizeof(blocks) / sizeof(size_t);
+    unsigned int b;
+
+    matrix *mat1 = rand_mat(dim1, dim2);
+    matrix *mat2 = rand_mat(dim2, dim3);
+    matrix *result = zero_mat(dim1, dim3);
+    matrix *true_result = zero_mat(dim1, dim3);
+
+    mat_mul(true_result, mat1, mat2);
+
+    bool output = true;
+
+    for (b = 0; b < num_blocks; b++) {
+        // Row blocks must be positive for the small batch paths
+        if (blocks[b] == 0 && dim3 <= SKINNY_MAX_COLS) {
+            continue;
+        }
+        tune_config config = {blocks[b], omp_get_max_threads()};
+        mat_mul_config(result, mat1, mat2, config);
+
+        if (test && !mat_is_equal(result, true_result)) {
+            output = false;
+            if (debug) {
+                printf("mat_mul differs with block %zu for %zux%zux%zu\n", blocks[b], dim1, dim2, dim3);
+            }
+        }
+    }
+
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(result);
+    free_mat(true_result);
+
+    return output;
+}
+
+bool test_autotune_cache(bool test, bool debug) {
+    // A tuned configuration is saved to the cache file and reused after reloading it
+
+    char *path = "test_autotune.cache";
+    remove(path);
+    enable_autotune(path);
+
+    size_t dim1 = rand_dim();
+    size_t dim2 = rand_dim();
+    size_t dim3 = rand_dim();
+    matrix *mat1 = rand_mat(dim1, dim2);
+    matrix *mat2 = rand_mat(dim2, dim3);
+    matrix *result = zero_mat(dim1, dim3);
+
+    mat_mul(result, mat1, mat2);
+    size_t num_tuned = tuner.num_tuned;
+    tune_entry tuned = tuner.entries[0];
+
+    enable_autotune(path);
+    mat_mul(result, mat1, mat2);
+
+    bool output = true;
+
+    if (test) {
+        tune_entry *loaded = &tuner.entries[0];
+        output = (tuner.num_entries == 1) && (tuner.num_tuned == num_tuned) &&
+            (loaded->kernel == tuned.kernel) && (loaded->isa == tuned.isa) &&
+            (loaded->dims[0] == dim1) && (loaded->dims[1] == dim2) && (loaded->dims[2] == dim3) &&
+            (loaded->config.block == tuned.config.block) && (loaded->config.threads == tuned.config.threads);
+
+        if (!output && debug) {
+            printf("Autotuning cache was not reused for %zux%zux%zu\n", dim1, dim2, dim3);
+        }
+    }
+
+    disable_autotune();
+    remove(path);
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(result);
+
+    return output;
+}
+
+bool test_autotune_invalid_cache(bool test, bool debug) {
+    // Cached entries with a block of 0 for a kernel other than mat_mul are skipped,
+    // and the kernel is tuned again instead of looping with a step of 0
+
+    char *path = "test_autotune.cache";
+    enum tune_kernel kernel = (rand() % 2) ? TUNE_GEMV : TUNE_SKINNY;
+    size_t rows = rand_dim();
+    size_t cols = rand_dim();
+    size_t length = rows * cols;
+
+    read_cpu_model(tuner.cpu);
+    FILE *file = fopen(path, "w");
+    check_alloc(file);
+    fprintf(file, "%s\t%s %d %s %zu 1 1 0 1\n", tuner.cpu, isa_names[kernels.isa], omp_get_max_threads(),
+        tune_kernel_names[TUNE_ELEM_MEMORY], length);
+    fprintf(file, "%s\t%s %d %s %zu %zu 1 0 1\n", tuner.cpu, isa_names[kernels.isa], omp_get_max_threads(),
+        tune_kernel_names[kernel], rows, cols);
+    fclose(file);
+    enable_autotune(path);
+
+    matrix *mat1 = rand_mat(rows, cols);
+    matrix *mat2 = rand_mat(rows, cols);
+    matrix *result = zero_mat(rows, cols);
+    size_t num_tuned = tuner.num_tuned;
+    bool output = (tuner.num_entries == 0);
+
+    mat_add(result, mat1, mat2);
+
+    if (test) {
+        unsigned int i;
+        for (i = 0; i < length && output; i++) {
+            output = (result->data[i] == mat1->data[i] + mat2->data[i]);
+        }
+        output = output && (tuner.num_tuned == num_tuned + 1) && (tuner.num_entries == 1) && (tuner.entries[0].config.block > 0);
+
+        if (!output && debug) {
+            printf("Autotuning cache entry with block 0 was not rejected\n");
+        }
+    }
+
+    disable_autotune();
+    remove(path);
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(result);
+
+    return output;
+}
+
+bool test_perf_counters(bool test, bool debug) {
+    // Kernels are counted per layer, and counting works with or without hardware counters
+
+    size_t dim1 = rand_dim();
+    size_t dim2 = rand_dim();
+    size_t dim3 = rand_dim();
+    int layer = rand() % PERF_MAX_LAYERS;
+
+    matrix *mat1 = rand_mat(dim1, dim2);
+    matrix *mat2 = rand_mat(dim2, dim3);
+    matrix *result = zero_mat(dim1, dim3);
+
+    bool hardware = enable_perf_counters();
+    perf_set_layer(layer);
+    mat_mul(result, mat1, mat2);
+    relu(result, result);
+    perf_set_layer(-1);
+    mat_mul(result, mat1, mat2);
+
+    bool output = true;
+
+    if (test) {
+        perf_total *total = &perf.totals[PERF_MAT_MUL][layer + 1];
+        output = (total->calls == 1) && (perf.totals[PERF_RELU][layer + 1].calls == 1) &&
+            (perf.totals[PERF_MAT_MUL][0].calls == 1) && (total->time >= 0.0);
+        if (hardware && perf.available[PERF_INSTRUCTIONS]) {
+            output = output && (total->values[PERF_INSTRUCTIONS] > 0.0);
+        }
+
+        if (!output && debug) {
+            printf("Performance counters were not attributed to layer %d\n", layer);
+        }
+    }
+
+    disable_perf_counters();
+    free_mat(mat1);
+    free_mat(mat2);
+    free_mat(result);
+
+    return output;
+}
+
+bool test_numa_replicas(bool test, bool debug) {
+    // NUMA placed buffers start zeroed, and every replica predicts like the model
+
+    size_t m = rand_dim();
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+
+    enable_numa(false);
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_replicas *replicas = create_replicas(model);
+    matrix *zeros = numa_zero_mat(layer_sizes[1], m);
+    matrix *input = rand_mat(layer_sizes[0], m);
+    matrix *result = zero_mat(layer_sizes[2], m);
+    matrix *true_result = zero_mat(layer_sizes[2], m);
+    unsigned int i;
+
+    model_predict(model, true_result, input, m);
+
+    bool output = true;
+
+    if (test) {
+        for (i = 0; i < layer_sizes[1] * m; i++) {
+            output = output && (zeros->data[i] == 0.0);
+        }
+        for (i = 0; i < model->num_params; i++) {
+            output = output && (model->grads[i] == 0.0) && (model->V[i] == 0.0) && (model->S[i] == 0.0);
+        }
+        for (i = 0; i < replicas->num_replicas; i++) {
+            model_predict(replicas->models[i], result, input, m);
+            output = output && mat_is_equal(result, true_result);
+        }
+        output = output && (local_replica(replicas) != NULL);
+
+        if (!output && debug) {
+            printf("NUMA placed buffers or replicas differ\n");
+        }
+    }
+
+    numa.enabled = false;
+    free_replicas(replicas);
+    free_model(model);
+    free_mat(zeros);
+    free_mat(input);
+    free_mat(result);
+    free_mat(true_result);
+
+    return output;
+}
+
+typedef struct {
+    nn_transport *transport;
+    double *data;
+    size_t count;
+} allreduce_args;
+
+void* allreduce_thread(void *arg) {
+    allreduce_args *args = arg;
+    allreduce_sum(args->transport, args->data, args->count);
+    return NULL;
+}
+
+bool test_allreduce_sum(bool test, bool debug) {
+    // Ranks run as threads on one shared memory region and all end up with the
+    // same sums, also for messages larger than a mailbox
+
+    int size = rand() % MAX_RANKS + 1;
+    size_t count = (rand() % 10 == 0) ? rand() % (3 * SHM_SLOT_SIZE) + 1 : rand_dim();
+    shm_region *region = calloc(1, shm_region_bytes(size));
+    check_alloc(region);
+    init_shm_region(region, size);
+
+    allreduce_args args[MAX_RANKS];
+    pthread_t threads[MAX_RANKS];
+    double *true_sum = calloc(count, sizeof(double));
+    check_alloc(true_sum);
+    unsigned int i, j;
+
+    for (i = 0; i < size; i++) {
+        args[i].transport = create_shm_transport(region, i, size, getppid());
+        args[i].data = malloc(count * sizeof(double));
+        check_alloc(args[i].data);
+        args[i].count = count;
+        for (j = 0; j < count; j++) {
+            args[i].data[j] = rand_weight();
+            true_sum[j] += args[i].data[j];
+        }
+    }
+    for (i = 0; i < size; i++) {
+        pthread_create(&threads[i], NULL, allreduce_thread, &args[i]);
+    }
+    for (i = 0; i < size; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    bool output = true;
+
+    if (test) {
+        for (i = 0; i < size && output; i++) {
+            output = (memcmp(args[i].data, args[0].data, count * sizeof(double)) == 0);
+            for (j = 0; j < count && output; j++) {
+                output = fabs(args[i].data[j] - true_sum[j]) < 1e-12;
+            }
+        }
+        if (!output && debug) {
+            printf("All-reduce of %zu values over %d ranks differs\n", count, size);
+        }
+    }
+
+    for (i = 0; i < size; i++) {
+        shm_close(args[i].transport);
+        free(args[i].data);
+    }
+    free(region);
+    free(true_sum);
+
+    return output;
+}
+
+typedef struct {
+    nn_server *server;
+    size_t n_in;
+    size_t n_out;
+    size_t first;
+    size_t stride;
+    size_t num_samples;
+    double *inputs;
+    double *outputs;
+    // Requests that server_predict refused
+    size_t num_refused;
+} client_args;
+
+void* client_thread(void *arg) {
+    // Submit samples first, first + stride, ... one at a time
+
+    client_args *args = arg;
+    size_t j;
+
+    for (j = args->first; j < args->num_samples; j += args->stride) {
+        if (!server_predict(args->server, args->outputs + j * args->n_out, args->inputs + j * args->n_in)) {
+            args->num_refused++;
+        }
+    }
+    return NULL;
+}
+
+bool test_inference_server(bool test, bool debug) {
+    // Concurrent clients of a batching server get the model_predict result of their own
+    // sample, also after the request queue wraps around and with batches cut by the deadline
+
+    size_t layer_sizes[] = {rand() % 20 + 1, rand() % 20 + 1, rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    size_t n_in = layer_sizes[0];
+    size_t n_out = layer_sizes[2];
+    // Some runs pass more requests through the queue than it holds
+    size_t num_samples = (rand() % 10 == 0) ? SERVER_QUEUE_SIZE + rand() % 200 + 1 : rand() % 100 + 1;
+    size_t max_batch = rand() % 32 + 1;
+    double max_delay = (rand() % 2) ? 0.0 : 1e-4;
+    client_args args[NUM_PREDICT_THREADS];
+    pthread_t threads[NUM_PREDICT_THREADS];
+    unsigned int i, j;
+
+    matrix *X = rand_mat(n_in, num_samples);
+    matrix *Y = zero_mat(n_out, num_samples);
+    double *inputs = malloc(num_samples * n_in * sizeof(double));
+    double *outputs = malloc(num_samples * n_out * sizeof(double));
+    check_alloc(inputs);
+    check_alloc(outputs);
+    for (i = 0; i < n_in; i++) {
+        for (j = 0; j < num_samples; j++) {
+            inputs[j * n_in + i] = mat_get(X, i, j);
+        }
+    }
+
+    nn_server *server = start_server(model, max_batch, max_delay);
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        args[i] = (client_args) {server, n_in, n_out, i, NUM_PREDICT_THREADS, num_samples, inputs, outputs, 0};
+        pthread_create(&threads[i], NULL, client_thread, &args[i]);
+    }
+    size_t num_refused = 0;
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        num_refused += args[i].num_refused;
+    }
+    size_t num_requests = server->num_requests;
+    size_t num_batches = server->num_batches;
+    stop_server(server);
+
+    bool output = (num_refused == 0) && (num_requests == num_samples) && (num_batches * max_batch >= num_samples);
+
+    if (test && output) {
+        model_predict(model, Y, X, num_samples);
+        for (j = 0; j < num_samples && output; j++) {
+            for (i = 0; i < n_out && output; i++) {
+                output = (outputs[j * n_out + i] == mat_get(Y, i, j));
+            }
+        }
+    }
+
+    if (!output && debug) {
+        printf("Server results differ from model_predict (%zu of %zu requests in %zu batches)\n", num_requests, num_samples, num_batches);
+    }
+
+    free_model(model);
+    free_mat(X);
+    free_mat(Y);
+    free(inputs);
+    free(outputs);
+
+    return output;
+}
+
+bool test_stop_server(bool test, bool debug) {
+    // stop_server evaluates the requests that clients are still waiting on before it
+    // frees the server, and server_predict refuses requests once the server stops
+
+    size_t layer_sizes[] = {rand() % 20 + 1, rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, SOFTMAX};
+    nn_model *model = create_model(2, layer_sizes, layer_activations);
+    size_t n_in = layer_sizes[0];
+    size_t n_out = layer_sizes[1];
+    size_t num_samples = NUM_PREDICT_THREADS;
+    client_args args[NUM_PREDICT_THREADS];
+    pthread_t threads[NUM_PREDICT_THREADS];
+    struct timespec pause = {0, 100000};
+    unsigned int i, j;
+
+    matrix *X = rand_mat(n_in, num_samples);
+    matrix *Y = zero_mat(n_out, num_samples);
+    double *inputs = malloc(num_samples * n_in * sizeof(double));
+    double *outputs = malloc(num_samples * n_out * sizeof(double));
+    check_alloc(inputs);
+    check_alloc(outputs);
+    for (i = 0; i < n_in; i++) {
+        for (j = 0; j < num_samples; j++) {
+            inputs[j * n_in + i] = mat_get(X, i, j);
+        }
+    }
+
+    // The batch never fills up and its deadline is far away, so only stop_server
+    // gets the requests evaluated
+    nn_server *server = start_server(model, num_samples + 1, 1000.0);
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        args[i] = (client_args) {server, n_in, n_out, i, NUM_PREDICT_THREADS, num_samples, inputs, outputs, 0};
+        pthread_create(&threads[i], NULL, client_thread, &args[i]);
+    }
+    bool waiting = false;
+    while (!waiting) {
+        nanosleep(&pause, NULL);
+        pthread_mutex_lock(&server->lock);
+        waiting = (server->count == num_samples);
+        pthread_mutex_unlock(&server->lock);
+    }
+    stop_server(server);
+
+    size_t num_refused = 0;
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        num_refused += args[i].num_refused;
+    }
+
+    // A request after stop, before the server is freed
+    server = start_server(model, 1, 0.0);
+    pthread_mutex_lock(&server->lock);
+    server->stop = true;
+    pthread_mutex_unlock(&server->lock);
+    bool refused = !server_predict(server, outputs, inputs) && (server->num_clients == 0) && (server->num_requests == 0);
+    stop_server(server);
+
+    bool output = (num_refused == 0) && refused;
+
+    if (test && output) {
+        model_predict(model, Y, X, num_samples);
+        for (j = 0; j < num_samples && output; j++) {
+            for (i = 0; i < n_out && output; i++) {
+                output = (outputs[j * n_out + i] == mat_get(Y, i, j));
+            }
+        }
+    }
+
+    if (!output && debug) {
+        printf("stop_server did not finish the waiting requests or accepted a request after stop\n");
+    }
+
+    free_model(model);
+    free_mat(X);
+    free_mat(Y);
+    free(inputs);
+    free(outputs);
+
+    return output;
+}
+
+typedef struct {
+    nn_publisher *publisher;
+    matrix *input;
+    atomic_bool *done;
+    // Results and the steps of the snapshots they were computed with
+    size_t num_results;
+    size_t steps[4 * NUM_PUBLICATIONS];
+    matrix *results[4 * NUM_PUBLICATIONS];
+} reader_args;
+
+void* reader_thread(void *arg) {
+    reader_args *args = arg;
+    size_t num_inputs = args->input->cols;
+    nn_reader *reader = create_reader(args->publisher, num_inputs);
+
+    while (!atomic_load(args->done) && args->num_results < 4 * NUM_PUBLICATIONS) {
+        matrix *result = args->results[args->num_results];
+        args->steps[args->num_results] = snapshot_predict(reader, result, args->input, num_inputs);
+        args->num_results++;
+    }
+    free_reader(reader);
+    return NULL;
+}
+
+int silence_stdout(void) {
+    // Send stdout to /dev/null until restore_stdout, returns the saved descriptor
+
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    return saved;
+}
+
+void restore_stdout(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+bool test_validation(bool test, bool debug) {
+    // After training with validation the model has the parameters of the best evaluated
+    // step, which are those of training without validation for that many steps, and
+    // training stops once patience evaluations in a row do not improve
+
+    size_t layer_sizes[] = {rand() % 10 + 1, rand() % 10 + 1, rand() % 5 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    size_t num_samples = rand() % 40 + 10;
+    size_t num_val = rand() % 20 + 1;
+    size_t m = rand() % num_samples + 1;
+    size_t interval = rand() % 5 + 1;
+    size_t patience = rand() % 3 + 1;
+    int epochs = rand() % 30 + 1;
+    int stop_epochs = 1000;
+    uint64_t seed = rand();
+    unsigned int j;
+
+    matrix *X = rand_mat(layer_sizes[0], num_samples);
+    matrix *Y = zero_mat(layer_sizes[2], num_samples);
+    matrix *val_X = rand_mat(layer_sizes[0], num_val);
+    matrix *val_Y = zero_mat(layer_sizes[2], num_val);
+    for (j = 0; j < num_samples; j++) {
+        mat_set(Y, rand() % layer_sizes[2], j, 1.0);
+    }
+    for (j = 0; j < num_val; j++) {
+        mat_set(val_Y, rand() % layer_sizes[2], j, 1.0);
+    }
+
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_model *true_model = alloc_model_like(model);
+    nn_model *stop_model = alloc_model_like(model);
+    memcpy(true_model->params, model->params, model->num_params * sizeof(double));
+    memcpy(stop_model->params, model->params, model->num_params * sizeof(double));
+
+    // Without a patience limit every evaluation counts towards the best step
+    int saved = silence_stdout();
+    nn_validation *val = create_validation(model, val_X, val_Y, interval, 0);
+    rng_seed(seed);
+    train_model(model, X, Y, m, epochs, 0.01, 0.9, 0.999, 1e-8);
+    size_t best_step = val->best_step;
+
+    // The mini-batches only depend on the seed, so this run repeats the first best_step steps
+    rng_seed(seed);
+    train_model(true_model, X, Y, m, best_step, 0.01, 0.9, 0.999, 1e-8);
+
+    // With a zero learning rate no evaluation improves on the first one
+    create_validation(stop_model, val_X, val_Y, 1, patience);
+    create_publisher(stop_model, stop_epochs + 1);
+    train_model(stop_model, X, Y, m, stop_epochs, 0.0, 0.9, 0.999, 1e-8);
+    restore_stdout(saved);
+
+    nn_validation *stop_val = stop_model->validation;
+    size_t stop_step = atomic_load(&stop_model->publisher->current)->step;
+
+    bool output = (memcmp(model->params, val->best_params, model->num_params * sizeof(double)) == 0) &&
+        (best_step >= 1) && (best_step <= (size_t) epochs);
+    if (!output && debug) {
+        printf("Trained parameters are not the best ones\n");
+    }
+
+    if (test && output) {
+        output = (memcmp(model->params, true_model->params, model->num_params * sizeof(double)) == 0);
+        if (!output && debug) {
+            printf("Best parameters differ from training for %zu steps\n", best_step);
+        }
+    }
+
+    if (test && output) {
+        output = stop_val->stop && (stop_val->evals_since_best >= patience) && (stop_step < (size_t) stop_epochs);
+        if (!output && debug) {
+            printf("Training with patience %zu stopped at step %zu of %d\n", patience, stop_step, stop_epochs);
+        }
+    }
+
+    free_model(model);
+    free_model(true_model);
+    free_model(stop_model);
+    free_mat(X);
+    free_mat(Y);
+    free_mat(val_X);
+    free_mat(val_Y);
+
+    return output;
+}
+
+bool test_train_models(bool test, bool debug) {
+    // train_models gives every model bitwise the parameters of train_model on the same
+    // mini-batches with its own Adam hyperparameters
+
+    size_t num_layers = rand() % 2 + 3;
+    size_t layer_sizes[] = {rand() % 20 + 1, rand() % 20 + 1, rand() % 20 + 1, rand() % 5 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SIGMOID, SOFTMAX};
+    size_t num_samples = rand() % 50 + 1;
+    size_t m = rand() % num_samples + 1;
+    int epochs = rand() % 10 + 1;
+    uint64_t seed = rand();
+    adam_config configs[2] = {{0.01, 0.9, 0.999, 1e-8}, {0.003, 0.8, 0.99, 1e-7}};
+    nn_model *models[2];
+    nn_model *true_models[2];
+    unsigned int j, k;
+
+    layer_sizes[num_layers - 1] = layer_sizes[3];
+    layer_activations[num_layers - 1] = SOFTMAX;
+    matrix *X = rand_mat(layer_sizes[0], num_samples);
+    matrix *Y = zero_mat(layer_sizes[num_layers - 1], num_samples);
+    for (j = 0; j < num_samples; j++) {
+        mat_set(Y, rand() % layer_sizes[num_layers - 1], j, 1.0);
+    }
+    for (k = 0; k < 2; k++) {
+        models[k] = create_model(num_layers, layer_sizes, layer_activations);
+        true_models[k] = alloc_model_like(models[k]);
+        memcpy(true_models[k]->params, models[k]->params, models[k]->num_params * sizeof(double));
+    }
+
+    // Every run starts from the same seed, so all of them draw the same mini-batches
+    int saved = silence_stdout();
+    rng_seed(seed);
+    train_models(models, 2, X, Y, m, epochs, configs);
+    for (k = 0; k < 2; k++) {
+        rng_seed(seed);
+        train_model(true_models[k], X, Y, m, epochs, configs[k].lr, configs[k].beta_1, configs[k].beta_2, configs[k].epsilon);
+    }
+    restore_stdout(saved);
+
+    bool output = true;
+    for (k = 0; k < 2 && output; k++) {
+        output = (memcmp(models[k]->params, true_models[k]->params, models[k]->num_params * sizeof(double)) == 0);
+        if (!output && debug) {
+            printf("Model %u of train_models differs from train_model\n", k);
+        }
+    }
+
+    for (k = 0; k < 2; k++) {
+        free_model(models[k]);
+        free_model(true_models[k]);
+    }
+    free_mat(X);
+    free_mat(Y);
+
+    return output;
+}
+
+bool test_snapshot_publish(bool test, bool debug) {
+    // Readers predicting while new weights are published always see one complete
+    // snapshot, never go back to an older one, and every replaced snapshot is freed
+
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    size_t num_inputs = rand() % 10 + 1;
+    nn_publisher *publisher = create_publisher(model, 1);
+    matrix *history[NUM_PUBLICATIONS + 1];
+    reader_args args[NUM_PREDICT_THREADS];
+    pthread_t threads[NUM_PREDICT_THREADS];
+    atomic_bool done;
+    unsigned int i, j;
+
+    atomic_init(&done, false);
+    history[0] = zero_mat(model->num_params, 1);
+    memcpy(history[0]->data, model->params, model->num_params * sizeof(double));
+
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        args[i].publisher = publisher;
+        args[i].input = rand_mat(layer_sizes[0], num_inputs);
+        args[i].done = &done;
+        args[i].num_results = 0;
+        for (j = 0; j < 4 * NUM_PUBLICATIONS; j++) {
+            args[i].results[j] = zero_mat(layer_sizes[2], num_inputs);
+        }
+        pthread_create(&threads[i], NULL, reader_thread, &args[i]);
+    }
+
+    // Stand-in for training: change the weights in place and publish them
+    for (i = 1; i <= NUM_PUBLICATIONS; i++) {
+        for (j = 0; j < model->num_params; j++) {
+            model->params[j] = rand_weight();
+        }
+        history[i] = zero_mat(model->num_params, 1);
+        memcpy(history[i]->data, model->params, model->num_params * sizeof(double));
+        publish_snapshot(publisher, model, i);
+    }
+    atomic_store(&done, true);
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // With no readers left, the next publication frees every replaced snapshot
+    publish_snapshot(publisher, model, NUM_PUBLICATIONS);
+
+    bool output = (publisher->retired == NULL) && (publisher->num_reclaimed == publisher->num_published - 1);
+
+    if (test) {
+        matrix *true_result = zero_mat(layer_sizes[2], num_inputs);
+        for (i = 0; i < NUM_PREDICT_THREADS && output; i++) {
+            for (j = 0; j < args[i].num_results && output; j++) {
+                size_t step = args[i].steps[j];
+                nn_model *replica = create_replica(model, history[step]->data);
+                model_predict(replica, true_result, args[i].input, num_inputs);
+                output = mat_is_equal(args[i].results[j], true_result) && (j == 0 || step >= args[i].steps[j - 1]);
+                replica->params = NULL;
+                free_model(replica);
+            }
+        }
+        free_mat(true_result);
+
+        if (!output && debug) {
+            printf("Reader saw a torn or older snapshot, or snapshots were not freed\n");
+        }
+    }
+
+    for (i = 0; i < NUM_PREDICT_THREADS; i++) {
+        free_mat(args[i].input);
+        for (j = 0; j < 4 * NUM_PUBLICATIONS; j++) {
+            free_mat(args[i].results[j]);
+        }
+    }
+    for (i = 0; i <= NUM_PUBLICATIONS; i++) {
+        free_mat(history[i]);
+    }
+    free_model(model);
+
+    return output;
+}
+
+bool test_quantized_model(bool test, bool debug) {
+    // An int8 model gives bitwise the same results on every kernel variant. A linear
+    // layer stays within the bound of its rounding: with weight steps s_w (per row) and
+    // input step s_x, |z_q - z| <= sum_k |w_k| s_x / 2 + |x_k| s_w / 2 + s_w s_x / 4.
+    // Through relu and softmax layers the probabilities stay within Q_TEST_TOLERANCE
+
+    size_t num_inputs = (rand() % 2 == 0) ? 1 : rand_dim();
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    enum func linear_activations[] = {INPUT, INPUT};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_model *linear = create_model(2, layer_sizes, linear_activations);
+    matrix *input = rand_mat(layer_sizes[0], num_inputs);
+    matrix *result = zero_mat(layer_sizes[2], num_inputs);
+    matrix *first_result = zero_mat(layer_sizes[2], num_inputs);
+    matrix *true_result = zero_mat(layer_sizes[2], num_inputs);
+    matrix *linear_result = zero_mat(layer_sizes[1], num_inputs);
+    matrix *true_linear = zero_mat(layer_sizes[1], num_inputs);
+    enum isa default_isa = kernels.isa;
+    bool output = true;
+    bool first = true;
+    unsigned int i, r, s;
+    int isa;
+
+    for (i = 0; i < model->num_params; i++) {
+        model->params[i] = rand_weight() - 0.5;
+    }
+    for (i = 0; i < linear->num_params; i++) {
+        linear->params[i] = rand_weight() - 0.5;
+    }
+    model_predict(model, true_result, input, num_inputs);
+    mat_mul(true_linear, linear->layers[1].W, input);
+    mat_vec_add(true_linear, true_linear, linear->layers[1].b);
+
+    // Calibrated on the inputs themselves, so that no input is clipped
+    q_model *qmodel = quantize_model(model, input);
+    q_model *qlinear = quantize_model(linear, input);
+    q_layer *ql = &qlinear->layers[1];
+
+    for (isa = ISA_SCALAR; isa < NUM_ISAS && output; isa++) {
+        if (!cpu_supports_isa(isa)) {
+            continue;
+        }
+        set_kernel_isa(isa);
+        q_model_predict(qmodel, result, input, num_inputs);
+        q_model_predict(qlinear, linear_result, input, num_inputs);
+
+        if (first) {
+            mat_copy(first_result, result);
+            first = false;
+        }
+        output = mat_is_equal(result, first_result);
+        for (i = 0; i < layer_sizes[2] * num_inputs && output && test; i++) {
+            output = fabs(result->data[i] - true_result->data[i]) <= Q_TEST_TOLERANCE;
+        }
+
+        for (r = 0; r < layer_sizes[1] && output && test; r++) {
+            double s_w = ql->W_scales[r];
+            double s_x = ql->in_scale;
+            for (s = 0; s < num_inputs && output; s++) {
+                double bound = 1e-12;
+                unsigned int k;
+                for (k = 0; k < layer_sizes[0]; k++) {
+                    bound += fabs(mat_get(linear->layers[1].W, r, k)) * s_x / 2 + fabs(mat_get(input, k, s)) * s_w / 2 + s_w * s_x / 4;
+                }
+                output = fabs(mat_get(linear_result, r, s) - mat_get(true_linear, r, s)) <= bound;
+            }
+        }
+
+        if (!output && debug) {
+            printf("int8 model differs from the double model or between kernel variants (%s)\n", isa_names[isa]);
+        }
+    }
+    set_kernel_isa(default_isa);
+
+    free_q_model(qmodel);
+    free_q_model(qlinear);
+    free_model(model);
+    free_model(linear);
+    free_mat(input);
+    free_mat(result);
+    free_mat(first_result);
+    free_mat(true_result);
+    free_mat(linear_result);
+    free_mat(true_linear);
+
+    return output;
+}
+
+bool test_half_model(bool test, bool debug) {
+    // Half precision models predict exactly like a double model with the rounded
+    // weights, on every kernel variant, and the rounding is to the nearest value
+
+    size_t num_inputs = (rand() % 2 == 0) ? 1 : rand_dim();
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    nn_model *rounded = create_model(3, layer_sizes, layer_activations);
+    matrix *input = rand_mat(layer_sizes[0], num_inputs);
+    matrix *result = zero_mat(layer_sizes[2], num_inputs);
+    matrix *true_result = zero_mat(layer_sizes[2], num_inputs);
+    enum isa default_isa = kernels.isa;
+    bool output = true;
+    unsigned int i, format;
+    int isa;
+
+    for (format = 0; format < NUM_HALF_FORMATS && output; format++) {
+        // Keep the biases, which stay double
+        memcpy(rounded->params, model->params, model->num_params * sizeof(double));
+        for (i = 1; i < 3; i++) {
+            size_t length = layer_sizes[i] * layer_sizes[i - 1];
+            unsigned int k;
+            for (k = 0; k < length; k++) {
+                rounded->layers[i].W->data[k] = half_to_double(double_to_half(model->layers[i].W->data[k], format), format);
+            }
+        }
+        model_predict(rounded, true_result, input, num_inputs);
+        h_model *hmodel = compress_model(model, format);
+
+        for (isa = ISA_SCALAR; isa < NUM_ISAS && test; isa++) {
+            if (!cpu_supports_isa(isa)) {
+                continue;
+            }
+            set_kernel_isa(isa);
+            h_model_predict(hmodel, result, input, num_inputs);
+            output = output && mat_is_equal(result, true_result);
+
+            if (!output && debug) {
+                printf("%s model differs with kernel variant %s\n", half_format_names[format], isa_names[isa]);
+            }
+        }
+        set_kernel_isa(default_isa);
+        free_h_model(hmodel);
+    }
+
+    if (test) {
+        // Every half value converts back to itself, and rounding is within half a unit
+        for (i = 0; i < 100 && output; i++) {
+            uint16_t value = rand() % 65536;
+            float x = 2.0 * rand_weight() * pow(2.0, rand() % 40 - 25);
+            double f16 = half_to_double(double_to_half(x, HALF_FP16), HALF_FP16);
+            double bf16 = half_to_double(double_to_half(x, HALF_BF16), HALF_BF16);
+            double f16_ulp = fmax(pow(2.0, floor(log2(fabs(x))) - 10), pow(2.0, -24));
+
+            output = (isnan(f16_to_float(value)) || float_to_f16(f16_to_float(value)) == value)
+                && (isnan(bf16_to_float(value)) || float_to_bf16(bf16_to_float(value)) == value)
+                && fabs(f16 - x) <= 0.5 * f16_ulp
+                && fabs(bf16 - x) <= fabs(x) * pow(2.0, -8);
+
+            if (!output && debug) {
+                printf("Rounding of %g (%g, %g) or conversion of %d is wrong\n", x, f16, bf16, value);
+            }
+        }
+    }
+
+    free_model(model);
+    free_model(rounded);
+    free_mat(input);
+    free_mat(result);
+    free_mat(true_result);
+
+    return output;
+}
+
+bool test_sparse_model(bool test, bool debug) {
+    // Pruning reaches the target sparsity without touching larger weights, and a
+    // CSR model predicts exactly like the pruned dense model
+
+    size_t num_inputs = (rand() % 2 == 0) ? 1 : rand_dim();
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    nn_model *model = create_model(3, layer_sizes, layer_activations);
+    double *original = malloc(model->num_params * sizeof(double));
+    check_alloc(original);
+    memcpy(original, model->params, model->num_params * sizeof(double));
+    double sparsity = rand_weight();
+    matrix *input = rand_mat(layer_sizes[0], num_inputs);
+    matrix *result = zero_mat(layer_sizes[2], num_inputs);
+    matrix *true_result = zero_mat(layer_sizes[2], num_inputs);
+    unsigned int i, k;
+
+    prune_to_sparsity(model, sparsity);
+    s_model *smodel = sparse_model(model);
+    model_predict(model, true_result, input, num_inputs);
+    s_model_predict(smodel, result, input, num_inputs);
+
+    bool output = mat_is_equal(result, true_result);
+
+    if (test) {
+        for (i = 1; i < 3 && output; i++) {
+            matrix *W = model->layers[i].W;
+            size_t length = W->rows * W->cols;
+            size_t zeros = 0;
+            double max_pruned = 0.0;
+            double min_kept = INFINITY;
+            for (k = 0; k < length; k++) {
+                double weight = original[W->data - model->params + k];
+                if (W->data[k] == 0.0) {
+                    zeros++;
+                    max_pruned = fmax(max_pruned, fabs(weight));
+                } else {
+                    min_kept = fmin(min_kept, fabs(weight));
+                    output = output && (W->data[k] == weight);
+                }
+            }
+            output = output && (zeros == (size_t) (sparsity * length)) && (max_pruned <= min_kept)
+                && (smodel->layers[i].W->nnz == length - zeros);
+        }
+        // Biases are kept
+        for (i = 1; i < 3; i++) {
+            matrix *b = model->layers[i].b;
+            output = output && (memcmp(b->data, original + (b->data - model->params), b->rows * sizeof(double)) == 0);
+        }
+
+        if (!output && debug) {
+            printf("Pruning to sparsity %g or the CSR model is wrong\n", sparsity);
+        }
+    }
+
+    free_s_model(smodel);
+    free_model(model);
+    free(original);
+    free_mat(input);
+    free_mat(result);
+    free_mat(true_result);
+
+    return output;
+}
+
+double cross_entropy(nn_model *model, matrix *X, matrix *Y) {
+    // Mean cross-entropy loss of model on X with one-hot labels Y
+
+    matrix *Y_hat = zero_mat(Y->rows, Y->cols);
+    model_predict(model, Y_hat, X, X->cols);
+    double loss = 0.0;
+    unsigned int i;
+
+    for (i = 0; i < Y->rows * Y->cols; i++) {
+        loss -= Y->data[i] * log(Y_hat->data[i]);
+    }
+    free_mat(Y_hat);
+    return loss / X->cols;
+}
+
+bool test_conv_model(bool test, bool debug) {
+    // A conv layer matches a direct convolution and a max pool layer the maxima of its windows,
+    // evaluation with the patches built in blocks matches forward_prop, the back_prop gradients
+    // match finite differences, and save_model and load_model keep the layers
+
+    size_t m = rand() % 40 + 1;
+    size_t channels = rand() % 3 + 1;
+    size_t k = rand() % 5 + 1;
+    size_t height = k + 3 + rand() % 12;
+    size_t width = k + 3 + rand() % 12;
+    size_t filters = rand() % 4 + 1;
+    size_t pool = rand() % 2 + 1;
+    size_t classes = rand() % 4 + 2;
+    nn_layer_spec specs[] = {input_layer(channels, height, width), conv_layer(filters, k, SIGMOID),
+        maxpool_layer(pool), conv_layer(rand() % 3 + 1, rand() % 2 + 1, SIGMOID), dense_layer(classes, SOFTMAX)};
+    nn_model *model = create_model_layers(5, specs);
+    nn_layer *layers = model->layers;
+    double h = 1e-7;
+    unsigned int i, j, c, y, x, s, dy, dx;
+
+    for (i = 0; i < model->num_params; i++) {
+        model->params[i] = rand_weight() - 0.5;
+    }
+
+    matrix *X = rand_mat(layers[0].num_nodes, m);
+    matrix *Y = zero_mat(classes, m);
+    matrix *Y_hat = zero_mat(classes, m);
+    for (s = 0; s < m; s++) {
+        mat_set(Y, rand() % classes, s, 1.0);
+    }
+
+    create_train_buffers(model, X);
+    forward_prop(model);
+    back_prop(model, Y);
+    model_predict(model, Y_hat, X, m);
+
+    bool output = true;
+
+    if (test) {
+        // Direct convolution of the input with the filters of layer 1
+        nn_layer *conv = &layers[1];
+        for (i = 0; i < conv->num_nodes && output; i++) {
+            size_t f = i / (conv->height * conv->width);
+            y = i / conv->width % conv->height;
+            x = i % conv->width;
+            for (s = 0; s < m; s++) {
+                double sum = 0.0;
+                for (j = 0; j < conv->W->cols; j++) {
+                    c = j / (k * k);
+                    size_t pixel = (c * height + y + j / k % k) * width + x + j % k;
+                    sum += mat_get(conv->W, f, j) * mat_get(X, pixel, s);
+                }
+                sum += conv->b->data[f];
+                output = output && (fabs(sum - mat_get(conv->Z, i, s)) < 1e-12);
+            }
+        }
+
+        // Maxima of the pooling windows of layer 1
+        nn_layer *maxp = &layers[2];
+        for (i = 0; i < maxp->num_nodes && output; i++) {
+            c = i / (maxp->height * maxp->width);
+            y = i / maxp->width % maxp->height;
+            x = i % maxp->width;
+            for (s = 0; s < m; s++) {
+                double max = -INFINITY;
+                for (dy = 0; dy < pool; dy++) {
+                    for (dx = 0; dx < pool; dx++) {
+                        size_t pixel = (c * conv->height + y * pool + dy) * conv->width + x * pool + dx;
+                        max = fmax(max, mat_get(conv->A, pixel, s));
+                    }
+                }
+                output = output && (max == mat_get(maxp->A, i, s));
+            }
+        }
+        if (!output && debug) {
+            printf("Convolution or pooling differs from the direct computation\n");
+        }
+
+        if (output && !mat_is_equal(Y_hat, layers[4].A)) {
+            output = false;
+            if (debug) {
+                printf("model_predict differs from forward_prop\n");
+            }
+        }
+    }
+
+    double *grads = malloc(model->num_params * sizeof(double));
+    check_alloc(grads);
+    memcpy(grads, model->grads, model->num_params * sizeof(double));
+    free_train_buffers(model);
+
+    if (test && output) {
+        // Finite differences for random weights and biases of the conv layers and the dense layer
+        // A step that moves the maximum of a pooling window has different slopes on its two
+        // sides, and is skipped
+        double loss = cross_entropy(model, X, Y);
+        unsigned int layer_ids[] = {1, 3, 4};
+        for (j = 0; j < 10 && output; j++) {
+            nn_layer *layer = &layers[layer_ids[rand() % 3]];
+            size_t length = layer->W->rows * layer->W->cols;
+            size_t r = rand() % (length + layer->b->rows);
+            double *param = (r < length) ? &layer->W->data[r] : &layer->b->data[r - length];
+            size_t index = param - model->params;
+
+            double value = *param;
+            *param = value + h;
+            double loss_plus = cross_entropy(model, X, Y);
+            *param = value - h;
+            double loss_minus = cross_entropy(model, X, Y);
+            *param = value;
+
+            double numeric = (loss_plus - loss_minus) / (2 * h);
+            double tolerance = 1e-7 + 1e-5 * fabs(numeric);
+            if (fabs((loss_plus - loss) - (loss - loss_minus)) > h * tolerance) {
+                continue;
+            }
+            output = fabs(numeric - grads[index]) < tolerance;
+            if (!output && debug) {
+                printf("Gradient of parameter %zu is %g, finite differences give %g\n", index, grads[index], numeric);
+            }
+        }
+    }
+
+    if (test && output) {
+        char *path = "test_conv_model.bin";
+        save_model(model, path);
+        nn_model *loaded = load_model(path);
+        matrix *Y_loaded = zero_mat(classes, m);
+        model_predict(loaded, Y_loaded, X, m);
+
+        output = (loaded->num_params == model->num_params) && mat_is_equal(Y_loaded, Y_hat);
+        for (i = 0; i < 5; i++) {
+            output = output && (loaded->layers[i].type == layers[i].type) && (loaded->layers[i].num_nodes == layers[i].num_nodes) &&
+                (loaded->layers[i].channels == layers[i].channels) && (loaded->layers[i].kernel_size == layers[i].kernel_size);
+        }
+        if (!output && debug) {
+            printf("Loaded conv model differs from the saved one\n");
+        }
+
+        remove(path);
+        free_mat(Y_loaded);
+        free_model(loaded);
+    }
+
+    free(grads);
+    free_mat(X);
+    free_mat(Y);
+    free_mat(Y_hat);
+    free_model(model);
+
+    return output;
+}
+
+typedef struct {
+    matrix *X;
+    matrix *Y;
+    size_t next;
+} column_source;
+
+bool column_producer(double *x, double *y, void *arg) {
+    // The columns of X and Y one after another
+
+    column_source *source = arg;
+    unsigned int i;
+
+    if (source->next == source->X->cols) {
+        return false;
+    }
+    for (i = 0; i < source->X->rows; i++) {
+        x[i] = mat_get(source->X, i, source->next);
+    }
+    for (i = 0; i < source->Y->rows; i++) {
+        y[i] = mat_get(source->Y, i, source->next);
+    }
+    source->next++;
+    return true;
+}
+
+bool test_stream_training(bool test, bool debug) {
+    // Stream mini-batches hold every sample at most once, in stream order without a
+    // shuffle buffer, and train_stream trains like the same steps on consecutive columns
+
+    size_t n_in = rand() % 10 + 1;
+    size_t n_out = rand() % 5 + 2;
+    size_t num_samples = rand() % 200;
+    size_t capacity = rand() % 20 + 1;
+    size_t m = rand() % 20 + 1;
+    size_t shuffle_size = (rand() % 2) ? rand() % 50 + 1 : 0;
+    unsigned int i, j;
+
+    matrix *X = rand_mat(n_in, num_samples);
+    matrix *Y = zero_mat(n_out, num_samples);
+    for (j = 0; j < num_samples; j++) {
+        // The first input identifies the sample
+        mat_set(X, 0, j, j);
+        mat_set(Y, rand() % n_out, j, 1.0);
+    }
+    matrix *mini_X = zero_mat(n_in, m);
+    matrix *mini_Y = zero_mat(n_out, m);
+    bool *seen = calloc(num_samples + 1, sizeof(bool));
+    check_alloc(seen);
+    bool output = true;
+
+    column_source source = {X, Y, 0};
+    sample_stream *stream = create_stream(n_in, n_out, capacity);
+    shuffle_buffer *shuffle = create_shuffle_buffer(stream, shuffle_size, m);
+    start_producer(stream, column_producer, &source);
+
+    size_t num_batches = 0;
+    while (stream_batch(shuffle, mini_X, mini_Y)) {
+        for (j = 0; j < m && output; j++) {
+            size_t k = (size_t) mat_get(mini_X, 0, j);
+            output = (k < num_samples) && !seen[k] && (shuffle_size > 0 || k == num_batches * m + j);
+            for (i = 0; i < n_in && output; i++) {
+                output = (mat_get(mini_X, i, j) == mat_get(X, i, k));
+            }
+            for (i = 0; i < n_out && output; i++) {
+                output = (mat_get(mini_Y, i, j) == mat_get(Y, i, k));
+            }
+            if (output) {
+                seen[k] = true;
+            }
+        }
+        num_batches++;
+    }
+    output = output && (num_batches == num_samples / m);
+    free_shuffle_buffer(shuffle);
+    free_stream(stream);
+
+    if (!output && debug) {
+        printf("Stream mini-batches lost, repeated or reordered samples\n");
+    }
+
+    if (test && output) {
+        size_t layer_sizes[] = {n_in, rand() % 10 + 1, n_out};
+        enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+        nn_model *model = create_model(3, layer_sizes, layer_activations);
+        nn_model *true_model = alloc_model_like(model);
+        memcpy(true_model->params, model->params, model->num_params * sizeof(double));
+        size_t max_steps = rand() % (num_samples / m + 2);
+
+        source.next = 0;
+        stream = create_stream(n_in, n_out, capacity);
+        start_producer(stream, column_producer, &source);
+        size_t steps = train_stream(model, stream, m, 0, max_steps, 0.01, 0.9, 0.999, 1e-8);
+        free_stream(stream);
+
+        size_t true_steps = num_samples / m;
+        true_steps = (max_steps > 0 && max_steps < true_steps) ? max_steps : true_steps;
+        create_train_buffers(true_model, mini_X);
+        for (i = 0; i < true_steps; i++) {
+            for (j = 0; j < n_in; j++) {
+                memcpy(mini_X->data + j * m, X->data + j * num_samples + i * m, m * sizeof(double));
+            }
+            for (j = 0; j < n_out; j++) {
+                memcpy(mini_Y->data + j * m, Y->data + j * num_samples + i * m, m * sizeof(double));
+            }
+            forward_prop(true_model);
+            back_prop(true_model, mini_Y);
+            grad_descent_adam(true_model, i, 0.01, 0.9, 0.999, 1e-8);
+        }
+        free_train_buffers(true_model);
+
+        output = (steps == true_steps) && (memcmp(model->params, true_model->params, model->num_params * sizeof(double)) == 0);
+        if (!output && debug) {
+            printf("train_stream ran %zu steps instead of %zu or trained differently\n", steps, true_steps);
+        }
+        free_model(model);
+        free_model(true_model);
+    }
+
+    free_mat(X);
+    free_mat(Y);
+    free_mat(mini_X);
+    free_mat(mini_Y);
+    free(seen);
+
+    return output;
+}
+
+bool test_random_threads(bool test, bool debug) {
+    // rand_mat, shuffle_array and init_model give bitwise the same results for 1 and
+    // NUM_PREDICT_THREADS threads, the shuffle is a permutation and the Xavier and He
+    // weights are within their limits, and the default state is rng_seed(RNG_DEFAULT_SEED)
+
+    uint64_t seed = rand();
+    size_t length = (rand() % 2) ? rand() % 1000 + 1 : RNG_PARALLEL_MIN + rand() % 100000;
+    int n = (rand() % 2) ? rand() % 1000 : SHUFFLE_PARALLEL_MIN + rand() % 100000;
+    size_t layer_sizes[] = {rand_dim(), rand_dim(), rand() % 10 + 2};
+    enum func layer_activations[] = {INPUT, RELU, SOFTMAX};
+    enum init_scheme scheme = rand() % 3;
+    int threads[] = {1, NUM_PREDICT_THREADS};
+    int max_threads = omp_get_max_threads();
+    matrix *mats[2];
+    int *indices[2];
+    nn_model *models[2];
+    unsigned int t, i;
+
+    for (t = 0; t < 2; t++) {
+        omp_set_num_threads(threads[t]);
+        rng_seed(seed);
+        mats[t] = rand_mat(length, 1);
+        indices[t] = malloc((n + 1) * sizeof(int));
+        check_alloc(indices[t]);
+        for (i = 0; i < (unsigned int) n; i++) {
+            indices[t][i] = i;
+        }
+        shuffle_array(indices[t], n);
+        models[t] = alloc_model(3, layer_sizes, layer_activations);
+        init_model(models[t], scheme);
+    }
+    omp_set_num_threads(max_threads);
+
+    bool output = mat_is_equal(mats[0], mats[1]) && (memcmp(indices[0], indices[1], n * sizeof(int)) == 0) &&
+        (memcmp(models[0]->params, models[1]->params, models[0]->num_params * sizeof(double)) == 0);
+    if (!output && debug) {
+        printf("Random numbers differ between 1 and %d threads\n", NUM_PREDICT_THREADS);
+    }
+    if (output && rng_mix(RNG_DEFAULT_SEED) != RNG_DEFAULT_KEY) {
+        output = false;
+        if (debug) {
+            printf("The default random state is not rng_seed(RNG_DEFAULT_SEED)\n");
+        }
+    }
+
+    if (test && output) {
+        bool *seen = calloc(n + 1, sizeof(bool));
+        check_alloc(seen);
+        for (i = 0; i < (unsigned int) n && output; i++) {
+            output = (indices[0][i] >= 0) && (indices[0][i] < n) && !seen[indices[0][i]];
+            seen[indices[0][i]] = output;
+        }
+        free(seen);
+        for (i = 0; i < length && output; i++) {
+            output = (mats[0]->data[i] >= 0.0) && (mats[0]->data[i] < 1.0);
+        }
+
+        nn_layer *layers = models[0]->layers;
+        for (t = 1; t < 3 && output && scheme != INIT_UNIFORM; t++) {
+            double fan_in = layers[t].W->cols;
+            double fan_out = layers[t].W->rows;
+            double limit = (scheme == INIT_HE) ? sqrt(6.0 / fan_in) : sqrt(6.0 / (fan_in + fan_out));
+            for (i = 0; i < fan_in * fan_out && output; i++) {
+                output = fabs(layers[t].W->data[i]) <= limit;
+            }
+            for (i = 0; i < fan_out && output; i++) {
+                output = (layers[t].b->data[i] == 0.0);
+            }
+        }
+
+        if (!output && debug) {
+            printf("Shuffle is not a permutation or random values are out of range\n");
+        }
+    }
+
+    for (t = 0; t < 2; t++) {
+        free_mat(mats[t]);
+        free(indices[t]);
+        free_model(models[t]);
+    }
+
+    return output;
+}
+
 void run_tests(bool (*test_func)(bool, bool), char *func_name, bool test, bool debug) {
 
     printf("Testing %s\n", func_name);
@@ -175,6 +2182,34 @@ int main(void) {
     run_tests(test_mat_lin_combo, "mat_lin_combo", true, true);
     run_tests(test_mat_vec_add, "mat_vec_add", true, true);
     run_tests(test_mat_mul_trans, "mat_mul_trans", true, true);
+    run_tests(test_mat_mul_skinny, "mat_mul (skinny)", true, true);
+    run_tests(test_mat_mul_trans_sparse, "mat_mul_trans_sparse", true, true);
+    run_tests(test_kernel_variants, "kernel variants", true, true);
+    run_tests(test_fast_exp, "fast_exp", true, true);
+    run_tests(test_model_predict_threads, "model_predict (threads)", true, true);
+    run_tests(test_mat_col_argmax, "mat_col_argmax", true, true);
+    run_tests(test_model_classify, "model_classify", true, true);
+    run_tests(test_invalid_num_inputs, "num_inputs not matching the input", true, true);
+    run_tests(test_save_load, "save_model and load_model", true, true);
+    run_tests(test_load_invalid_model, "load_model with invalid layers", true, true);
+    run_tests(test_lazy_back_prop, "lazy back_prop", true, true);
+    run_tests(test_mat_mul_configs, "mat_mul (tuning configurations)", true, true);
+    run_tests(test_autotune_cache, "autotuning cache", true, true);
+    run_tests(test_autotune_invalid_cache, "autotuning cache (invalid entries)", true, true);
+    run_tests(test_perf_counters, "performance counters", true, true);
+    run_tests(test_numa_replicas, "NUMA placement", true, true);
+    run_tests(test_allreduce_sum, "allreduce_sum", true, true);
+    run_tests(test_inference_server, "inference server", true, true);
+    run_tests(test_stop_server, "stop_server", true, true);
+    run_tests(test_validation, "validation and early stopping", true, true);
+    run_tests(test_train_models, "train_models", true, true);
+    run_tests(test_snapshot_publish, "weight snapshot publication", true, true);
+    run_tests(test_quantized_model, "int8 models", true, true);
+    run_tests(test_half_model, "fp16 and bf16 models", true, true);
+    run_tests(test_sparse_model, "pruning and CSR models", true, true);
+    run_tests(test_conv_model, "conv and max pool layers", true, true);
+    run_tests(test_stream_training, "stream training", true, true);
+    run_tests(test_random_threads, "random numbers (threads)", true, true);
     
 
 }
\ No newline at end of file
@@ -10,9 +10,12 @@
 
 int main(void) {
 
-    srand(12);
+    rng_seed(12);
 
     const double lr = 0.1f;
+    const double beta_1 = 0.9f;
+    const double beta_2 = 0.999f;
+    const double epsilon = pow(10.0, -8.0);
     const double epochs = 10000;
 
     double X_arr[] = {0.0f, 1.0f, 0.0f, 1.0f, 
@@ -26,7 +29,8 @@ int main(void) {
     size_t layer_sizes[] = {n, 10, 25, n2};
     enum func layer_activations[] = {INPUT, RELU, RELU, SOFTMAX};
     nn_model *model = create_model(4, layer_sizes, layer_activations);
-    train_model(model, X, Y, m, epochs, lr);
+    init_model(model, INIT_HE);
+    train_model(model, X, Y, m, epochs, lr, beta_1, beta_2, epsilon);
 
     double test_arr[] = {1.0f, 0.0f};
     matrix *test = mat_from_array(test_arr, 2, 1);